@@ -0,0 +1,78 @@
+#include <assert.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/timers.h"
+#include "esp_log.h"
+#include "driver/gpio.h"
+
+#include "ab_switch_driver.h"
+#include "midi_router.h"
+
+#define SW_AB_PIN                   35
+#define SW_AB_LEVEL_TYPE_A          1   // switch level in the type A position
+#define AB_SWITCH_DEBOUNCE_MS       20
+
+static const char *TAG = "AB_SWITCH";
+
+static TimerHandle_t debounce_timer;
+static void (*switch_on_change)(void);
+static _Atomic uint8_t switch_position;
+
+static inline uint8_t ab_switch_read(void)
+{
+    return gpio_get_level(SW_AB_PIN) == SW_AB_LEVEL_TYPE_A ? MIDI_ROUTE_AB_A : MIDI_ROUTE_AB_B;
+}
+
+static void IRAM_ATTR ab_switch_isr(void *arg)
+{
+    BaseType_t high_task_wakeup = pdFALSE;
+
+    //Contacts bounce for a few ms: stay quiet until the timer had a look at the settled level
+    gpio_intr_disable(SW_AB_PIN);
+    if (xTimerResetFromISR(debounce_timer, &high_task_wakeup) != pdPASS) {
+        //Timer command queue full, the callback would never arm us again: the next edge retries
+        gpio_intr_enable(SW_AB_PIN);
+    }
+    portYIELD_FROM_ISR(high_task_wakeup);
+}
+
+static void ab_switch_debounce_cb(TimerHandle_t timer)
+{
+    //Armed again before the read, an edge right after it still interrupts
+    gpio_intr_enable(SW_AB_PIN);
+
+    uint8_t position = ab_switch_read();
+    if (atomic_exchange(&switch_position, position) == position) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Switch on %c", position == MIDI_ROUTE_AB_A ? 'A' : 'B');
+    if (switch_on_change) {
+        switch_on_change();
+    }
+}
+
+void ab_switch_driver_init(void (*on_change)(void))
+{
+    switch_on_change = on_change;
+
+    gpio_config_t io_conf = {
+        .pin_bit_mask = 1ULL << SW_AB_PIN,
+        .mode = GPIO_MODE_INPUT,
+        .intr_type = GPIO_INTR_ANYEDGE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&io_conf));
+
+    atomic_store(&switch_position, ab_switch_read());
+
+    debounce_timer = xTimerCreate("ab_debounce", pdMS_TO_TICKS(AB_SWITCH_DEBOUNCE_MS), pdFALSE, NULL, ab_switch_debounce_cb);
+    assert(debounce_timer);
+
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(SW_AB_PIN, ab_switch_isr, NULL));
+}
+
+uint8_t ab_switch_get(void)
+{
+    return atomic_load(&switch_position);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Read the TRS A/B switch and watch it for changes
+ * @param[in] on_change called from the timer task once a new position has settled
+ *
+ * The switch interrupts on either edge and a one-shot timer debounces it,
+ * nothing runs while it is left alone.
+ */
+void ab_switch_driver_init(void (*on_change)(void));
+
+/**
+ * @brief Debounced switch position, lock free
+ *
+ * @return MIDI_ROUTE_AB_A or MIDI_ROUTE_AB_B
+ */
+uint8_t ab_switch_get(void);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -6,13 +6,21 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "usb/usb_host.h"
 
 #include "midi_translator.h"
+#include "class_driver.h"
+#include "clock_driver.h"
+#include "spsc_queue.h"
+#include "midi_pipeline.h"
+#include "usb_midi_desc.h"
+#include "trace_ring.h"
 
 #define CLIENT_NUM_EVENT_MSG        5
 
@@ -22,477 +30,769 @@
 #define ACTION_GET_CONFIG_DESC      0x08
 #define ACTION_GET_STR_DESC         0x10
 #define ACTION_CLOSE_DEV            0x20
-#define ACTION_EXIT                 0x40
+#define ACTION_FREE_DEV             0x40
 
-#define DEFAULT_MIDI_CLOCK_TIMER_IN_USEC 20833 // = 120 BPM
 
+#define USB_OUT_TRANSFER_POOL_SIZE  4   // OUT transfers that can be in flight at the same time
+#define USB_OUT_TRANSFER_SIZE       64  // largest full speed bulk max packet size
+
+#define USB_MIDI_MAX_DEVICES        MIDI_PIPELINE_MAX_SOURCES // devices served at the same time, e.g. behind a hub
+
+#define USB_IN_TRANSFERS_PER_EP     2   // IN transfers kept in flight per endpoint, one is polled while the other is decoded
+#define USB_IN_MAX_TRANSFERS        (USB_MIDI_MAX_ENDPOINTS * USB_IN_TRANSFERS_PER_EP)
+#define USB_IN_QUEUE_SIZE           64  // completed IN transfers waiting for the worker, more than all devices can have in flight
+#define USB_IN_REMOVED_TAG          0x1 // queue word (index << 1) | tag: a device went away, transfer pointers are never odd
+#define USB_IN_TASK_PRIORITY        5   // above the client task so decoding keeps up with completions
+#define USB_IN_HELD_POLL_MS         50  // transfers held behind another device's SysEx look for its timeout this often
+
+typedef struct class_driver class_driver_t;
+
+//One entry of the device table, every device has its own actions and transfers
 typedef struct {
-    usb_host_client_handle_t client_hdl;
+    class_driver_t *driver;
+    uint8_t index;
     uint8_t dev_addr;
     usb_device_handle_t dev_hdl;
     uint32_t actions;
-    esp_timer_handle_t midi_timer_hdl;
-    uint64_t midi_timer_period;
-    uint64_t midi_timer_base_period;
-    uint64_t new_midi_timer_period;
-    uint64_t midi_timer_period_pre_bend;
-    int16_t midi_timer_fine;
-} class_driver_t;
+    volatile bool closing;
+    uint8_t claimed_intfs[USB_MIDI_MAX_INTERFACES];
+    uint8_t num_claimed_intfs;
+    uint8_t num_in;                                     //IN endpoints, each has USB_IN_TRANSFERS_PER_EP transfers
+    usb_transfer_t *in_transfers[USB_IN_MAX_TRANSFERS]; //Transfers of endpoint N are N * USB_IN_TRANSFERS_PER_EP onwards
+    _Atomic uint32_t in_busy_mask;                      //Transfers owned by the host or the IN worker
+    _Atomic uint8_t in_flight[USB_MIDI_MAX_ENDPOINTS];  //Transfers of an endpoint submitted to the host
+    int64_t in_idle_since[USB_MIDI_MAX_ENDPOINTS];      //When the endpoint last ran out of submitted transfers
+    uint32_t in_completed_at[USB_IN_MAX_TRANSFERS];     //Completion time of each transfer, the start of its messages' latency
+    uint16_t in_cables_to_trs[USB_MIDI_MAX_ENDPOINTS]; //Routing table: bit N forwards cable N of that IN endpoint to TRS out
+    uint8_t out_ep_addr;
+    uint8_t out_cable_from_trs;                         //Routing table: cable the TRS input is sent on
+    uint16_t out_mps;
+    uint32_t out_free_mask;
+    usb_transfer_t *out_transfers[USB_OUT_TRANSFER_POOL_SIZE];
+    int64_t out_submit_time[USB_OUT_TRANSFER_POOL_SIZE];
+    uint32_t out_received_at[USB_OUT_TRANSFER_POOL_SIZE];   //Arrival of the oldest TRS packet in each transfer
+} usb_midi_device_t;
+
+struct class_driver {
+    usb_host_client_handle_t client_hdl;
+    usb_midi_device_t devices[USB_MIDI_MAX_DEVICES];
+    uint8_t open_devices;
+};
 
 
 
 extern void led_connect_effect_start(void);
 extern void led_disconnect_effect_start(void);
 
-extern int uart_send_data(struct uart_midi_event_packet ev);
 
 
 static const char *TAG = "CLASS";
 
+static usb_midi_device_t *find_device_by_hdl(class_driver_t *driver_obj, usb_device_handle_t dev_hdl)
+{
+    for (int i = 0; i < USB_MIDI_MAX_DEVICES; i++) {
+        if (driver_obj->devices[i].dev_hdl == dev_hdl) {
+            return &driver_obj->devices[i];
+        }
+    }
+    return NULL;
+}
+
 static void client_event_cb(const usb_host_client_event_msg_t *event_msg, void *arg)
 {
     class_driver_t *driver_obj = (class_driver_t *)arg;
     switch (event_msg->event) {
-        case USB_HOST_CLIENT_EVENT_NEW_DEV:
-            if (driver_obj->dev_addr == 0) {
-                driver_obj->dev_addr = event_msg->new_dev.address;
-                //Open the device next
-                driver_obj->actions |= ACTION_OPEN_DEV;
+        case USB_HOST_CLIENT_EVENT_NEW_DEV: {
+            //Take the first free slot of the device table, enumeration of several devices runs interleaved
+            for (int i = 0; i < USB_MIDI_MAX_DEVICES; i++) {
+                usb_midi_device_t *device = &driver_obj->devices[i];
+                if (device->dev_addr == 0) {
+                    device->dev_addr = event_msg->new_dev.address;
+                    //Open the device next
+                    device->actions |= ACTION_OPEN_DEV;
+                    return;
+                }
             }
+            ESP_LOGW(TAG, "Device table full, ignoring device at address %d", event_msg->new_dev.address);
             break;
-        case USB_HOST_CLIENT_EVENT_DEV_GONE:
-            if (driver_obj->dev_hdl != NULL) {
-                //Cancel any other actions and close the device next
-                driver_obj->actions = ACTION_CLOSE_DEV;
+        }
+        case USB_HOST_CLIENT_EVENT_DEV_GONE: {
+            usb_midi_device_t *device = find_device_by_hdl(driver_obj, event_msg->dev_gone.dev_hdl);
+            if (device != NULL && !device->closing) {
+                //Cancel any other actions and close the device next, one already closing keeps its pending free
+                device->actions = ACTION_CLOSE_DEV;
             }
             break;
+        }
         default:
             //Should never occur
             abort();
     }
 }
 
-static void action_open_dev(class_driver_t *driver_obj)
+static void action_open_dev(usb_midi_device_t *device)
 {
-    assert(driver_obj->dev_addr != 0);
-    ESP_LOGI(TAG, "Opening device at address %d", driver_obj->dev_addr);
-    ESP_ERROR_CHECK(usb_host_device_open(driver_obj->client_hdl, driver_obj->dev_addr, &driver_obj->dev_hdl));
+    assert(device->dev_addr != 0);
+    ESP_LOGI(TAG, "Opening device at address %d", device->dev_addr);
+    if (usb_host_device_open(device->driver->client_hdl, device->dev_addr, &device->dev_hdl) != ESP_OK) {
+        //Gone again before we got to it
+        device->dev_addr = 0;
+        device->actions = 0;
+        return;
+    }
+    device->driver->open_devices++;
     //Get the device's information next
-    driver_obj->actions &= ~ACTION_OPEN_DEV;
-    driver_obj->actions |= ACTION_GET_DEV_INFO;
+    device->actions &= ~ACTION_OPEN_DEV;
+    device->actions |= ACTION_GET_DEV_INFO;
 }
 
-static void action_get_info(class_driver_t *driver_obj)
+static void action_get_info(usb_midi_device_t *device)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(device->dev_hdl != NULL);
     ESP_LOGI(TAG, "Getting device information");
     usb_device_info_t dev_info;
-    ESP_ERROR_CHECK(usb_host_device_info(driver_obj->dev_hdl, &dev_info));
+    ESP_ERROR_CHECK(usb_host_device_info(device->dev_hdl, &dev_info));
     ESP_LOGI(TAG, "\t%s speed", (dev_info.speed == USB_SPEED_LOW) ? "Low" : "Full");
     ESP_LOGI(TAG, "\tbConfigurationValue %d", dev_info.bConfigurationValue);
     //Todo: Print string descriptors
 
     //Get the device descriptor next
-    driver_obj->actions &= ~ACTION_GET_DEV_INFO;
-    driver_obj->actions |= ACTION_GET_DEV_DESC;
+    device->actions &= ~ACTION_GET_DEV_INFO;
+    device->actions |= ACTION_GET_DEV_DESC;
 }
 
 
-unsigned long loopcounter = 0;
+static volatile struct usb_midi_out_stats usb_out_stats;
+static usb_host_client_handle_t volatile usb_out_client_hdl;
 
+//IN transfers handed from the client task (completion callbacks) to the IN worker, zero-copy by pointer
+static uint32_t usb_in_queue_storage[USB_IN_QUEUE_SIZE];
+static spsc_queue_t usb_in_queue = SPSC_QUEUE_INIT(usb_in_queue_storage, USB_IN_QUEUE_SIZE);
+static TaskHandle_t usb_in_task_hdl;
+static volatile struct usb_midi_in_stats usb_in_stats;
 
-static esp_err_t midi_find_intf_and_ep_desc(class_driver_t *driver_obj, const usb_ep_desc_t **in_ep, const usb_ep_desc_t **out_ep, int* intf_num)
-{
-    bool interface_found = false;
-    const usb_config_desc_t *config_desc;
-    const usb_device_desc_t *device_desc;
-    int intf_idx = -1;
-    int desc_offset = 0;
-    
+//Decoded IN transfers held back while TRS out is saturated, IN worker only
+static usb_transfer_t *usb_in_parked[USB_MIDI_MAX_DEVICES * USB_IN_MAX_TRANSFERS];
+static uint8_t usb_in_parked_count;
 
-    // Get required descriptors
-    ESP_ERROR_CHECK(usb_host_get_device_descriptor(driver_obj->dev_hdl, &device_desc));
-    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(driver_obj->dev_hdl, &config_desc));
+//Completed IN transfers not decoded yet, their device waits for another one's SysEx, IN worker only
+static usb_transfer_t *usb_in_held[USB_MIDI_MAX_DEVICES * USB_IN_MAX_TRANSFERS];
+static uint8_t usb_in_held_count;
 
-    #define USB_SUBCLASS_COMMON        0x02
-    #define USB_DEVICE_PROTOCOL_IAD    0x01
+void usb_midi_in_get_stats(struct usb_midi_in_stats *stats)
+{
+    memcpy(stats, (const void *)&usb_in_stats, sizeof(*stats));
 
-    if ((device_desc->bDeviceClass == USB_CLASS_MISC) && (device_desc->bDeviceSubClass == USB_SUBCLASS_COMMON) &&
-        (device_desc->bDeviceProtocol == USB_DEVICE_PROTOCOL_IAD)) {
+    //Throttling is decided and counted by the pipeline
+    stats->throttled = midi_pipeline.stats.usb_in_throttled;
+    stats->throttled_max_us = midi_pipeline.stats.usb_in_throttled_max_us;
+    stats->throttled_total_us = midi_pipeline.stats.usb_in_throttled_total_us;
+}
 
+void usb_midi_in_kick(void)
+{
+    if (usb_in_task_hdl == NULL) {
+        return;
+    }
+    //TRS out drains in the UART interrupt
+    if (xPortInIsrContext()) {
+        BaseType_t task_woken = pdFALSE;
+        vTaskNotifyGiveFromISR(usb_in_task_hdl, &task_woken);
+        portYIELD_FROM_ISR(task_woken);
+    } else {
+        xTaskNotifyGive(usb_in_task_hdl);
+    }
+}
 
-        const usb_standard_desc_t *this_desc = (const usb_standard_desc_t *)config_desc;
-        do {
+void usb_midi_out_kick(void)
+{
+    if (usb_out_client_hdl != NULL) {
+        usb_host_client_unblock(usb_out_client_hdl);
+    }
+}
 
-            ESP_LOGI(TAG, "TRY");
-            intf_idx++;
+void usb_midi_out_get_stats(struct usb_midi_out_stats *stats)
+{
+    memcpy(stats, (const void *)&usb_out_stats, sizeof(*stats));
 
-            this_desc = usb_parse_next_descriptor_of_type(
-                this_desc, config_desc->wTotalLength, USB_B_DESCRIPTOR_TYPE_INTERFACE, &desc_offset);
+    //The TRS input side of the queue is counted by the pipeline
+    stats->packets_queued = midi_pipeline.stats.usb_out_queued;
+    stats->packets_dropped_queue_full = midi_pipeline.stats.usb_out_dropped_queue_full;
+    stats->queue_depth_max = midi_pipeline.stats.usb_out_queue_depth_max;
+    stats->packets_dropped_no_device += midi_pipeline.stats.usb_reply_dropped_gone;
+}
 
-            if (this_desc == NULL){
-                ESP_LOGI(TAG, "INTERFACE NOT FOUND");
-                break; // Reached end of configuration descriptor
-            }
+static bool usb_out_submit(usb_midi_device_t *device, const uint32_t *words, size_t count, uint32_t received_at)
+{
+    int idx = __builtin_ctz(device->out_free_mask);
+    usb_transfer_t *transfer = device->out_transfers[idx];
+
+    memcpy(transfer->data_buffer, words, count * 4);
+    if (device->out_cable_from_trs != 0) {
+        //The TRS parser produces cable 0 packets
+        for (size_t i = 0; i < count; i++) {
+            transfer->data_buffer[i * 4] = (transfer->data_buffer[i * 4] & 0x0F) | (device->out_cable_from_trs << 4);
+        }
+    }
+    transfer->num_bytes = count * 4;
+    transfer->device_handle = device->dev_hdl;
+    transfer->bEndpointAddress = device->out_ep_addr;
+    device->out_submit_time[idx] = esp_timer_get_time();
+    device->out_received_at[idx] = received_at;
+
+    if (usb_host_transfer_submit(transfer) != ESP_OK) {
+        usb_out_stats.transfers_failed++;
+        usb_out_stats.packets_dropped_no_device += count;
+        return false;
+    }
 
-            const usb_intf_desc_t *intf_desc = (const usb_intf_desc_t *)this_desc;
-            
-            #define USB_SUBCLASS_MIDISTREAMING 0x03
-            if (intf_desc->bInterfaceClass == USB_CLASS_AUDIO && intf_desc->bInterfaceSubClass == USB_SUBCLASS_MIDISTREAMING && intf_desc->bInterfaceProtocol == 0x00){
+    device->out_free_mask &= ~(1UL << idx);
+    usb_out_stats.transfers_submitted++;
+    return true;
+}
 
-                ESP_LOGI(TAG, "MIDI INTERFACE FOUND %d", intf_idx);
-                *intf_num = intf_idx;
-                interface_found = true;
+//A reply batch waiting for a free transfer of the device it goes to, USB client task only
+static uint32_t usb_out_reply_words[USB_OUT_TRANSFER_SIZE / 4];
+static size_t usb_out_reply_count;
+static uint8_t usb_out_reply_device;
+static uint32_t usb_out_reply_received_at;
 
+static void usb_out_flush(class_driver_t *driver_obj)
+{
+    //Runs in the USB client task only, which makes it the single consumer of usb_out_queue and usb_reply_queue
+    uint32_t words[USB_OUT_TRANSFER_SIZE / 4];
+    uint32_t received_at;
+    uint8_t target;
+
+    for (;;) {
+
+        //A reply is never cut short, nothing overtakes it while its device has every transfer in flight
+        if (usb_out_reply_count > 0) {
+            usb_midi_device_t *device = &driver_obj->devices[usb_out_reply_device];
+            if (device->out_ep_addr == 0 || device->closing) {
+                usb_out_stats.packets_dropped_no_device += usb_out_reply_count;
             }
-            
-        } while (!interface_found);
-
-
-        if (interface_found){
-
-            usb_intf_desc_t* intf_desc = usb_parse_interface_descriptor(config_desc, intf_idx, 0, &desc_offset);
-
-            int temp_offset = desc_offset;
-            for (int i = 0; i < 2; i++) {
-                const usb_ep_desc_t *this_ep = usb_parse_endpoint_descriptor_by_index(intf_desc, i, config_desc->wTotalLength, &desc_offset);
-                assert(this_ep);
-                if (USB_EP_DESC_GET_EP_DIR(this_ep)) {
-                    *in_ep = this_ep;
-                    ESP_LOGI(TAG, "IN EP FOUND %d", this_ep->bEndpointAddress);
-                } else {
-                    *out_ep = this_ep;
-                    ESP_LOGI(TAG, "OUT EP FOUND %d", this_ep->bEndpointAddress);
-                }
-                desc_offset = temp_offset;
+            else if (device->out_free_mask == 0) {
+                //Its completion calls us again
+                return;
             }
-
-            return ESP_OK;
-
+            else {
+                usb_out_submit(device, usb_out_reply_words, usb_out_reply_count, usb_out_reply_received_at);
+            }
+            usb_out_reply_count = 0;
         }
-    } 
-    else{
-        ESP_LOGI(TAG, "NOT IAD");
-
-             const usb_standard_desc_t *this_desc = (const usb_standard_desc_t *)config_desc;
-        do {
-
-            ESP_LOGI(TAG, "TRY");
-            intf_idx++;
 
-            this_desc = usb_parse_next_descriptor_of_type(
-                this_desc, config_desc->wTotalLength, USB_B_DESCRIPTOR_TYPE_INTERFACE, &desc_offset);
-
-            if (this_desc == NULL){
-                ESP_LOGI(TAG, "INTERFACE NOT FOUND");
-                break; // Reached end of configuration descriptor
+        //Every device with an OUT endpoint gets a copy, batches are sized for the smallest endpoint
+        uint16_t batch = USB_OUT_TRANSFER_SIZE / 4;
+        bool has_out = false;
+        bool has_free = false;
+        for (int i = 0; i < USB_MIDI_MAX_DEVICES; i++) {
+            usb_midi_device_t *device = &driver_obj->devices[i];
+            if (device->out_ep_addr == 0 || device->closing) {
+                continue;
             }
+            has_out = true;
+            has_free |= device->out_free_mask != 0;
+            if (device->out_mps / 4 < batch) {
+                batch = device->out_mps / 4;
+            }
+        }
 
-            const usb_intf_desc_t *intf_desc = (const usb_intf_desc_t *)this_desc;
-            
-            #define USB_SUBCLASS_MIDISTREAMING 0x03
-            if (intf_desc->bInterfaceClass == USB_CLASS_AUDIO && intf_desc->bInterfaceSubClass == USB_SUBCLASS_MIDISTREAMING && intf_desc->bInterfaceProtocol == 0x00){
-
-                ESP_LOGI(TAG, "MIDI INTERFACE FOUND %d", intf_idx);
-                *intf_num = intf_idx;
-                interface_found = true;
-
+        if (!has_out) {
+            //Nothing to send to, discard what the TRS input produced meanwhile
+            size_t count;
+            while ((count = midi_pipeline_usb_out_pop(&midi_pipeline, words, USB_OUT_TRANSFER_SIZE / 4, &received_at, &target)) > 0) {
+                usb_out_stats.packets_dropped_no_device += count;
             }
-            
-        } while (!interface_found);
+            return;
+        }
 
+        if (!has_free) {
+            //Every pool is in flight, a completion calls us again
+            return;
+        }
 
-        if (interface_found){
+        //Coalesce as many event packets as fit into one max packet sized transfer
+        size_t count = midi_pipeline_usb_out_pop(&midi_pipeline, words, batch, &received_at, &target);
+        if (count == 0) {
+            return;
+        }
 
-            usb_intf_desc_t* intf_desc = usb_parse_interface_descriptor(config_desc, intf_idx, 0, &desc_offset);
+        if (target != MIDI_PIPELINE_USB_OUT_ALL) {
+            //A reply goes back to the device that asked only, it waits above for a free transfer
+            memcpy(usb_out_reply_words, words, count * 4);
+            usb_out_reply_count = count;
+            usb_out_reply_device = target;
+            usb_out_reply_received_at = received_at;
+            continue;
+        }
 
-            int temp_offset = desc_offset;
-            for (int i = 0; i < 2; i++) {
-                const usb_ep_desc_t *this_ep = usb_parse_endpoint_descriptor_by_index(intf_desc, i, config_desc->wTotalLength, &desc_offset);
-                assert(this_ep);
-                if (USB_EP_DESC_GET_EP_DIR(this_ep)) {
-                    *in_ep = this_ep;
-                    ESP_LOGI(TAG, "IN EP FOUND %d", this_ep->bEndpointAddress);
-                } else {
-                    *out_ep = this_ep;
-                    ESP_LOGI(TAG, "OUT EP FOUND %d", this_ep->bEndpointAddress);
-                }
-                desc_offset = temp_offset;
+        //A device that is still busy misses this batch of the TRS stream rather than holding up the others
+        for (int i = 0; i < USB_MIDI_MAX_DEVICES; i++) {
+            usb_midi_device_t *device = &driver_obj->devices[i];
+            if (device->out_ep_addr == 0 || device->closing) {
+                continue;
             }
-
-            return ESP_OK;
-
+            if (device->out_free_mask == 0) {
+                usb_out_stats.packets_dropped_device_busy += count;
+                continue;
+            }
+            usb_out_submit(device, words, count, received_at);
         }
     }
-
-    return ESP_ERR_NOT_FOUND;
 }
 
+static bool usb_midi_device_idle(const usb_midi_device_t *device)
+{
+    uint32_t all = (1UL << USB_OUT_TRANSFER_POOL_SIZE) - 1;
+    bool out_idle = device->out_transfers[0] == NULL || device->out_free_mask == all;
+    return atomic_load(&device->in_busy_mask) == 0 && out_idle;
+}
 
-static usb_transfer_t *transfer;
+static void usb_midi_device_check_closed(usb_midi_device_t *device)
+{
+    //The last transfer of a closing device came back, its resources can go now
+    if (device->closing && usb_midi_device_idle(device)) {
+        device->actions |= ACTION_FREE_DEV;
+    }
+}
 
-static void transfer_cb(usb_transfer_t *transfer)
+static void out_transfer_cb(usb_transfer_t *transfer)
 {
     //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
-    struct class_driver_t *class_driver_obj = (struct class_driver_t *)transfer->context;
-    printf("OUT: Transfer status %d, actual number of bytes transferred %d\n", transfer->status, transfer->actual_num_bytes);
+    usb_midi_device_t *device = (usb_midi_device_t *)transfer->context;
 
-}
+    int idx = 0;
+    while (device->out_transfers[idx] != transfer) {
+        idx++;
+    }
 
-static usb_transfer_t *in_transfer;
+    uint32_t latency = (uint32_t)(esp_timer_get_time() - device->out_submit_time[idx]);
+    usb_out_stats.transfer_latency_total_us += latency;
+    if (latency > usb_out_stats.transfer_latency_max_us) {
+        usb_out_stats.transfer_latency_max_us = latency;
+    }
 
-static void transform_midi_packet(struct uart_midi_event_packet *uart_ev)
-{
-    if ((uart_ev->byte1 & 0xF0) == 0xB0 && uart_ev->byte2 >= 0x15 && uart_ev->byte2 <= 0x1A) // MIDI CC
-    {
-        uint8_t cc_on_channel_zero = uart_ev->byte1 - 9;
-        uint8_t channel_shift = uart_ev->byte2 - 0x15;
-        uart_ev->byte1 = cc_on_channel_zero + channel_shift;
-        uart_ev->byte2 = 0x5F; // Model:Samples track level CC
+    if (transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+        usb_out_stats.packets_sent += transfer->actual_num_bytes / 4;
+        midi_pipeline_usb_out_done(&midi_pipeline, device->out_received_at[idx]);
+    }
+    else {
+        usb_out_stats.transfers_failed++;
+        TRACE_E(CLASS, TRACE_EV_USB_OUT_ERROR, transfer->status);
+    }
+
+    //Return the transfer to the pool and keep the pipeline full
+    device->out_free_mask |= 1UL << idx;
+
+    if (device->closing) {
+        usb_midi_device_check_closed(device);
     }
+    //A reply waiting for this device is dropped once it is closing, the others go on
+    usb_out_flush(device->driver);
 }
 
 
-static uint64_t get_midi_clock_pulse_rate_usec(uint16_t stepIdx)
+static int in_transfer_index(const usb_midi_device_t *device, const usb_transfer_t *transfer)
 {
-    uint8_t minBPM = 70;
-    uint8_t maxBPM = 180;
-    uint8_t pulseRatePPQN = 24; // as per MIDI clock spec
-    uint16_t totalSteps = 128;
-    float new_period = ((float)60 * 1000000) / (minBPM * pulseRatePPQN + ((maxBPM - minBPM) * stepIdx * pulseRatePPQN)/totalSteps);
-    return (uint64_t)new_period;
+    int idx = 0;
+    while (device->in_transfers[idx] != transfer) {
+        idx++;
+    }
+    return idx;
 }
 
-
-static uint64_t get_midi_clock_pulse_rate_with_fine(uint64_t base, int16_t fine)
+static void in_transfer_give_back(usb_midi_device_t *device, int idx)
 {
-    // mapping the 7-bit unsigned fine to +/- 8% - the first - is because we need to reverse the values
-    float ratio = 1 - (fine / 63.0 * 8 / 100); 
-    uint64_t result = (uint64_t)(base * ratio);
-    ESP_LOGI(TAG, "Calculating pulse rate: base = %llu, fine = %i (ratio = %f), result = %llu", base, fine, ratio, result);
-    return result;
+    //The client task frees the device once nothing is busy, after the clear the slot may already be wiped
+    usb_host_client_handle_t client_hdl = device->driver->client_hdl;
+    atomic_fetch_and(&device->in_busy_mask, ~(1UL << idx));
+    usb_host_client_unblock(client_hdl);
 }
 
+static void in_transfer_submit(usb_midi_device_t *device, int idx)
+{
+    int ep = idx / USB_IN_TRANSFERS_PER_EP;
+
+    if (atomic_fetch_add(&device->in_flight[ep], 1) == 0 && device->in_idle_since[ep] != 0) {
+        //Nothing was polling this endpoint since in_idle_since
+        uint32_t idle = (uint32_t)(esp_timer_get_time() - device->in_idle_since[ep]);
+        usb_in_stats.idle_total_us += idle;
+        usb_in_stats.idle_count++;
+        if (idle > usb_in_stats.idle_max_us) {
+            usb_in_stats.idle_max_us = idle;
+        }
+    }
+
+    if (usb_host_transfer_submit(device->in_transfers[idx]) != ESP_OK) {
+        usb_in_stats.submit_failed++;
+        atomic_fetch_sub(&device->in_flight[ep], 1);
+        in_transfer_give_back(device, idx);
+    }
+}
 
 static void in_transfer_cb(usb_transfer_t *in_transfer)
 {
     //This is function is called from within usb_host_client_handle_events(). Don't block and try to keep it short
-    class_driver_t *class_driver_obj = (class_driver_t *)in_transfer->context;
-    //printf("IN: Transfer status %d, actual number of bytes transferred %d\n", in_transfer->status, in_transfer->actual_num_bytes);
+    usb_midi_device_t *device = (usb_midi_device_t *)in_transfer->context;
+    int idx = in_transfer_index(device, in_transfer);
+    int ep = idx / USB_IN_TRANSFERS_PER_EP;
+    int64_t now = esp_timer_get_time();
 
-    //printf("IN: %d %d %d %d", in_transfer->data_buffer[0], in_transfer->data_buffer[1], in_transfer->data_buffer[2], in_transfer->data_buffer[3]);
+    device->in_completed_at[idx] = (uint32_t)now;
 
+    //The other transfers of the endpoint are still polling, unless this was the last one
+    if (atomic_fetch_sub(&device->in_flight[ep], 1) == 1) {
+        device->in_idle_since[ep] = now;
+    }
+    usb_in_stats.transfers_completed++;
 
-    struct usb_midi_event_packet usb_ev = {
-        .byte0 = in_transfer->data_buffer[0],
-        .byte1 = in_transfer->data_buffer[1],
-        .byte2 = in_transfer->data_buffer[2],
-        .byte3 = in_transfer->data_buffer[3]
-    };
+    //Hand the buffer itself to the worker, it resubmits the transfer once decoded
+    spsc_queue_push(&usb_in_queue, (uint32_t)(uintptr_t)in_transfer);
+    xTaskNotifyGive(usb_in_task_hdl);
+}
 
-    struct uart_midi_event_packet uart_ev = usb_midi_to_uart(usb_ev);
+static bool usb_in_device_held(const usb_midi_device_t *device)
+{
+    //Later transfers of a device queue up behind its held ones
+    for (int i = 0; i < usb_in_held_count; i++) {
+        if (usb_in_held[i]->context == device) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    // control coarse tempo based on 7th knob
-    if ((uart_ev.byte1 & 0xF0) == 0xB0 && uart_ev.byte2 == 0x1B)
-    {
-        class_driver_obj->midi_timer_base_period = get_midi_clock_pulse_rate_usec(uart_ev.byte3);
-        class_driver_obj->new_midi_timer_period = get_midi_clock_pulse_rate_with_fine(
-            class_driver_obj->midi_timer_base_period, 
-            class_driver_obj->midi_timer_fine
-        );
+static void usb_in_process(usb_transfer_t *in_transfer)
+{
+    usb_midi_device_t *device = (usb_midi_device_t *)in_transfer->context;
+    int idx = in_transfer_index(device, in_transfer);
+    int ep = idx / USB_IN_TRANSFERS_PER_EP;
+    //printf("IN: Transfer status %d, actual number of bytes transferred %d\n", in_transfer->status, in_transfer->actual_num_bytes);
+
+    if (in_transfer->status == USB_TRANSFER_STATUS_COMPLETED) {
+        if (!device->closing && (usb_in_device_held(device) || midi_pipeline_usb_in_held(&midi_pipeline, device->index))) {
+            //Another device is in the middle of a SysEx, the transfer waits undecoded and the device buffers what follows
+            usb_in_held[usb_in_held_count++] = in_transfer;
+            return;
+        }
+        midi_pipeline_usb_in(&midi_pipeline, device->index, in_transfer->data_buffer, in_transfer->actual_num_bytes,
+                             device->in_cables_to_trs[ep], device->in_completed_at[idx]);
     }
-    // fine tempo control based on 8th knob
-    if ((uart_ev.byte1 & 0xF0) == 0xB0 && uart_ev.byte2 == 0x1C)
-    {
-        class_driver_obj->midi_timer_fine = uart_ev.byte3 - 0x3F;
-        class_driver_obj->new_midi_timer_period = get_midi_clock_pulse_rate_with_fine(
-            class_driver_obj->midi_timer_base_period, 
-            class_driver_obj->midi_timer_fine
-        );
+    else {
+        TRACE_E(CLASS, TRACE_EV_USB_IN_ERROR, in_transfer->status);
     }
-    // tempo bend - speed up; store pre-bend tempo
-    if (uart_ev.byte1 == 0xBF && uart_ev.byte2 == 0x68 && uart_ev.byte3 == 0x7F) {
-        class_driver_obj->midi_timer_period_pre_bend = class_driver_obj->midi_timer_period;
-        class_driver_obj->new_midi_timer_period = class_driver_obj->midi_timer_period - class_driver_obj->midi_timer_period / 16;
+
+    if (device->closing || in_transfer->status == USB_TRANSFER_STATUS_NO_DEVICE || in_transfer->status == USB_TRANSFER_STATUS_CANCELED) {
+        in_transfer_give_back(device, idx);
+        return;
     }
-    // tempo bend - slow down; store pre-bend tempo
-    if (uart_ev.byte1 == 0xBF && uart_ev.byte2 == 0x69 && uart_ev.byte3 == 0x7F) {
-        class_driver_obj->midi_timer_period_pre_bend = class_driver_obj->midi_timer_period;
-        class_driver_obj->new_midi_timer_period = class_driver_obj->midi_timer_period + class_driver_obj->midi_timer_period / 16;
+
+    if (midi_pipeline_usb_in_throttle(&midi_pipeline)) {
+        //TRS out is saturated, the device keeps the next messages in its own buffer meanwhile
+        usb_in_parked[usb_in_parked_count++] = in_transfer;
+        return;
     }
-    // tempo bend - release; restore pre-bend tempo
-    if (uart_ev.byte1 == 0xBF && (uart_ev.byte2 == 0x68 || uart_ev.byte2 == 0x69) && uart_ev.byte3 == 0x00) {
-        class_driver_obj->new_midi_timer_period = class_driver_obj->midi_timer_period_pre_bend;
+
+    in_transfer_submit(device, idx);
+}
+
+static void usb_in_unpark(bool throttled)
+{
+    //Transfers of a closing device go back right away, the others once TRS out has drained
+    uint8_t kept = 0;
+    for (int i = 0; i < usb_in_parked_count; i++) {
+        usb_transfer_t *in_transfer = usb_in_parked[i];
+        usb_midi_device_t *device = (usb_midi_device_t *)in_transfer->context;
+        int idx = in_transfer_index(device, in_transfer);
+
+        if (device->closing) {
+            in_transfer_give_back(device, idx);
+        }
+        else if (throttled) {
+            usb_in_parked[kept++] = in_transfer;
+        }
+        else {
+            in_transfer_submit(device, idx);
+        }
     }
+    usb_in_parked_count = kept;
+}
 
-    
-    ESP_LOGI(TAG, "USB -> MIDI USB in: 0x%02X 0x%02X 0x%02X 0x%02X", usb_ev.byte0, usb_ev.byte1, usb_ev.byte2, usb_ev.byte3);
-    transform_midi_packet(&uart_ev);
-    uart_send_data(uart_ev);
+static void usb_in_release(void)
+{
+    //Held transfers go in completion order, a device stays behind its first one that still has to wait
+    usb_transfer_t *held[USB_MIDI_MAX_DEVICES * USB_IN_MAX_TRANSFERS];
+    uint8_t count = usb_in_held_count;
+    uint8_t waiting = 0;
+
+    memcpy(held, usb_in_held, count * sizeof(held[0]));
+    usb_in_held_count = 0;
 
+    for (int i = 0; i < count; i++) {
+        usb_midi_device_t *device = (usb_midi_device_t *)held[i]->context;
+        uint8_t bit = 1 << device->index;
 
-    usb_host_transfer_submit(in_transfer);
+        if (device->closing) {
+            in_transfer_give_back(device, in_transfer_index(device, held[i]));
+        }
+        else if ((waiting & bit) || midi_pipeline_usb_in_held(&midi_pipeline, device->index)) {
+            waiting |= bit;
+            usb_in_held[usb_in_held_count++] = held[i];
+        }
+        else {
+            usb_in_process(held[i]);
+        }
+    }
+}
+
+static void usb_in_task(void *arg)
+{
+    uint32_t word;
+
+    for (;;) {
+        //While transfers are held, look again now and then, a SysEx left unfinished times out
+        ulTaskNotifyTake(pdTRUE, usb_in_held_count > 0 ? pdMS_TO_TICKS(USB_IN_HELD_POLL_MS) : portMAX_DELAY);
+
+        if (usb_in_held_count > 0) {
+            usb_in_release();
+        }
+
+        while (spsc_queue_pop(&usb_in_queue, &word)) {
+            if (word & USB_IN_REMOVED_TAG) {
+                midi_pipeline_usb_in_remove(&midi_pipeline, word >> 1);
+            }
+            else {
+                usb_in_process((usb_transfer_t *)(uintptr_t)word);
+            }
+            //The transfer may have ended the SysEx the others wait for
+            if (usb_in_held_count > 0) {
+                usb_in_release();
+            }
+        }
 
+        //Woken by the UART interrupt once the wire drained, or by a device going away
+        if (usb_in_parked_count > 0) {
+            usb_in_unpark(midi_pipeline_usb_in_throttle(&midi_pipeline));
+        }
+    }
 }
 
 
-static void action_get_dev_desc(class_driver_t *driver_obj)
+static void action_get_dev_desc(usb_midi_device_t *device)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(device->dev_hdl != NULL);
     ESP_LOGI(TAG, "Getting device descriptor");
     const usb_device_desc_t *dev_desc;
-    ESP_ERROR_CHECK(usb_host_get_device_descriptor(driver_obj->dev_hdl, &dev_desc));
+    ESP_ERROR_CHECK(usb_host_get_device_descriptor(device->dev_hdl, &dev_desc));
     usb_print_device_descriptor(dev_desc);
     //Get the device's config descriptor next
-    driver_obj->actions &= ~ACTION_GET_DEV_DESC;
-    driver_obj->actions |= ACTION_GET_CONFIG_DESC;
+    device->actions &= ~ACTION_GET_DEV_DESC;
+    device->actions |= ACTION_GET_CONFIG_DESC;
 
 }
 
-static void action_get_config_desc(class_driver_t *driver_obj)
+static void action_get_config_desc(usb_midi_device_t *device)
 {
-    assert(driver_obj->dev_hdl != NULL);
+    assert(device->dev_hdl != NULL);
     ESP_LOGI(TAG, "Getting config descriptor");
     const usb_config_desc_t *config_desc;
-    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(driver_obj->dev_hdl, &config_desc));
+    ESP_ERROR_CHECK(usb_host_get_active_config_descriptor(device->dev_hdl, &config_desc));
     usb_print_config_descriptor(config_desc, NULL);
 
+    device->actions &= ~ACTION_GET_CONFIG_DESC;
 
-    const usb_ep_desc_t *in_ep = NULL;
-    const usb_ep_desc_t *out_ep = NULL;
-    int intf_num = NULL;
-    midi_find_intf_and_ep_desc(driver_obj, &in_ep, &out_ep, &intf_num);
-
-    ESP_LOGI(TAG, "SUKU claim interface %d nice", intf_num);
-    ESP_ERROR_CHECK(usb_host_interface_claim(driver_obj->client_hdl, driver_obj->dev_hdl, intf_num, 0));
+    //Parsed once here, the transfer path only looks at the routing table built from it
+    static struct usb_midi_stream_info stream;
+    usb_midi_parse_config((const uint8_t *)config_desc, config_desc->wTotalLength, &stream);
 
+    if (stream.num_interfaces == 0) {
+        //Not a MIDI device (a hub, a keyboard without MIDI...), let it go
+        ESP_LOGI(TAG, "No MIDI streaming interface on device %d", device->dev_addr);
+        device->actions |= ACTION_CLOSE_DEV;
+        return;
+    }
 
-    usb_host_transfer_alloc(4, 0, &transfer);
+    for (int i = 0; i < stream.num_interfaces; i++) {
+        ESP_LOGI(TAG, "Claiming MIDI streaming interface %d", stream.interfaces[i]);
+        if (usb_host_interface_claim(device->driver->client_hdl, device->dev_hdl, stream.interfaces[i], 0) == ESP_OK) {
+            device->claimed_intfs[device->num_claimed_intfs++] = stream.interfaces[i];
+        }
+    }
 
-    //Send an OUT transfer to EP1
-    memset(transfer->data_buffer, 0xAA, 4);
-    transfer->num_bytes = 4;
-    transfer->device_handle = driver_obj->dev_hdl;
-    transfer->bEndpointAddress = out_ep->bEndpointAddress;
-    transfer->callback = transfer_cb;
-    transfer->context = (void *)&driver_obj;
+    for (int i = 0; i < stream.num_jacks; i++) {
+        ESP_LOGI(TAG, "\tjack %d: %s %s", stream.jacks[i].id,
+                 stream.jacks[i].type == USB_MIDI_JACK_EMBEDDED ? "embedded" : "external",
+                 stream.jacks[i].direction == USB_MIDI_JACK_IN ? "IN" : "OUT");
+    }
 
-    //SETUP IN TRANSFER
-    usb_host_transfer_alloc(USB_EP_DESC_GET_MPS(in_ep), 0, &in_transfer);
-    memset(in_transfer->data_buffer, 0xAA, 4);
-    in_transfer->num_bytes = USB_EP_DESC_GET_MPS(in_ep);
-    in_transfer->device_handle = driver_obj->dev_hdl;
-    in_transfer->bEndpointAddress = in_ep->bEndpointAddress;
-    in_transfer->callback = in_transfer_cb;
-    in_transfer->context = (void *)driver_obj;
+    const struct usb_midi_endpoint_info *out_ep = NULL;
 
+    for (int i = 0; i < stream.num_endpoints; i++) {
 
-    ESP_LOGI(TAG, "SUKU start IN transfer on ep %02x nice", in_ep->bEndpointAddress);
-    usb_host_transfer_submit(in_transfer);
+        const struct usb_midi_endpoint_info *ep = &stream.endpoints[i];
+        ESP_LOGI(TAG, "\tep %02x on interface %d, %d cables", ep->address, ep->interface, ep->num_cables);
 
-    //Get the device's string descriptors next
-    driver_obj->actions &= ~ACTION_GET_CONFIG_DESC;
-    driver_obj->actions |= ACTION_GET_STR_DESC;
-}
-
-static void action_get_str_desc(class_driver_t *driver_obj)
-{
+        if (!usb_midi_endpoint_is_in(ep)) {
+            //TRS input goes to cable 0 of the first OUT endpoint
+            if (out_ep == NULL) {
+                out_ep = ep;
+            }
+            continue;
+        }
 
-    if (loopcounter == 0){
-         assert(driver_obj->dev_hdl != NULL);
-        usb_device_info_t dev_info;
-        ESP_ERROR_CHECK(usb_host_device_info(driver_obj->dev_hdl, &dev_info));
-        if (dev_info.str_desc_manufacturer) {
-            ESP_LOGI(TAG, "Getting Manufacturer string descriptor");
-            usb_print_string_descriptor(dev_info.str_desc_manufacturer);
+        //SETUP IN TRANSFERS, several per IN endpoint so one is always polling, every cable is routed to TRS out
+        int n = device->num_in;
+        for (int k = 0; k < USB_IN_TRANSFERS_PER_EP; k++) {
+            ESP_ERROR_CHECK(usb_host_transfer_alloc(ep->mps, 0, &device->in_transfers[n * USB_IN_TRANSFERS_PER_EP + k]));
         }
-        if (dev_info.str_desc_product) {
-            ESP_LOGI(TAG, "Getting Product string descriptor");
-            usb_print_string_descriptor(dev_info.str_desc_product);
+        device->num_in++;
+        device->in_cables_to_trs[n] = (uint16_t)((1UL << ep->num_cables) - 1);
+
+        ESP_LOGI(TAG, "Start %d IN transfers on ep %02x", USB_IN_TRANSFERS_PER_EP, ep->address);
+        for (int k = 0; k < USB_IN_TRANSFERS_PER_EP; k++) {
+            int idx = n * USB_IN_TRANSFERS_PER_EP + k;
+            usb_transfer_t *in_transfer = device->in_transfers[idx];
+            memset(in_transfer->data_buffer, 0xAA, 4);
+            in_transfer->num_bytes = ep->mps;
+            in_transfer->device_handle = device->dev_hdl;
+            in_transfer->bEndpointAddress = ep->address;
+            in_transfer->callback = in_transfer_cb;
+            in_transfer->context = (void *)device;
+            atomic_fetch_or(&device->in_busy_mask, 1UL << idx);
+            in_transfer_submit(device, idx);
         }
-        if (dev_info.str_desc_serial_num) {
-            ESP_LOGI(TAG, "Getting Serial Number string descriptor");
-            usb_print_string_descriptor(dev_info.str_desc_serial_num);
-        }   
     }
 
+    //SETUP OUT PIPELINE, every device has a transfer pool of its own
+    if (out_ep != NULL) {
+        for (int i = 0; i < USB_OUT_TRANSFER_POOL_SIZE; i++) {
+            ESP_ERROR_CHECK(usb_host_transfer_alloc(USB_OUT_TRANSFER_SIZE, 0, &device->out_transfers[i]));
+            device->out_transfers[i]->callback = out_transfer_cb;
+            device->out_transfers[i]->context = (void *)device;
+            device->out_free_mask |= 1UL << i;
+        }
+        device->out_mps = out_ep->mps;
+        if (device->out_mps > USB_OUT_TRANSFER_SIZE) {
+            device->out_mps = USB_OUT_TRANSFER_SIZE;
+        }
+        device->out_cable_from_trs = 0;
+        device->out_ep_addr = out_ep->address;
+        ESP_LOGI(TAG, "OUT pipeline on ep %02x, %d byte transfers", device->out_ep_addr, device->out_mps);
+    }
 
-    // if (loopcounter%10 == 1){
-
-    //     usb_host_transfer_submit(transfer);
-
-    // }
-
-
-    loopcounter++;
-
-    //Nothing to do until the device disconnects
-    //driver_obj->actions &= ~ACTION_GET_STR_DESC;
+    //Get the device's string descriptors next
+    device->actions |= ACTION_GET_STR_DESC;
 }
 
-static void aciton_close_dev(class_driver_t *driver_obj)
+static void action_get_str_desc(usb_midi_device_t *device)
 {
-    ESP_ERROR_CHECK(usb_host_device_close(driver_obj->client_hdl, driver_obj->dev_hdl));
-    driver_obj->dev_hdl = NULL;
-    driver_obj->dev_addr = 0;
-    //We need to exit the event handler loop
-    driver_obj->actions &= ~ACTION_CLOSE_DEV;
-    driver_obj->actions |= ACTION_EXIT;
-}
+    assert(device->dev_hdl != NULL);
+    usb_device_info_t dev_info;
+    ESP_ERROR_CHECK(usb_host_device_info(device->dev_hdl, &dev_info));
+    if (dev_info.str_desc_manufacturer) {
+        ESP_LOGI(TAG, "Getting Manufacturer string descriptor");
+        usb_print_string_descriptor(dev_info.str_desc_manufacturer);
+    }
+    if (dev_info.str_desc_product) {
+        ESP_LOGI(TAG, "Getting Product string descriptor");
+        usb_print_string_descriptor(dev_info.str_desc_product);
+    }
+    if (dev_info.str_desc_serial_num) {
+        ESP_LOGI(TAG, "Getting Serial Number string descriptor");
+        usb_print_string_descriptor(dev_info.str_desc_serial_num);
+    }
 
+    //Nothing to do until the device disconnects
+    device->actions &= ~ACTION_GET_STR_DESC;
+}
 
-static void timer_cb(void *arg)
+static void aciton_close_dev(usb_midi_device_t *device)
 {
-    class_driver_t *driver_obj = (class_driver_t *)arg;
-    struct uart_midi_event_packet clock =
-    {
-        .length = 1,
-        .byte1 = 0xF8,
-        .byte2 = 0,
-        .byte3 = 0,
-    };
-    uart_send_data(clock);
-
-    if (driver_obj->new_midi_timer_period != driver_obj->midi_timer_period)
-    {
-        esp_timer_restart(driver_obj->midi_timer_hdl, driver_obj->new_midi_timer_period);
-        driver_obj->midi_timer_period = driver_obj->new_midi_timer_period;
+    ESP_LOGI(TAG, "Closing device at address %d", device->dev_addr);
+    device->closing = true;
+    device->actions &= ~ACTION_CLOSE_DEV;
+
+    //Cancel what is still in flight, the callbacks report back before anything is freed
+    for (int i = 0; i < device->num_in; i++) {
+        uint8_t address = device->in_transfers[i * USB_IN_TRANSFERS_PER_EP]->bEndpointAddress;
+        usb_host_endpoint_halt(device->dev_hdl, address);
+        usb_host_endpoint_flush(device->dev_hdl, address);
     }
-}
-
+    if (device->out_ep_addr != 0) {
+        usb_host_endpoint_halt(device->dev_hdl, device->out_ep_addr);
+        usb_host_endpoint_flush(device->dev_hdl, device->out_ep_addr);
+    }
+    //Transfers the IN worker held back for TRS out or another device's SysEx are not in flight, it gives them back
+    usb_midi_in_kick();
 
-static void setup_timer_for_midi_clock(class_driver_t *driver_obj)
-{
-    esp_timer_create_args_t timer_args = {
-        .callback = timer_cb,
-        .arg = (void *)driver_obj,
-        .dispatch_method = ESP_TIMER_TASK,
-        .name = "MIDI clock",
-        .skip_unhandled_events = true,
-    };
-    driver_obj->midi_timer_base_period = DEFAULT_MIDI_CLOCK_TIMER_IN_USEC;
-    driver_obj->midi_timer_period = DEFAULT_MIDI_CLOCK_TIMER_IN_USEC;
-    driver_obj->new_midi_timer_period = DEFAULT_MIDI_CLOCK_TIMER_IN_USEC;
-    esp_timer_create(&timer_args, &driver_obj->midi_timer_hdl);
+    usb_midi_device_check_closed(device);
 }
 
-static void start_midi_clock(class_driver_t *driver_obj)
+static void action_free_dev(usb_midi_device_t *device)
 {
-    esp_timer_start_periodic(driver_obj->midi_timer_hdl, driver_obj->midi_timer_period);
-    ESP_LOGI(TAG, "MIDI clock started");
+    class_driver_t *driver_obj = device->driver;
+
+    //The merge state belongs to the IN worker, tell it in order with the device's last transfers
+    spsc_queue_push(&usb_in_queue, ((uint32_t)device->index << 1) | USB_IN_REMOVED_TAG);
+    xTaskNotifyGive(usb_in_task_hdl);
+
+    for (int i = 0; i < device->num_in * USB_IN_TRANSFERS_PER_EP; i++) {
+        usb_host_transfer_free(device->in_transfers[i]);
+    }
+    for (int i = 0; i < USB_OUT_TRANSFER_POOL_SIZE; i++) {
+        if (device->out_transfers[i] != NULL) {
+            usb_host_transfer_free(device->out_transfers[i]);
+        }
+    }
+    for (int i = 0; i < device->num_claimed_intfs; i++) {
+        usb_host_interface_release(driver_obj->client_hdl, device->dev_hdl, device->claimed_intfs[i]);
+    }
+    ESP_ERROR_CHECK(usb_host_device_close(driver_obj->client_hdl, device->dev_hdl));
+    driver_obj->open_devices--;
+
+    //Clear the slot for the next device
+    uint8_t index = device->index;
+    memset(device, 0, sizeof(*device));
+    device->driver = driver_obj;
+    device->index = index;
 }
 
-static void stop_midi_clock(class_driver_t *driver_obj)
+static void handle_device_actions(usb_midi_device_t *device)
 {
-    esp_timer_stop(driver_obj->midi_timer_hdl);
-    esp_timer_delete(driver_obj->midi_timer_hdl);
+    if (device->actions & ACTION_OPEN_DEV) {
+        action_open_dev(device);
+        if (device->dev_hdl != NULL) {
+            clock_driver_start();
+        }
+    }
+    if (device->actions & ACTION_GET_DEV_INFO) {
+        action_get_info(device);
+    }
+    if (device->actions & ACTION_GET_DEV_DESC) {
+        action_get_dev_desc(device);
+        led_connect_effect_start();
+    }
+    if (device->actions & ACTION_GET_CONFIG_DESC) {
+        action_get_config_desc(device);
+    }
+    if (device->actions & ACTION_GET_STR_DESC) {
+        action_get_str_desc(device);
+    }
+    if (device->actions & ACTION_CLOSE_DEV) {
+        aciton_close_dev(device);
+    }
+    if (device->actions & ACTION_FREE_DEV) {
+        action_free_dev(device);
+    }
 }
 
 
 void class_driver_task(void *arg)
 {
     SemaphoreHandle_t signaling_sem = (SemaphoreHandle_t)arg;
-    class_driver_t driver_obj = {0};
+    //Callbacks keep pointers into the device table, keep it off the task stack
+    static class_driver_t driver_obj;
 
     //Wait until daemon task has installed USB Host Library
     xSemaphoreTake(signaling_sem, portMAX_DELAY);
@@ -507,48 +807,44 @@ void class_driver_task(void *arg)
         },
     };
     ESP_ERROR_CHECK(usb_host_client_register(&client_config, &driver_obj.client_hdl));
- 
-    setup_timer_for_midi_clock(&driver_obj);
 
+    for (int i = 0; i < USB_MIDI_MAX_DEVICES; i++) {
+        driver_obj.devices[i].driver = &driver_obj;
+        driver_obj.devices[i].index = i;
+    }
+    usb_out_client_hdl = driver_obj.client_hdl;
+
+    xTaskCreatePinnedToCore(usb_in_task,
+                            "usb_in",
+                            4096,
+                            (void *)&driver_obj,
+                            USB_IN_TASK_PRIORITY,
+                            &usb_in_task_hdl,
+                            xPortGetCoreID());
+
+    //Devices come and go through hotplug, the client stays registered for the lifetime of the firmware
     while (1) {
 
-        //ESP_LOGI(TAG, "actions: %d, loopcounter: %d", driver_obj.actions, loopcounter);
-        
-        usb_host_client_handle_events(driver_obj.client_hdl, 10);
+        //A closing device has no action while it waits for its transfers, their callbacks wake us up
+        bool pending = false;
+        for (int i = 0; i < USB_MIDI_MAX_DEVICES; i++) {
+            pending |= driver_obj.devices[i].actions != 0;
+        }
 
+        //Sleep until a client event, a transfer completion or usb_out_kick wakes us up.
+        //Actions still pending from the last pass are handled without waiting.
+        usb_host_client_handle_events(driver_obj.client_hdl, pending ? 0 : portMAX_DELAY);
 
+        usb_out_flush(&driver_obj);
 
-        if (driver_obj.actions & ACTION_OPEN_DEV) {
-            action_open_dev(&driver_obj);
-            start_midi_clock(&driver_obj);
-        }
-        if (driver_obj.actions & ACTION_GET_DEV_INFO) {
-            action_get_info(&driver_obj);
-        }
-        if (driver_obj.actions & ACTION_GET_DEV_DESC) {
-            action_get_dev_desc(&driver_obj);
-            led_connect_effect_start();
-        }
-        if (driver_obj.actions & ACTION_GET_CONFIG_DESC) {
-            action_get_config_desc(&driver_obj);
-        }
-        if (driver_obj.actions & ACTION_GET_STR_DESC) {
-            action_get_str_desc(&driver_obj);
-        }
-        if (driver_obj.actions & ACTION_CLOSE_DEV) {
-            aciton_close_dev(&driver_obj);
+        for (int i = 0; i < USB_MIDI_MAX_DEVICES; i++) {
+            //IN transfers of a closing device come back through the worker, which unblocks us
+            usb_midi_device_check_closed(&driver_obj.devices[i]);
+            handle_device_actions(&driver_obj.devices[i]);
         }
-        if (driver_obj.actions & ACTION_EXIT) {
-            break;
+
+        if (driver_obj.open_devices == 0) {
+            clock_driver_stop();
         }
     }
-
-    stop_midi_clock(&driver_obj);
-
-    ESP_LOGI(TAG, "Deregistering Client");
-    ESP_ERROR_CHECK(usb_host_client_deregister(driver_obj.client_hdl));
-
-    //Wait to be deleted
-    xSemaphoreGive(signaling_sem);
-    vTaskSuspend(NULL);
 }
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include "midi_translator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Counters of the TRS -> USB OUT pipeline.
+ * The first group is written by the TRS input task, the rest by the USB client task.
+ */
+struct usb_midi_out_stats
+{
+  uint32_t packets_queued;              // accepted from the TRS input
+  uint32_t packets_dropped_queue_full;  // TRS input outran the USB device
+  uint32_t queue_depth_max;             // deepest the queue has been
+
+  uint32_t packets_dropped_no_device;   // no OUT endpoint to send them to, or the device a reply was for left
+  uint32_t packets_dropped_device_busy; // TRS stream, one device still had every transfer in flight, the others got them
+  uint32_t packets_sent;                // acknowledged by the device
+  uint32_t transfers_submitted;
+  uint32_t transfers_failed;
+  uint32_t transfer_latency_max_us;     // submit to completion
+  uint64_t transfer_latency_total_us;
+};
+
+/**
+ * Counters of the USB IN -> TRS pipeline.
+ * An endpoint is idle while none of its transfers is submitted, i.e. the host has stopped polling it.
+ */
+struct usb_midi_in_stats
+{
+  uint32_t transfers_completed;         // handed from the client task to the IN worker
+  uint32_t submit_failed;               // resubmits the host refused, the transfer is retired
+  uint32_t idle_max_us;                 // longest an endpoint went without a submitted transfer
+  uint64_t idle_total_us;
+  uint32_t idle_count;                  // times an endpoint had no transfer submitted
+  uint32_t throttled;                   // times resubmission was held back because TRS out was saturated
+  uint32_t throttled_max_us;            // longest it was held back
+  uint64_t throttled_total_us;
+};
+
+/**
+ * @brief USB host class driver task, handles enumeration and MIDI transfers
+ * @param[in] arg signaling semaphore shared with the host library daemon
+ */
+void class_driver_task(void *arg);
+
+/**
+ * @brief Wake the USB client task so the event packets queued in the pipeline go out
+ */
+void usb_midi_out_kick(void);
+
+/**
+ * @brief Snapshot of the OUT pipeline counters
+ * @param[out] stats counters
+ */
+void usb_midi_out_get_stats(struct usb_midi_out_stats *stats);
+
+/**
+ * @brief Wake the IN worker so it resubmits the transfers it held back for TRS out
+ */
+void usb_midi_in_kick(void);
+
+/**
+ * @brief Snapshot of the IN pipeline counters
+ * @param[out] stats counters
+ */
+void usb_midi_in_get_stats(struct usb_midi_in_stats *stats);
+
+
+#ifdef __cplusplus
+}
+#endif
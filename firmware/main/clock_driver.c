@@ -0,0 +1,150 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "driver/gptimer.h"
+
+#include "midi_clock.h"
+#include "clock_driver.h"
+#include "config_driver.h"
+#include "midi_pipeline.h"
+#include "trace_ring.h"
+
+#define CLOCK_TIMER_RESOLUTION_HZ   1000000 // 1 tick = 1 us, the clock engine time base
+#define CLOCK_TASK_PRIORITY         (configMAX_PRIORITIES - 1)
+
+static const char *TAG = "CLOCK";
+
+static midi_clock_t midi_clock;
+static gptimer_handle_t clock_timer;
+static TaskHandle_t clock_task_hdl;
+static bool clock_running;
+static volatile uint64_t clock_alarm_at;
+static struct clock_driver_stats clock_stats;
+
+static bool IRAM_ATTR clock_alarm_cb(gptimer_handle_t timer, const gptimer_alarm_event_data_t *edata, void *user_ctx)
+{
+    BaseType_t high_task_wakeup = pdFALSE;
+
+    clock_alarm_at = edata->alarm_value;
+
+    //Program the next pulse on its absolute deadline, the timer keeps counting so nothing drifts
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = midi_clock_advance(&midi_clock, edata->count_value),
+    };
+    gptimer_set_alarm_action(timer, &alarm_config);
+
+    vTaskNotifyGiveFromISR(clock_task_hdl, &high_task_wakeup);
+    return high_task_wakeup == pdTRUE;
+}
+
+static void clock_timer_init(void)
+{
+    gptimer_config_t timer_config = {
+        .clk_src = GPTIMER_CLK_SRC_DEFAULT,
+        .direction = GPTIMER_COUNT_UP,
+        .resolution_hz = CLOCK_TIMER_RESOLUTION_HZ,
+    };
+    ESP_ERROR_CHECK(gptimer_new_timer(&timer_config, &clock_timer));
+
+    gptimer_event_callbacks_t callbacks = {
+        .on_alarm = clock_alarm_cb,
+    };
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(clock_timer, &callbacks, NULL));
+    ESP_ERROR_CHECK(gptimer_enable(clock_timer));
+}
+
+static void clock_task(void *arg)
+{
+    TaskHandle_t init_task_hdl = (TaskHandle_t)arg;
+
+    //The alarm interrupt is allocated on the core that registers it, keep it next to this task
+    clock_timer_init();
+    xTaskNotifyGive(init_task_hdl);
+
+    for (;;) {
+        //Highest priority task in the system, runs right after the alarm ISR returns
+        uint32_t pulses = ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        uint64_t now;
+        gptimer_get_raw_count(clock_timer, &now);
+        uint32_t latency = (uint32_t)(now - clock_alarm_at);
+        if (latency > clock_stats.wake_latency_max_us) {
+            clock_stats.wake_latency_max_us = latency;
+        }
+        clock_stats.wake_latency_total_us += latency;
+        clock_stats.pulses += pulses;
+
+        //The pulses were due when the alarm fired, their latency counts from there
+        uint32_t due_at = (uint32_t)esp_timer_get_time() - latency;
+        while (pulses--) {
+            midi_pipeline_clock_pulse(&midi_pipeline, due_at);
+        }
+    }
+}
+
+void clock_driver_init(void)
+{
+    const knot_config_snapshot_t *config = config_driver_acquire();
+    midi_clock_init(&midi_clock, midi_clock_period_from_ppm(config->config.bpm_default * MIDI_CLOCK_PPQN));
+    config_driver_release(config);
+
+    xTaskCreatePinnedToCore(clock_task,
+                            "clock",
+                            2048,
+                            xTaskGetCurrentTaskHandle(),
+                            CLOCK_TASK_PRIORITY,
+                            &clock_task_hdl,
+                            CONFIG_KNOT_MIDI_CORE);
+
+    //Wait until the timer exists so clock_driver_start can be called right away
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+}
+
+void clock_driver_start(void)
+{
+    if (clock_running) {
+        return;
+    }
+
+    uint64_t now;
+    ESP_ERROR_CHECK(gptimer_get_raw_count(clock_timer, &now));
+    midi_clock_start(&midi_clock, now + 1);
+
+    gptimer_alarm_config_t alarm_config = {
+        .alarm_count = midi_clock_deadline_us(&midi_clock),
+    };
+    ESP_ERROR_CHECK(gptimer_set_alarm_action(clock_timer, &alarm_config));
+    ESP_ERROR_CHECK(gptimer_start(clock_timer));
+    clock_running = true;
+
+    ESP_LOGI(TAG, "MIDI clock started");
+}
+
+void clock_driver_stop(void)
+{
+    if (!clock_running) {
+        return;
+    }
+
+    ESP_ERROR_CHECK(gptimer_stop(clock_timer));
+    clock_running = false;
+}
+
+void clock_driver_set_period(uint32_t period)
+{
+    midi_clock_set_period(&midi_clock, period);
+    TRACE_I(CLOCK, TRACE_EV_TEMPO_PERIOD, period >> MIDI_CLOCK_FRAC_BITS);
+}
+
+uint32_t clock_driver_get_period(void)
+{
+    return midi_clock_get_period(&midi_clock);
+}
+
+void clock_driver_get_stats(struct clock_driver_stats *stats)
+{
+    *stats = clock_stats;
+}
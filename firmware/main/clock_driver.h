@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Counters of the MIDI clock output, written by the clock task.
+ */
+struct clock_driver_stats
+{
+  uint32_t pulses;                  // F8 bytes handed to the TRS output
+  uint32_t wake_latency_max_us;     // alarm deadline to clock task running
+  uint64_t wake_latency_total_us;
+};
+
+/**
+ * @brief Create the clock task on the MIDI core and set up its timer there
+ */
+void clock_driver_init(void);
+
+/**
+ * @brief Start sending F8 pulses, the first one goes out right away
+ */
+void clock_driver_start(void);
+
+/**
+ * @brief Stop sending F8 pulses
+ */
+void clock_driver_stop(void);
+
+/**
+ * @brief Change the tempo, the next pulse keeps its phase
+ * @param[in] period pulse period in MIDI_CLOCK_FRAC_BITS fixed point microseconds
+ */
+void clock_driver_set_period(uint32_t period);
+
+/**
+ * @brief Current pulse period in MIDI_CLOCK_FRAC_BITS fixed point microseconds
+ */
+uint32_t clock_driver_get_period(void);
+
+/**
+ * @brief Snapshot of the clock counters
+ * @param[out] stats counters
+ */
+void clock_driver_get_stats(struct clock_driver_stats *stats);
+
+
+#ifdef __cplusplus
+}
+#endif
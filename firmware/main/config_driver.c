@@ -0,0 +1,110 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "config_driver.h"
+
+#define CONFIG_NVS_NAMESPACE    "knot"
+#define CONFIG_NVS_KEY          "config"   // knot_config blob, see knot_config.h
+
+static const char *TAG = "CONFIG";
+
+static knot_config_store_t config_store;
+static SemaphoreHandle_t config_write_mutex;
+
+static void config_load(struct knot_config *config)
+{
+    knot_config_defaults(config);
+
+    nvs_handle_t nvs;
+    if (nvs_open(CONFIG_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK) {
+        ESP_LOGI(TAG, "Nothing stored, using the defaults");
+        return;
+    }
+
+    uint8_t *blob = malloc(KNOT_CONFIG_MAX_SIZE);
+    size_t size = KNOT_CONFIG_MAX_SIZE;
+    esp_err_t err = blob ? nvs_get_blob(nvs, CONFIG_NVS_KEY, blob, &size) : ESP_ERR_NO_MEM;
+    nvs_close(nvs);
+
+    if (err == ESP_OK && knot_config_decode(config, blob, size)) {
+        ESP_LOGI(TAG, "Loaded version %u, %u rules", blob[2], config->rule_count);
+    }
+    else if (err == ESP_ERR_NVS_NOT_FOUND) {
+        ESP_LOGI(TAG, "Nothing stored, using the defaults");
+    }
+    else {
+        ESP_LOGW(TAG, "Stored config unreadable (%s, %u bytes), using the defaults", esp_err_to_name(err), (unsigned)size);
+    }
+    free(blob);
+}
+
+static esp_err_t config_save(const struct knot_config *config)
+{
+    uint8_t *blob = malloc(KNOT_CONFIG_MAX_SIZE);
+    if (blob == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    size_t size = knot_config_encode(config, blob, KNOT_CONFIG_MAX_SIZE);
+
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(CONFIG_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(nvs, CONFIG_NVS_KEY, blob, size);
+        if (err == ESP_OK) {
+            err = nvs_commit(nvs);
+        }
+        nvs_close(nvs);
+    }
+    free(blob);
+    return err;
+}
+
+void config_driver_init(void)
+{
+    config_write_mutex = xSemaphoreCreateMutex();
+
+    //Temporary copy, the store keeps its own
+    struct knot_config *config = malloc(sizeof(*config));
+    assert(config);
+    config_load(config);
+    if (!knot_config_store_init(&config_store, config)) {
+        ESP_LOGW(TAG, "Stored rules rejected, using the defaults");
+    }
+    free(config);
+}
+
+const knot_config_snapshot_t *config_driver_acquire(void)
+{
+    return knot_config_acquire(&config_store);
+}
+
+void config_driver_release(const knot_config_snapshot_t *snapshot)
+{
+    knot_config_release(&config_store, snapshot);
+}
+
+esp_err_t config_driver_update(const struct knot_config *config)
+{
+    xSemaphoreTake(config_write_mutex, portMAX_DELAY);
+
+    //Readers hold a snapshot for one transfer at most, the previous one frees up within a tick
+    enum knot_config_result result;
+    while ((result = knot_config_publish(&config_store, config)) == KNOT_CONFIG_BUSY) {
+        vTaskDelay(1);
+    }
+
+    esp_err_t err = ESP_ERR_INVALID_ARG;
+    if (result == KNOT_CONFIG_OK) {
+        err = config_save(config);
+        ESP_LOGI(TAG, "Applied %u rules, %s", config->rule_count, err == ESP_OK ? "stored" : esp_err_to_name(err));
+    }
+
+    xSemaphoreGive(config_write_mutex);
+    return err;
+}
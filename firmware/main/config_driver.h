@@ -0,0 +1,39 @@
+#pragma once
+
+#include "esp_err.h"
+#include "knot_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Load the configuration from NVS, falls back to the defaults
+ *
+ * Call once at boot after nvs_flash_init, before any task reads the configuration.
+ */
+void config_driver_init(void);
+
+/**
+ * @brief Pin the live configuration, lock free, release it after the unit of work it is used for
+ */
+const knot_config_snapshot_t *config_driver_acquire(void);
+
+/**
+ * @brief Unpin a configuration taken with config_driver_acquire
+ * @param[in] snapshot snapshot
+ */
+void config_driver_release(const knot_config_snapshot_t *snapshot);
+
+/**
+ * @brief Apply a new configuration and store it in NVS, may be called from any task
+ * @param[in] config new configuration
+ *
+ * @return ESP_ERR_INVALID_ARG if the rules do not compile, otherwise the NVS result
+ */
+esp_err_t config_driver_update(const struct knot_config *config);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_timer.h"
+
+#include "knot_hal.h"
+#include "midi_pipeline.h"
+#include "config_driver.h"
+#include "clock_driver.h"
+#include "class_driver.h"
+#include "sysex_driver.h"
+#include "ab_switch_driver.h"
+
+//The ESP-IDF side of knot_hal.h, every call maps onto one of the drivers
+
+extern void led_tx_effect_start(void);
+extern void led_rx_effect_start(void);
+extern void led_err_effect_start(void);
+
+extern void uart_tx_wake(void);
+
+midi_pipeline_t midi_pipeline;
+
+uint32_t knot_hal_time_us(void)
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+void knot_hal_yield(void)
+{
+    vTaskDelay(1);
+}
+
+void knot_hal_trs_tx_wake(void)
+{
+    uart_tx_wake();
+}
+
+void knot_hal_usb_in_wake(void)
+{
+    usb_midi_in_kick();
+}
+
+void knot_hal_usb_out_wake(void)
+{
+    usb_midi_out_kick();
+}
+
+void knot_hal_led(enum knot_hal_led led)
+{
+    switch (led) {
+    case KNOT_HAL_LED_TX:
+        led_tx_effect_start();
+        break;
+    case KNOT_HAL_LED_RX:
+        led_rx_effect_start();
+        break;
+    case KNOT_HAL_LED_ERROR:
+        led_err_effect_start();
+        break;
+    }
+}
+
+const knot_config_snapshot_t *knot_hal_config_acquire(void)
+{
+    return config_driver_acquire();
+}
+
+void knot_hal_config_release(const knot_config_snapshot_t *snapshot)
+{
+    config_driver_release(snapshot);
+}
+
+uint8_t knot_hal_ab_switch(void)
+{
+    return ab_switch_get();
+}
+
+void knot_hal_clock_set_period(uint32_t period)
+{
+    clock_driver_set_period(period);
+}
+
+uint32_t knot_hal_clock_get_period(void)
+{
+    return clock_driver_get_period();
+}
+
+void knot_hal_sysex_request(knot_sysex_port_t *port)
+{
+    sysex_driver_request(port);
+}
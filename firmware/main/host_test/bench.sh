@@ -0,0 +1,4 @@
+cmake -S . -B ./build
+cd ./build
+make
+./Benchmark
@@ -0,0 +1,314 @@
+#include "../midi_translator.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#endif
+
+#define FRAME_SIZE 64
+#define FRAME_COUNT 1000000
+
+static double now_sec(void){
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile uint32_t sink = 0;
+
+// Synthetic 64 byte IN transfer: 16 CC event packets, the way a dense encoder sweep arrives
+static void fill_cc_frame(uint8_t *frame, uint8_t value){
+
+  for (int i = 0; i < FRAME_SIZE / 4; i++){
+    frame[i * 4 + 0] = 0x0B;
+    frame[i * 4 + 1] = 0xB0 | (i & 0x0F);
+    frame[i * 4 + 2] = i;
+    frame[i * 4 + 3] = value & 0x7F;
+  }
+}
+
+static void bench_usb_in_transfer(void){
+
+  uint8_t frame[FRAME_SIZE];
+  struct uart_midi_event_packet packets[FRAME_SIZE / 4];
+  uint8_t uart_bytes[FRAME_SIZE / 4 * 3];
+
+  // first event packet only, as the IN callback used to do
+  double start = now_sec();
+  uint64_t messages = 0;
+  for (uint32_t n = 0; n < FRAME_COUNT; n++){
+    fill_cc_frame(frame, n);
+    struct usb_midi_event_packet usb_ev = {frame[0], frame[1], frame[2], frame[3]};
+    struct uart_midi_event_packet uart_ev = usb_midi_to_uart(usb_ev);
+    sink += uart_ev.byte3;
+    messages += (uart_ev.length != 0);
+  }
+  double single = now_sec() - start;
+  printf("usb in, first packet only : %10.0f frames/s, %10.0f msg/s, %llu of %u messages forwarded\n",
+    FRAME_COUNT / single, messages / single, (unsigned long long)messages, FRAME_COUNT * (FRAME_SIZE / 4));
+
+  // whole transfer decoded and packed for a single uart write
+  start = now_sec();
+  messages = 0;
+  for (uint32_t n = 0; n < FRAME_COUNT; n++){
+    fill_cc_frame(frame, n);
+    size_t count = usb_midi_decode_transfer(frame, FRAME_SIZE, packets, FRAME_SIZE / 4);
+    size_t length = uart_midi_pack_packets(packets, count, uart_bytes, sizeof(uart_bytes));
+    sink += uart_bytes[length - 1];
+    messages += count;
+  }
+  double batched = now_sec() - start;
+  printf("usb in, batched transfer  : %10.0f frames/s, %10.0f msg/s, %llu of %u messages forwarded\n",
+    FRAME_COUNT / batched, messages / batched, (unsigned long long)messages, FRAME_COUNT * (FRAME_SIZE / 4));
+}
+
+#define UART_STREAM_SIZE 1024
+#define UART_STREAM_COUNT 20000
+
+// Synthetic TRS input: running status notes, CC sweeps, clock ticks and a short sysex
+static size_t fill_uart_stream(uint8_t *stream, size_t size){
+
+  size_t n = 0;
+  uint8_t value = 0;
+
+  while (n + 16 <= size){
+    stream[n++] = 0x90; stream[n++] = value & 0x7F; stream[n++] = 0x7F;
+    stream[n++] = (value + 4) & 0x7F; stream[n++] = 0x7F;
+    stream[n++] = 0xF8;
+    stream[n++] = 0xB3; stream[n++] = 0x4A; stream[n++] = value & 0x7F;
+    stream[n++] = 0xF0; stream[n++] = 0x7D; stream[n++] = 0x01; stream[n++] = 0x02; stream[n++] = 0xF7;
+    stream[n++] = 0xC0; stream[n++] = value & 0x7F;
+    value++;
+  }
+
+  return n;
+}
+
+static void bench_uart_rx(void){
+
+  static uint8_t stream[UART_STREAM_SIZE];
+  static struct usb_midi_event_packet packets[UART_STREAM_SIZE];
+  size_t length = fill_uart_stream(stream, sizeof(stream));
+
+  // byte by byte, the way uart_rx_task used to do it
+  double start = now_sec();
+  uint64_t messages = 0;
+  for (uint32_t n = 0; n < UART_STREAM_COUNT; n++){
+    for (size_t i = 0; i < length; i++){
+      struct uart_midi_event_packet uart_ev = uart_midi_process_byte(stream[i]);
+      if (uart_ev.length){
+        struct usb_midi_event_packet usb_ev = midi_uart_to_usb(uart_ev);
+        sink += usb_ev.byte0;
+        messages++;
+      }
+    }
+  }
+  double per_byte = now_sec() - start;
+  printf("uart rx, per byte         : %10.0f bytes/s, %10.0f msg/s\n",
+    (double)length * UART_STREAM_COUNT / per_byte, messages / per_byte);
+
+  // whole read parsed in one call
+  midi_parser_t parser;
+  midi_parser_init(&parser);
+  start = now_sec();
+  messages = 0;
+  for (uint32_t n = 0; n < UART_STREAM_COUNT; n++){
+    size_t count = midi_parse_span(&parser, stream, length, packets, UART_STREAM_SIZE);
+    sink += packets[count - 1].byte0;
+    messages += count;
+  }
+  double span = now_sec() - start;
+  printf("uart rx, span             : %10.0f bytes/s, %10.0f msg/s\n",
+    (double)length * UART_STREAM_COUNT / span, messages / span);
+}
+
+/*
+
+  Reference copies of the switch/if-chain translators the lookup tables replaced,
+  used to compare cycles per packet and to check the tables are bit-exact.
+
+*/
+
+__attribute__((noinline)) static struct uart_midi_event_packet legacy_usb_midi_to_uart(struct usb_midi_event_packet usb_packet){
+
+  struct uart_midi_event_packet uart_packet = {
+    .length = 0,
+    .byte1 = usb_packet.byte1,
+    .byte2 = usb_packet.byte2,
+    .byte3 = usb_packet.byte3
+  };
+
+  uint8_t cin = (usb_packet.byte0 & 0b00001111);
+
+  switch(cin){
+    case 0x00: break;
+    case 0x01: break;
+    case 0x02: uart_packet.length = 2; break;
+    case 0x03: uart_packet.length = 3; break;
+    case 0x04: uart_packet.length = 3; break;
+    case 0x05: uart_packet.length = 1; break;
+    case 0x06: uart_packet.length = 2; break;
+    case 0x07: uart_packet.length = 3; break;
+    case 0x08: uart_packet.length = 3; break;
+    case 0x09: uart_packet.length = 3; break;
+    case 0x0A: uart_packet.length = 3; break;
+    case 0x0B: uart_packet.length = 3; break;
+    case 0x0C: uart_packet.length = 2; break;
+    case 0x0D: uart_packet.length = 2; break;
+    case 0x0E: uart_packet.length = 3; break;
+    case 0x0F: uart_packet.length = 1; break;
+  }
+
+  return uart_packet;
+}
+
+__attribute__((noinline)) static struct usb_midi_event_packet legacy_midi_uart_to_usb(struct uart_midi_event_packet uart_packet){
+
+  struct usb_midi_event_packet ev = {0, 0, 0, 0};
+
+  if (uart_packet.length == 0){
+    return ev;
+  }
+
+  ev.byte1 = uart_packet.byte1;
+  ev.byte2 = uart_packet.byte2;
+  ev.byte3 = uart_packet.byte3;
+
+  if (uart_packet.byte1 == 0xF0 || uart_packet.byte1 < 128){
+    if (uart_packet.byte2 == 0xF7){
+      ev.byte0 = 0x06;
+    }
+    else if (uart_packet.byte3 == 0xF7){
+      ev.byte0 = 0x07;
+    }
+    else{
+      ev.byte0 = 0x04;
+    }
+  }
+  else if (uart_packet.byte1 == 0xF7){
+    ev.byte0 = 0x05;
+  }
+  else if (uart_packet.byte1 > 0xF0 && uart_packet.byte1 < 0xF8){
+    ev.byte0 = uart_packet.length == 3 ? 0x03 : uart_packet.length == 2 ? 0x02 : 0x05;
+  }
+  else{
+    ev.byte0 = (uart_packet.byte1 >> 4);
+  }
+
+  return ev;
+}
+
+static uint32_t check_tables_bit_exact(void){
+
+  uint32_t mismatches = 0;
+  const uint8_t probes[] = {0x00, 0x01, 0x7F, 0x80, 0xF0, 0xF7, 0xF8, 0xFF};
+
+  for (int byte0 = 0; byte0 < 256; byte0++){
+    struct usb_midi_event_packet usb_ev = {byte0, 0x90, 0x40, 0x7F};
+    struct uart_midi_event_packet a = usb_midi_to_uart(usb_ev);
+    struct uart_midi_event_packet b = legacy_usb_midi_to_uart(usb_ev);
+    mismatches += memcmp(&a, &b, 4) != 0;
+  }
+
+  for (int length = 0; length < 4; length++){
+    for (int byte1 = 0; byte1 < 256; byte1++){
+      for (size_t i = 0; i < sizeof(probes); i++){
+        for (size_t j = 0; j < sizeof(probes); j++){
+          struct uart_midi_event_packet uart_ev = {length, byte1, probes[i], probes[j]};
+          struct usb_midi_event_packet a = midi_uart_to_usb(uart_ev);
+          struct usb_midi_event_packet b = legacy_midi_uart_to_usb(uart_ev);
+          mismatches += memcmp(&a, &b, 4) != 0;
+        }
+      }
+    }
+  }
+
+  return mismatches;
+}
+
+#define TRANSLATE_PACKETS 4096
+#define TRANSLATE_ROUNDS 2000
+
+static uint64_t ticks(void){
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return (uint64_t)(now_sec() * 1e9);
+#endif
+}
+
+static void bench_translate_tables(void){
+
+  static struct usb_midi_event_packet usb_in[TRANSLATE_PACKETS];
+  static struct uart_midi_event_packet uart_in[TRANSLATE_PACKETS];
+
+  // a realistic mix: channel voice, clock, sysex data and sysex ends
+  uint32_t seed = 1;
+  for (int i = 0; i < TRANSLATE_PACKETS; i++){
+    seed = seed * 1103515245 + 12345;
+    uint8_t kind = (seed >> 16) % 8;
+    uint8_t status = kind < 5 ? 0x80 + ((seed >> 8) & 0x6F) : kind == 5 ? 0xF8 : kind == 6 ? 0x12 : 0xF0;
+    uint8_t byte3 = kind == 7 ? 0xF7 : (seed >> 4) & 0x7F;
+    usb_in[i] = (struct usb_midi_event_packet){(seed >> 20) & 0x0F, status, (seed >> 12) & 0x7F, byte3};
+    uart_in[i] = (struct uart_midi_event_packet){1 + (seed >> 24) % 3, status, (seed >> 12) & 0x7F, byte3};
+  }
+
+  uint64_t start = ticks();
+  for (int r = 0; r < TRANSLATE_ROUNDS; r++){
+    for (int i = 0; i < TRANSLATE_PACKETS; i++){
+      sink += legacy_usb_midi_to_uart(usb_in[i]).length;
+    }
+  }
+  uint64_t legacy_usb = ticks() - start;
+
+  start = ticks();
+  for (int r = 0; r < TRANSLATE_ROUNDS; r++){
+    for (int i = 0; i < TRANSLATE_PACKETS; i++){
+      sink += usb_midi_to_uart(usb_in[i]).length;
+    }
+  }
+  uint64_t table_usb = ticks() - start;
+
+  start = ticks();
+  for (int r = 0; r < TRANSLATE_ROUNDS; r++){
+    for (int i = 0; i < TRANSLATE_PACKETS; i++){
+      sink += legacy_midi_uart_to_usb(uart_in[i]).byte0;
+    }
+  }
+  uint64_t legacy_uart = ticks() - start;
+
+  start = ticks();
+  for (int r = 0; r < TRANSLATE_ROUNDS; r++){
+    for (int i = 0; i < TRANSLATE_PACKETS; i++){
+      sink += midi_uart_to_usb(uart_in[i]).byte0;
+    }
+  }
+  uint64_t table_uart = ticks() - start;
+
+  double packets = (double)TRANSLATE_PACKETS * TRANSLATE_ROUNDS;
+#ifdef HAVE_RDTSC
+  const char *unit = "cycles";
+#else
+  const char *unit = "ns";
+#endif
+  printf("usb_midi_to_uart          : %6.2f %s/packet switch, %6.2f %s/packet table\n",
+    legacy_usb / packets, unit, table_usb / packets, unit);
+  printf("midi_uart_to_usb          : %6.2f %s/packet if-chain, %6.2f %s/packet table\n",
+    legacy_uart / packets, unit, table_uart / packets, unit);
+  printf("lookup tables bit-exact   : %s\n", check_tables_bit_exact() == 0 ? "yes" : "NO");
+}
+
+int main(void){
+
+  bench_usb_in_transfer();
+  bench_uart_rx();
+  bench_translate_tables();
+
+  return 0;
+}
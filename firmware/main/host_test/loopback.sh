@@ -0,0 +1,7 @@
+cmake -S . -B ./build
+cd ./build
+make
+# state read, then a note that is passed through
+printf '\xF0\x7D\x4B\x05\xF7\x90\x40\x7F' | ./SysexLoopback | xxd
+# config read
+printf '\xF0\x7D\x4B\x01\xF7' | ./SysexLoopback | xxd
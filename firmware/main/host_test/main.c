@@ -1,5 +1,17 @@
 #include "unity.h"
 #include "../midi_translator.h"
+#include "../trace_ring.h"
+#include "../spsc_queue.h"
+#include "../midi_clock.h"
+#include "../midi_tx_scheduler.h"
+#include "../midi_merge.h"
+#include "../usb_midi_desc.h"
+#include "../midi_router.h"
+#include "../knot_config.h"
+#include "../knot_sysex.h"
+#include "../knot_hal.h"
+#include "../midi_pipeline.h"
+#include "../latency_hist.h"
 
 #include <stdio.h>
 #include <memory.h>
@@ -370,6 +382,1536 @@ void midi_uart_to_usb__should_convertAllMessages(void){
 }
 
 
+static struct uart_midi_event_packet parse_bytes(midi_parser_t *parser, const uint8_t *bytes, int count){
+
+  struct uart_midi_event_packet ev = {0};
+  for (int i = 0; i < count; i++){
+    ev = midi_parser_process_byte(parser, bytes[i]);
+    if (i < count - 1){
+      TEST_ASSERT_EQUAL_UINT8(0, ev.length);
+    }
+  }
+  return ev;
+}
+
+void midi_parser__should_supportRunningStatus(void){
+
+  midi_parser_t parser;
+  midi_parser_init(&parser);
+
+  struct uart_midi_event_packet expected;
+  struct uart_midi_event_packet actual;
+
+  // data bytes without a status byte are ignored
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser, 0x40).length);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser, 0x7F).length);
+
+  // Note on, then two more notes using running status
+  actual = parse_bytes(&parser, (const uint8_t[]){0x92, 0x40, 0x7F}, 3);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0x92, .byte2 = 0x40, .byte3 = 0x7F};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  actual = parse_bytes(&parser, (const uint8_t[]){0x41, 0x7E}, 2);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0x92, .byte2 = 0x41, .byte3 = 0x7E};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  // a clock tick in the middle keeps running status
+  actual = midi_parser_process_byte(&parser, 0x42);
+  TEST_ASSERT_EQUAL_UINT8(0, actual.length);
+  actual = midi_parser_process_byte(&parser, 0xF8);
+  expected = (struct uart_midi_event_packet){.length = 0x01, .byte1 = 0xF8, .byte2 = 0x00, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+  actual = midi_parser_process_byte(&parser, 0x00);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0x92, .byte2 = 0x42, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  // two byte messages with running status
+  actual = parse_bytes(&parser, (const uint8_t[]){0xC5, 0x10}, 2);
+  expected = (struct uart_midi_event_packet){.length = 0x02, .byte1 = 0xC5, .byte2 = 0x10, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+  actual = midi_parser_process_byte(&parser, 0x11);
+  expected = (struct uart_midi_event_packet){.length = 0x02, .byte1 = 0xC5, .byte2 = 0x11, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  // system common cancels running status
+  actual = parse_bytes(&parser, (const uint8_t[]){0xF3, 0x05}, 2);
+  expected = (struct uart_midi_event_packet){.length = 0x02, .byte1 = 0xF3, .byte2 = 0x05, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser, 0x12).length);
+
+}
+
+void midi_parser__should_recogniseSystemCommonLengths(void){
+
+  midi_parser_t parser;
+  midi_parser_init(&parser);
+
+  struct uart_midi_event_packet expected;
+  struct uart_midi_event_packet actual;
+
+  // MTC quarter frame
+  actual = parse_bytes(&parser, (const uint8_t[]){0xF1, 0x23}, 2);
+  expected = (struct uart_midi_event_packet){.length = 0x02, .byte1 = 0xF1, .byte2 = 0x23, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  // Song position pointer
+  actual = parse_bytes(&parser, (const uint8_t[]){0xF2, 0x01, 0x02}, 3);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0xF2, .byte2 = 0x01, .byte3 = 0x02};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  // Tune request
+  actual = midi_parser_process_byte(&parser, 0xF6);
+  expected = (struct uart_midi_event_packet){.length = 0x01, .byte1 = 0xF6, .byte2 = 0x00, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  // undefined system common is ignored along with its data
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser, 0xF4).length);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser, 0x01).length);
+
+  // converted to the matching USB code index numbers
+  struct usb_midi_event_packet usb_expected;
+  struct usb_midi_event_packet usb_actual;
+
+  usb_actual = midi_uart_to_usb((struct uart_midi_event_packet){.length = 0x02, .byte1 = 0xF1, .byte2 = 0x23, .byte3 = 0x00});
+  usb_expected = (struct usb_midi_event_packet){.byte0 = 0x02, .byte1 = 0xF1, .byte2 = 0x23, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&usb_expected, &usb_actual, 4);
+
+  usb_actual = midi_uart_to_usb((struct uart_midi_event_packet){.length = 0x03, .byte1 = 0xF2, .byte2 = 0x01, .byte3 = 0x02});
+  usb_expected = (struct usb_midi_event_packet){.byte0 = 0x03, .byte1 = 0xF2, .byte2 = 0x01, .byte3 = 0x02};
+  TEST_ASSERT_EQUAL_MEMORY(&usb_expected, &usb_actual, 4);
+
+  usb_actual = midi_uart_to_usb((struct uart_midi_event_packet){.length = 0x01, .byte1 = 0xF6, .byte2 = 0x00, .byte3 = 0x00});
+  usb_expected = (struct usb_midi_event_packet){.byte0 = 0x05, .byte1 = 0xF6, .byte2 = 0x00, .byte3 = 0x00};
+  TEST_ASSERT_EQUAL_MEMORY(&usb_expected, &usb_actual, 4);
+
+}
+
+void midi_parser__should_keepInstancesIndependent(void){
+
+  midi_parser_t parser_a;
+  midi_parser_t parser_b;
+  midi_parser_init(&parser_a);
+  midi_parser_init(&parser_b);
+
+  struct uart_midi_event_packet expected;
+  struct uart_midi_event_packet actual;
+
+  // interleave a sysex on one instance with a CC on the other
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser_a, 0xF0).length);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser_b, 0xB1).length);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser_a, 0x7D).length);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser_b, 0x07).length);
+
+  actual = midi_parser_process_byte(&parser_a, 0xF7);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0xF0, .byte2 = 0x7D, .byte3 = 0xF7};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  actual = midi_parser_process_byte(&parser_b, 0x64);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0xB1, .byte2 = 0x07, .byte3 = 0x64};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+  // a status byte inside sysex terminates it
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser_a, 0xF0).length);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser_a, 0x01).length);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser_a, 0x90).length);
+  TEST_ASSERT_EQUAL_UINT8(0, midi_parser_process_byte(&parser_a, 0x3C).length);
+  actual = midi_parser_process_byte(&parser_a, 0x40);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0x90, .byte2 = 0x3C, .byte3 = 0x40};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &actual, 4);
+
+}
+
+void midi_parse_span__should_matchPerBytePath(void){
+
+  // notes with running status, a clock tick inside, a sysex and a program change
+  const uint8_t stream[] = {
+    0x90, 0x3C, 0x7F, 0x3E, 0x7F, 0xF8, 0x40, 0x7F,
+    0xF0, 0x7D, 0x01, 0x02, 0x03, 0xF7,
+    0xC2, 0x05,
+    0xB0, 0x07
+  };
+
+  midi_parser_t span_parser;
+  midi_parser_t byte_parser;
+  midi_parser_init(&span_parser);
+  midi_parser_init(&byte_parser);
+
+  struct usb_midi_event_packet packets[sizeof(stream)];
+  size_t count = midi_parse_span(&span_parser, stream, sizeof(stream), packets, sizeof(stream));
+  TEST_ASSERT_EQUAL_UINT32(7, count);
+
+  size_t index = 0;
+  for (size_t i = 0; i < sizeof(stream); i++){
+    struct uart_midi_event_packet uart_ev = midi_parser_process_byte(&byte_parser, stream[i]);
+    if (uart_ev.length){
+      struct usb_midi_event_packet expected = midi_uart_to_usb(uart_ev);
+      TEST_ASSERT_EQUAL_MEMORY(&expected, &packets[index], 4);
+      index++;
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(count, index);
+
+  // state carries over: the pending CC completes in the next span
+  const uint8_t rest[] = {0x64};
+  count = midi_parse_span(&span_parser, rest, sizeof(rest), packets, 1);
+  TEST_ASSERT_EQUAL_UINT32(1, count);
+  struct usb_midi_event_packet expected = {.byte0 = 0x0B, .byte1 = 0xB0, .byte2 = 0x07, .byte3 = 0x64};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &packets[0], 4);
+
+  // packets beyond capacity are dropped
+  midi_parser_init(&span_parser);
+  TEST_ASSERT_EQUAL_UINT32(2, midi_parse_span(&span_parser, stream, sizeof(stream), packets, 2));
+
+}
+
+void usb_midi_decode_transfer__should_decodeEveryPacketInTransfer(void){
+
+  struct uart_midi_event_packet packets[16];
+  struct uart_midi_event_packet expected;
+
+  // three CC messages followed by CIN 0 padding up to a full 64 byte frame
+  uint8_t frame[64] = {
+    0x0B, 0xB0, 0x01, 0x10,
+    0x0B, 0xB1, 0x02, 0x20,
+    0x00, 0x00, 0x00, 0x00,
+    0x0B, 0xB2, 0x03, 0x30,
+  };
+
+  size_t count = usb_midi_decode_transfer(frame, sizeof(frame), packets, 16);
+  TEST_ASSERT_EQUAL_UINT32(3, count);
+
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0xB0, .byte2 = 0x01, .byte3 = 0x10};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &packets[0], 4);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0xB1, .byte2 = 0x02, .byte3 = 0x20};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &packets[1], 4);
+  expected = (struct uart_midi_event_packet){.length = 0x03, .byte1 = 0xB2, .byte2 = 0x03, .byte3 = 0x30};
+  TEST_ASSERT_EQUAL_MEMORY(&expected, &packets[2], 4);
+
+  // only the actual number of bytes is decoded, trailing partial packet is ignored
+  count = usb_midi_decode_transfer(frame, 6, packets, 16);
+  TEST_ASSERT_EQUAL_UINT32(1, count);
+
+  // output capacity is respected
+  count = usb_midi_decode_transfer(frame, sizeof(frame), packets, 2);
+  TEST_ASSERT_EQUAL_UINT32(2, count);
+
+}
+
+void uart_midi_pack_packets__should_packVariableLengthMessages(void){
+
+  struct uart_midi_event_packet packets[3] = {
+    {.length = 0x03, .byte1 = 0x90, .byte2 = 0x40, .byte3 = 0x7F},
+    {.length = 0x01, .byte1 = 0xF8, .byte2 = 0x00, .byte3 = 0x00},
+    {.length = 0x02, .byte1 = 0xC0, .byte2 = 0x05, .byte3 = 0x00},
+  };
+  uint8_t out[8] = {0};
+
+  uint8_t expected[6] = {0x90, 0x40, 0x7F, 0xF8, 0xC0, 0x05};
+  TEST_ASSERT_EQUAL_UINT32(6, uart_midi_pack_packets(packets, 3, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_MEMORY(expected, out, 6);
+
+  // a message that does not fit is not split
+  TEST_ASSERT_EQUAL_UINT32(4, uart_midi_pack_packets(packets, 3, out, 5));
+
+}
+
+
+static trace_ring_t test_trace_ring;
+
+void trace_ring__should_keepOrderAndDropWhenFull(void){
+
+  struct trace_entry entry;
+
+  trace_ring_init(&test_trace_ring);
+  TEST_ASSERT_FALSE(trace_ring_pop(&test_trace_ring, &entry));
+
+  for (uint32_t i = 0; i < TRACE_RING_SIZE; i++){
+    TEST_ASSERT_TRUE(trace_ring_push(&test_trace_ring, i, TRACE_EV_USB_IN_MESSAGE, i * 2));
+  }
+
+  // ring is full, next entry is dropped and counted
+  TEST_ASSERT_FALSE(trace_ring_push(&test_trace_ring, 0, TRACE_EV_USB_IN_ERROR, 0));
+  TEST_ASSERT_EQUAL_UINT32(1, trace_ring_take_dropped(&test_trace_ring));
+  TEST_ASSERT_EQUAL_UINT32(0, trace_ring_take_dropped(&test_trace_ring));
+
+  for (uint32_t i = 0; i < TRACE_RING_SIZE; i++){
+    TEST_ASSERT_TRUE(trace_ring_pop(&test_trace_ring, &entry));
+    TEST_ASSERT_EQUAL_UINT32(i, entry.timestamp);
+    TEST_ASSERT_EQUAL_UINT32(i * 2, entry.arg);
+  }
+  TEST_ASSERT_FALSE(trace_ring_pop(&test_trace_ring, &entry));
+
+  // wraps around after a full lap
+  TEST_ASSERT_TRUE(trace_ring_push(&test_trace_ring, 7, TRACE_EV_TEMPO_PERIOD, TRACE_PACK4(1, 2, 3, 4)));
+  TEST_ASSERT_TRUE(trace_ring_pop(&test_trace_ring, &entry));
+  TEST_ASSERT_EQUAL_UINT16(TRACE_EV_TEMPO_PERIOD, entry.event);
+  TEST_ASSERT_EQUAL_HEX32(0x01020304, entry.arg);
+
+}
+
+
+void spsc_queue__should_keepOrderAndRejectWhenFull(void){
+
+  uint32_t storage[8];
+  uint32_t values[8];
+  uint32_t value;
+  spsc_queue_t queue;
+
+  spsc_queue_init(&queue, storage, 8);
+  TEST_ASSERT_FALSE(spsc_queue_pop(&queue, &value));
+  TEST_ASSERT_EQUAL_UINT32(0, spsc_queue_count(&queue));
+
+  for (uint32_t i = 0; i < 8; i++){
+    TEST_ASSERT_TRUE(spsc_queue_push(&queue, 100 + i));
+  }
+  TEST_ASSERT_FALSE(spsc_queue_push(&queue, 999));
+  TEST_ASSERT_EQUAL_UINT32(8, spsc_queue_count(&queue));
+
+  TEST_ASSERT_TRUE(spsc_queue_pop(&queue, &value));
+  TEST_ASSERT_EQUAL_UINT32(100, value);
+
+  // bulk pop is limited by max
+  TEST_ASSERT_EQUAL_UINT32(3, spsc_queue_pop_many(&queue, values, 3));
+  TEST_ASSERT_EQUAL_UINT32(101, values[0]);
+  TEST_ASSERT_EQUAL_UINT32(103, values[2]);
+
+  // wrap around the end of the storage
+  for (uint32_t i = 0; i < 4; i++){
+    TEST_ASSERT_TRUE(spsc_queue_push(&queue, 200 + i));
+  }
+  TEST_ASSERT_EQUAL_UINT32(8, spsc_queue_pop_many(&queue, values, 8));
+  TEST_ASSERT_EQUAL_UINT32(104, values[0]);
+  TEST_ASSERT_EQUAL_UINT32(203, values[7]);
+  TEST_ASSERT_EQUAL_UINT32(0, spsc_queue_pop_many(&queue, values, 8));
+
+}
+
+void latency_hist__should_reportPercentilesWithinABucket(void){
+
+  static latency_hist_t hist;
+  latency_hist_init(&hist);
+
+  struct latency_hist_summary summary;
+  latency_hist_summarize(&hist, &summary);
+  TEST_ASSERT_EQUAL_UINT32(0, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(0, summary.p99_us);
+
+  // 98 fast messages, one slow one and one stuck behind a long SysEx
+  for (int i = 0; i < 98; i++){
+    latency_hist_record(&hist, 300 + i);
+  }
+  latency_hist_record(&hist, 5000);
+  latency_hist_record(&hist, 100000000);
+
+  latency_hist_summarize(&hist, &summary);
+  TEST_ASSERT_EQUAL_UINT32(100, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(100000000, summary.max_us);
+  // the 50th of 100 is 349, its bucket is 320-351
+  TEST_ASSERT_EQUAL_UINT32(351, summary.p50_us);
+  // 5000 lies in 4608-5119
+  TEST_ASSERT_EQUAL_UINT32(5119, summary.p99_us);
+
+  // small values have buckets of their own
+  latency_hist_init(&hist);
+  latency_hist_record(&hist, 0);
+  latency_hist_record(&hist, 7);
+  latency_hist_summarize(&hist, &summary);
+  TEST_ASSERT_EQUAL_UINT32(0, summary.p50_us);
+  TEST_ASSERT_EQUAL_UINT32(7, summary.p99_us);
+
+}
+
+
+void midi_clock__should_notDriftOverLongRuns(void){
+
+  midi_clock_t clock;
+
+  // 120 BPM = 20833.33 us per pulse, an integer microsecond timer would drift 20 ms per minute
+  midi_clock_init(&clock, midi_clock_period_from_ppm(120 * MIDI_CLOCK_PPQN));
+  midi_clock_start(&clock, 1000);
+  TEST_ASSERT_EQUAL_UINT64(1000, midi_clock_deadline_us(&clock));
+
+  uint64_t deadline = 0;
+  for (uint32_t i = 0; i < 120 * MIDI_CLOCK_PPQN * 60; i++){
+    deadline = midi_clock_advance(&clock, midi_clock_deadline_us(&clock));
+  }
+
+  // one hour of pulses stays within 20 us of the ideal grid, far below crystal tolerance
+  TEST_ASSERT_UINT64_WITHIN(20, 1000 + 3600ULL * 1000000, deadline);
+  TEST_ASSERT_EQUAL_UINT32(120 * MIDI_CLOCK_PPQN * 60, clock.pulses);
+  TEST_ASSERT_EQUAL_UINT32(0, clock.pulses_skipped);
+
+}
+
+void midi_clock__should_changeTempoWithoutPhaseReset(void){
+
+  midi_clock_t clock;
+
+  midi_clock_init(&clock, 10000 << MIDI_CLOCK_FRAC_BITS);
+  midi_clock_start(&clock, 0);
+
+  TEST_ASSERT_EQUAL_UINT64(10000, midi_clock_advance(&clock, 0));
+  TEST_ASSERT_EQUAL_UINT64(20000, midi_clock_advance(&clock, 10000));
+
+  // tempo change half way through a pulse keeps the pending deadline
+  midi_clock_set_period(&clock, 5000 << MIDI_CLOCK_FRAC_BITS);
+  TEST_ASSERT_EQUAL_UINT64(20000, midi_clock_deadline_us(&clock));
+  TEST_ASSERT_EQUAL_UINT64(25000, midi_clock_advance(&clock, 20000));
+  TEST_ASSERT_EQUAL_UINT64(30000, midi_clock_advance(&clock, 25000));
+
+  // more than a period late: skip to the next grid point instead of bursting
+  TEST_ASSERT_EQUAL_UINT64(45000, midi_clock_advance(&clock, 41000));
+  TEST_ASSERT_EQUAL_UINT32(2, clock.pulses_skipped);
+
+}
+
+void midi_clock__should_applyFineTempo(void){
+
+  uint32_t period = midi_clock_period_from_ppm(100 * MIDI_CLOCK_PPQN);
+  TEST_ASSERT_EQUAL_UINT32(25000 << MIDI_CLOCK_FRAC_BITS, period);
+
+  TEST_ASSERT_EQUAL_UINT32(period, midi_clock_apply_fine(period, 0));
+  TEST_ASSERT_EQUAL_UINT32((23000 << MIDI_CLOCK_FRAC_BITS), midi_clock_apply_fine(period, 63));
+  TEST_ASSERT_EQUAL_UINT32((27000 << MIDI_CLOCK_FRAC_BITS), midi_clock_apply_fine(period, -63));
+
+  // the slowest tempo still fits with the fine offset and a bend on top, slower ones stop at the longest period
+  period = midi_clock_period_from_ppm(MIDI_CLOCK_BPM_MIN * MIDI_CLOCK_PPQN);
+  TEST_ASSERT_TRUE(midi_clock_apply_fine(period, -63) > period);
+  TEST_ASSERT_EQUAL_UINT32(MIDI_CLOCK_PERIOD_MAX, midi_clock_bend(midi_clock_apply_fine(period, -63), 1, true));
+  TEST_ASSERT_EQUAL_UINT32(period - period / 2, midi_clock_bend(period, 2, false));
+  TEST_ASSERT_EQUAL_UINT32(MIDI_CLOCK_PERIOD_MAX, midi_clock_period_from_ppm(MIDI_CLOCK_PPQN));
+
+}
+
+
+static struct uart_midi_event_packet tx_msg(uint8_t length, uint8_t byte1, uint8_t byte2, uint8_t byte3){
+
+  struct uart_midi_event_packet msg = { .length = length, .byte1 = byte1, .byte2 = byte2, .byte3 = byte3 };
+  return msg;
+}
+
+void midi_tx_scheduler__should_putRealtimeAtMessageBoundaries(void){
+
+  static midi_tx_scheduler_t scheduler;
+  midi_tx_scheduler_init(&scheduler);
+
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x90, 0x40, 0x7F), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x80, 0x40, 0x00), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(1, 0xF8, 0, 0), 100);
+
+  TEST_ASSERT_EQUAL_UINT32(1, midi_tx_scheduler_depth(&scheduler, MIDI_TX_LANE_REALTIME));
+  TEST_ASSERT_EQUAL_UINT32(2, midi_tx_scheduler_depth(&scheduler, MIDI_TX_LANE_NORMAL));
+
+  // the clock jumps the queue, a message that does not fit whole waits for the next pull
+  uint8_t out[8];
+  TEST_ASSERT_EQUAL(4, midi_tx_scheduler_pull(&scheduler, 150, out, 5));
+  const uint8_t first[] = { 0xF8, 0x90, 0x40, 0x7F };
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(first, out, 4);
+
+  midi_tx_scheduler_push(&scheduler, tx_msg(1, 0xFC, 0, 0), 400);
+  TEST_ASSERT_EQUAL(4, midi_tx_scheduler_pull(&scheduler, 1400, out, sizeof(out)));
+  const uint8_t second[] = { 0xFC, 0x80, 0x40, 0x00 };
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(second, out, 4);
+  TEST_ASSERT_EQUAL(0, midi_tx_scheduler_pull(&scheduler, 1400, out, sizeof(out)));
+
+  struct midi_tx_lane_stats stats;
+  midi_tx_scheduler_get_stats(&scheduler, MIDI_TX_LANE_REALTIME, &stats);
+  TEST_ASSERT_EQUAL_UINT32(0, stats.depth);
+  TEST_ASSERT_EQUAL_UINT32(1, stats.depth_max);
+  TEST_ASSERT_EQUAL_UINT32(1000, stats.wait_max_us);
+  TEST_ASSERT_EQUAL_UINT32(2, stats.messages);
+
+  midi_tx_scheduler_get_stats(&scheduler, MIDI_TX_LANE_NORMAL, &stats);
+  TEST_ASSERT_EQUAL_UINT32(2, stats.depth_max);
+  TEST_ASSERT_EQUAL_UINT32(1400, stats.wait_max_us);
+  TEST_ASSERT_EQUAL_UINT32(2, stats.messages);
+
+}
+
+void midi_tx_scheduler__should_interleaveRealtimeInsideSysEx(void){
+
+  static midi_tx_scheduler_t scheduler;
+  midi_tx_scheduler_init(&scheduler);
+
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xF0, 0x7D, 0x01), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(2, 0x02, 0xF7, 0), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(2, 0xC0, 0x05, 0), 0);
+
+  uint8_t out[16];
+  size_t count = midi_tx_scheduler_pull(&scheduler, 0, out, 2);
+  TEST_ASSERT_EQUAL(2, count);
+
+  midi_tx_scheduler_push(&scheduler, tx_msg(1, 0xF8, 0, 0), 0);
+  count += midi_tx_scheduler_pull(&scheduler, 0, out + count, 2);
+  TEST_ASSERT_EQUAL(4, count);
+
+  count += midi_tx_scheduler_pull(&scheduler, 0, out + count, sizeof(out) - count);
+  const uint8_t expected[] = { 0xF0, 0x7D, 0xF8, 0x01, 0x02, 0xF7, 0xC0, 0x05 };
+  TEST_ASSERT_EQUAL(sizeof(expected), count);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, out, count);
+
+}
+
+void midi_tx_scheduler__should_keepClockLaneSeparate(void){
+
+  static midi_tx_scheduler_t scheduler;
+  midi_tx_scheduler_init(&scheduler);
+
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x07, 0x64), 10);
+  midi_tx_scheduler_push(&scheduler, tx_msg(1, 0xFA, 0, 0), 20);
+  TEST_ASSERT_TRUE(midi_tx_scheduler_push_clock(&scheduler, 0xF8, 30));
+
+  TEST_ASSERT_EQUAL_UINT32(1, midi_tx_scheduler_depth(&scheduler, MIDI_TX_LANE_CLOCK));
+  TEST_ASSERT_EQUAL_UINT32(1, midi_tx_scheduler_depth(&scheduler, MIDI_TX_LANE_REALTIME));
+
+  uint8_t out[8];
+  const uint8_t expected[] = { 0xF8, 0xFA, 0xB0, 0x07, 0x64 };
+  TEST_ASSERT_EQUAL(sizeof(expected), midi_tx_scheduler_pull(&scheduler, 40, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, out, sizeof(expected));
+
+  // every message the pull finished is reported with its lane and arrival
+  TEST_ASSERT_EQUAL_UINT8(3, scheduler.sent_count);
+  TEST_ASSERT_EQUAL_UINT8(MIDI_TX_LANE_CLOCK, scheduler.sent[0].lane);
+  TEST_ASSERT_EQUAL_UINT32(30, scheduler.sent[0].enqueued_at);
+  TEST_ASSERT_EQUAL_UINT8(1, scheduler.sent[0].end);
+  TEST_ASSERT_EQUAL_UINT8(MIDI_TX_LANE_NORMAL, scheduler.sent[2].lane);
+  TEST_ASSERT_EQUAL_UINT32(10, scheduler.sent[2].enqueued_at);
+  TEST_ASSERT_EQUAL_UINT8(5, scheduler.sent[2].end);
+
+}
+
+void midi_tx_scheduler__should_keepRepliesOutOfSysEx(void){
+
+  static midi_tx_scheduler_t scheduler;
+  midi_tx_scheduler_init(&scheduler);
+
+  // a SysEx of the normal lane is on the wire when the reply arrives
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xF0, 0x01, 0x02), 0);
+  uint8_t out[16];
+  TEST_ASSERT_EQUAL(3, midi_tx_scheduler_pull(&scheduler, 0, out, 3));
+  TEST_ASSERT_FALSE(midi_tx_scheduler_at_boundary(&scheduler));
+
+  TEST_ASSERT_TRUE(midi_tx_scheduler_push_reply(&scheduler, tx_msg(3, 0xF0, 0x7D, 0x4B), 0));
+  TEST_ASSERT_TRUE(midi_tx_scheduler_push_reply(&scheduler, tx_msg(1, 0xF7, 0, 0), 0));
+  midi_tx_scheduler_push(&scheduler, tx_msg(1, 0xF7, 0, 0), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x90, 0x40, 0x7F), 0);
+
+  // the normal SysEx ends first, the note goes ahead of the reply, the reply then stays whole
+  // a note queued once the reply started waits for its F7
+  const uint8_t expected[] = { 0xF7, 0x90, 0x40, 0x7F, 0xF0, 0x7D, 0x4B, 0xF7, 0x80, 0x40, 0x00 };
+  TEST_ASSERT_EQUAL(5, midi_tx_scheduler_pull(&scheduler, 0, out, 5));
+  TEST_ASSERT_FALSE(midi_tx_scheduler_at_boundary(&scheduler));
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x80, 0x40, 0x00), 0);
+  TEST_ASSERT_EQUAL(6, midi_tx_scheduler_pull(&scheduler, 0, &out[5], 11));
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(expected, out, sizeof(expected));
+  TEST_ASSERT_TRUE(midi_tx_scheduler_at_boundary(&scheduler));
+
+}
+
+void midi_tx_scheduler__should_dropWhenLaneFull(void){
+
+  static midi_tx_scheduler_t scheduler;
+  midi_tx_scheduler_init(&scheduler);
+
+  for (int i = 0; i < MIDI_TX_LANE_SIZE; i++){
+    TEST_ASSERT_TRUE(midi_tx_scheduler_push(&scheduler, tx_msg(2, 0xC0, i & 0x7F, 0), 0));
+  }
+  TEST_ASSERT_FALSE(midi_tx_scheduler_push(&scheduler, tx_msg(2, 0xC0, 0, 0), 0));
+
+  // a full normal lane never blocks the clock
+  TEST_ASSERT_TRUE(midi_tx_scheduler_push(&scheduler, tx_msg(1, 0xF8, 0, 0), 0));
+
+  struct midi_tx_lane_stats stats;
+  midi_tx_scheduler_get_stats(&scheduler, MIDI_TX_LANE_NORMAL, &stats);
+  TEST_ASSERT_EQUAL_UINT32(MIDI_TX_LANE_SIZE, stats.depth);
+  TEST_ASSERT_EQUAL_UINT32(1, stats.dropped);
+
+}
+
+void midi_tx_scheduler__should_leaveOutRepeatedStatusBytes(void){
+
+  static midi_tx_scheduler_t scheduler;
+  midi_tx_scheduler_init(&scheduler);
+  scheduler.running_status = true;
+
+  uint8_t out[32];
+  size_t count;
+
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x90, 0x40, 0x7F), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x90, 0x41, 0x7F), 0);
+  count = midi_tx_scheduler_pull(&scheduler, 0, out, sizeof(out));
+  const uint8_t notes[] = { 0x90, 0x40, 0x7F, 0x41, 0x7F };
+  TEST_ASSERT_EQUAL(sizeof(notes), count);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(notes, out, count);
+
+  // real-time bytes leave the running status alone, another status or system common replaces it
+  midi_tx_scheduler_push_clock(&scheduler, 0xF8, 1000);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x90, 0x42, 0x7F), 1000);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x07, 0x64), 1000);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x07, 0x65), 1000);
+  midi_tx_scheduler_push(&scheduler, tx_msg(2, 0xF3, 0x01, 0), 1000);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x07, 0x66), 1000);
+  count = midi_tx_scheduler_pull(&scheduler, 1000, out, sizeof(out));
+  const uint8_t mixed[] = { 0xF8, 0x42, 0x7F, 0xB0, 0x07, 0x64, 0x07, 0x65, 0xF3, 0x01, 0xB0, 0x07, 0x66 };
+  TEST_ASSERT_EQUAL(sizeof(mixed), count);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(mixed, out, count);
+
+  // so does a SysEx
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xF0, 0x7D, 0xF7), 2000);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x07, 0x67), 2000);
+  count = midi_tx_scheduler_pull(&scheduler, 2000, out, sizeof(out));
+  const uint8_t sysex[] = { 0xF0, 0x7D, 0xF7, 0xB0, 0x07, 0x67 };
+  TEST_ASSERT_EQUAL(sizeof(sysex), count);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(sysex, out, count);
+
+  // the status byte is repeated once it is old, after a rewiring and with running status off
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x07, 0x68), 0);
+  TEST_ASSERT_EQUAL(3, midi_tx_scheduler_pull(&scheduler, 2000 + MIDI_TX_RUNNING_STATUS_REFRESH_US, out, sizeof(out)));
+  midi_tx_scheduler_cancel_running_status(&scheduler);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x07, 0x69), 0);
+  TEST_ASSERT_EQUAL(3, midi_tx_scheduler_pull(&scheduler, 2000 + MIDI_TX_RUNNING_STATUS_REFRESH_US, out, sizeof(out)));
+  scheduler.running_status = false;
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x07, 0x6A), 0);
+  TEST_ASSERT_EQUAL(3, midi_tx_scheduler_pull(&scheduler, 2000 + MIDI_TX_RUNNING_STATUS_REFRESH_US, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8(0xB0, out[0]);
+
+}
+
+void midi_tx_scheduler__should_overwriteQueuedControllerValues(void){
+
+  static midi_tx_scheduler_t scheduler;
+  midi_tx_scheduler_init(&scheduler);
+
+  // below the coalescing depth every value is queued
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x90, 0x40, 0x7F), 0);
+  for (int i = 0; i < MIDI_TX_COALESCE_DEPTH - 1; i++){
+    midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x10 + i, 0x00), 0);
+  }
+  TEST_ASSERT_EQUAL_UINT32(MIDI_TX_COALESCE_DEPTH, midi_tx_scheduler_depth(&scheduler, MIDI_TX_LANE_NORMAL));
+
+  // from there a newer value takes the place of the queued one, pitch bend and pressure too
+  TEST_ASSERT_TRUE(midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x10, 0x11), 0));
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xE0, 0x00, 0x40), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xE0, 0x7F, 0x7F), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xE0, 0x00, 0x40), 0);
+  TEST_ASSERT_EQUAL_UINT32(MIDI_TX_COALESCE_DEPTH + 1, midi_tx_scheduler_depth(&scheduler, MIDI_TX_LANE_NORMAL));
+
+  // a value never overtakes a note, nor the data entry of an RPN
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x80, 0x40, 0x00), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x10, 0x22), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x06, 0x01), 0);
+  midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x06, 0x02), 0);
+  TEST_ASSERT_EQUAL_UINT32(MIDI_TX_COALESCE_DEPTH + 5, midi_tx_scheduler_depth(&scheduler, MIDI_TX_LANE_NORMAL));
+
+  struct midi_tx_lane_stats stats;
+  midi_tx_scheduler_get_stats(&scheduler, MIDI_TX_LANE_NORMAL, &stats);
+  TEST_ASSERT_EQUAL_UINT32(3, stats.coalesced);
+
+  uint8_t out[64];
+  size_t count = midi_tx_scheduler_pull(&scheduler, 0, out, sizeof(out));
+  TEST_ASSERT_EQUAL((MIDI_TX_COALESCE_DEPTH + 5) * 3, count);
+  const uint8_t first[] = { 0x90, 0x40, 0x7F, 0xB0, 0x10, 0x11, 0xB0, 0x11, 0x00 };
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(first, out, sizeof(first));
+  const uint8_t last[] = { 0xE0, 0x00, 0x40, 0x80, 0x40, 0x00, 0xB0, 0x10, 0x22, 0xB0, 0x06, 0x01, 0xB0, 0x06, 0x02 };
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(last, &out[count - sizeof(last)], sizeof(last));
+
+}
+
+void midi_tx_scheduler__should_boundKnobLatencyOnTheWire(void){
+
+  static midi_tx_scheduler_t scheduler;
+  midi_tx_scheduler_init(&scheduler);
+
+  // 8 encoders swept at once, a full 64 byte transfer every ms, a note every 50 ms: 16x what 31250 baud carries
+  const uint32_t byte_us = 320;
+  static uint32_t arrived[8][128];
+  uint8_t latest[8] = { 0 };
+  uint8_t on_wire[8] = { 0 };
+  bool sent[8] = { false };
+  uint32_t latency_max = 0;
+  uint32_t notes_pushed = 0;
+  uint32_t notes_sent = 0;
+  uint32_t wire_free = 0;
+
+  for (uint32_t t = 0; t < 500000; t += 1000){
+
+    // the wire sends one message after the other until the next transfer arrives
+    while (wire_free < t){
+      uint8_t out[3];
+      size_t length = midi_tx_scheduler_pull(&scheduler, wire_free, out, sizeof(out));
+      if (length == 0){
+        wire_free = t;
+        break;
+      }
+      wire_free += length * byte_us;
+
+      if (out[0] == 0x90){
+        TEST_ASSERT_EQUAL_UINT8(notes_sent & 0x7F, out[1]);
+        notes_sent++;
+        continue;
+      }
+      // how old the value the wire showed for this knob had become when it was replaced
+      uint8_t encoder = out[1] - 0x10;
+      if (sent[encoder] && wire_free - arrived[encoder][on_wire[encoder]] > latency_max){
+        latency_max = wire_free - arrived[encoder][on_wire[encoder]];
+      }
+      on_wire[encoder] = out[2];
+      sent[encoder] = true;
+    }
+
+    if (t % 50000 == 0){
+      TEST_ASSERT_TRUE(midi_tx_scheduler_push(&scheduler, tx_msg(3, 0x90, notes_pushed & 0x7F, 0x40), t));
+      notes_pushed++;
+    }
+    for (int i = 0; i < 16; i++){
+      uint8_t encoder = i % 8;
+      latest[encoder] = (latest[encoder] + 1) & 0x7F;
+      arrived[encoder][latest[encoder]] = t;
+      TEST_ASSERT_TRUE(midi_tx_scheduler_push(&scheduler, tx_msg(3, 0xB0, 0x10 + encoder, latest[encoder]), t));
+    }
+  }
+
+  // every note went out in order and the wire ends on the last value of every knob
+  uint8_t out[64];
+  while (midi_tx_scheduler_pull(&scheduler, wire_free, out, 3) > 0){
+    if (out[0] == 0x90){
+      notes_sent++;
+    }
+    else {
+      on_wire[out[1] - 0x10] = out[2];
+    }
+  }
+  TEST_ASSERT_EQUAL_UINT32(notes_pushed, notes_sent);
+  TEST_ASSERT_EQUAL_UINT8_ARRAY(latest, on_wire, sizeof(latest));
+
+  // plain queuing would fill the lane within 20 ms and drop from there, here no knob lags more than a few messages
+  TEST_ASSERT_TRUE(latency_max < 25000);
+
+  struct midi_tx_lane_stats stats;
+  midi_tx_scheduler_get_stats(&scheduler, MIDI_TX_LANE_NORMAL, &stats);
+  TEST_ASSERT_EQUAL_UINT32(0, stats.dropped);
+  TEST_ASSERT_TRUE(stats.depth_max < 32);
+
+}
+
+
+void midi_merge__should_holdOtherSourcesDuringSysEx(void){
+
+  static midi_merge_t merge;
+  midi_merge_init(&merge);
+
+  struct uart_midi_event_packet out[16];
+  size_t count;
+
+  const struct uart_midi_event_packet a_start[] = { tx_msg(3, 0xF0, 0x7D, 0x01) };
+  count = midi_merge_push(&merge, 0, a_start, 1, out, 16, 0);
+  TEST_ASSERT_EQUAL(1, count);
+
+  // device 1 plays a note and a clock in the middle of device 0's SysEx, only the clock may pass
+  const struct uart_midi_event_packet b_notes[] = { tx_msg(3, 0x90, 0x3C, 0x40), tx_msg(1, 0xF8, 0, 0), tx_msg(3, 0x80, 0x3C, 0x00) };
+  count = midi_merge_push(&merge, 1, b_notes, 3, out, 16, 0);
+  TEST_ASSERT_EQUAL(1, count);
+  TEST_ASSERT_EQUAL_HEX8(0xF8, out[0].byte1);
+
+  const struct uart_midi_event_packet a_end[] = { tx_msg(3, 0x02, 0x03, 0x04), tx_msg(2, 0x05, 0xF7, 0) };
+  count = midi_merge_push(&merge, 0, a_end, 2, out, 16, 0);
+  TEST_ASSERT_EQUAL(4, count);
+  TEST_ASSERT_EQUAL_HEX8(0x02, out[0].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0xF7, out[1].byte2);
+  TEST_ASSERT_EQUAL_HEX8(0x90, out[2].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0x80, out[3].byte1);
+
+  // no SysEx in progress, sources pass straight through
+  const struct uart_midi_event_packet a_note[] = { tx_msg(2, 0xC0, 0x01, 0) };
+  TEST_ASSERT_EQUAL(1, midi_merge_push(&merge, 0, a_note, 1, out, 16, 0));
+  TEST_ASSERT_EQUAL(0, merge.held_count);
+
+}
+
+void midi_merge__should_releaseWhenSourceRemoved(void){
+
+  static midi_merge_t merge;
+  midi_merge_init(&merge);
+
+  struct uart_midi_event_packet out[16];
+
+  const struct uart_midi_event_packet a_start[] = { tx_msg(3, 0xF0, 0x7D, 0x01) };
+  midi_merge_push(&merge, 0, a_start, 1, out, 16, 0);
+
+  const struct uart_midi_event_packet b_sysex[] = { tx_msg(3, 0xF0, 0x7E, 0x02), tx_msg(1, 0xF7, 0, 0) };
+  TEST_ASSERT_EQUAL(0, midi_merge_push(&merge, 1, b_sysex, 2, out, 16, 0));
+  const struct uart_midi_event_packet c_note[] = { tx_msg(3, 0x91, 0x40, 0x40) };
+  TEST_ASSERT_EQUAL(0, midi_merge_push(&merge, 2, c_note, 1, out, 16, 0));
+
+  // device 0 is unplugged mid SysEx, the others continue in arrival order
+  size_t count = midi_merge_remove_source(&merge, 0, out, 16, 0);
+  TEST_ASSERT_EQUAL(3, count);
+  TEST_ASSERT_EQUAL_HEX8(0xF0, out[0].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0x7E, out[0].byte2);
+  TEST_ASSERT_EQUAL_HEX8(0xF7, out[1].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0x91, out[2].byte1);
+  TEST_ASSERT_EQUAL(MIDI_MERGE_NO_OWNER, merge.sysex_owner);
+
+}
+
+void midi_merge__should_holdBackSourcesAndTimeOutSilentOwner(void){
+
+  static midi_merge_t merge;
+  midi_merge_init(&merge);
+
+  struct uart_midi_event_packet out[MIDI_MERGE_MAX_PUSH + MIDI_MERGE_HOLD_SIZE];
+  struct uart_midi_event_packet notes[MIDI_MERGE_MAX_PUSH];
+  for (int i = 0; i < MIDI_MERGE_MAX_PUSH; i++){
+    notes[i] = tx_msg(3, 0x90, i, 0x40);
+  }
+
+  const struct uart_midi_event_packet a_start[] = { tx_msg(3, 0xF0, 0x7D, 0x01) };
+  midi_merge_push(&merge, 0, a_start, 1, out, 16, 1000);
+  TEST_ASSERT_FALSE(midi_merge_is_held(&merge, 0));
+
+  // every other source fills the hold with one full push, then waits for the SysEx
+  for (uint8_t source = 1; source < MIDI_MERGE_MAX_SOURCES; source++){
+    TEST_ASSERT_FALSE(midi_merge_is_held(&merge, source));
+    TEST_ASSERT_EQUAL(0, midi_merge_push(&merge, source, notes, MIDI_MERGE_MAX_PUSH, out, 16, 2000));
+    TEST_ASSERT_TRUE(midi_merge_is_held(&merge, source));
+  }
+  TEST_ASSERT_EQUAL(MIDI_MERGE_HOLD_SIZE, merge.held_count);
+
+  // the owner keeps its SysEx as long as it goes on
+  const struct uart_midi_event_packet a_data[] = { tx_msg(3, 0x01, 0x02, 0x03) };
+  TEST_ASSERT_EQUAL(0, midi_merge_expire(&merge, 1000 + MIDI_MERGE_OWNER_TIMEOUT_US - 1, out, 16));
+  TEST_ASSERT_EQUAL(1, midi_merge_push(&merge, 0, a_data, 1, out, 16, 400000));
+  TEST_ASSERT_EQUAL(0, midi_merge_expire(&merge, 1000 + MIDI_MERGE_OWNER_TIMEOUT_US, out, 16));
+
+  // then goes silent, the held sources go out in arrival order
+  size_t count = midi_merge_expire(&merge, 400000 + MIDI_MERGE_OWNER_TIMEOUT_US, out, sizeof(out) / sizeof(out[0]));
+  TEST_ASSERT_EQUAL(MIDI_MERGE_HOLD_SIZE, count);
+  TEST_ASSERT_EQUAL(MIDI_MERGE_NO_OWNER, merge.sysex_owner);
+  TEST_ASSERT_EQUAL(1, merge.owner_timeouts);
+  TEST_ASSERT_EQUAL_HEX8(0x00, out[0].byte2);
+  TEST_ASSERT_EQUAL_HEX8(MIDI_MERGE_MAX_PUSH - 1, out[count - 1].byte2);
+  for (uint8_t source = 1; source < MIDI_MERGE_MAX_SOURCES; source++){
+    TEST_ASSERT_FALSE(midi_merge_is_held(&merge, source));
+  }
+
+}
+
+void usb_midi_decode_transfer_cables__should_skipUnroutedCables(void){
+
+  struct uart_midi_event_packet packets[4];
+
+  uint8_t frame[] = {
+    0x09, 0x90, 0x40, 0x7F,   // cable 0
+    0x19, 0x91, 0x41, 0x7F,   // cable 1
+    0x29, 0x92, 0x42, 0x7F,   // cable 2
+  };
+
+  uint8_t cables[4];
+  size_t count = usb_midi_decode_transfer_cables(frame, sizeof(frame), (1 << 1) | (1 << 2), packets, cables, 4);
+  TEST_ASSERT_EQUAL_UINT32(2, count);
+  TEST_ASSERT_EQUAL_HEX8(0x91, packets[0].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0x92, packets[1].byte1);
+  TEST_ASSERT_EQUAL_UINT8(1, cables[0]);
+  TEST_ASSERT_EQUAL_UINT8(2, cables[1]);
+
+  TEST_ASSERT_EQUAL_UINT32(3, usb_midi_decode_transfer(frame, sizeof(frame), packets, 4));
+
+}
+
+void usb_midi_parse_config__should_findEveryStreamingInterfaceAndCable(void){
+
+  const uint8_t config[] = {
+    0x09, 0x02, 0x00, 0x00, 0x03, 0x01, 0x00, 0x80, 0x32,
+    // audio control interface, not MIDI streaming
+    0x09, 0x04, 0x00, 0x00, 0x00, 0x01, 0x01, 0x00, 0x00,
+    0x09, 0x24, 0x01, 0x00, 0x01, 0x09, 0x00, 0x01, 0x01,
+    // two port MIDI streaming interface
+    0x09, 0x04, 0x01, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+    0x07, 0x24, 0x01, 0x00, 0x01, 0x41, 0x00,
+    0x06, 0x24, 0x02, 0x01, 0x01, 0x00,
+    0x06, 0x24, 0x02, 0x02, 0x02, 0x00,
+    0x09, 0x24, 0x03, 0x01, 0x03, 0x01, 0x02, 0x01, 0x00,
+    0x09, 0x24, 0x03, 0x02, 0x04, 0x01, 0x01, 0x01, 0x00,
+    0x06, 0x24, 0x02, 0x01, 0x05, 0x00,
+    0x09, 0x24, 0x03, 0x01, 0x06, 0x01, 0x02, 0x01, 0x00,
+    0x09, 0x05, 0x01, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x25, 0x01, 0x02, 0x01, 0x05,
+    0x09, 0x05, 0x81, 0x02, 0x40, 0x00, 0x00, 0x00, 0x00,
+    0x06, 0x25, 0x01, 0x02, 0x03, 0x06,
+    // second MIDI streaming interface without MS endpoint descriptors
+    0x09, 0x04, 0x02, 0x00, 0x02, 0x01, 0x03, 0x00, 0x00,
+    0x07, 0x05, 0x02, 0x02, 0x20, 0x00, 0x00,
+    0x07, 0x05, 0x82, 0x03, 0x08, 0x00, 0x01,
+    // alternate setting, ignored
+    0x09, 0x04, 0x02, 0x01, 0x01, 0x01, 0x03, 0x00, 0x00,
+    0x07, 0x05, 0x83, 0x02, 0x40, 0x00, 0x00,
+  };
+
+  static struct usb_midi_stream_info info;
+  TEST_ASSERT_EQUAL_UINT32(2, usb_midi_parse_config(config, sizeof(config), &info));
+
+  TEST_ASSERT_EQUAL_UINT8(1, info.interfaces[0]);
+  TEST_ASSERT_EQUAL_UINT8(2, info.interfaces[1]);
+  TEST_ASSERT_EQUAL_UINT8(4, info.num_endpoints);
+  TEST_ASSERT_EQUAL_UINT8(6, info.num_jacks);
+
+  TEST_ASSERT_EQUAL_HEX8(0x01, info.endpoints[0].address);
+  TEST_ASSERT_FALSE(usb_midi_endpoint_is_in(&info.endpoints[0]));
+  TEST_ASSERT_EQUAL_UINT8(2, info.endpoints[0].num_cables);
+  TEST_ASSERT_EQUAL_UINT8(5, info.endpoints[0].jack_ids[1]);
+
+  TEST_ASSERT_EQUAL_HEX8(0x81, info.endpoints[1].address);
+  TEST_ASSERT_TRUE(usb_midi_endpoint_is_in(&info.endpoints[1]));
+  TEST_ASSERT_EQUAL_UINT8(2, info.endpoints[1].num_cables);
+  TEST_ASSERT_EQUAL_UINT8(3, info.endpoints[1].jack_ids[0]);
+  TEST_ASSERT_EQUAL_UINT8(1, info.endpoints[1].interface);
+
+  TEST_ASSERT_EQUAL_HEX8(0x02, info.endpoints[2].address);
+  TEST_ASSERT_EQUAL_UINT16(32, info.endpoints[2].mps);
+  TEST_ASSERT_EQUAL_UINT8(1, info.endpoints[2].num_cables);
+  TEST_ASSERT_EQUAL_HEX8(0x82, info.endpoints[3].address);
+  TEST_ASSERT_EQUAL_UINT8(2, info.endpoints[3].interface);
+
+  TEST_ASSERT_EQUAL_UINT8(USB_MIDI_JACK_OUT, info.jacks[3].direction);
+  TEST_ASSERT_EQUAL_UINT8(USB_MIDI_JACK_EXTERNAL, info.jacks[3].type);
+
+  // an MS endpoint descriptor listing no jack, or cut short before them, still leaves cable 0
+  uint8_t no_jacks[sizeof(config)];
+  memcpy(no_jacks, config, sizeof(config));
+  const size_t out_ms = 97, in_ms = 112;
+  TEST_ASSERT_EQUAL_HEX8(0x25, no_jacks[out_ms + 1]);
+  TEST_ASSERT_EQUAL_HEX8(0x25, no_jacks[in_ms + 1]);
+  no_jacks[out_ms + 3] = 0x00;
+  no_jacks[in_ms] = 0x04;
+  no_jacks[in_ms + 4] = 0x02;   // the rest is a descriptor of its own, of no known type
+  no_jacks[in_ms + 5] = 0x00;
+  TEST_ASSERT_EQUAL_UINT32(2, usb_midi_parse_config(no_jacks, sizeof(no_jacks), &info));
+  TEST_ASSERT_EQUAL_UINT8(4, info.num_endpoints);
+  TEST_ASSERT_EQUAL_UINT8(1, info.endpoints[0].num_cables);
+  TEST_ASSERT_EQUAL_UINT8(1, info.endpoints[1].num_cables);
+
+  // a zero length descriptor ends the walk instead of looping
+  uint8_t broken[sizeof(config)];
+  memcpy(broken, config, sizeof(config));
+  broken[9 + 18] = 0x00;
+  TEST_ASSERT_EQUAL_UINT32(0, usb_midi_parse_config(broken, sizeof(broken), &info));
+
+}
+
+void midi_router__should_applyDefaultRules(void){
+
+  static midi_router_t router;
+  struct uart_midi_event_packet out[MIDI_ROUTER_MAX_OUT];
+  enum midi_route_clock clock;
+
+  TEST_ASSERT_TRUE(midi_router_compile(&router, midi_router_default_rules, midi_router_default_rule_count));
+
+  // Model:Samples track level, CC 0x17 on channel 10 becomes CC 0x5F on channel 3
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 0, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0xB9, 0x17, 0x40), out, &clock));
+  TEST_ASSERT_EQUAL_HEX8(0xB2, out[0].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0x5F, out[0].byte2);
+  TEST_ASSERT_EQUAL_HEX8(0x40, out[0].byte3);
+  TEST_ASSERT_EQUAL(MIDI_ROUTE_CLOCK_NONE, clock);
+
+  // tempo knob passes through and reports its clock control
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 0, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0xB0, 0x1B, 0x10), out, &clock));
+  TEST_ASSERT_EQUAL_HEX8(0x1B, out[0].byte2);
+  TEST_ASSERT_EQUAL(MIDI_ROUTE_CLOCK_COARSE, clock);
+
+  // the bend buttons only act on channel 16
+  midi_router_route(&router, 0, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0xBF, 0x69, 0x7F), out, &clock);
+  TEST_ASSERT_EQUAL(MIDI_ROUTE_CLOCK_BEND_DOWN, clock);
+  midi_router_route(&router, 0, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0xB0, 0x69, 0x7F), out, &clock);
+  TEST_ASSERT_EQUAL(MIDI_ROUTE_CLOCK_NONE, clock);
+
+  // everything else is untouched
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 0, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+  TEST_ASSERT_EQUAL_HEX8(0x90, out[0].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0x40, out[0].byte2);
+
+}
+
+void midi_router__should_fallThroughRulesOfOtherSources(void){
+
+  static midi_router_t router;
+  struct uart_midi_event_packet out[MIDI_ROUTER_MAX_OUT];
+  enum midi_route_clock clock;
+
+  const struct midi_route_rule rules[] = {
+    // notes of device 1 are dropped
+    { .source_mask = 1 << 1, .status = 0x90, .data1_min = 0x00, .data1_max = 0x7F, .actions = MIDI_ROUTE_DROP },
+    // cable 2 notes go out twice, the copy an octave up on channel 2 with halved velocity
+    { .cable_mask = 1 << 2, .status = 0x90, .data1_min = 0x00, .data1_max = 0x6F,
+      .actions = MIDI_ROUTE_DUPLICATE | MIDI_ROUTE_REMAP | MIDI_ROUTE_CHANNEL | MIDI_ROUTE_SCALE,
+      .data1 = 0x0C, .data1_step = 1, .channel_shift = 1, .out_min = 0, .out_max = 0x3F },
+  };
+
+  TEST_ASSERT_TRUE(midi_router_compile(&router, rules, 2));
+
+  TEST_ASSERT_EQUAL_UINT32(0, midi_router_route(&router, 1, 2, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+
+  TEST_ASSERT_EQUAL_UINT32(2, midi_router_route(&router, 0, 2, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+  TEST_ASSERT_EQUAL_HEX8(0x90, out[0].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0x40, out[0].byte2);
+  TEST_ASSERT_EQUAL_HEX8(0x91, out[1].byte1);
+  TEST_ASSERT_EQUAL_HEX8(0x4C, out[1].byte2);
+  TEST_ASSERT_EQUAL_HEX8(0x3F, out[1].byte3);
+
+  // other cables and data1 outside the range pass
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 0, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 0, 2, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x70, 0x7F), out, &clock));
+
+  // SysEx bytes are never routed
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 1, 2, MIDI_ROUTE_AB_A, tx_msg(3, 0x40, 0x7F, 0xF7), out, &clock));
+
+  // a rule for one switch position lets the other fall through to the next rule of the cell
+  const struct midi_route_rule switched[] = {
+    { .ab_mask = MIDI_ROUTE_AB_B, .status = 0x90, .data1_min = 0x00, .data1_max = 0x7F, .actions = MIDI_ROUTE_DROP },
+    { .status = 0x90, .data1_min = 0x00, .data1_max = 0x7F, .actions = MIDI_ROUTE_CHANNEL, .channel_shift = 1 },
+  };
+  TEST_ASSERT_TRUE(midi_router_compile(&router, switched, 2));
+  TEST_ASSERT_EQUAL_UINT32(0, midi_router_route(&router, 0, 0, MIDI_ROUTE_AB_B, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 0, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+  TEST_ASSERT_EQUAL_HEX8(0x91, out[0].byte1);
+
+  // a cell only chains the rules covering it, cells with the same rules share their links
+  static struct midi_route_rule chained[MIDI_ROUTER_MAX_RULES];
+  memset(chained, 0, sizeof(chained));
+  for (int i = 0; i < 32; i++){
+    chained[i] = (struct midi_route_rule){ .source_mask = 1 << 1, .status = 0x90, .data1_min = i, .data1_max = i,
+                                           .actions = MIDI_ROUTE_DROP };
+  }
+  chained[32] = (struct midi_route_rule){ .source_mask = 1 << 2, .status = 0x90, .data1_min = 0x00, .data1_max = 0x7F,
+                                          .actions = MIDI_ROUTE_DROP };
+  chained[33] = (struct midi_route_rule){ .status = 0x90, .data1_min = 0x00, .data1_max = 0x7F,
+                                          .actions = MIDI_ROUTE_CHANNEL, .channel_shift = 1 };
+  TEST_ASSERT_TRUE(midi_router_compile(&router, chained, 34));
+  TEST_ASSERT_EQUAL_UINT8(32 + 1 + 1, router.link_count);
+  TEST_ASSERT_EQUAL_UINT32(0, midi_router_route(&router, 1, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x1F, 0x7F), out, &clock));
+  TEST_ASSERT_EQUAL_UINT32(0, midi_router_route(&router, 2, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 1, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+  TEST_ASSERT_EQUAL_HEX8(0x91, out[0].byte1);
+  // a note outside the per-note rules only walks the two rules of its cell
+  midi_router_link_t first = router.links[router.dispatch[0x90 - 0x80][0x40]];
+  TEST_ASSERT_EQUAL_UINT8(32, first.rule);
+  TEST_ASSERT_EQUAL_UINT8(33, router.links[first.next].rule);
+  TEST_ASSERT_EQUAL_UINT8(MIDI_ROUTER_NO_RULE, router.links[first.next].next);
+
+  // overlapping restricted rules that need too many distinct links are rejected
+  for (int i = 0; i < 32; i++){
+    chained[i] = (struct midi_route_rule){ .source_mask = 1 << 1, .status = 0x90, .data1_min = 0x00, .data1_max = 0x7F };
+    chained[32 + i] = (struct midi_route_rule){ .status = 0x90, .data1_min = i, .data1_max = i };
+  }
+  TEST_ASSERT_FALSE(midi_router_compile(&router, chained, MIDI_ROUTER_MAX_RULES));
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 1, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x00, 0x7F), out, &clock));
+
+  // a rule on a SysEx status or with a channel in its status is rejected
+  struct midi_route_rule bad = { .status = 0xF0 };
+  TEST_ASSERT_FALSE(midi_router_compile(&router, &bad, 1));
+  bad.status = 0x91;
+  TEST_ASSERT_FALSE(midi_router_compile(&router, &bad, 1));
+  TEST_ASSERT_EQUAL_UINT32(1, midi_router_route(&router, 1, 0, MIDI_ROUTE_AB_A, tx_msg(3, 0x90, 0x40, 0x7F), out, &clock));
+
+}
+
+void knot_config__should_roundTripAndRejectNewerVersions(void){
+
+  static struct knot_config config, loaded;
+  static uint8_t blob[KNOT_CONFIG_MAX_SIZE];
+
+  knot_config_defaults(&config);
+  config.bpm_default = 97;
+  config.trs_ab = KNOT_TRS_AB_FORCE_B;
+  config.trs_out = KNOT_TRS_OUT_FULL_STATUS;
+  config.rules[0].channel_shift = -9;
+  config.rules[0].cable_mask = 0x8001;
+
+  size_t size = knot_config_encode(&config, blob, sizeof(blob));
+  TEST_ASSERT_EQUAL_UINT32(KNOT_CONFIG_HEADER_SIZE + config.rule_count * KNOT_CONFIG_RULE_SIZE, size);
+  TEST_ASSERT_EQUAL_UINT32(0, knot_config_encode(&config, blob, size - 1));
+
+  TEST_ASSERT_TRUE(knot_config_decode(&loaded, blob, size));
+  TEST_ASSERT_EQUAL_UINT16(97, loaded.bpm_default);
+  TEST_ASSERT_EQUAL_UINT16(70, loaded.bpm_min);
+  TEST_ASSERT_EQUAL_UINT8(KNOT_TRS_AB_FORCE_B, loaded.trs_ab);
+  TEST_ASSERT_EQUAL_UINT8(KNOT_TRS_OUT_FULL_STATUS, loaded.trs_out);
+  TEST_ASSERT_EQUAL_UINT8(config.rule_count, loaded.rule_count);
+  TEST_ASSERT_EQUAL_MEMORY(config.rules, loaded.rules, config.rule_count * sizeof(config.rules[0]));
+
+  // truncated blobs and blobs of a newer firmware fall back to the defaults
+  TEST_ASSERT_FALSE(knot_config_decode(&loaded, blob, size - 1));
+  TEST_ASSERT_EQUAL_UINT16(120, loaded.bpm_default);
+  blob[2] = KNOT_CONFIG_VERSION + 1;
+  TEST_ASSERT_FALSE(knot_config_decode(&loaded, blob, size));
+  blob[2] = KNOT_CONFIG_VERSION;
+
+  // tempos too slow for the clock's fixed point are rejected
+  blob[6] = MIDI_CLOCK_BPM_MIN - 1;
+  TEST_ASSERT_FALSE(knot_config_decode(&loaded, blob, size));
+  blob[6] = MIDI_CLOCK_BPM_MIN;
+  TEST_ASSERT_TRUE(knot_config_decode(&loaded, blob, size));
+  blob[4] = MIDI_CLOCK_BPM_MIN - 1;
+  blob[5] = 0;
+  TEST_ASSERT_FALSE(knot_config_decode(&loaded, blob, size));
+
+  // and so are tempos whose pulses would flood the wire
+  blob[4] = (MIDI_CLOCK_BPM_MAX + 1) & 0xFF;
+  blob[5] = (MIDI_CLOCK_BPM_MAX + 1) >> 8;
+  TEST_ASSERT_FALSE(knot_config_decode(&loaded, blob, size));
+  blob[4] = 97;
+  blob[5] = 0;
+  TEST_ASSERT_TRUE(knot_config_decode(&loaded, blob, size));
+  blob[8] = (MIDI_CLOCK_BPM_MAX + 1) & 0xFF;
+  blob[9] = (MIDI_CLOCK_BPM_MAX + 1) >> 8;
+  TEST_ASSERT_FALSE(knot_config_decode(&loaded, blob, size));
+  blob[8] = MIDI_CLOCK_BPM_MAX & 0xFF;
+  blob[9] = MIDI_CLOCK_BPM_MAX >> 8;
+  TEST_ASSERT_TRUE(knot_config_decode(&loaded, blob, size));
+
+  // version 2 headers have no TRS out profile, running status is on
+  config.rule_count = 1;
+  config.rules[0].ab_mask = MIDI_ROUTE_AB_B;
+  size = knot_config_encode(&config, blob, sizeof(blob));
+  memmove(&blob[KNOT_CONFIG_HEADER_SIZE_V2], &blob[KNOT_CONFIG_HEADER_SIZE], size - KNOT_CONFIG_HEADER_SIZE);
+  size--;
+  blob[2] = 2;
+  TEST_ASSERT_TRUE(knot_config_decode(&loaded, blob, size));
+  TEST_ASSERT_EQUAL_UINT8(KNOT_TRS_OUT_RUNNING_STATUS, loaded.trs_out);
+  TEST_ASSERT_EQUAL_UINT8(MIDI_ROUTE_AB_B, loaded.rules[0].ab_mask);
+
+  // version 1 rules are one byte shorter and match both switch positions
+  blob[2] = 1;
+  TEST_ASSERT_FALSE(knot_config_decode(&loaded, blob, size));
+  TEST_ASSERT_TRUE(knot_config_decode(&loaded, blob, size - 1));
+  TEST_ASSERT_EQUAL_INT8(-9, loaded.rules[0].channel_shift);
+  TEST_ASSERT_EQUAL_UINT8(0, loaded.rules[0].ab_mask);
+
+}
+
+void knot_config__should_swapSnapshotsOnlyWhenReadersLeft(void){
+
+  static knot_config_store_t store;
+  static struct knot_config config;
+
+  knot_config_defaults(&config);
+  TEST_ASSERT_TRUE(knot_config_store_init(&store, &config));
+
+  const knot_config_snapshot_t *old = knot_config_acquire(&store);
+  TEST_ASSERT_EQUAL_UINT16(120, old->config.bpm_default);
+
+  // first update goes into the spare snapshot, the pinned one is untouched
+  config.bpm_default = 90;
+  TEST_ASSERT_EQUAL(KNOT_CONFIG_OK, knot_config_publish(&store, &config));
+  TEST_ASSERT_EQUAL_UINT16(120, old->config.bpm_default);
+
+  const knot_config_snapshot_t *current = knot_config_acquire(&store);
+  TEST_ASSERT_EQUAL_UINT16(90, current->config.bpm_default);
+  knot_config_release(&store, current);
+
+  // the next one would reuse the snapshot still pinned
+  config.bpm_default = 80;
+  TEST_ASSERT_EQUAL(KNOT_CONFIG_BUSY, knot_config_publish(&store, &config));
+  knot_config_release(&store, old);
+  TEST_ASSERT_EQUAL(KNOT_CONFIG_OK, knot_config_publish(&store, &config));
+
+  // rules that do not compile leave the live snapshot alone
+  config.rules[0].status = 0xF0;
+  TEST_ASSERT_EQUAL(KNOT_CONFIG_INVALID, knot_config_publish(&store, &config));
+  current = knot_config_acquire(&store);
+  TEST_ASSERT_EQUAL_UINT16(80, current->config.bpm_default);
+  TEST_ASSERT_EQUAL_HEX8(0xB0, current->config.rules[0].status);
+  knot_config_release(&store, current);
+
+  // so does a tempo range the clock cannot run
+  config.rules[0].status = 0xB0;
+  config.bpm_max = MIDI_CLOCK_BPM_MAX + 1;
+  TEST_ASSERT_EQUAL(KNOT_CONFIG_INVALID, knot_config_publish(&store, &config));
+  config.bpm_max = MIDI_CLOCK_BPM_MAX;
+  config.bpm_default = MIDI_CLOCK_BPM_MAX + 1;
+  TEST_ASSERT_EQUAL(KNOT_CONFIG_INVALID, knot_config_publish(&store, &config));
+
+}
+
+static uint8_t sysex_reply[KNOT_CONFIG_MAX_SIZE * 2];
+static size_t sysex_reply_length;
+
+static void sysex_reply_collect(void *ctx, const uint8_t *bytes, size_t length){
+
+  memcpy(&sysex_reply[sysex_reply_length], bytes, length);
+  sysex_reply_length += length;
+}
+
+// Feed a byte stream the way a USB device packs it, 3 bytes at a time
+static enum knot_sysex_feed_result sysex_feed_bytes(knot_sysex_parser_t *parser, const uint8_t *bytes, size_t length){
+
+  enum knot_sysex_feed_result result = KNOT_SYSEX_PASS;
+  for (size_t i = 0; i < length; i += 3){
+    size_t n = length - i < 3 ? length - i : 3;
+    result = knot_sysex_feed(parser, tx_msg(n, bytes[i], n > 1 ? bytes[i + 1] : 0, n > 2 ? bytes[i + 2] : 0));
+  }
+  return result;
+}
+
+void knot_sysex__should_streamConfigWriteIntoStaging(void){
+
+  static struct knot_config config, staging;
+  static uint8_t blob[KNOT_CONFIG_MAX_SIZE];
+  knot_sysex_parser_t parser;
+  knot_sysex_writer_t writer;
+
+  knot_config_defaults(&config);
+  config.bpm_default = 133;
+  config.rules[0].channel_shift = -9;   // a byte with the top bit set
+  size_t size = knot_config_encode(&config, blob, sizeof(blob));
+
+  // a reply carrying the blob is exactly what a host tool sends as a write request
+  sysex_reply_length = 0;
+  knot_sysex_reply_begin(&writer, sysex_reply_collect, NULL, KNOT_SYSEX_CONFIG_WRITE & ~KNOT_SYSEX_REPLY, KNOT_SYSEX_OK);
+  knot_sysex_reply_write(&writer, blob, size);
+  knot_sysex_reply_end(&writer);
+  TEST_ASSERT_EQUAL_HEX8(0x42, sysex_reply[3]);
+  TEST_ASSERT_EQUAL_UINT32(5 + size + (size + 6) / 7 + 1, sysex_reply_length);
+
+  // request: header, command, then the packed payload after the status byte
+  sysex_reply[3] = KNOT_SYSEX_CONFIG_WRITE;
+  memmove(&sysex_reply[4], &sysex_reply[5], sysex_reply_length - 5);
+  sysex_reply_length--;
+  for (size_t i = 0; i < sysex_reply_length; i++){
+    TEST_ASSERT_TRUE(i == 0 || i == sysex_reply_length - 1 || sysex_reply[i] < 0x80);
+  }
+
+  knot_sysex_parser_init(&parser, &staging);
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_REQUEST, sysex_feed_bytes(&parser, sysex_reply, sysex_reply_length));
+  TEST_ASSERT_EQUAL_HEX8(KNOT_SYSEX_CONFIG_WRITE, parser.command);
+  TEST_ASSERT_TRUE(parser.valid);
+  TEST_ASSERT_EQUAL_UINT16(133, staging.bpm_default);
+  TEST_ASSERT_EQUAL_INT8(-9, staging.rules[0].channel_shift);
+
+  // a truncated upload is reported invalid
+  sysex_reply[sysex_reply_length - 2] = 0xF7;
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_REQUEST, sysex_feed_bytes(&parser, sysex_reply, sysex_reply_length - 1));
+  TEST_ASSERT_FALSE(parser.valid);
+
+}
+
+void knot_sysex__should_passForeignMessages(void){
+
+  static struct knot_config staging;
+  knot_sysex_parser_t parser;
+  knot_sysex_parser_init(&parser, &staging);
+
+  // other manufacturers and plain messages go through
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_PASS, knot_sysex_feed(&parser, tx_msg(3, 0xF0, 0x43, 0x10)));
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_PASS, knot_sysex_feed(&parser, tx_msg(3, 0x90, 0x40, 0x7F)));
+
+  // a request interleaved with a clock tick, the tick is forwarded
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_CONSUMED, knot_sysex_feed(&parser, tx_msg(3, 0xF0, 0x7D, 0x4B)));
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_PASS, knot_sysex_feed(&parser, tx_msg(1, 0xF8, 0, 0)));
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_REQUEST, knot_sysex_feed(&parser, tx_msg(2, KNOT_SYSEX_COUNTERS_READ, 0xF7, 0)));
+  TEST_ASSERT_TRUE(parser.valid);
+
+  // a status byte cuts the request short and is a message of its own
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_CONSUMED, knot_sysex_feed(&parser, tx_msg(3, 0xF0, 0x7D, 0x4B)));
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_PASS, knot_sysex_feed(&parser, tx_msg(3, 0x90, 0x40, 0x7F)));
+  TEST_ASSERT_EQUAL(KNOT_SYSEX_PASS, knot_sysex_feed(&parser, tx_msg(1, 0xF7, 0, 0)));
+
+}
+
+// knot_hal.h for the pipeline tests: a clock that only moves when told, counters instead of wake ups
+static knot_config_store_t fake_hal_store;
+static uint32_t fake_hal_now;
+static uint32_t fake_hal_trs_wakes;
+static uint32_t fake_hal_usb_wakes;
+static uint32_t fake_hal_usb_in_wakes;
+static uint32_t fake_hal_requests;
+static knot_sysex_port_t *fake_hal_request_port;
+static uint32_t fake_hal_clock_period;
+
+uint32_t knot_hal_time_us(void){ return fake_hal_now; }
+void knot_hal_yield(void){ TEST_FAIL_MESSAGE("a queue filled up, nothing drains it here"); }
+void knot_hal_trs_tx_wake(void){ fake_hal_trs_wakes++; }
+void knot_hal_usb_in_wake(void){ fake_hal_usb_in_wakes++; }
+void knot_hal_usb_out_wake(void){ fake_hal_usb_wakes++; }
+void knot_hal_led(enum knot_hal_led led){ }
+const knot_config_snapshot_t *knot_hal_config_acquire(void){ return knot_config_acquire(&fake_hal_store); }
+void knot_hal_config_release(const knot_config_snapshot_t *snapshot){ knot_config_release(&fake_hal_store, snapshot); }
+uint8_t knot_hal_ab_switch(void){ return MIDI_ROUTE_AB_A; }
+void knot_hal_clock_set_period(uint32_t period){ fake_hal_clock_period = period; }
+uint32_t knot_hal_clock_get_period(void){ return fake_hal_clock_period; }
+
+void knot_hal_sysex_request(knot_sysex_port_t *port){
+
+  fake_hal_requests++;
+  fake_hal_request_port = port;
+}
+
+// what the request task of the platform does, later and on its own
+static void fake_hal_answer(void){
+
+  // an empty reply is enough to see which way it goes out
+  knot_sysex_writer_t writer;
+  knot_sysex_port_t *port = fake_hal_request_port;
+  fake_hal_request_port = NULL;
+  knot_sysex_reply_begin(&writer, port->send, port->ctx, port->parser.command, KNOT_SYSEX_OK);
+  knot_sysex_reply_end(&writer);
+  knot_sysex_port_done(port);
+}
+
+static void fake_hal_reset(void){
+
+  static struct knot_config defaults;
+  knot_config_defaults(&defaults);
+  knot_config_store_init(&fake_hal_store, &defaults);
+  fake_hal_now = 0;
+  fake_hal_trs_wakes = 0;
+  fake_hal_usb_wakes = 0;
+  fake_hal_usb_in_wakes = 0;
+  fake_hal_requests = 0;
+  fake_hal_request_port = NULL;
+  fake_hal_clock_period = midi_clock_period_from_ppm(120 * MIDI_CLOCK_PPQN);
+}
+
+void midi_pipeline__should_answerRequestsAndForwardTheRest(void){
+
+  static midi_pipeline_t pipeline;
+  fake_hal_reset();
+  midi_pipeline_init(&pipeline);
+
+  // a note and a state request in one transfer, the note goes to TRS, the reply back to USB
+  const uint8_t transfer[] = { 0x09, 0x90, 0x40, 0x7F, 0x04, 0xF0, 0x7D, 0x4B, 0x06, KNOT_SYSEX_STATE_READ, 0xF7, 0x00 };
+  midi_pipeline_usb_in(&pipeline, 0, transfer, sizeof(transfer), 0x0001, 100);
+  TEST_ASSERT_EQUAL_UINT32(3, pipeline.stats.usb_in_packets);
+  TEST_ASSERT_EQUAL_UINT32(1, fake_hal_requests);
+  TEST_ASSERT_TRUE(fake_hal_trs_wakes > 0);
+
+  // until the request is answered the port skips further ones, nothing of them is forwarded
+  midi_pipeline_usb_in(&pipeline, 0, &transfer[4], 8, 0x0001, 100);
+  TEST_ASSERT_EQUAL_UINT32(1, fake_hal_requests);
+  fake_hal_answer();
+
+  uint8_t out[6];
+  TEST_ASSERT_EQUAL(3, midi_pipeline_trs_out_pull(&pipeline, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8(0x90, out[0]);
+  TEST_ASSERT_EQUAL_HEX8(0x7F, out[2]);
+
+  // the note is on the wire 960 us after its transfer completed
+  fake_hal_now = 1060;
+  midi_pipeline_trs_out_done(&pipeline, fake_hal_now);
+  struct latency_hist_summary summary;
+  latency_hist_summarize(&pipeline.latency[MIDI_PIPELINE_PATH_USB_TO_TRS], &summary);
+  TEST_ASSERT_EQUAL_UINT32(1, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(960, summary.max_us);
+  TEST_ASSERT_EQUAL(0, midi_pipeline_trs_out_pull(&pipeline, out, sizeof(out)));
+
+  uint32_t words[16];
+  uint32_t received;
+  uint8_t device;
+  TEST_ASSERT_EQUAL(2, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+  TEST_ASSERT_EQUAL_UINT8(0, device);
+  TEST_ASSERT_EQUAL_HEX32(0x4B7DF004, words[0]);
+  TEST_ASSERT_EQUAL_HEX32(0xF7004507, words[1]);
+
+  // the same request on TRS in is answered on TRS out
+  const uint8_t request[] = { 0xF0, 0x7D, 0x4B, KNOT_SYSEX_STATE_READ, 0xF7 };
+  midi_pipeline_trs_in(&pipeline, request, sizeof(request), fake_hal_now);
+  TEST_ASSERT_EQUAL_UINT32(2, fake_hal_requests);
+  fake_hal_answer();
+  TEST_ASSERT_EQUAL(0, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+  TEST_ASSERT_EQUAL(6, midi_pipeline_trs_out_pull(&pipeline, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8(0xF0, out[0]);
+  TEST_ASSERT_EQUAL_HEX8(KNOT_SYSEX_STATE_READ | KNOT_SYSEX_REPLY, out[3]);
+  TEST_ASSERT_EQUAL_HEX8(0xF7, out[5]);
+
+}
+
+void midi_pipeline__should_forwardFramedTrsInput(void){
+
+  static midi_pipeline_t pipeline;
+  fake_hal_reset();
+  midi_pipeline_init(&pipeline);
+
+  // framed one byte at a time as the UART interrupt does, a clock byte in the middle of a note
+  midi_parser_t parser;
+  midi_parser_init(&parser);
+  const uint8_t bytes[] = { 0x90, 0x40, 0xF8, 0x7F, 0xF0, 0x7D, 0x4B, KNOT_SYSEX_STATE_READ, 0xF7 };
+  for (size_t i = 0; i < sizeof(bytes); i++){
+    struct usb_midi_event_packet packet;
+    if (midi_parse_span(&parser, &bytes[i], 1, &packet, 1) > 0){
+      midi_pipeline_trs_in_packets(&pipeline, &packet, 1, 100 + i);
+    }
+  }
+
+  uint32_t words[16];
+  uint32_t received;
+  uint8_t device;
+  TEST_ASSERT_EQUAL(2, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+  TEST_ASSERT_EQUAL_UINT8(MIDI_PIPELINE_USB_OUT_ALL, device);
+  TEST_ASSERT_EQUAL_HEX32(0x0000F80F, words[0]);
+  TEST_ASSERT_EQUAL_HEX32(0x7F409009, words[1]);
+  TEST_ASSERT_EQUAL_UINT32(102, received);
+
+  // the request is answered on TRS out
+  uint8_t out[6];
+  TEST_ASSERT_EQUAL(1, fake_hal_requests);
+  fake_hal_answer();
+  TEST_ASSERT_EQUAL(6, midi_pipeline_trs_out_pull(&pipeline, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8(0xF0, out[0]);
+  TEST_ASSERT_EQUAL_HEX8(KNOT_SYSEX_STATE_READ | KNOT_SYSEX_REPLY, out[3]);
+
+}
+
+void midi_pipeline__should_keepRepliesOutOfTrsSysEx(void){
+
+  static midi_pipeline_t pipeline;
+  fake_hal_reset();
+  midi_pipeline_init(&pipeline);
+
+  const uint8_t sysex_start[] = { 0xF0, 0x01, 0x02, 0x03 };
+  midi_pipeline_trs_in(&pipeline, sysex_start, sizeof(sysex_start), 10);
+  TEST_ASSERT_EQUAL_UINT32(1, pipeline.stats.usb_out_queued);
+  TEST_ASSERT_TRUE(fake_hal_usb_wakes > 0);
+
+  uint32_t words[16];
+  uint32_t received;
+  uint8_t device;
+  TEST_ASSERT_EQUAL(1, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+  TEST_ASSERT_EQUAL_UINT8(MIDI_PIPELINE_USB_OUT_ALL, device);
+  TEST_ASSERT_EQUAL_HEX32(0x0201F004, words[0]);
+  TEST_ASSERT_EQUAL_UINT32(10, received);
+
+  // a reply queued while the TRS stream is inside its SysEx waits for the end of it
+  const uint8_t transfer[] = { 0x04, 0xF0, 0x7D, 0x4B, 0x06, KNOT_SYSEX_STATE_READ, 0xF7, 0x00 };
+  midi_pipeline_usb_in(&pipeline, 1, transfer, sizeof(transfer), 0x0001, 20);
+  fake_hal_answer();
+  TEST_ASSERT_EQUAL(0, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+
+  // the end of the TRS SysEx goes to every device, the reply after it to the device that asked only
+  const uint8_t sysex_end[] = { 0x04, 0xF7 };
+  midi_pipeline_trs_in(&pipeline, sysex_end, sizeof(sysex_end), 30);
+  TEST_ASSERT_EQUAL(1, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+  TEST_ASSERT_EQUAL_UINT8(MIDI_PIPELINE_USB_OUT_ALL, device);
+  TEST_ASSERT_EQUAL_UINT32(30, received);
+  TEST_ASSERT_EQUAL_HEX32(0xF7040307, words[0]);
+  TEST_ASSERT_EQUAL(2, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+  TEST_ASSERT_EQUAL_UINT8(1, device);
+  TEST_ASSERT_EQUAL_HEX32(0x4B7DF004, words[0]);
+  TEST_ASSERT_EQUAL_HEX32(0xF7004507, words[1]);
+  TEST_ASSERT_EQUAL(0, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+
+  // a reply answered after its device left never reaches the next device in the same slot
+  midi_pipeline_usb_in(&pipeline, 1, transfer, sizeof(transfer), 0x0001, 40);
+  midi_pipeline_usb_in_remove(&pipeline, 1);
+  fake_hal_answer();
+  TEST_ASSERT_EQUAL(0, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+  TEST_ASSERT_EQUAL_UINT32(2, pipeline.stats.usb_reply_dropped_gone);
+
+  // its next request is answered again
+  midi_pipeline_usb_in(&pipeline, 1, transfer, sizeof(transfer), 0x0001, 60);
+  fake_hal_answer();
+  TEST_ASSERT_EQUAL(2, midi_pipeline_usb_out_pop(&pipeline, words, 16, &received, &device));
+  TEST_ASSERT_EQUAL_UINT8(1, device);
+
+}
+
+void midi_pipeline__should_driveTempoFromControlChanges(void){
+
+  static midi_pipeline_t pipeline;
+  fake_hal_reset();
+  midi_pipeline_init(&pipeline);
+
+  // coarse tempo halfway between 70 and 180 BPM
+  const uint8_t coarse[] = { 0x0B, 0xB0, 0x1B, 0x40 };
+  midi_pipeline_usb_in(&pipeline, 0, coarse, sizeof(coarse), 0x0001, fake_hal_now);
+  uint32_t period = midi_clock_period_from_ppm(125 * MIDI_CLOCK_PPQN);
+  TEST_ASSERT_EQUAL_UINT32(period, fake_hal_clock_period);
+
+  // a bend on channel 16 speeds up while held and comes back to the same period
+  const uint8_t press[] = { 0x0B, 0xBF, 0x68, 0x7F };
+  midi_pipeline_usb_in(&pipeline, 0, press, sizeof(press), 0x0001, fake_hal_now);
+  TEST_ASSERT_EQUAL_UINT32(period - period / 16, fake_hal_clock_period);
+  const uint8_t release[] = { 0x0B, 0xBF, 0x68, 0x00 };
+  midi_pipeline_usb_in(&pipeline, 0, release, sizeof(release), 0x0001, fake_hal_now);
+  TEST_ASSERT_EQUAL_UINT32(period, fake_hal_clock_period);
+
+  // pulses go ahead of whatever the control changes left on TRS out
+  TEST_ASSERT_TRUE(midi_pipeline_clock_pulse(&pipeline, fake_hal_now));
+  uint8_t out[6];
+  TEST_ASSERT_TRUE(midi_pipeline_trs_out_pull(&pipeline, out, sizeof(out)) > 0);
+  TEST_ASSERT_EQUAL_HEX8(0xF8, out[0]);
+
+}
+
+void midi_pipeline__should_timeEachMessageByItsLastByte(void){
+
+  static midi_pipeline_t pipeline;
+  fake_hal_reset();
+  midi_pipeline_init(&pipeline);
+
+  // a note from USB and a clock pulse go out in one pull, the pulse first
+  const uint8_t transfer[] = { 0x09, 0x90, 0x40, 0x7F };
+  midi_pipeline_usb_in(&pipeline, 0, transfer, sizeof(transfer), 0x0001, 100);
+  TEST_ASSERT_TRUE(midi_pipeline_clock_pulse(&pipeline, 200));
+
+  uint8_t out[6];
+  fake_hal_now = 300;
+  TEST_ASSERT_EQUAL(4, midi_pipeline_trs_out_pull(&pipeline, out, sizeof(out)));
+  TEST_ASSERT_EQUAL_HEX8(0xF8, out[0]);
+
+  // the note ends the pull, the pulse left the wire three bytes before it
+  midi_pipeline_trs_out_done(&pipeline, 300 + 4 * MIDI_PIPELINE_TRS_BYTE_US);
+  struct latency_hist_summary summary;
+  latency_hist_summarize(&pipeline.latency[MIDI_PIPELINE_PATH_CLOCK], &summary);
+  TEST_ASSERT_EQUAL_UINT32(1, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(300 + MIDI_PIPELINE_TRS_BYTE_US - 200, summary.max_us);
+  latency_hist_summarize(&pipeline.latency[MIDI_PIPELINE_PATH_USB_TO_TRS], &summary);
+  TEST_ASSERT_EQUAL_UINT32(1, summary.count);
+  TEST_ASSERT_EQUAL_UINT32(300 + 4 * MIDI_PIPELINE_TRS_BYTE_US - 100, summary.max_us);
+
+}
+
+void midi_pipeline__should_throttleUsbInUntilTrsOutDrains(void){
+
+  static midi_pipeline_t pipeline;
+  fake_hal_reset();
+  midi_pipeline_init(&pipeline);
+
+  // full transfers of 16 notes each until the lanes reach the high watermark
+  uint8_t transfer[64];
+  uint8_t note = 0;
+  int transfers = 0;
+  while (!midi_pipeline_usb_in_throttle(&pipeline)){
+    TEST_ASSERT_TRUE(transfers < MIDI_PIPELINE_TRS_HIGH_WATER / 16);
+    for (int i = 0; i < 16; i++){
+      const uint8_t packet[] = { 0x09, 0x90, note++, 0x40 };
+      memcpy(&transfer[i * 4], packet, 4);
+    }
+    midi_pipeline_usb_in(&pipeline, 0, transfer, sizeof(transfer), 0x0001, fake_hal_now);
+    transfers++;
+  }
+  TEST_ASSERT_EQUAL(MIDI_PIPELINE_TRS_HIGH_WATER / 16, transfers);
+  TEST_ASSERT_EQUAL_UINT32(1, pipeline.stats.usb_in_throttled);
+
+  // the IN worker is woken once, when the wire has drained the lanes to the low watermark
+  fake_hal_now = 1000;
+  uint8_t out[3];
+  uint32_t pulled = 0;
+  while (midi_pipeline_trs_out_pull(&pipeline, out, sizeof(out)) > 0){
+    pulled++;
+    TEST_ASSERT_EQUAL_UINT32(pulled >= MIDI_PIPELINE_TRS_HIGH_WATER - MIDI_PIPELINE_TRS_LOW_WATER, fake_hal_usb_in_wakes);
+    if (fake_hal_usb_in_wakes > 0){
+      break;
+    }
+    TEST_ASSERT_TRUE(midi_pipeline_usb_in_throttle(&pipeline));
+  }
+
+  fake_hal_now = 4000;
+  TEST_ASSERT_FALSE(midi_pipeline_usb_in_throttle(&pipeline));
+  TEST_ASSERT_EQUAL_UINT32(1, pipeline.stats.usb_in_throttled);
+  TEST_ASSERT_EQUAL_UINT32(4000, pipeline.stats.usb_in_throttled_max_us);
+  TEST_ASSERT_EQUAL_UINT64(4000, pipeline.stats.usb_in_throttled_total_us);
+
+}
+
 void test_function_should_doAlsoDoBlah(void) {
     //more test stuff
 }
@@ -389,5 +1931,49 @@ int main(void) {
     RUN_TEST(uart_midi_find_packet_from_buffer__should_recogniseChannelVoiceMessages);
     RUN_TEST(midi_uart_to_usb__should_convertAllMessages);
 
+    RUN_TEST(midi_parser__should_supportRunningStatus);
+    RUN_TEST(midi_parser__should_recogniseSystemCommonLengths);
+    RUN_TEST(midi_parser__should_keepInstancesIndependent);
+
+    RUN_TEST(midi_parse_span__should_matchPerBytePath);
+
+    RUN_TEST(usb_midi_decode_transfer__should_decodeEveryPacketInTransfer);
+    RUN_TEST(uart_midi_pack_packets__should_packVariableLengthMessages);
+    RUN_TEST(usb_midi_decode_transfer_cables__should_skipUnroutedCables);
+    RUN_TEST(usb_midi_parse_config__should_findEveryStreamingInterfaceAndCable);
+    RUN_TEST(midi_router__should_applyDefaultRules);
+    RUN_TEST(midi_router__should_fallThroughRulesOfOtherSources);
+    RUN_TEST(knot_config__should_roundTripAndRejectNewerVersions);
+    RUN_TEST(knot_config__should_swapSnapshotsOnlyWhenReadersLeft);
+    RUN_TEST(knot_sysex__should_streamConfigWriteIntoStaging);
+    RUN_TEST(knot_sysex__should_passForeignMessages);
+    RUN_TEST(midi_pipeline__should_answerRequestsAndForwardTheRest);
+    RUN_TEST(midi_pipeline__should_forwardFramedTrsInput);
+    RUN_TEST(midi_pipeline__should_keepRepliesOutOfTrsSysEx);
+    RUN_TEST(midi_pipeline__should_driveTempoFromControlChanges);
+    RUN_TEST(midi_pipeline__should_timeEachMessageByItsLastByte);
+    RUN_TEST(midi_pipeline__should_throttleUsbInUntilTrsOutDrains);
+
+    RUN_TEST(trace_ring__should_keepOrderAndDropWhenFull);
+    RUN_TEST(spsc_queue__should_keepOrderAndRejectWhenFull);
+    RUN_TEST(latency_hist__should_reportPercentilesWithinABucket);
+
+    RUN_TEST(midi_clock__should_notDriftOverLongRuns);
+    RUN_TEST(midi_clock__should_changeTempoWithoutPhaseReset);
+    RUN_TEST(midi_clock__should_applyFineTempo);
+
+    RUN_TEST(midi_tx_scheduler__should_putRealtimeAtMessageBoundaries);
+    RUN_TEST(midi_tx_scheduler__should_interleaveRealtimeInsideSysEx);
+    RUN_TEST(midi_tx_scheduler__should_keepClockLaneSeparate);
+    RUN_TEST(midi_tx_scheduler__should_keepRepliesOutOfSysEx);
+    RUN_TEST(midi_tx_scheduler__should_dropWhenLaneFull);
+    RUN_TEST(midi_tx_scheduler__should_leaveOutRepeatedStatusBytes);
+    RUN_TEST(midi_tx_scheduler__should_overwriteQueuedControllerValues);
+    RUN_TEST(midi_tx_scheduler__should_boundKnobLatencyOnTheWire);
+
+    RUN_TEST(midi_merge__should_holdOtherSourcesDuringSysEx);
+    RUN_TEST(midi_merge__should_releaseWhenSourceRemoved);
+    RUN_TEST(midi_merge__should_holdBackSourcesAndTimeOutSilentOwner);
+
     return UNITY_END();
 }
\ No newline at end of file
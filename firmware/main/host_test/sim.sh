@@ -0,0 +1,5 @@
+cmake -S . -B ./build
+cd ./build
+make
+# the sample trace at 10x real time, add -p to get a pty for TRS
+./Simulator -s 10 ../sim_trace.txt
@@ -0,0 +1,723 @@
+#define _GNU_SOURCE
+#include "../midi_pipeline.h"
+#include "../midi_clock.h"
+#include "../usb_midi_desc.h"
+#include "../knot_config.h"
+#include "../knot_sysex.h"
+#include "../knot_hal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+  The firmware data path on Linux: midi_pipeline.c behind the knot_hal.h
+  of this file, with a thread for every firmware task that touches it.
+
+    replay   plays the USB side of a trace, it is the IN worker
+    rx       TRS in: bytes of the trace and of the pty, if there is one
+    tx       TRS out at 31250 baud, to the pty or just counted
+    usb_out  USB client task, one OUT transfer per 1 ms frame
+    clock    the MIDI clock engine while a device is attached
+    request  answers configuration requests, as the firmware's sysex task
+
+  Time is virtual: the wall clock since start times the speed factor, so
+  a trace plays faster than real time and every wait of the pipeline and
+  the wire shrinks with it.
+
+    ./build/Simulator [-s speed] [-p] [-q] trace.txt
+
+  -p opens a pty for TRS, its name is printed on stderr. -q leaves out the
+  per message output. Trace lines, times in virtual microseconds:
+
+    <t> config <dev> <hex>      a device is attached, configuration descriptor
+    <t> in <dev> <ep> <hex>     an IN transfer completed on endpoint ep
+    <t> trs <hex>               bytes arrive on TRS in
+    <t> gone <dev>              the device went away
+*/
+
+#define SIM_BYTE_US       MIDI_PIPELINE_TRS_BYTE_US
+#define SIM_FRAME_US      1000  // one full speed USB frame
+#define SIM_TX_CHUNK      3     // as the firmware TX interrupt
+#define SIM_DRAIN_US      2000000
+#define SIM_HELD_SIZE     (MIDI_PIPELINE_MAX_SOURCES * USB_MIDI_MAX_ENDPOINTS * 2)  // transfers in flight, as the class driver
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  bool given;
+} sim_notify_t;
+
+typedef struct
+{
+  bool attached;
+  bool has_out;
+  uint8_t in_address[USB_MIDI_MAX_ENDPOINTS];
+  uint16_t in_cables[USB_MIDI_MAX_ENDPOINTS];
+  uint8_t num_in;
+} sim_device_t;
+
+typedef struct
+{
+  uint8_t dev;
+  uint8_t address;
+  uint8_t length;
+  uint8_t data[MIDI_PIPELINE_IN_MAX_PACKETS * 4];
+} sim_held_t;
+
+midi_pipeline_t midi_pipeline;
+
+static double sim_speed = 1.0;
+static bool sim_quiet = false;
+static struct timespec sim_start;
+static atomic_bool sim_running = true;
+
+static knot_config_store_t sim_store;
+static midi_clock_t sim_clock;
+static atomic_int sim_attached = 0;
+static sim_device_t sim_devices[MIDI_PIPELINE_MAX_SOURCES];
+
+// transfers of devices waiting for another one's SysEx, replay thread only
+static sim_held_t sim_held[SIM_HELD_SIZE];
+static size_t sim_held_count = 0;
+
+static sim_notify_t tx_notify = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+static sim_notify_t usb_out_notify = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+static sim_notify_t usb_in_notify = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+static sim_notify_t clock_notify = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+static sim_notify_t request_notify = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+
+// ports with a request waiting for the request thread, one each at most
+static pthread_mutex_t request_mutex = PTHREAD_MUTEX_INITIALIZER;
+static knot_sysex_port_t *sim_requests[MIDI_PIPELINE_MAX_SOURCES + 1];
+static size_t sim_request_count = 0;
+static atomic_uint sim_requests_open;
+
+static int trs_pipe[2];
+static int pty_fd = -1;
+static pthread_mutex_t print_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static atomic_uint_fast64_t trs_in_written;
+static atomic_uint_fast64_t trs_in_read;
+static atomic_uint_fast64_t trs_out_bytes;
+static atomic_uint_fast64_t usb_out_packets;
+static atomic_uint_fast64_t usb_out_dropped_no_device;
+static atomic_uint_fast64_t usb_out_transfers;
+static atomic_uint leds[3];
+static atomic_uint clock_pulses;
+static atomic_uint sysex_requests;
+
+static uint64_t sim_now_us(void){
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  double elapsed = (ts.tv_sec - sim_start.tv_sec) * 1e6 + (ts.tv_nsec - sim_start.tv_nsec) / 1e3;
+  return (uint64_t)(elapsed * sim_speed);
+}
+
+static void sim_sleep_until(uint64_t virtual_us){
+
+  uint64_t now = sim_now_us();
+  if (virtual_us <= now){
+    return;
+  }
+  uint64_t real_ns = (uint64_t)((virtual_us - now) * 1000 / sim_speed);
+  struct timespec ts = { .tv_sec = real_ns / 1000000000, .tv_nsec = real_ns % 1000000000 };
+  nanosleep(&ts, NULL);
+}
+
+static void sim_notify_give(sim_notify_t *notify){
+
+  pthread_mutex_lock(&notify->mutex);
+  notify->given = true;
+  pthread_cond_signal(&notify->cond);
+  pthread_mutex_unlock(&notify->mutex);
+}
+
+// ulTaskNotifyTake with a timeout in real milliseconds
+static void sim_notify_take(sim_notify_t *notify, int timeout_ms){
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_nsec += (long)timeout_ms * 1000000;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+
+  pthread_mutex_lock(&notify->mutex);
+  while (!notify->given && atomic_load(&sim_running)){
+    if (pthread_cond_timedwait(&notify->cond, &notify->mutex, &deadline) == ETIMEDOUT){
+      break;
+    }
+  }
+  notify->given = false;
+  pthread_mutex_unlock(&notify->mutex);
+}
+
+static void sim_print(const char *what, const uint8_t *bytes, size_t length){
+
+  if (sim_quiet){
+    return;
+  }
+  pthread_mutex_lock(&print_mutex);
+  printf("%10llu %s", (unsigned long long)sim_now_us(), what);
+  for (size_t i = 0; i < length; i++){
+    printf(" %02X", bytes[i]);
+  }
+  printf("\n");
+  pthread_mutex_unlock(&print_mutex);
+}
+
+// knot_hal.h
+
+uint32_t knot_hal_time_us(void){ return (uint32_t)sim_now_us(); }
+
+void knot_hal_yield(void){
+
+  struct timespec ts = { .tv_nsec = 100000 };
+  nanosleep(&ts, NULL);
+}
+
+void knot_hal_trs_tx_wake(void){ sim_notify_give(&tx_notify); }
+void knot_hal_usb_in_wake(void){ sim_notify_give(&usb_in_notify); }
+void knot_hal_usb_out_wake(void){ sim_notify_give(&usb_out_notify); }
+void knot_hal_led(enum knot_hal_led led){ atomic_fetch_add(&leds[led], 1); }
+const knot_config_snapshot_t *knot_hal_config_acquire(void){ return knot_config_acquire(&sim_store); }
+void knot_hal_config_release(const knot_config_snapshot_t *snapshot){ knot_config_release(&sim_store, snapshot); }
+uint8_t knot_hal_ab_switch(void){ return MIDI_ROUTE_AB_A; }
+void knot_hal_clock_set_period(uint32_t period){ midi_clock_set_period(&sim_clock, period); }
+uint32_t knot_hal_clock_get_period(void){ return midi_clock_get_period(&sim_clock); }
+
+void knot_hal_sysex_request(knot_sysex_port_t *port){
+
+  atomic_fetch_add(&sim_requests_open, 1);
+  pthread_mutex_lock(&request_mutex);
+  sim_requests[sim_request_count++] = port;
+  pthread_mutex_unlock(&request_mutex);
+  sim_notify_give(&request_notify);
+}
+
+static void sim_answer(knot_sysex_port_t *port){
+
+  knot_sysex_parser_t *parser = &port->parser;
+  knot_sysex_writer_t writer;
+  uint8_t status = parser->valid ? KNOT_SYSEX_OK : KNOT_SYSEX_INVALID;
+
+  atomic_fetch_add(&sysex_requests, 1);
+
+  switch (parser->command){
+
+    case KNOT_SYSEX_CONFIG_WRITE:
+    case KNOT_SYSEX_CONFIG_RESET:
+      if (parser->command == KNOT_SYSEX_CONFIG_RESET){
+        knot_config_defaults(&port->staging);
+      }
+      if (status == KNOT_SYSEX_OK){
+        enum knot_config_result result;
+        while ((result = knot_config_publish(&sim_store, &port->staging)) == KNOT_CONFIG_BUSY){
+          knot_hal_yield();
+        }
+        status = result == KNOT_CONFIG_OK ? KNOT_SYSEX_OK : KNOT_SYSEX_INVALID;
+      }
+      knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+      break;
+
+    case KNOT_SYSEX_CONFIG_READ: {
+      uint8_t blob[KNOT_CONFIG_MAX_SIZE];
+      const knot_config_snapshot_t *snapshot = knot_config_acquire(&sim_store);
+      size_t size = status == KNOT_SYSEX_OK ? knot_config_encode(&snapshot->config, blob, sizeof(blob)) : 0;
+      knot_config_release(&sim_store, snapshot);
+      knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+      knot_sysex_reply_write(&writer, blob, size);
+      break;
+    }
+
+    case KNOT_SYSEX_STATE_READ:
+      knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+      if (status == KNOT_SYSEX_OK){
+        knot_sysex_reply_write_u32(&writer, midi_clock_get_period(&sim_clock) >> MIDI_CLOCK_FRAC_BITS);
+        knot_sysex_reply_write_u32(&writer, atomic_load(&clock_pulses));
+        const knot_config_snapshot_t *snapshot = knot_config_acquire(&sim_store);
+        uint8_t state[] = { KNOT_CONFIG_VERSION, snapshot->config.rule_count, snapshot->config.trs_ab, MIDI_ROUTE_AB_A };
+        knot_config_release(&sim_store, snapshot);
+        knot_sysex_reply_write(&writer, state, sizeof(state));
+      }
+      break;
+
+    case KNOT_SYSEX_LATENCY_READ:
+      knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+      if (status == KNOT_SYSEX_OK){
+        for (int path = 0; path < MIDI_PIPELINE_PATH_COUNT; path++){
+          struct latency_hist_summary summary;
+          latency_hist_summarize(&midi_pipeline.latency[path], &summary);
+          knot_sysex_reply_write_u32(&writer, summary.count);
+          knot_sysex_reply_write_u32(&writer, summary.p50_us);
+          knot_sysex_reply_write_u32(&writer, summary.p99_us);
+          knot_sysex_reply_write_u32(&writer, summary.max_us);
+        }
+      }
+      break;
+
+    default:
+      // counters are the firmware's own, the report at the end has the simulator's
+      status = KNOT_SYSEX_UNKNOWN_COMMAND;
+      knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+      break;
+  }
+
+  knot_sysex_reply_end(&writer);
+}
+
+// tasks
+
+static void *sim_request_task(void *arg){
+
+  while (atomic_load(&sim_running)){
+    sim_notify_take(&request_notify, 10);
+
+    pthread_mutex_lock(&request_mutex);
+    knot_sysex_port_t *ports[MIDI_PIPELINE_MAX_SOURCES + 1];
+    size_t count = sim_request_count;
+    memcpy(ports, sim_requests, count * sizeof(ports[0]));
+    sim_request_count = 0;
+    pthread_mutex_unlock(&request_mutex);
+
+    for (size_t i = 0; i < count; i++){
+      sim_answer(ports[i]);
+      knot_sysex_port_done(ports[i]);
+      atomic_fetch_sub(&sim_requests_open, 1);
+    }
+  }
+  return NULL;
+}
+
+static void *sim_tx_task(void *arg){
+
+  uint8_t chunk[SIM_TX_CHUNK];
+
+  while (atomic_load(&sim_running)){
+    sim_notify_take(&tx_notify, 10);
+
+    size_t length;
+    while ((length = midi_pipeline_trs_out_pull(&midi_pipeline, chunk, sizeof(chunk))) > 0){
+      // the chunk is on the wire for as long as it takes at 31250 baud
+      uint64_t done = sim_now_us() + length * SIM_BYTE_US;
+      if (pty_fd >= 0 && write(pty_fd, chunk, length) < 0 && errno != EAGAIN){
+        perror("pty");
+      }
+      sim_print("trs out", chunk, length);
+      atomic_fetch_add(&trs_out_bytes, length);
+      sim_sleep_until(done);
+      midi_pipeline_trs_out_done(&midi_pipeline, (uint32_t)done);
+    }
+  }
+  return NULL;
+}
+
+static void *sim_usb_out_task(void *arg){
+
+  uint32_t words[16];
+
+  while (atomic_load(&sim_running)){
+    sim_notify_take(&usb_out_notify, 10);
+
+    size_t count;
+    uint32_t received;
+    uint8_t device;
+    while ((count = midi_pipeline_usb_out_pop(&midi_pipeline, words, 16, &received, &device)) > 0){
+      // a reply goes to the device that asked only
+      bool has_out = false;
+      for (int i = 0; i < MIDI_PIPELINE_MAX_SOURCES; i++){
+        if (device == MIDI_PIPELINE_USB_OUT_ALL || device == i){
+          has_out |= sim_devices[i].attached && sim_devices[i].has_out;
+        }
+      }
+      if (!has_out){
+        atomic_fetch_add(&usb_out_dropped_no_device, count);
+        continue;
+      }
+      // one transfer per frame, as many event packets as fit into it
+      uint64_t done = sim_now_us() + SIM_FRAME_US;
+      sim_print("usb out", (const uint8_t *)words, count * 4);
+      atomic_fetch_add(&usb_out_packets, count);
+      atomic_fetch_add(&usb_out_transfers, 1);
+      sim_sleep_until(done);
+      midi_pipeline_usb_out_done(&midi_pipeline, received);
+    }
+  }
+  return NULL;
+}
+
+static void *sim_clock_task(void *arg){
+
+  while (atomic_load(&sim_running)){
+    if (atomic_load(&sim_attached) == 0){
+      sim_notify_take(&clock_notify, 10);
+      continue;
+    }
+    midi_clock_start(&sim_clock, sim_now_us() + 1);
+    while (atomic_load(&sim_running) && atomic_load(&sim_attached) > 0){
+      uint64_t due = midi_clock_deadline_us(&sim_clock);
+      sim_sleep_until(due);
+      midi_pipeline_clock_pulse(&midi_pipeline, (uint32_t)due);
+      atomic_fetch_add(&clock_pulses, 1);
+      midi_clock_advance(&sim_clock, sim_now_us());
+    }
+  }
+  return NULL;
+}
+
+static void *sim_rx_task(void *arg){
+
+  uint8_t buffer[256];
+  struct pollfd fds[2] = {
+    { .fd = trs_pipe[0], .events = POLLIN },
+    { .fd = pty_fd, .events = POLLIN },
+  };
+
+  while (atomic_load(&sim_running)){
+    if (poll(fds, pty_fd >= 0 ? 2 : 1, 10) <= 0){
+      continue;
+    }
+    for (int i = 0; i < 2; i++){
+      if (fds[i].fd < 0 || !(fds[i].revents & POLLIN)){
+        continue;
+      }
+      ssize_t length = read(fds[i].fd, buffer, sizeof(buffer));
+      if (length <= 0){
+        continue;
+      }
+      midi_pipeline_trs_in(&midi_pipeline, buffer, length, knot_hal_time_us());
+      if (i == 0){
+        atomic_fetch_add(&trs_in_read, length);
+      }
+    }
+  }
+  return NULL;
+}
+
+// trace replay
+
+static size_t sim_parse_hex(const char *text, uint8_t *out, size_t max){
+
+  size_t count = 0;
+  unsigned int byte;
+  int used;
+  while (count < max && sscanf(text, " %2x%n", &byte, &used) == 1){
+    out[count++] = byte;
+    text += used;
+  }
+  return count;
+}
+
+static void sim_attach(uint8_t dev, const uint8_t *descriptor, size_t length){
+
+  static struct usb_midi_stream_info stream;
+  sim_device_t *device = &sim_devices[dev];
+
+  usb_midi_parse_config(descriptor, length, &stream);
+  memset(device, 0, sizeof(*device));
+
+  for (int i = 0; i < stream.num_endpoints; i++){
+    const struct usb_midi_endpoint_info *ep = &stream.endpoints[i];
+    if (!usb_midi_endpoint_is_in(ep)){
+      device->has_out = true;
+      continue;
+    }
+    // every cable of an IN endpoint is routed to TRS out, as the class driver does
+    device->in_address[device->num_in] = ep->address;
+    device->in_cables[device->num_in] = (uint16_t)((1UL << ep->num_cables) - 1);
+    device->num_in++;
+  }
+
+  device->attached = true;
+  fprintf(stderr, "device %d: %d IN endpoints%s\n", dev, device->num_in, device->has_out ? ", OUT" : "");
+  if (atomic_fetch_add(&sim_attached, 1) == 0){
+    sim_notify_give(&clock_notify);
+  }
+}
+
+static void sim_in_decode(uint8_t dev, uint8_t address, const uint8_t *data, size_t length){
+
+  sim_device_t *device = &sim_devices[dev];
+
+  for (int i = 0; i < device->num_in; i++){
+    if (device->in_address[i] == address){
+      midi_pipeline_usb_in(&midi_pipeline, dev, data, length, device->in_cables[i], knot_hal_time_us());
+      return;
+    }
+  }
+  fprintf(stderr, "device %d has no IN endpoint %02x\n", dev, address);
+}
+
+static bool sim_in_waiting(uint8_t dev){
+
+  for (size_t i = 0; i < sim_held_count; i++){
+    if (sim_held[i].dev == dev){
+      return true;
+    }
+  }
+  return false;
+}
+
+// Held transfers go in trace order, a device stays behind its first one that still has to wait
+static void sim_in_release(void){
+
+  static sim_held_t held[SIM_HELD_SIZE];
+  size_t count = sim_held_count;
+  uint8_t waiting = 0;
+
+  memcpy(held, sim_held, count * sizeof(held[0]));
+  sim_held_count = 0;
+
+  for (size_t i = 0; i < count; i++){
+    uint8_t bit = 1 << held[i].dev;
+    if (!sim_devices[held[i].dev].attached){
+      continue;
+    }
+    if ((waiting & bit) || midi_pipeline_usb_in_held(&midi_pipeline, held[i].dev)){
+      waiting |= bit;
+      sim_held[sim_held_count++] = held[i];
+    }
+    else {
+      sim_in_decode(held[i].dev, held[i].address, held[i].data, held[i].length);
+    }
+  }
+}
+
+static void sim_in(uint8_t dev, uint8_t address, const uint8_t *data, size_t length){
+
+  // while TRS out is saturated the device keeps the transfer, the trace falls behind as a real one would
+  while (midi_pipeline_usb_in_throttle(&midi_pipeline) && atomic_load(&sim_running)){
+    sim_notify_take(&usb_in_notify, 10);
+  }
+
+  sim_in_release();
+  if (!sim_in_waiting(dev) && !midi_pipeline_usb_in_held(&midi_pipeline, dev)){
+    sim_in_decode(dev, address, data, length);
+    sim_in_release();
+    return;
+  }
+
+  // another device is in the middle of a SysEx, this one's transfers wait undecoded and once they are
+  // all taken the trace falls behind, until that SysEx ends or times out
+  while (sim_held_count == SIM_HELD_SIZE && atomic_load(&sim_running)){
+    sim_notify_take(&usb_in_notify, 10);
+    sim_in_release();
+  }
+  if (length > sizeof(sim_held[0].data)){
+    length = sizeof(sim_held[0].data);
+  }
+  sim_held[sim_held_count] = (sim_held_t){ .dev = dev, .address = address, .length = (uint8_t)length };
+  memcpy(sim_held[sim_held_count].data, data, length);
+  sim_held_count++;
+}
+
+static void sim_gone(uint8_t dev){
+
+  if (!sim_devices[dev].attached){
+    return;
+  }
+  sim_devices[dev].attached = false;
+  midi_pipeline_usb_in_remove(&midi_pipeline, dev);
+  sim_in_release();
+  atomic_fetch_sub(&sim_attached, 1);
+}
+
+static void sim_replay(FILE *trace){
+
+  char line[4096];
+  uint8_t data[1024];
+  unsigned long long t;
+  unsigned int dev, ep;
+  char kind[16];
+  int used;
+
+  while (fgets(line, sizeof(line), trace)){
+    if (line[0] == '#' || sscanf(line, "%llu %15s%n", &t, kind, &used) != 2){
+      continue;
+    }
+    sim_sleep_until(t);
+
+    const char *rest = line + used;
+    int more = 0;
+    if (strcmp(kind, "trs") == 0){
+      size_t length = sim_parse_hex(rest, data, sizeof(data));
+      atomic_fetch_add(&trs_in_written, length);
+      if (write(trs_pipe[1], data, length) < 0){
+        perror("trs");
+      }
+    }
+    else if (sscanf(rest, "%u%n", &dev, &more) != 1 || dev >= MIDI_PIPELINE_MAX_SOURCES){
+      fprintf(stderr, "bad trace line: %s", line);
+    }
+    else if (strcmp(kind, "config") == 0){
+      sim_attach(dev, data, sim_parse_hex(rest + more, data, sizeof(data)));
+    }
+    else if (strcmp(kind, "in") == 0 && sscanf(rest + more, "%x%n", &ep, &used) == 1){
+      sim_in(dev, ep, data, sim_parse_hex(rest + more + used, data, sizeof(data)));
+    }
+    else if (strcmp(kind, "gone") == 0){
+      sim_gone(dev);
+    }
+    else {
+      fprintf(stderr, "bad trace line: %s", line);
+    }
+  }
+
+  // transfers still waiting for a SysEx that never ended go once it times out
+  while (sim_held_count > 0 && atomic_load(&sim_running)){
+    sim_notify_take(&usb_in_notify, 10);
+    sim_in_release();
+  }
+}
+
+static bool sim_drained(void){
+
+  for (int lane = 0; lane < MIDI_TX_LANE_COUNT; lane++){
+    if (lane != MIDI_TX_LANE_CLOCK && midi_tx_scheduler_depth(&midi_pipeline.tx, lane) > 0){
+      return false;
+    }
+  }
+  return atomic_load(&trs_in_read) == atomic_load(&trs_in_written) && atomic_load(&sim_requests_open) == 0 &&
+         spsc_queue_count(&midi_pipeline.usb_out_queue) == 0 &&
+         spsc_queue_count(&midi_pipeline.usb_reply_queue) == 0;
+}
+
+static void sim_report(double wall){
+
+  static const char *lane_names[] = { "clock", "realtime", "normal", "reply" };
+  static const char *led_names[] = { "tx", "rx", "error" };
+  static const char *path_names[] = { "usb>trs", "trs>usb", "clock" };
+
+  fprintf(stderr, "\n%.3f s virtual in %.3f s wall, %.1fx\n", sim_now_us() / 1e6, wall, sim_now_us() / 1e6 / wall);
+  fprintf(stderr, "TRS out: %llu bytes\n", (unsigned long long)atomic_load(&trs_out_bytes));
+  for (int lane = 0; lane < MIDI_TX_LANE_COUNT; lane++){
+    struct midi_tx_lane_stats stats;
+    midi_tx_scheduler_get_stats(&midi_pipeline.tx, lane, &stats);
+    fprintf(stderr, "  %-8s %8u messages %6u dropped %6u coalesced  depth max %3u  wait max %7u us\n",
+            lane_names[lane], stats.messages, stats.dropped, stats.coalesced, stats.depth_max, stats.wait_max_us);
+  }
+  fprintf(stderr, "USB in: %u packets, throttled %u times for %llu us, max %u us\n", midi_pipeline.stats.usb_in_packets,
+          midi_pipeline.stats.usb_in_throttled, (unsigned long long)midi_pipeline.stats.usb_in_throttled_total_us,
+          midi_pipeline.stats.usb_in_throttled_max_us);
+  fprintf(stderr, "merge: %u SysEx timed out\n", midi_pipeline.merge.owner_timeouts);
+  fprintf(stderr, "USB out: %llu packets in %llu transfers, %u dropped queue full, %llu dropped no device, depth max %u\n",
+          (unsigned long long)atomic_load(&usb_out_packets), (unsigned long long)atomic_load(&usb_out_transfers),
+          midi_pipeline.stats.usb_out_dropped_queue_full,
+          (unsigned long long)atomic_load(&usb_out_dropped_no_device) + midi_pipeline.stats.usb_reply_dropped_gone,
+          midi_pipeline.stats.usb_out_queue_depth_max);
+  fprintf(stderr, "clock: %u pulses, %u skipped\n", atomic_load(&clock_pulses), sim_clock.pulses_skipped);
+  fprintf(stderr, "latency:\n");
+  for (int path = 0; path < MIDI_PIPELINE_PATH_COUNT; path++){
+    struct latency_hist_summary summary;
+    latency_hist_summarize(&midi_pipeline.latency[path], &summary);
+    fprintf(stderr, "  %-8s %8u messages  p50 %7u us  p99 %7u us  max %7u us\n",
+            path_names[path], summary.count, summary.p50_us, summary.p99_us, summary.max_us);
+  }
+  fprintf(stderr, "requests: %u\n", atomic_load(&sysex_requests));
+  for (int i = 0; i < 3; i++){
+    fprintf(stderr, "led %s: %u\n", led_names[i], atomic_load(&leds[i]));
+  }
+}
+
+static int sim_open_pty(void){
+
+  int fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0){
+    perror("pty");
+    return -1;
+  }
+
+  // raw bytes both ways, a reader that falls behind loses bytes instead of stalling TRS out
+  struct termios tio;
+  tcgetattr(fd, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(fd, TCSANOW, &tio);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  fprintf(stderr, "TRS on %s\n", ptsname(fd));
+  return fd;
+}
+
+int main(int argc, char **argv){
+
+  bool use_pty = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "s:pq")) != -1){
+    switch (opt){
+      case 's': sim_speed = atof(optarg); break;
+      case 'p': use_pty = true; break;
+      case 'q': sim_quiet = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-s speed] [-p] [-q] trace.txt\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+  }
+  if (optind >= argc || sim_speed <= 0){
+    fprintf(stderr, "usage: %s [-s speed] [-p] [-q] trace.txt\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  FILE *trace = fopen(argv[optind], "r");
+  if (trace == NULL || pipe(trs_pipe) != 0){
+    perror(argv[optind]);
+    return EXIT_FAILURE;
+  }
+  if (use_pty){
+    pty_fd = sim_open_pty();
+  }
+
+  struct knot_config defaults;
+  knot_config_defaults(&defaults);
+  knot_config_store_init(&sim_store, &defaults);
+  midi_clock_init(&sim_clock, midi_clock_period_from_ppm(defaults.bpm_default * MIDI_CLOCK_PPQN));
+
+  clock_gettime(CLOCK_MONOTONIC, &sim_start);
+  midi_pipeline_init(&midi_pipeline);
+
+  pthread_t threads[5];
+  pthread_create(&threads[0], NULL, sim_tx_task, NULL);
+  pthread_create(&threads[1], NULL, sim_usb_out_task, NULL);
+  pthread_create(&threads[2], NULL, sim_clock_task, NULL);
+  pthread_create(&threads[3], NULL, sim_rx_task, NULL);
+  pthread_create(&threads[4], NULL, sim_request_task, NULL);
+
+  sim_replay(trace);
+  fclose(trace);
+
+  // give the queues time to run dry before stopping
+  uint64_t give_up = sim_now_us() + SIM_DRAIN_US;
+  while (!sim_drained() && sim_now_us() < give_up){
+    sim_sleep_until(sim_now_us() + SIM_FRAME_US);
+  }
+  sim_sleep_until(sim_now_us() + SIM_FRAME_US);
+
+  atomic_store(&sim_running, false);
+  sim_notify_give(&tx_notify);
+  sim_notify_give(&usb_out_notify);
+  sim_notify_give(&clock_notify);
+  sim_notify_give(&request_notify);
+  for (int i = 0; i < 5; i++){
+    pthread_join(threads[i], NULL);
+  }
+
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  fflush(stdout);
+  sim_report((end.tv_sec - sim_start.tv_sec) + (end.tv_nsec - sim_start.tv_nsec) / 1e9);
+
+  if (pty_fd >= 0){
+    close(pty_fd);
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,129 @@
+#include "../midi_translator.h"
+#include "../knot_config.h"
+#include "../knot_sysex.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+  Stand-in for a Knot port on Linux: raw MIDI bytes in on stdin, replies and
+  every message that is not a Knot request out on stdout, so the SysEx
+  protocol can be driven from a script without hardware:
+
+    printf '\xF0\x7D\x4B\x05\xF7' | ./build/SysexLoopback | xxd
+*/
+
+static knot_config_store_t store;
+static struct knot_config staging;
+static knot_sysex_parser_t parser;
+
+static uint32_t messages_passed = 0;
+static uint32_t requests = 0;
+
+static void loopback_send(void *ctx, const uint8_t *bytes, size_t length){
+
+  fwrite(bytes, 1, length, stdout);
+}
+
+static void loopback_run_request(void){
+
+  knot_sysex_writer_t writer;
+  uint8_t status = parser.valid ? KNOT_SYSEX_OK : KNOT_SYSEX_INVALID;
+
+  switch (parser.command){
+
+    case KNOT_SYSEX_CONFIG_WRITE:
+    case KNOT_SYSEX_CONFIG_RESET:
+      if (parser.command == KNOT_SYSEX_CONFIG_RESET){
+        knot_config_defaults(&staging);
+      }
+      // nothing pins a snapshot here, publish cannot be busy
+      if (status == KNOT_SYSEX_OK && knot_config_publish(&store, &staging) != KNOT_CONFIG_OK){
+        status = KNOT_SYSEX_INVALID;
+      }
+      knot_sysex_reply_begin(&writer, loopback_send, NULL, parser.command, status);
+      break;
+
+    case KNOT_SYSEX_CONFIG_READ: {
+      uint8_t blob[KNOT_CONFIG_MAX_SIZE];
+      const knot_config_snapshot_t *snapshot = knot_config_acquire(&store);
+      size_t size = status == KNOT_SYSEX_OK ? knot_config_encode(&snapshot->config, blob, sizeof(blob)) : 0;
+      knot_config_release(&store, snapshot);
+      knot_sysex_reply_begin(&writer, loopback_send, NULL, parser.command, status);
+      knot_sysex_reply_write(&writer, blob, size);
+      break;
+    }
+
+    case KNOT_SYSEX_COUNTERS_READ:
+      // no USB, TRS or clock here: only the counters the stand-in has
+      knot_sysex_reply_begin(&writer, loopback_send, NULL, parser.command, status);
+      if (status == KNOT_SYSEX_OK){
+        knot_sysex_reply_write_u32(&writer, messages_passed);
+        knot_sysex_reply_write_u32(&writer, requests);
+      }
+      break;
+
+    case KNOT_SYSEX_STATE_READ: {
+      knot_sysex_reply_begin(&writer, loopback_send, NULL, parser.command, status);
+      if (status == KNOT_SYSEX_OK){
+        const knot_config_snapshot_t *snapshot = knot_config_acquire(&store);
+        knot_sysex_reply_write_u32(&writer, 60000000u / 24 / snapshot->config.bpm_default);
+        knot_sysex_reply_write_u32(&writer, 0);
+        uint8_t state[] = { KNOT_CONFIG_VERSION, snapshot->config.rule_count, snapshot->config.trs_ab, MIDI_ROUTE_AB_A };
+        knot_config_release(&store, snapshot);
+        knot_sysex_reply_write(&writer, state, sizeof(state));
+      }
+      break;
+    }
+
+    default:
+      knot_sysex_reply_begin(&writer, loopback_send, NULL, parser.command, KNOT_SYSEX_UNKNOWN_COMMAND);
+      break;
+  }
+
+  knot_sysex_reply_end(&writer);
+  fprintf(stderr, "request %02x, status %02x\n", parser.command, status);
+}
+
+int main(void){
+
+  struct knot_config defaults;
+  knot_config_defaults(&defaults);
+  knot_config_store_init(&store, &defaults);
+  knot_sysex_parser_init(&parser, &staging);
+
+  midi_parser_t midi;
+  midi_parser_init(&midi);
+
+  int c;
+  while ((c = getchar()) != EOF){
+
+    struct uart_midi_event_packet packet = midi_parser_process_byte(&midi, (uint8_t)c);
+    if (packet.length == 0){
+      continue;
+    }
+
+    switch (knot_sysex_feed(&parser, packet)){
+      case KNOT_SYSEX_REQUEST:
+        requests++;
+        loopback_run_request();
+        break;
+      case KNOT_SYSEX_PASS:
+        messages_passed++;
+        loopback_send(NULL, &packet.byte1, 1);
+        if (packet.length > 1){
+          loopback_send(NULL, &packet.byte2, 1);
+        }
+        if (packet.length > 2){
+          loopback_send(NULL, &packet.byte3, 1);
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  fflush(stdout);
+  return EXIT_SUCCESS;
+}
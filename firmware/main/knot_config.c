@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include <string.h>
+#include "knot_config.h"
+#include "midi_clock.h"
+
+void knot_config_defaults(struct knot_config *config){
+
+  memset(config, 0, sizeof(*config));
+  config->bpm_default = 120;
+  config->bpm_min = 70;
+  config->bpm_max = 180;
+  config->bend_divisor = 16;
+  config->trs_ab = KNOT_TRS_AB_SWITCH;
+  config->trs_out = KNOT_TRS_OUT_RUNNING_STATUS;
+  config->rule_count = (uint8_t)midi_router_default_rule_count;
+  memcpy(config->rules, midi_router_default_rules, midi_router_default_rule_count * sizeof(config->rules[0]));
+}
+
+static inline void put_u16(uint8_t *out, uint16_t value){
+
+  out[0] = value & 0xFF;
+  out[1] = value >> 8;
+}
+
+static inline uint16_t get_u16(const uint8_t *data){
+
+  return data[0] | (data[1] << 8);
+}
+
+static void knot_config_encode_rule(const struct midi_route_rule *rule, uint8_t *out){
+
+  put_u16(&out[0], rule->cable_mask);
+  put_u16(&out[2], rule->channel_mask);
+  out[4] = rule->source_mask;
+  out[5] = rule->status;
+  out[6] = rule->data1_min;
+  out[7] = rule->data1_max;
+  out[8] = rule->actions;
+  out[9] = rule->clock;
+  out[10] = (uint8_t)rule->channel_shift;
+  out[11] = (uint8_t)rule->channel_step;
+  out[12] = rule->data1;
+  out[13] = rule->data1_step;
+  out[14] = rule->out_min;
+  out[15] = rule->out_max;
+  out[16] = rule->ab_mask;
+}
+
+static void knot_config_decode_rule(struct midi_route_rule *rule, const uint8_t *data, uint8_t size){
+
+  rule->cable_mask = get_u16(&data[0]);
+  rule->channel_mask = get_u16(&data[2]);
+  rule->source_mask = data[4];
+  rule->status = data[5];
+  rule->data1_min = data[6];
+  rule->data1_max = data[7];
+  rule->actions = data[8];
+  rule->clock = data[9];
+  rule->channel_shift = (int8_t)data[10];
+  rule->channel_step = (int8_t)data[11];
+  rule->data1 = data[12];
+  rule->data1_step = data[13];
+  rule->out_min = data[14];
+  rule->out_max = data[15];
+  rule->ab_mask = size > KNOT_CONFIG_RULE_SIZE_V1 ? data[16] : 0;
+}
+
+size_t knot_config_encode(const struct knot_config *config, uint8_t *out, size_t capacity){
+
+  size_t size = KNOT_CONFIG_HEADER_SIZE + (size_t)config->rule_count * KNOT_CONFIG_RULE_SIZE;
+  if (config->rule_count > MIDI_ROUTER_MAX_RULES || size > capacity){
+    return 0;
+  }
+
+  out[0] = 'K';
+  out[1] = 'C';
+  out[2] = KNOT_CONFIG_VERSION;
+  out[3] = config->rule_count;
+  put_u16(&out[4], config->bpm_default);
+  put_u16(&out[6], config->bpm_min);
+  put_u16(&out[8], config->bpm_max);
+  out[10] = config->bend_divisor;
+  out[11] = config->trs_ab;
+  out[12] = config->trs_out;
+
+  for (uint8_t i = 0; i < config->rule_count; i++){
+    knot_config_encode_rule(&config->rules[i], &out[KNOT_CONFIG_HEADER_SIZE + i * KNOT_CONFIG_RULE_SIZE]);
+  }
+
+  return size;
+}
+
+enum {
+  KNOT_CONFIG_DECODE_HEADER,
+  KNOT_CONFIG_DECODE_RULES,
+  KNOT_CONFIG_DECODE_DONE,
+  KNOT_CONFIG_DECODE_FAILED,
+};
+
+static bool knot_config_decode_header(knot_config_decoder_t *decoder, const uint8_t *data){
+
+  struct knot_config *config = decoder->config;
+
+  if (data[0] != 'K' || data[1] != 'C'){
+    return false;
+  }
+
+  // a later version may append to the header or the rules, but their meaning is unknown here
+  uint8_t version = data[2];
+  if (version == 0 || version > KNOT_CONFIG_VERSION){
+    return false;
+  }
+
+  // slower tempos have no period in the clock's fixed point, faster ones flood the TRS wire with F8
+  uint16_t bpm_default = get_u16(&data[4]);
+  uint16_t bpm_min = get_u16(&data[6]);
+  uint16_t bpm_max = get_u16(&data[8]);
+  if (data[3] > MIDI_ROUTER_MAX_RULES || bpm_default < MIDI_CLOCK_BPM_MIN || bpm_default > MIDI_CLOCK_BPM_MAX ||
+      bpm_min < MIDI_CLOCK_BPM_MIN || bpm_min > bpm_max || bpm_max > MIDI_CLOCK_BPM_MAX || data[10] == 0 ||
+      data[11] > KNOT_TRS_AB_FORCE_B){
+    return false;
+  }
+
+  config->rule_count = data[3];
+  config->bpm_default = bpm_default;
+  config->bpm_min = bpm_min;
+  config->bpm_max = bpm_max;
+  config->bend_divisor = data[10];
+  config->trs_ab = data[11];
+  if (version >= 3){
+    if (data[12] > KNOT_TRS_OUT_FULL_STATUS){
+      return false;
+    }
+    config->trs_out = data[12];
+  }
+  decoder->rule_size = version == 1 ? KNOT_CONFIG_RULE_SIZE_V1 : KNOT_CONFIG_RULE_SIZE;
+  return true;
+}
+
+void knot_config_decoder_init(knot_config_decoder_t *decoder, struct knot_config *config){
+
+  knot_config_defaults(config);
+  decoder->config = config;
+  decoder->rule_size = KNOT_CONFIG_RULE_SIZE;
+  decoder->fill = 0;
+  decoder->rules_done = 0;
+  decoder->state = KNOT_CONFIG_DECODE_HEADER;
+}
+
+bool knot_config_decoder_feed(knot_config_decoder_t *decoder, uint8_t byte){
+
+  switch (decoder->state){
+
+    case KNOT_CONFIG_DECODE_HEADER:
+      // the version is the third byte, the ones before 3 have a shorter header
+      decoder->buffer[decoder->fill++] = byte;
+      if (decoder->fill < KNOT_CONFIG_HEADER_SIZE_V2 || (decoder->fill < KNOT_CONFIG_HEADER_SIZE && decoder->buffer[2] >= 3)){
+        return true;
+      }
+      decoder->fill = 0;
+      if (!knot_config_decode_header(decoder, decoder->buffer)){
+        decoder->state = KNOT_CONFIG_DECODE_FAILED;
+        return false;
+      }
+      decoder->state = decoder->config->rule_count ? KNOT_CONFIG_DECODE_RULES : KNOT_CONFIG_DECODE_DONE;
+      return true;
+
+    case KNOT_CONFIG_DECODE_RULES:
+      decoder->buffer[decoder->fill++] = byte;
+      if (decoder->fill < decoder->rule_size){
+        return true;
+      }
+      decoder->fill = 0;
+      knot_config_decode_rule(&decoder->config->rules[decoder->rules_done++], decoder->buffer, decoder->rule_size);
+      if (decoder->rules_done == decoder->config->rule_count){
+        decoder->state = KNOT_CONFIG_DECODE_DONE;
+      }
+      return true;
+
+    default:
+      // trailing bytes after the last rule
+      decoder->state = KNOT_CONFIG_DECODE_FAILED;
+      return false;
+  }
+}
+
+bool knot_config_decoder_finish(knot_config_decoder_t *decoder){
+
+  if (decoder->state != KNOT_CONFIG_DECODE_DONE){
+    knot_config_defaults(decoder->config);
+    return false;
+  }
+  return true;
+}
+
+bool knot_config_decode(struct knot_config *config, const uint8_t *data, size_t length){
+
+  knot_config_decoder_t decoder;
+  knot_config_decoder_init(&decoder, config);
+
+  for (size_t i = 0; i < length; i++){
+    if (!knot_config_decoder_feed(&decoder, data[i])){
+      break;
+    }
+  }
+
+  return knot_config_decoder_finish(&decoder);
+}
+
+static inline int knot_config_slot(const knot_config_store_t *store, const knot_config_snapshot_t *snapshot){
+
+  return snapshot == &store->slots[1];
+}
+
+static bool knot_config_fill(knot_config_snapshot_t *snapshot, const struct knot_config *config){
+
+  if (config->bpm_default < MIDI_CLOCK_BPM_MIN || config->bpm_default > MIDI_CLOCK_BPM_MAX ||
+      config->bpm_min < MIDI_CLOCK_BPM_MIN || config->bpm_min > config->bpm_max || config->bpm_max > MIDI_CLOCK_BPM_MAX ||
+      config->bend_divisor == 0){
+    return false;
+  }
+  if (!midi_router_compile(&snapshot->router, config->rules, config->rule_count)){
+    return false;
+  }
+  snapshot->config = *config;
+  return true;
+}
+
+bool knot_config_store_init(knot_config_store_t *store, const struct knot_config *config){
+
+  atomic_store(&store->readers[0], 0);
+  atomic_store(&store->readers[1], 0);
+
+  bool valid = knot_config_fill(&store->slots[0], config);
+  if (!valid){
+    struct knot_config defaults;
+    knot_config_defaults(&defaults);
+    knot_config_fill(&store->slots[0], &defaults);
+  }
+
+  atomic_store_explicit(&store->current, &store->slots[0], memory_order_release);
+  return valid;
+}
+
+const knot_config_snapshot_t *knot_config_acquire(knot_config_store_t *store){
+
+  for (;;){
+    knot_config_snapshot_t *snapshot = atomic_load_explicit(&store->current, memory_order_acquire);
+    atomic_fetch_add(&store->readers[knot_config_slot(store, snapshot)], 1);
+
+    // the writer may have swapped in between, then this slot may be rewritten: let go and take the new one
+    if (atomic_load(&store->current) == snapshot){
+      return snapshot;
+    }
+    atomic_fetch_sub(&store->readers[knot_config_slot(store, snapshot)], 1);
+  }
+}
+
+void knot_config_release(knot_config_store_t *store, const knot_config_snapshot_t *snapshot){
+
+  atomic_fetch_sub(&store->readers[knot_config_slot(store, snapshot)], 1);
+}
+
+enum knot_config_result knot_config_publish(knot_config_store_t *store, const struct knot_config *config){
+
+  knot_config_snapshot_t *current = atomic_load(&store->current);
+  int spare = !knot_config_slot(store, current);
+
+  // readers that pinned the spare before the last swap are still using it
+  if (atomic_load(&store->readers[spare]) != 0){
+    return KNOT_CONFIG_BUSY;
+  }
+
+  if (!knot_config_fill(&store->slots[spare], config)){
+    return KNOT_CONFIG_INVALID;
+  }
+
+  atomic_store_explicit(&store->current, &store->slots[spare], memory_order_release);
+  return KNOT_CONFIG_OK;
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "midi_router.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+  Persistent configuration
+
+  Everything that used to be a #define and differs per setup: routing
+  rules, the clock tempo range, the TRS A/B wiring and the TRS output
+  profile. It is stored as a
+  compact versioned blob; older blobs load with defaults for the fields
+  they predate, newer ones are rejected.
+
+  Blob layout, multi-byte fields little endian:
+
+    0   'K' 'C'           magic
+    2   version
+    3   rule count
+    4   bpm default, min, max   3 x uint16, MIDI_CLOCK_BPM_MIN..MIDI_CLOCK_BPM_MAX
+    10  bend divisor
+    11  TRS A/B mode
+    12  TRS out profile
+    13  rules                   17 bytes each, struct midi_route_rule field order
+
+  Version 1 rules are 16 bytes, they predate the A/B switch mask. Version 1
+  and 2 headers are 12 bytes, they predate the TRS out profile.
+
+  The live configuration is double buffered. Readers pin the current
+  snapshot for the duration of one unit of work and never take a lock; a
+  writer fills the other snapshot and publishes it with a single pointer
+  swap, so a reader sees either the old or the new rule set, never a mix.
+  The spare snapshot is only reused once every reader pinned on it left.
+
+*/
+
+#define KNOT_CONFIG_VERSION       3
+#define KNOT_CONFIG_HEADER_SIZE   13
+#define KNOT_CONFIG_HEADER_SIZE_V2 12
+#define KNOT_CONFIG_RULE_SIZE     17
+#define KNOT_CONFIG_RULE_SIZE_V1  16
+#define KNOT_CONFIG_MAX_SIZE      (KNOT_CONFIG_HEADER_SIZE + MIDI_ROUTER_MAX_RULES * KNOT_CONFIG_RULE_SIZE)
+
+enum knot_trs_ab
+{
+  KNOT_TRS_AB_SWITCH,   // follow the hardware switch
+  KNOT_TRS_AB_FORCE_A,  // TRS type A whatever the switch says
+  KNOT_TRS_AB_FORCE_B,  // TRS type B whatever the switch says
+};
+
+enum knot_trs_out_profile
+{
+  KNOT_TRS_OUT_RUNNING_STATUS,  // repeated status bytes are left out, see midi_tx_scheduler.h
+  KNOT_TRS_OUT_FULL_STATUS,     // every message carries its status byte, for receivers that mishandle running status
+};
+
+struct knot_config
+{
+  uint16_t bpm_default;   // tempo of the MIDI clock at boot
+  uint16_t bpm_min;       // range of the coarse tempo control
+  uint16_t bpm_max;
+  uint8_t bend_divisor;   // tempo bend changes the period by 1/divisor
+  uint8_t trs_ab;         // enum knot_trs_ab
+  uint8_t trs_out;        // enum knot_trs_out_profile
+  uint8_t rule_count;
+  struct midi_route_rule rules[MIDI_ROUTER_MAX_RULES];
+};
+
+typedef struct
+{
+  struct knot_config config;
+  midi_router_t router;       // compiled from config.rules
+} knot_config_snapshot_t;
+
+typedef struct
+{
+  knot_config_snapshot_t slots[2];
+  _Atomic(knot_config_snapshot_t *) current;
+  _Atomic uint32_t readers[2];  // readers pinned on each slot
+} knot_config_store_t;
+
+/**
+ * Incremental blob parser, for blobs that arrive in pieces and are never whole in memory.
+ */
+typedef struct
+{
+  struct knot_config *config;
+  uint8_t buffer[KNOT_CONFIG_RULE_SIZE];  // the header, then one rule at a time, the rule is the larger
+  uint8_t rule_size;                      // of the blob version being parsed
+  uint8_t fill;
+  uint8_t rules_done;
+  uint8_t state;
+} knot_config_decoder_t;
+
+enum knot_config_result
+{
+  KNOT_CONFIG_OK,
+  KNOT_CONFIG_INVALID,  // rules do not compile, nothing changed
+  KNOT_CONFIG_BUSY,     // a reader still holds the previous snapshot, try again later
+};
+
+/**
+ * @brief Fill in the built-in configuration
+ * @param[out] config configuration
+ */
+void knot_config_defaults(struct knot_config *config);
+
+/**
+ * @brief Serialize a configuration into the stored blob format
+ * @param[in] config configuration
+ * @param[out] out destination buffer
+ * @param[in] capacity size of out in bytes, KNOT_CONFIG_MAX_SIZE always fits
+ *
+ * @return number of bytes written, 0 if out is too small
+ */
+size_t knot_config_encode(const struct knot_config *config, uint8_t *out, size_t capacity);
+
+/**
+ * @brief Parse a stored blob
+ * @param[out] config configuration, fields the blob version predates keep their defaults
+ * @param[in] data blob
+ * @param[in] length blob size in bytes
+ *
+ * @return false if the blob is malformed or from a newer firmware, config then holds the defaults
+ */
+bool knot_config_decode(struct knot_config *config, const uint8_t *data, size_t length);
+
+/**
+ * @brief Start parsing a blob into a configuration
+ * @param[out] decoder decoder
+ * @param[out] config destination, starts out with the defaults
+ */
+void knot_config_decoder_init(knot_config_decoder_t *decoder, struct knot_config *config);
+
+/**
+ * @brief Feed the next blob byte
+ * @param[in] decoder decoder
+ * @param[in] byte blob byte
+ *
+ * @return false once the blob is known to be malformed, later bytes are ignored
+ */
+bool knot_config_decoder_feed(knot_config_decoder_t *decoder, uint8_t byte);
+
+/**
+ * @brief End of the blob
+ * @param[in] decoder decoder
+ *
+ * @return true if the blob was complete and valid, otherwise the config is reset to the defaults
+ */
+bool knot_config_decoder_finish(knot_config_decoder_t *decoder);
+
+/**
+ * @brief Set up the store with a first configuration
+ * @param[out] store store
+ * @param[in] config configuration, the defaults are used if its rules do not compile
+ *
+ * @return false if the defaults had to be used
+ */
+bool knot_config_store_init(knot_config_store_t *store, const struct knot_config *config);
+
+/**
+ * @brief Pin the current snapshot, lock free
+ * @param[in] store store
+ *
+ * @return snapshot that stays valid until knot_config_release
+ */
+const knot_config_snapshot_t *knot_config_acquire(knot_config_store_t *store);
+
+/**
+ * @brief Unpin a snapshot taken with knot_config_acquire
+ * @param[in] store store
+ * @param[in] snapshot snapshot
+ */
+void knot_config_release(knot_config_store_t *store, const knot_config_snapshot_t *snapshot);
+
+/**
+ * @brief Build a new snapshot and swap it in, writers have to be serialized by the caller
+ * @param[in] store store
+ * @param[in] config new configuration
+ *
+ * @return KNOT_CONFIG_OK once readers acquire the new snapshot
+ */
+enum knot_config_result knot_config_publish(knot_config_store_t *store, const struct knot_config *config);
+
+
+#ifdef __cplusplus
+}
+#endif
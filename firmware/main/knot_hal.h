@@ -0,0 +1,105 @@
+#pragma once
+
+#include <stdint.h>
+#include "knot_config.h"
+#include "knot_sysex.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+  Platform seam of the data path
+
+  midi_pipeline.c holds everything between the USB endpoints and the TRS
+  wire that does not touch hardware. What it needs from the platform is
+  declared here and implemented twice: by the ESP-IDF drivers in the
+  firmware (hal_driver.c) and by the Linux simulator (host_test/simulator.c).
+
+  The pipeline calls these on the forwarding path, from whichever task
+  feeds it: none of them may block, except knot_hal_yield. The firmware
+  drains TRS out in the UART interrupt, so what midi_pipeline_trs_out_pull
+  calls must be safe there as well.
+
+*/
+
+enum knot_hal_led
+{
+  KNOT_HAL_LED_TX,      // a message was queued for TRS out
+  KNOT_HAL_LED_RX,      // bytes arrived on TRS in
+  KNOT_HAL_LED_ERROR,
+};
+
+/**
+ * @brief Microseconds on the time base of the latency counters, wraps after ~71 minutes
+ */
+uint32_t knot_hal_time_us(void);
+
+/**
+ * @brief Let the consumer of a full queue run before trying again, one tick on the firmware
+ */
+void knot_hal_yield(void);
+
+/**
+ * @brief Bytes are waiting in the TRS out scheduler, wake its consumer
+ */
+void knot_hal_trs_tx_wake(void);
+
+/**
+ * @brief TRS out drained below the low watermark, let the IN worker resubmit what it held back, called by the TRS out consumer
+ */
+void knot_hal_usb_in_wake(void);
+
+/**
+ * @brief Event packets are waiting for the USB OUT endpoints, wake their consumer
+ */
+void knot_hal_usb_out_wake(void);
+
+/**
+ * @brief Start an LED effect, a single store on the firmware
+ * @param[in] led which one
+ */
+void knot_hal_led(enum knot_hal_led led);
+
+/**
+ * @brief Pin the live configuration, lock free
+ */
+const knot_config_snapshot_t *knot_hal_config_acquire(void);
+
+/**
+ * @brief Unpin a configuration taken with knot_hal_config_acquire
+ * @param[in] snapshot snapshot
+ */
+void knot_hal_config_release(const knot_config_snapshot_t *snapshot);
+
+/**
+ * @brief Debounced position of the TRS A/B switch, MIDI_ROUTE_AB_A or MIDI_ROUTE_AB_B
+ */
+uint8_t knot_hal_ab_switch(void);
+
+/**
+ * @brief Change the tempo of the MIDI clock output, phase continuous
+ * @param[in] period pulse period in MIDI_CLOCK_FRAC_BITS fixed point microseconds
+ */
+void knot_hal_clock_set_period(uint32_t period);
+
+/**
+ * @brief Current pulse period in MIDI_CLOCK_FRAC_BITS fixed point microseconds
+ */
+uint32_t knot_hal_clock_get_period(void);
+
+/**
+ * @brief Hand over the configuration request a port just completed, the port is deferred
+ * @param[in] port port, its parser holds the command and whether the request was valid
+ *
+ * Called on the forwarding path like the rest, so it only queues the port. A task of the
+ * platform's own applies and stores the request, writes the reply through the port's send,
+ * which may wait for room, and then calls knot_sysex_port_done.
+ */
+void knot_hal_sysex_request(knot_sysex_port_t *port);
+
+
+#ifdef __cplusplus
+}
+#endif
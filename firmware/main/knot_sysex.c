@@ -0,0 +1,202 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include "knot_sysex.h"
+
+enum {
+  KNOT_SYSEX_IDLE,
+  KNOT_SYSEX_COMMAND,   // header seen, command byte next
+  KNOT_SYSEX_PAYLOAD,
+  KNOT_SYSEX_SKIP,      // a request that came in while the parser was busy
+};
+
+void knot_sysex_parser_init(knot_sysex_parser_t *parser, struct knot_config *staging){
+
+  parser->state = KNOT_SYSEX_IDLE;
+  parser->command = 0;
+  parser->msbs = 0;
+  parser->group = 0;
+  parser->valid = false;
+  atomic_store(&parser->busy, false);
+  parser->staging = staging;
+}
+
+static inline uint8_t packet_byte(struct uart_midi_event_packet packet, uint8_t index){
+
+  return index == 0 ? packet.byte1 : index == 1 ? packet.byte2 : packet.byte3;
+}
+
+static void knot_sysex_start_payload(knot_sysex_parser_t *parser, uint8_t command){
+
+  parser->command = command;
+  parser->state = KNOT_SYSEX_PAYLOAD;
+  parser->msbs = 0;
+  parser->group = 0;
+  parser->valid = true;
+
+  if (command == KNOT_SYSEX_CONFIG_WRITE){
+    knot_config_decoder_init(&parser->decoder, parser->staging);
+  }
+}
+
+static void knot_sysex_payload_byte(knot_sysex_parser_t *parser, uint8_t byte){
+
+  if (parser->group == 0){
+    parser->msbs = byte;
+    parser->group = 1;
+    return;
+  }
+
+  uint8_t value = byte | (((parser->msbs >> (parser->group - 1)) & 1) << 7);
+  parser->group = parser->group == 7 ? 0 : parser->group + 1;
+
+  if (parser->command == KNOT_SYSEX_CONFIG_WRITE){
+    parser->valid &= knot_config_decoder_feed(&parser->decoder, value);
+  }
+  else{
+    // no other request takes a payload
+    parser->valid = false;
+  }
+}
+
+static enum knot_sysex_feed_result knot_sysex_finish(knot_sysex_parser_t *parser){
+
+  parser->state = KNOT_SYSEX_IDLE;
+
+  if (parser->command == KNOT_SYSEX_CONFIG_WRITE){
+    // a dangling msbs byte without data is harmless, a partial blob is not
+    parser->valid &= knot_config_decoder_finish(&parser->decoder);
+  }
+  return KNOT_SYSEX_REQUEST;
+}
+
+enum knot_sysex_feed_result knot_sysex_feed(knot_sysex_parser_t *parser, struct uart_midi_event_packet packet){
+
+  if (packet.length == 0){
+    return KNOT_SYSEX_PASS;
+  }
+
+  if (parser->state == KNOT_SYSEX_IDLE){
+
+    // both the USB packetizer and the TRS parser put F0 and the next two bytes in one packet
+    if (packet.length == 3 && packet.byte1 == 0xF0 && packet.byte2 == KNOT_SYSEX_MANUFACTURER && packet.byte3 == KNOT_SYSEX_DEVICE){
+      if (atomic_load(&parser->busy)){
+        parser->state = KNOT_SYSEX_SKIP;
+        return KNOT_SYSEX_CONSUMED;
+      }
+      parser->state = KNOT_SYSEX_COMMAND;
+      parser->command = 0;
+      parser->valid = false;
+      return KNOT_SYSEX_CONSUMED;
+    }
+    return KNOT_SYSEX_PASS;
+  }
+
+  // real-time bytes may sit inside the request, they go their way
+  if (packet.length == 1 && packet.byte1 >= 0xF8){
+    return KNOT_SYSEX_PASS;
+  }
+
+  for (uint8_t i = 0; i < packet.length; i++){
+
+    uint8_t byte = packet_byte(packet, i);
+
+    if (byte == 0xF7){
+      if (parser->state == KNOT_SYSEX_COMMAND || parser->state == KNOT_SYSEX_SKIP){
+        // no command byte at all, or nobody to answer it
+        parser->state = KNOT_SYSEX_IDLE;
+        return KNOT_SYSEX_CONSUMED;
+      }
+      return knot_sysex_finish(parser);
+    }
+
+    if (byte > 0x7F){
+      // any other status byte cuts the request short, the packet is a message of its own
+      parser->state = KNOT_SYSEX_IDLE;
+      return KNOT_SYSEX_PASS;
+    }
+
+    if (parser->state == KNOT_SYSEX_SKIP){
+      continue;
+    }
+    if (parser->state == KNOT_SYSEX_COMMAND){
+      knot_sysex_start_payload(parser, byte);
+    }
+    else{
+      knot_sysex_payload_byte(parser, byte);
+    }
+  }
+
+  return KNOT_SYSEX_CONSUMED;
+}
+
+void knot_sysex_port_init(knot_sysex_port_t *port, knot_sysex_send_fn send, void *ctx){
+
+  port->send = send;
+  port->ctx = ctx;
+  knot_sysex_parser_init(&port->parser, &port->staging);
+}
+
+void knot_sysex_port_reset(knot_sysex_port_t *port){
+
+  // command, result and staging config of a request being answered are not the parser's to touch
+  port->parser.state = KNOT_SYSEX_IDLE;
+}
+
+void knot_sysex_port_defer(knot_sysex_port_t *port){
+
+  atomic_store(&port->parser.busy, true);
+}
+
+void knot_sysex_port_done(knot_sysex_port_t *port){
+
+  atomic_store(&port->parser.busy, false);
+}
+
+void knot_sysex_reply_begin(knot_sysex_writer_t *writer, knot_sysex_send_fn send, void *ctx, uint8_t command, uint8_t status){
+
+  writer->send = send;
+  writer->ctx = ctx;
+  writer->fill = 1;
+
+  uint8_t header[] = { 0xF0, KNOT_SYSEX_MANUFACTURER, KNOT_SYSEX_DEVICE, (command | KNOT_SYSEX_REPLY) & 0x7F, status & 0x7F };
+  send(ctx, header, sizeof(header));
+}
+
+static void knot_sysex_reply_flush(knot_sysex_writer_t *writer){
+
+  if (writer->fill > 1){
+    writer->send(writer->ctx, writer->group, writer->fill);
+  }
+  writer->group[0] = 0;
+  writer->fill = 1;
+}
+
+void knot_sysex_reply_write(knot_sysex_writer_t *writer, const uint8_t *data, size_t length){
+
+  for (size_t i = 0; i < length; i++){
+
+    if (writer->fill == 1){
+      writer->group[0] = 0;
+    }
+    writer->group[0] |= (data[i] >> 7) << (writer->fill - 1);
+    writer->group[writer->fill++] = data[i] & 0x7F;
+
+    if (writer->fill == sizeof(writer->group)){
+      knot_sysex_reply_flush(writer);
+    }
+  }
+}
+
+void knot_sysex_reply_write_u32(knot_sysex_writer_t *writer, uint32_t value){
+
+  uint8_t bytes[4] = { value & 0xFF, (value >> 8) & 0xFF, (value >> 16) & 0xFF, value >> 24 };
+  knot_sysex_reply_write(writer, bytes, sizeof(bytes));
+}
+
+void knot_sysex_reply_end(knot_sysex_writer_t *writer){
+
+  knot_sysex_reply_flush(writer);
+
+  uint8_t end = 0xF7;
+  writer->send(writer->ctx, &end, 1);
+}
@@ -0,0 +1,193 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "midi_translator.h"
+#include "knot_config.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+  SysEx configuration protocol
+
+  Requests and replies are SysEx messages with the non-commercial
+  manufacturer ID:
+
+    request   F0 7D 4B <command> [payload] F7
+    reply     F0 7D 4B <command | 40> <status> [payload] F7
+
+  Payloads carry 8-bit data packed 7 to 8: every group of up to 7 bytes is
+  preceded by a byte holding their top bits, bit N for byte N of the group.
+
+    01  config read     reply payload: the stored blob, see knot_config.h
+    02  config write    request payload: a blob, applied and stored at F7
+    03  config reset    back to the built-in defaults
+    04  counters read   reply payload: uint32 little endian counters, in order
+                          usb out:  queued, dropped queue full, dropped no device,
+                                    dropped device busy, sent, transfers failed
+                          usb in:   transfers, submit failed, idle max us
+                          trs out:  messages, dropped, wait max us
+                                    for each lane: clock, realtime, normal, reply
+                          clock:    pulses, wake latency max us
+    05  state read      reply payload: clock period us (uint32), clock pulses (uint32),
+                        config version, rule count, TRS A/B mode, A/B switch position
+    06  latency read    reply payload: uint32 little endian, count, p50 us, p99 us, max us
+                        for each path: USB to TRS, TRS to USB, clock
+
+  Parsing is incremental: a port feeds every packet it receives, the
+  parser consumes the ones of a Knot request and decodes a config write
+  straight into a staging config while it streams in, so no request is
+  ever buffered whole. Replies are written the same way, a packed group
+  at a time.
+
+  A completed request may be answered away from the task that feeds the
+  port. From knot_sysex_port_defer until knot_sysex_port_done the port is
+  busy: its command, result and staging config stay as they are, and a
+  request that arrives meanwhile is consumed without an answer.
+
+*/
+
+#define KNOT_SYSEX_MANUFACTURER   0x7D  // non-commercial, for development and in-house use
+#define KNOT_SYSEX_DEVICE         0x4B  // 'K'
+#define KNOT_SYSEX_REPLY          0x40  // set in the command byte of replies
+
+enum knot_sysex_command
+{
+  KNOT_SYSEX_CONFIG_READ    = 0x01,
+  KNOT_SYSEX_CONFIG_WRITE   = 0x02,
+  KNOT_SYSEX_CONFIG_RESET   = 0x03,
+  KNOT_SYSEX_COUNTERS_READ  = 0x04,
+  KNOT_SYSEX_STATE_READ     = 0x05,
+  KNOT_SYSEX_LATENCY_READ   = 0x06,
+};
+
+enum knot_sysex_status
+{
+  KNOT_SYSEX_OK               = 0x00,
+  KNOT_SYSEX_INVALID          = 0x01, // malformed request or a config that does not compile
+  KNOT_SYSEX_STORAGE_ERROR    = 0x02, // applied but not stored
+  KNOT_SYSEX_UNKNOWN_COMMAND  = 0x7F,
+};
+
+enum knot_sysex_feed_result
+{
+  KNOT_SYSEX_PASS,      // not part of a Knot request, forward it
+  KNOT_SYSEX_CONSUMED,  // part of a request still in progress
+  KNOT_SYSEX_REQUEST,   // a request is complete, see parser command and valid
+};
+
+typedef struct
+{
+  uint8_t state;
+  uint8_t command;
+  uint8_t msbs;         // top bits of the current packed group
+  uint8_t group;        // bytes of the current packed group seen, 0 means the msbs byte is next
+  bool valid;           // the request was well formed, for a config write: the staging config is complete
+  _Atomic bool busy;    // the completed request is still being answered, later ones are skipped
+  struct knot_config *staging;
+  knot_config_decoder_t decoder;
+} knot_sysex_parser_t;
+
+typedef void (*knot_sysex_send_fn)(void *ctx, const uint8_t *bytes, size_t length);
+
+typedef struct
+{
+  knot_sysex_send_fn send;
+  void *ctx;
+  uint8_t group[8];
+  uint8_t fill;
+} knot_sysex_writer_t;
+
+/**
+ * One input that accepts requests, replies go out through send on the same port.
+ */
+typedef struct
+{
+  knot_sysex_parser_t parser;
+  struct knot_config staging;
+  knot_sysex_send_fn send;
+  void *ctx;
+} knot_sysex_port_t;
+
+/**
+ * @brief Reset a parser
+ * @param[out] parser parser, one per input port
+ * @param[in] staging config a config write is decoded into, owned by the port
+ */
+void knot_sysex_parser_init(knot_sysex_parser_t *parser, struct knot_config *staging);
+
+/**
+ * @brief Feed the next packet received on the port
+ * @param[in] parser parser
+ * @param[in] packet 1-3 byte message or SysEx chunk
+ *
+ * @return KNOT_SYSEX_PASS if the packet has to be forwarded as usual
+ */
+enum knot_sysex_feed_result knot_sysex_feed(knot_sysex_parser_t *parser, struct uart_midi_event_packet packet);
+
+/**
+ * @brief Set up a port
+ * @param[out] port port
+ * @param[in] send writes reply bytes to the port, may block until there is room
+ * @param[in] ctx passed to send
+ */
+void knot_sysex_port_init(knot_sysex_port_t *port, knot_sysex_send_fn send, void *ctx);
+
+/**
+ * @brief Drop a request in progress, e.g. because its sender went away, one being answered stays busy
+ * @param[in] port port
+ */
+void knot_sysex_port_reset(knot_sysex_port_t *port);
+
+/**
+ * @brief The completed request is answered later, by another task, the port is busy until then
+ * @param[in] port port
+ */
+void knot_sysex_port_defer(knot_sysex_port_t *port);
+
+/**
+ * @brief The deferred request was answered, the port takes the next one
+ * @param[in] port port
+ */
+void knot_sysex_port_done(knot_sysex_port_t *port);
+
+/**
+ * @brief Start a reply
+ * @param[out] writer writer
+ * @param[in] send called with consecutive pieces of the reply, may block until the port has room
+ * @param[in] ctx passed to send
+ * @param[in] command request command being answered
+ * @param[in] status enum knot_sysex_status
+ */
+void knot_sysex_reply_begin(knot_sysex_writer_t *writer, knot_sysex_send_fn send, void *ctx, uint8_t command, uint8_t status);
+
+/**
+ * @brief Append payload bytes to a reply, packed 7 to 8
+ * @param[in] writer writer
+ * @param[in] data payload bytes
+ * @param[in] length number of bytes
+ */
+void knot_sysex_reply_write(knot_sysex_writer_t *writer, const uint8_t *data, size_t length);
+
+/**
+ * @brief Append a uint32 little endian to a reply
+ * @param[in] writer writer
+ * @param[in] value value
+ */
+void knot_sysex_reply_write_u32(knot_sysex_writer_t *writer, uint32_t value);
+
+/**
+ * @brief Finish a reply with F7
+ * @param[in] writer writer
+ */
+void knot_sysex_reply_end(knot_sysex_writer_t *writer);
+
+
+#ifdef __cplusplus
+}
+#endif
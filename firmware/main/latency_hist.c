@@ -0,0 +1,90 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "latency_hist.h"
+
+#define LATENCY_HIST_SUB_MASK ((1UL << LATENCY_HIST_SUB_BITS) - 1)
+
+static uint32_t latency_hist_index(uint32_t us){
+
+  if (us > LATENCY_HIST_RANGE_US){
+    return LATENCY_HIST_BUCKETS - 1;
+  }
+  if (us <= LATENCY_HIST_SUB_MASK){
+    return us;
+  }
+
+  // the top LATENCY_HIST_SUB_BITS + 1 bits pick the bucket, the leading one is implied by the octave
+  uint32_t shift = (31 - __builtin_clz(us)) - LATENCY_HIST_SUB_BITS;
+  return ((shift + 1) << LATENCY_HIST_SUB_BITS) + ((us >> shift) & LATENCY_HIST_SUB_MASK);
+}
+
+static uint32_t latency_hist_upper(uint32_t index){
+
+  if (index <= LATENCY_HIST_SUB_MASK){
+    return index;
+  }
+
+  uint32_t shift = (index >> LATENCY_HIST_SUB_BITS) - 1;
+  uint32_t low = ((index & LATENCY_HIST_SUB_MASK) | (1UL << LATENCY_HIST_SUB_BITS)) << shift;
+  return low + (1UL << shift) - 1;
+}
+
+void latency_hist_init(latency_hist_t *hist){
+
+  for (int i = 0; i < LATENCY_HIST_BUCKETS; i++){
+    atomic_store_explicit(&hist->buckets[i], 0, memory_order_relaxed);
+  }
+  atomic_store_explicit(&hist->max_us, 0, memory_order_relaxed);
+}
+
+void latency_hist_record(latency_hist_t *hist, uint32_t us){
+
+  atomic_fetch_add_explicit(&hist->buckets[latency_hist_index(us)], 1, memory_order_relaxed);
+
+  uint32_t max = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+  while (us > max && !atomic_compare_exchange_weak_explicit(&hist->max_us, &max, us, memory_order_relaxed, memory_order_relaxed)){
+  }
+}
+
+void latency_hist_summarize(latency_hist_t *hist, struct latency_hist_summary *summary){
+
+  // a copy first, samples recorded meanwhile must not move the ranks under the walk
+  uint32_t buckets[LATENCY_HIST_BUCKETS];
+  uint32_t count = 0;
+  for (int i = 0; i < LATENCY_HIST_BUCKETS; i++){
+    buckets[i] = atomic_load_explicit(&hist->buckets[i], memory_order_relaxed);
+    count += buckets[i];
+  }
+
+  summary->count = count;
+  summary->max_us = atomic_load_explicit(&hist->max_us, memory_order_relaxed);
+  summary->p50_us = 0;
+  summary->p99_us = 0;
+  if (count == 0){
+    return;
+  }
+
+  // rank of the sample at or below which 50% and 99% of them are, rounded up
+  uint32_t rank50 = (uint32_t)(((uint64_t)count * 50 + 99) / 100);
+  uint32_t rank99 = (uint32_t)(((uint64_t)count * 99 + 99) / 100);
+  uint32_t seen = 0;
+  for (int i = 0; i < LATENCY_HIST_BUCKETS; i++){
+    bool below50 = seen < rank50;
+    seen += buckets[i];
+    if (below50 && seen >= rank50){
+      summary->p50_us = latency_hist_upper(i);
+    }
+    if (seen >= rank99){
+      summary->p99_us = latency_hist_upper(i);
+      break;
+    }
+  }
+
+  // a bucket bound can lie above the largest sample
+  if (summary->p50_us > summary->max_us){
+    summary->p50_us = summary->max_us;
+  }
+  if (summary->p99_us > summary->max_us){
+    summary->p99_us = summary->max_us;
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Lock-free latency histogram in microseconds.
+ *
+ * Buckets are log-linear: every power of two is split into
+ * 2^LATENCY_HIST_SUB_BITS buckets, so a percentile read back is within
+ * 12.5% of the true value, from 1 us up to LATENCY_HIST_RANGE_US. Larger
+ * values land in the last bucket, the maximum is kept exactly. Recording
+ * is a couple of relaxed atomic adds, any task may record while another
+ * one reads a summary.
+ */
+
+#define LATENCY_HIST_SUB_BITS   3
+#define LATENCY_HIST_RANGE_BITS 24  // 16.7 s
+#define LATENCY_HIST_RANGE_US   ((1UL << LATENCY_HIST_RANGE_BITS) - 1)
+#define LATENCY_HIST_BUCKETS    ((LATENCY_HIST_RANGE_BITS - LATENCY_HIST_SUB_BITS + 1) << LATENCY_HIST_SUB_BITS)
+
+typedef struct
+{
+  _Atomic uint32_t buckets[LATENCY_HIST_BUCKETS];
+  _Atomic uint32_t max_us;
+} latency_hist_t;
+
+struct latency_hist_summary
+{
+  uint32_t count;
+  uint32_t p50_us;  // upper bound of the bucket holding the median
+  uint32_t p99_us;
+  uint32_t max_us;
+};
+
+/**
+ * @brief Clear every bucket
+ * @param[out] hist histogram
+ */
+void latency_hist_init(latency_hist_t *hist);
+
+/**
+ * @brief Count one sample
+ * @param[in] hist histogram
+ * @param[in] us latency in microseconds
+ */
+void latency_hist_record(latency_hist_t *hist, uint32_t us);
+
+/**
+ * @brief Percentiles of everything recorded so far
+ * @param[in] hist histogram
+ * @param[out] summary count, p50, p99 and max, all zero if nothing was recorded
+ */
+void latency_hist_summarize(latency_hist_t *hist, struct latency_hist_summary *summary);
+
+
+#ifdef __cplusplus
+}
+#endif
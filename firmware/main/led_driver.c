@@ -6,8 +6,10 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
+#include "freertos/task.h"
 #include "esp_log.h"
 
 
@@ -25,42 +27,54 @@
 static uint8_t led_strip_pixels[EXAMPLE_LED_NUMBERS * 3];
 
 
+//Set by the USB and UART paths, counted down by the LED task
+static _Atomic uint8_t tx_led_timer = 0;
+static _Atomic uint8_t rx_led_timer = 0;
+static _Atomic uint8_t err_led_timer = 0;
 
-volatile uint8_t tx_led_timer = 0;
-volatile uint8_t rx_led_timer = 0;
-volatile uint8_t err_led_timer = 0;
+static _Atomic uint8_t connected = 0;
 
-volatile uint8_t connected = 0;
+//The LED task sleeps on a notification while nothing animates, the first event after that wakes it
+static TaskHandle_t led_task_hdl = NULL;
+static atomic_bool led_task_idle = false;
+
+static inline void led_wake(void)
+{
+    //Only one caller wins the exchange, every other event stays a single store
+    if (atomic_load(&led_task_idle) && atomic_exchange(&led_task_idle, false)) {
+        xTaskNotifyGive(led_task_hdl);
+    }
+}
 
 void led_tx_effect_start(void)
 {
-   
-    tx_led_timer = 10;
+    atomic_store(&tx_led_timer, 10);
+    led_wake();
 }
 
 void led_rx_effect_start(void)
 {
-   
-    rx_led_timer = 10;
+    atomic_store(&rx_led_timer, 10);
+    led_wake();
 }
 
 void led_err_effect_start(void)
 {
-   
-    err_led_timer = 10;
+    atomic_store(&err_led_timer, 10);
+    led_wake();
 }
 
 
 void led_connect_effect_start(void)
 {
-   
-    connected = 1;
+    atomic_store(&connected, 1);
+    led_wake();
 }
 
 void led_disconnect_effect_start(void)
 {
-   
-    connected = 0;
+    atomic_store(&connected, 0);
+    led_wake();
 }
 
 
@@ -123,10 +137,6 @@ void led_task(void *arg)
     ESP_LOGI(TAG, "Init LED");
 
 
-    uint32_t red = 0;
-    uint32_t green = 0;
-    uint32_t blue = 0;
-
     ESP_LOGI(TAG, "Create RMT TX channel");
     rmt_channel_handle_t led_chan = NULL;
     rmt_tx_channel_config_t tx_chan_config = {
@@ -155,83 +165,87 @@ void led_task(void *arg)
     };
 
 
+    led_task_hdl = xTaskGetCurrentTaskHandle();
+
     uint8_t wainting_animation_direction = 0;
     uint8_t wainting_animation = 0;
+    uint8_t pixels[sizeof(led_strip_pixels)];
+
+    //Nothing was sent yet, the first frame always goes out
+    memset(led_strip_pixels, 0xFF, sizeof(led_strip_pixels));
 
     while (1) {
 
-        if (wainting_animation_direction == 0){
-            wainting_animation++;
-            if (wainting_animation == 150){
-                wainting_animation_direction = 1;
+        uint8_t is_connected = atomic_load(&connected);
+
+        if (!is_connected) {
+            if (wainting_animation_direction == 0){
+                wainting_animation++;
+                if (wainting_animation == 150){
+                    wainting_animation_direction = 1;
+                }
             }
-        }
-        else{
-            wainting_animation--;
-            if (wainting_animation == 0){
-                wainting_animation_direction = 0;
+            else{
+                wainting_animation--;
+                if (wainting_animation == 0){
+                    wainting_animation_direction = 0;
+                }
             }
         }
 
-
-
-        //ESP_LOGI(TAG, "Update LED");
-
-
-        led_strip_pixels[0 * 3 + 0] = green;
-        led_strip_pixels[0 * 3 + 1] = blue;
-        led_strip_pixels[0 * 3 + 2] = red;
-
-        if (tx_led_timer>0){
-
-            tx_led_timer--;
-
-            led_strip_pixels[2 * 3 + 0] = tx_led_timer*4;
-            led_strip_pixels[2 * 3 + 1] = tx_led_timer*4;
-            led_strip_pixels[2 * 3 + 2] = tx_led_timer*4;      
-
+        //A timer set again in between loses at most one step of its fade
+        uint8_t tx_timer = atomic_load(&tx_led_timer);
+        if (tx_timer > 0) {
+            atomic_store(&tx_led_timer, --tx_timer);
         }
-        else{
-
-            led_strip_pixels[2 * 3 + 0] = 0;
-            led_strip_pixels[2 * 3 + 1] = 0;
-            led_strip_pixels[2 * 3 + 2] = 0;            
-        }        
-        
-        if (rx_led_timer>0){
-
-            rx_led_timer--;
-
-            led_strip_pixels[1 * 3 + 0] = rx_led_timer*6;
-            led_strip_pixels[1 * 3 + 1] = rx_led_timer*6;
-            led_strip_pixels[1 * 3 + 2] = rx_led_timer*6;      
-
+        uint8_t rx_timer = atomic_load(&rx_led_timer);
+        if (rx_timer > 0) {
+            atomic_store(&rx_led_timer, --rx_timer);
         }
-        else{
-
-            led_strip_pixels[1 * 3 + 0] = 0;
-            led_strip_pixels[1 * 3 + 1] = 0;
-            led_strip_pixels[1 * 3 + 2] = 0;            
+        uint8_t err_timer = atomic_load(&err_led_timer);
+        if (err_timer > 0) {
+            atomic_store(&err_led_timer, --err_timer);
         }
 
-        if (err_led_timer>0){
-
-            err_led_timer--;
+        pixels[2 * 3 + 0] = tx_timer*4;
+        pixels[2 * 3 + 1] = tx_timer*4;
+        pixels[2 * 3 + 2] = tx_timer*4;
 
-            led_strip_pixels[0 * 3 + 0] = connected*50;
-            led_strip_pixels[0 * 3 + 1] = err_led_timer*3;
-            led_strip_pixels[0 * 3 + 2] = 0;      
+        pixels[1 * 3 + 0] = rx_timer*6;
+        pixels[1 * 3 + 1] = rx_timer*6;
+        pixels[1 * 3 + 2] = rx_timer*6;
 
+        if (err_timer > 0){
+            pixels[0 * 3 + 0] = is_connected*50;
+            pixels[0 * 3 + 1] = err_timer*3;
+            pixels[0 * 3 + 2] = 0;
         }
         else{
+            pixels[0 * 3 + 0] = (!is_connected)*wainting_animation/2 + is_connected*50;
+            pixels[0 * 3 + 1] = (!is_connected)*wainting_animation/2;
+            pixels[0 * 3 + 2] = (!is_connected)*wainting_animation/2;
+        }
 
-            led_strip_pixels[0 * 3 + 0] = (!connected)*wainting_animation/2 + connected*50;
-            led_strip_pixels[0 * 3 + 1] = (!connected)*wainting_animation/2;
-            led_strip_pixels[0 * 3 + 2] = (!connected)*wainting_animation/2;            
+        //The RMT only fires for a frame that differs from the one on the strip
+        if (memcmp(pixels, led_strip_pixels, sizeof(pixels)) != 0) {
+            //The previous frame may still be shifting out of the buffer about to be rewritten
+            ESP_ERROR_CHECK(rmt_tx_wait_all_done(led_chan, portMAX_DELAY));
+            memcpy(led_strip_pixels, pixels, sizeof(pixels));
+            ESP_ERROR_CHECK(rmt_transmit(led_chan, led_encoder, led_strip_pixels, sizeof(led_strip_pixels), &tx_config));
         }
 
+        if (is_connected && tx_timer == 0 && rx_timer == 0 && err_timer == 0) {
+            //Static frame: sleep until an effect starts. The flag is raised before the timers are
+            //checked again, so an event in between either shows up here or leaves a notification
+            atomic_store(&led_task_idle, true);
+            if (atomic_load(&tx_led_timer) == 0 && atomic_load(&rx_led_timer) == 0 &&
+                atomic_load(&err_led_timer) == 0 && atomic_load(&connected)) {
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            }
+            atomic_store(&led_task_idle, false);
+            continue;
+        }
 
-        ESP_ERROR_CHECK(rmt_transmit(led_chan, led_encoder, led_strip_pixels, sizeof(led_strip_pixels), &tx_config));
         vTaskDelay(pdMS_TO_TICKS(EXAMPLE_CHASE_SPEED_MS));
 
     }
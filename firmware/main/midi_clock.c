@@ -0,0 +1,75 @@
+#include <stdint.h>
+#include "midi_clock.h"
+
+void midi_clock_init(midi_clock_t *clock, uint32_t period){
+
+  clock->deadline = 0;
+  clock->pulses = 0;
+  clock->pulses_skipped = 0;
+  atomic_store_explicit(&clock->period, period, memory_order_release);
+}
+
+void midi_clock_start(midi_clock_t *clock, uint64_t now_us){
+
+  clock->deadline = now_us << MIDI_CLOCK_FRAC_BITS;
+}
+
+void midi_clock_set_period(midi_clock_t *clock, uint32_t period){
+
+  atomic_store_explicit(&clock->period, period, memory_order_release);
+}
+
+uint32_t midi_clock_get_period(midi_clock_t *clock){
+
+  return atomic_load_explicit(&clock->period, memory_order_acquire);
+}
+
+uint64_t midi_clock_deadline_us(const midi_clock_t *clock){
+
+  return clock->deadline >> MIDI_CLOCK_FRAC_BITS;
+}
+
+uint64_t midi_clock_advance(midi_clock_t *clock, uint64_t now_us){
+
+  uint32_t period = atomic_load_explicit(&clock->period, memory_order_acquire);
+  if (period == 0){
+    period = 1;
+  }
+
+  clock->pulses++;
+  clock->deadline += period;
+
+  // fell a full period behind: skip pulses rather than bursting them out, the phase stays on the grid
+  while ((clock->deadline >> MIDI_CLOCK_FRAC_BITS) <= now_us){
+    clock->deadline += period;
+    clock->pulses_skipped++;
+  }
+
+  return clock->deadline >> MIDI_CLOCK_FRAC_BITS;
+}
+
+static uint32_t midi_clock_period_clamp(uint64_t period){
+
+  return period > MIDI_CLOCK_PERIOD_MAX ? MIDI_CLOCK_PERIOD_MAX : (uint32_t)period;
+}
+
+uint32_t midi_clock_period_from_ppm(uint32_t pulses_per_minute){
+
+  if (pulses_per_minute == 0){
+    return MIDI_CLOCK_PERIOD_MAX;
+  }
+  return midi_clock_period_clamp(((uint64_t)60 * 1000000 << MIDI_CLOCK_FRAC_BITS) / pulses_per_minute);
+}
+
+uint32_t midi_clock_apply_fine(uint32_t period, int16_t fine){
+
+  // mapping the 7-bit fine to +/- 8% - the subtraction reverses it, higher values mean faster tempo
+  int64_t delta = (int64_t)period * fine * 8 / (63 * 100);
+  return midi_clock_period_clamp((uint64_t)((int64_t)period - delta));
+}
+
+uint32_t midi_clock_bend(uint32_t period, uint8_t divisor, bool slower){
+
+  uint32_t bend = period / divisor;
+  return slower ? midi_clock_period_clamp((uint64_t)period + bend) : period - bend;
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+  MIDI clock engine
+
+  Pulses are scheduled on absolute deadlines: every pulse adds the period
+  to the previous deadline instead of restarting a timer, so rounding never
+  accumulates and a tempo change takes effect from the next pulse without
+  resetting the phase. Periods and deadlines carry MIDI_CLOCK_FRAC_BITS
+  fractional bits of a microsecond.
+
+*/
+
+#define MIDI_CLOCK_FRAC_BITS 12 // 1/4096 us resolution, periods up to ~1 s
+#define MIDI_CLOCK_PPQN      24 // as per MIDI clock spec
+#define MIDI_CLOCK_BPM_MIN   3  // slowest tempo whose period fits, the fine offset included
+#define MIDI_CLOCK_BPM_MAX   1000 // fastest tempo, its F8 bytes take a seventh of the TRS wire with the fine offset
+#define MIDI_CLOCK_PERIOD_MAX UINT32_MAX
+
+typedef struct
+{
+  uint64_t deadline;          // next pulse, fixed point microseconds on the timer time base
+  _Atomic uint32_t period;    // fixed point microseconds per pulse, may be written from any task
+  uint32_t pulses;            // pulses emitted
+  uint32_t pulses_skipped;    // pulses dropped because the engine fell a full period behind
+} midi_clock_t;
+
+/**
+ * @brief Initialize the engine
+ * @param[out] clock engine
+ * @param[in] period fixed point microseconds per pulse
+ */
+void midi_clock_init(midi_clock_t *clock, uint32_t period);
+
+/**
+ * @brief Schedule the first pulse
+ * @param[in] clock engine
+ * @param[in] now_us current time on the timer time base
+ */
+void midi_clock_start(midi_clock_t *clock, uint64_t now_us);
+
+/**
+ * @brief Change the tempo, phase continuous: the pulse in flight keeps its deadline
+ * @param[in] clock engine
+ * @param[in] period fixed point microseconds per pulse
+ */
+void midi_clock_set_period(midi_clock_t *clock, uint32_t period);
+
+/**
+ * @brief Current period in fixed point microseconds per pulse
+ * @param[in] clock engine
+ */
+uint32_t midi_clock_get_period(midi_clock_t *clock);
+
+/**
+ * @brief Deadline of the next pulse in whole microseconds, rounded down
+ * @param[in] clock engine
+ */
+uint64_t midi_clock_deadline_us(const midi_clock_t *clock);
+
+/**
+ * @brief Account for the pulse that was just emitted and schedule the next one
+ * @param[in] clock engine
+ * @param[in] now_us current time on the timer time base
+ *
+ * @return deadline of the next pulse in whole microseconds, always later than now_us
+ */
+uint64_t midi_clock_advance(midi_clock_t *clock, uint64_t now_us);
+
+/**
+ * @brief Fixed point period of a pulse rate
+ * @param[in] pulses_per_minute clock pulses per minute (BPM * 24)
+ *
+ * @return MIDI_CLOCK_PERIOD_MAX for rates below MIDI_CLOCK_BPM_MIN that do not fit
+ */
+uint32_t midi_clock_period_from_ppm(uint32_t pulses_per_minute);
+
+/**
+ * @brief Scale a period by a fine tempo offset
+ * @param[in] period fixed point microseconds per pulse
+ * @param[in] fine -63..63 maps to -8%..+8% tempo, the period shrinks as fine grows
+ */
+uint32_t midi_clock_apply_fine(uint32_t period, int16_t fine);
+
+/**
+ * @brief Lengthen or shorten a period by a fraction of it, for a tempo bend
+ * @param[in] period fixed point microseconds per pulse
+ * @param[in] divisor the period changes by 1/divisor, at least 1
+ * @param[in] slower lengthen the period instead of shortening it
+ *
+ * @return the bent period, MIDI_CLOCK_PERIOD_MAX at most
+ */
+uint32_t midi_clock_bend(uint32_t period, uint8_t divisor, bool slower);
+
+
+#ifdef __cplusplus
+}
+#endif
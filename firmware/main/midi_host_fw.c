@@ -9,6 +9,7 @@
 #include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_intr_alloc.h"
+#include "nvs_flash.h"
 #include "usb/usb_host.h"
 
 #include <string.h>
@@ -17,19 +18,37 @@
 
 #include "driver/gpio.h"
 
+#include "class_driver.h"
+#include "clock_driver.h"
+#include "midi_tx_scheduler.h"
+#include "config_driver.h"
+#include "sysex_driver.h"
+#include "midi_pipeline.h"
+
+// Core affinity plan: the USB host library and class driver share one core,
+// the TRS side (UART tasks, MIDI clock) runs on the other so the 31250 baud
+// path never waits behind USB event handling. Messages cross between the
+// cores through single producer rings only.
+#define USB_CORE    CONFIG_KNOT_USB_CORE
+#define MIDI_CORE   CONFIG_KNOT_MIDI_CORE
+
 #define DAEMON_TASK_PRIORITY    3
 #define CLASS_TASK_PRIORITY     4
 #define LED_TASK_PRIORITY       2
+#define TRACE_TASK_PRIORITY     1
+#define LATENCY_REPORT_TASK_PRIORITY    1
+#define SYSEX_TASK_PRIORITY     1   //Configuration requests, NVS writes and replies that wait for room
 
 #define UART_RX_TASK_PRIORITY      12
-#define UART_HOUSEKEEPING_TASK_PRIORITY      11
 
 extern void class_driver_task(void *arg);
 extern void led_task(void *arg);
 
-extern void uart_init(void);
 extern void uart_rx_task(void *arg);
-extern void uart_housekeeping_task(void *arg);
+extern void uart_get_tx_stats(enum midi_tx_lane lane, struct midi_tx_lane_stats *stats);
+
+extern void trace_init(void);
+extern void trace_task(void *arg);
 
 static const char *TAG = "DAEMON";
 
@@ -69,6 +88,86 @@ static void host_lib_daemon_task(void *arg)
     vTaskSuspend(NULL);
 }
 
+#ifdef CONFIG_KNOT_LATENCY_REPORT
+
+#define LATENCY_REPORT_PERIOD_MS 5000
+
+static const char *path_names[MIDI_PIPELINE_PATH_COUNT] = {
+    [MIDI_PIPELINE_PATH_USB_TO_TRS] = "usb -> trs",
+    [MIDI_PIPELINE_PATH_TRS_TO_USB] = "trs -> usb",
+    [MIDI_PIPELINE_PATH_CLOCK] = "clock",
+};
+
+static const char *tx_lane_names[MIDI_TX_LANE_COUNT] = {
+    [MIDI_TX_LANE_CLOCK] = "clock",
+    [MIDI_TX_LANE_REALTIME] = "realtime",
+    [MIDI_TX_LANE_NORMAL] = "normal",
+    [MIDI_TX_LANE_REPLY] = "reply",
+};
+
+//Logs the worst case latencies of every path so builds with different core plans can be compared under the same load
+static void latency_report_task(void *arg)
+{
+    ESP_LOGI(TAG, "Latency report, USB on core %d, UART and clock on core %d", USB_CORE, MIDI_CORE);
+
+    for (;;) {
+
+        vTaskDelay(pdMS_TO_TICKS(LATENCY_REPORT_PERIOD_MS));
+
+        for (int path = 0; path < MIDI_PIPELINE_PATH_COUNT; path++) {
+            struct latency_hist_summary summary;
+            latency_hist_summarize(&midi_pipeline.latency[path], &summary);
+            ESP_LOGI(TAG, "%-10s: p50 %lu us, p99 %lu us, max %lu us over %lu messages",
+                     path_names[path],
+                     (unsigned long)summary.p50_us,
+                     (unsigned long)summary.p99_us,
+                     (unsigned long)summary.max_us,
+                     (unsigned long)summary.count);
+        }
+
+        struct clock_driver_stats clock_stats;
+        clock_driver_get_stats(&clock_stats);
+        ESP_LOGI(TAG, "clock wake: max %lu us, avg %lu us over %lu pulses",
+                 (unsigned long)clock_stats.wake_latency_max_us,
+                 (unsigned long)(clock_stats.pulses ? clock_stats.wake_latency_total_us / clock_stats.pulses : 0),
+                 (unsigned long)clock_stats.pulses);
+
+        for (int lane = 0; lane < MIDI_TX_LANE_COUNT; lane++) {
+            struct midi_tx_lane_stats tx_stats;
+            uart_get_tx_stats(lane, &tx_stats);
+            ESP_LOGI(TAG, "trs out %-8s: wait max %lu us, depth max %lu, sent %lu, dropped %lu, coalesced %lu",
+                     tx_lane_names[lane],
+                     (unsigned long)tx_stats.wait_max_us,
+                     (unsigned long)tx_stats.depth_max,
+                     (unsigned long)tx_stats.messages,
+                     (unsigned long)tx_stats.dropped,
+                     (unsigned long)tx_stats.coalesced);
+        }
+
+        struct usb_midi_out_stats out_stats;
+        usb_midi_out_get_stats(&out_stats);
+        ESP_LOGI(TAG, "usb out: transfer max %lu us, avg %lu us over %lu transfers, queue depth max %lu",
+                 (unsigned long)out_stats.transfer_latency_max_us,
+                 (unsigned long)(out_stats.transfers_submitted ? out_stats.transfer_latency_total_us / out_stats.transfers_submitted : 0),
+                 (unsigned long)out_stats.transfers_submitted,
+                 (unsigned long)out_stats.queue_depth_max);
+
+        struct usb_midi_in_stats in_stats;
+        usb_midi_in_get_stats(&in_stats);
+        ESP_LOGI(TAG, "usb in: endpoint idle max %lu us, avg %lu us over %lu gaps, %lu transfers",
+                 (unsigned long)in_stats.idle_max_us,
+                 (unsigned long)(in_stats.idle_count ? in_stats.idle_total_us / in_stats.idle_count : 0),
+                 (unsigned long)in_stats.idle_count,
+                 (unsigned long)in_stats.transfers_completed);
+        ESP_LOGI(TAG, "usb in: throttled for TRS out %lu times, max %lu us, total %llu us",
+                 (unsigned long)in_stats.throttled,
+                 (unsigned long)in_stats.throttled_max_us,
+                 (unsigned long long)in_stats.throttled_total_us);
+    }
+}
+
+#endif
+
 void app_main(void)
 {
     
@@ -88,15 +187,59 @@ void app_main(void)
 
 
 
+    //Settings and routing rules live in NVS, start over with an empty partition if its layout changed
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_ERROR_CHECK(nvs_flash_erase());
+        err = nvs_flash_init();
+    }
+    ESP_ERROR_CHECK(err);
+    config_driver_init();
+
+    //Every task below feeds or drains the pipeline, it starts out with the loaded configuration
+    midi_pipeline_init(&midi_pipeline);
+
+    //Requests the pipeline hands over are answered here, away from the forwarding tasks
+    sysex_driver_init();
+    xTaskCreatePinnedToCore(sysex_driver_task,
+                            "sysex",
+                            4096,
+                            NULL,
+                            SYSEX_TASK_PRIORITY,
+                            NULL,
+                            USB_CORE);
+
     SemaphoreHandle_t signaling_sem = xSemaphoreCreateBinary();
 
+    clock_driver_init();
+
+#ifdef CONFIG_KNOT_TRACE_RING
+    trace_init();
+    xTaskCreatePinnedToCore(trace_task,
+                            "trace",
+                            3072,
+                            NULL,
+                            TRACE_TASK_PRIORITY,
+                            NULL,
+                            USB_CORE);
+#endif
+
+#ifdef CONFIG_KNOT_LATENCY_REPORT
+    xTaskCreatePinnedToCore(latency_report_task,
+                            "latency",
+                            3072,
+                            NULL,
+                            LATENCY_REPORT_TASK_PRIORITY,
+                            NULL,
+                            USB_CORE);
+#endif
+
 
     TaskHandle_t daemon_task_hdl;
     TaskHandle_t class_driver_task_hdl;
     TaskHandle_t led_task_hdl;
 
     TaskHandle_t uart_rx_task_hdl;
-    TaskHandle_t uart_housekeeping_task_hdl;
     //Create daemon task
     xTaskCreatePinnedToCore(host_lib_daemon_task,
                             "daemon",
@@ -104,7 +247,7 @@ void app_main(void)
                             (void *)signaling_sem,
                             DAEMON_TASK_PRIORITY,
                             &daemon_task_hdl,
-                            0);
+                            USB_CORE);
     //Create the class driver task
     xTaskCreatePinnedToCore(class_driver_task,
                             "class",
@@ -112,7 +255,7 @@ void app_main(void)
                             (void *)signaling_sem,
                             CLASS_TASK_PRIORITY,
                             &class_driver_task_hdl,
-                            0);
+                            USB_CORE);
 
     //Create the class driver task
     xTaskCreatePinnedToCore(led_task,
@@ -121,30 +264,20 @@ void app_main(void)
                             (void *)signaling_sem,
                             LED_TASK_PRIORITY,
                             &led_task_hdl,
-                            0);
+                            USB_CORE);
 
 
-    //Create a task to handler UART event from ISR
+    //Create a task to handle UART input, it allocates the UART interrupt on the MIDI core and TRS out runs in there
 
     vTaskDelay(10);     //Add a short delay to let the tasks run
 
-    uart_init();
-
     xTaskCreatePinnedToCore(uart_rx_task, 
                             "uart_rx", 
-                            2048, 
+                            3072, 
                             (void *)signaling_sem, 
                             UART_RX_TASK_PRIORITY, 
                             &uart_rx_task_hdl,
-                            0);
-
-    xTaskCreatePinnedToCore(uart_housekeeping_task, 
-                            "uart_rx_decode", 
-                            2048, 
-                            (void *)signaling_sem, 
-                            UART_HOUSEKEEPING_TASK_PRIORITY, 
-                            &uart_housekeeping_task_hdl,
-                            0);
+                            MIDI_CORE);
 
     //Wait for the tasks to complete
     for (int i = 0; i < 2; i++) {
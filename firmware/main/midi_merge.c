@@ -0,0 +1,173 @@
+#include <stdint.h>
+#include "midi_merge.h"
+
+static inline bool midi_merge_is_realtime(const struct uart_midi_event_packet *packet){
+
+  return packet->length == 1 && packet->byte1 >= 0xF8;
+}
+
+static inline uint8_t midi_merge_last_byte(const struct uart_midi_event_packet *packet){
+
+  return packet->length == 1 ? packet->byte1 : packet->length == 2 ? packet->byte2 : packet->byte3;
+}
+
+static inline bool midi_merge_may_emit(const midi_merge_t *merge, uint8_t source){
+
+  return merge->sysex_owner == MIDI_MERGE_NO_OWNER || merge->sysex_owner == source;
+}
+
+static void midi_merge_hold(midi_merge_t *merge, uint8_t source, const struct uart_midi_event_packet *packet){
+
+  // fits as long as held sources wait for midi_merge_is_held, see midi_merge.h
+  merge->held[merge->held_count].packet = *packet;
+  merge->held[merge->held_count].source = source;
+  merge->held_count++;
+  merge->held_per_source[source]++;
+}
+
+// Emit one packet and track which source, if any, is in the middle of a SysEx
+static void midi_merge_emit(midi_merge_t *merge, uint8_t source, const struct uart_midi_event_packet *packet,
+                            struct uart_midi_event_packet *out, size_t *count, uint32_t now_us){
+
+  out[(*count)++] = *packet;
+
+  if (midi_merge_is_realtime(packet)){
+    return;
+  }
+
+  if (packet->byte1 == 0xF0){
+    merge->sysex_owner = source;
+    merge->owner_seen_us = now_us;
+  }
+  else if (packet->byte1 > 0x7F){
+    // any other status byte ends a SysEx of this source
+    merge->sysex_owner = MIDI_MERGE_NO_OWNER;
+    return;
+  }
+
+  if (merge->sysex_owner == source && midi_merge_last_byte(packet) == 0xF7){
+    merge->sysex_owner = MIDI_MERGE_NO_OWNER;
+  }
+}
+
+// Emit held packets in arrival order, a source stays in order behind its first packet that has to wait
+static void midi_merge_release(midi_merge_t *merge, struct uart_midi_event_packet *out, size_t *count, size_t capacity,
+                               uint32_t now_us){
+
+  bool progress = true;
+
+  while (progress && merge->held_count > 0 && *count < capacity){
+
+    uint8_t waiting = 0; // bit per source with a packet kept in this pass
+    uint8_t kept = 0;
+    progress = false;
+
+    for (uint8_t i = 0; i < merge->held_count; i++){
+
+      struct midi_merge_held entry = merge->held[i];
+      uint8_t bit = 1 << entry.source;
+
+      if (!(waiting & bit) && *count < capacity && midi_merge_may_emit(merge, entry.source)){
+        midi_merge_emit(merge, entry.source, &entry.packet, out, count, now_us);
+        merge->held_per_source[entry.source]--;
+        progress = true;
+      }
+      else {
+        waiting |= bit;
+        merge->held[kept++] = entry;
+      }
+    }
+
+    merge->held_count = kept;
+  }
+}
+
+void midi_merge_init(midi_merge_t *merge){
+
+  merge->held_count = 0;
+  for (int i = 0; i < MIDI_MERGE_MAX_SOURCES; i++){
+    merge->held_per_source[i] = 0;
+  }
+  merge->sysex_owner = MIDI_MERGE_NO_OWNER;
+  merge->owner_seen_us = 0;
+  merge->owner_timeouts = 0;
+}
+
+size_t midi_merge_push(midi_merge_t *merge, uint8_t source, const struct uart_midi_event_packet *packets, size_t count,
+                       struct uart_midi_event_packet *out, size_t capacity, uint32_t now_us){
+
+  size_t emitted = 0;
+
+  midi_merge_release(merge, out, &emitted, capacity, now_us);
+
+  for (size_t i = 0; i < count; i++){
+
+    const struct uart_midi_event_packet *packet = &packets[i];
+
+    if (midi_merge_is_realtime(packet) && emitted < capacity){
+      out[emitted++] = *packet;
+      continue;
+    }
+
+    if (!midi_merge_may_emit(merge, source) || merge->held_per_source[source] > 0 || emitted >= capacity){
+      midi_merge_hold(merge, source, packet);
+      continue;
+    }
+
+    midi_merge_emit(merge, source, packet, out, &emitted, now_us);
+
+    if (merge->sysex_owner == MIDI_MERGE_NO_OWNER && merge->held_count > 0){
+      midi_merge_release(merge, out, &emitted, capacity, now_us);
+    }
+  }
+
+  if (merge->sysex_owner == source){
+    merge->owner_seen_us = now_us;
+  }
+
+  return emitted;
+}
+
+bool midi_merge_is_held(const midi_merge_t *merge, uint8_t source){
+
+  return merge->held_per_source[source] > 0;
+}
+
+size_t midi_merge_expire(midi_merge_t *merge, uint32_t now_us, struct uart_midi_event_packet *out, size_t capacity){
+
+  size_t emitted = 0;
+
+  if (merge->sysex_owner == MIDI_MERGE_NO_OWNER || now_us - merge->owner_seen_us < MIDI_MERGE_OWNER_TIMEOUT_US){
+    return 0;
+  }
+
+  // the next status byte of another source ends the unfinished SysEx on the wire
+  merge->sysex_owner = MIDI_MERGE_NO_OWNER;
+  merge->owner_timeouts++;
+  midi_merge_release(merge, out, &emitted, capacity, now_us);
+
+  return emitted;
+}
+
+size_t midi_merge_remove_source(midi_merge_t *merge, uint8_t source, struct uart_midi_event_packet *out, size_t capacity,
+                                uint32_t now_us){
+
+  size_t emitted = 0;
+  uint8_t kept = 0;
+
+  for (uint8_t i = 0; i < merge->held_count; i++){
+    if (merge->held[i].source != source){
+      merge->held[kept++] = merge->held[i];
+    }
+  }
+  merge->held_count = kept;
+  merge->held_per_source[source] = 0;
+
+  if (merge->sysex_owner == source){
+    merge->sysex_owner = MIDI_MERGE_NO_OWNER;
+  }
+
+  midi_merge_release(merge, out, &emitted, capacity, now_us);
+
+  return emitted;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "midi_translator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Merges the message streams of several USB devices into the single TRS output.
+ *
+ * Packets are emitted in the order they are pushed, which is the order the
+ * IN transfers completed. The one exception is SysEx: once a source starts a
+ * SysEx, other sources' packets are held back until it ends, because any
+ * status byte in the middle would cut it short. Real-time packets are never
+ * held.
+ *
+ * A source with held packets does not push again until midi_merge_is_held
+ * says so; its caller keeps the rest of its input back instead, the IN
+ * worker by parking the transfers of that device. Each source then holds at
+ * most one push, so the hold never runs out. A source that stops sending
+ * for MIDI_MERGE_OWNER_TIMEOUT_US in the middle of its SysEx loses it, see
+ * midi_merge_expire.
+ */
+
+#define MIDI_MERGE_MAX_SOURCES      4
+#define MIDI_MERGE_MAX_PUSH         32  // packets of one midi_merge_push, a full IN transfer routed
+#define MIDI_MERGE_HOLD_SIZE        ((MIDI_MERGE_MAX_SOURCES - 1) * MIDI_MERGE_MAX_PUSH) // every source but the owner held
+#define MIDI_MERGE_OWNER_TIMEOUT_US 500000  // silence of the SysEx owner before the others go again
+#define MIDI_MERGE_NO_OWNER         0xFF
+
+struct midi_merge_held
+{
+  struct uart_midi_event_packet packet;
+  uint8_t source;
+};
+
+typedef struct
+{
+  struct midi_merge_held held[MIDI_MERGE_HOLD_SIZE];
+  uint8_t held_count;
+  uint8_t held_per_source[MIDI_MERGE_MAX_SOURCES];
+  uint8_t sysex_owner;      // source in the middle of a SysEx or MIDI_MERGE_NO_OWNER
+  uint32_t owner_seen_us;   // latest push of the owner
+  uint32_t owner_timeouts;  // SysEx given up because the owner went silent
+} midi_merge_t;
+
+/**
+ * @brief Reset the merger
+ * @param[out] merge merger
+ */
+void midi_merge_init(midi_merge_t *merge);
+
+/**
+ * @brief Merge the packets of one source into the output stream
+ * @param[in] merge merger
+ * @param[in] source source index, below MIDI_MERGE_MAX_SOURCES, not held
+ * @param[in] packets packets of this source in arrival order
+ * @param[in] count number of packets, up to MIDI_MERGE_MAX_PUSH
+ * @param[out] out packets ready to be sent, in order
+ * @param[in] capacity number of packets out can hold, packets that do not fit are held,
+ *            MIDI_MERGE_HOLD_SIZE + count never holds any
+ * @param[in] now_us time of the packets, in microseconds
+ *
+ * @return number of packets written to out
+ */
+size_t midi_merge_push(midi_merge_t *merge, uint8_t source, const struct uart_midi_event_packet *packets, size_t count,
+                       struct uart_midi_event_packet *out, size_t capacity, uint32_t now_us);
+
+/**
+ * @brief Whether the source has packets held back, it may not push until they went out
+ * @param[in] merge merger
+ * @param[in] source source index
+ *
+ * @return true while the source waits for another one's SysEx
+ */
+bool midi_merge_is_held(const midi_merge_t *merge, uint8_t source);
+
+/**
+ * @brief End the SysEx ownership of a source that went silent for MIDI_MERGE_OWNER_TIMEOUT_US
+ * @param[in] merge merger
+ * @param[in] now_us current time, in microseconds
+ * @param[out] out packets of other sources released by this, in order
+ * @param[in] capacity number of packets out can hold
+ *
+ * @return number of packets written to out
+ */
+size_t midi_merge_expire(midi_merge_t *merge, uint32_t now_us, struct uart_midi_event_packet *out, size_t capacity);
+
+/**
+ * @brief Forget a source that went away, ends its SysEx ownership and drops what it had held
+ * @param[in] merge merger
+ * @param[in] source source index
+ * @param[out] out packets of other sources released by this, in order
+ * @param[in] capacity number of packets out can hold
+ * @param[in] now_us current time, in microseconds
+ *
+ * @return number of packets written to out
+ */
+size_t midi_merge_remove_source(midi_merge_t *merge, uint8_t source, struct uart_midi_event_packet *out, size_t capacity,
+                                uint32_t now_us);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,466 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include "midi_pipeline.h"
+#include "midi_clock.h"
+#include "knot_hal.h"
+#include "trace_ring.h"
+
+// TRS input is parsed in slices of this many bytes, a byte completes at most one message
+#define TRS_IN_SLICE 64
+
+static void midi_pipeline_usb_reply_send(void *ctx, const uint8_t *bytes, size_t length){
+
+  // request task only, the single producer of the reply queue, it waits for room and the forwarding tasks never do
+  const struct midi_pipeline_usb_reply_route *route = ctx;
+  midi_pipeline_t *pipeline = route->pipeline;
+  struct usb_midi_event_packet packets[8];
+
+  while (length > 0){
+    size_t chunk = length < 8 ? length : 8;
+    size_t count = midi_parse_span(&pipeline->usb_reply_parser, bytes, chunk, packets, 8);
+    for (size_t i = 0; i < count; i++){
+      uint32_t word;
+      memcpy(&word, &packets[i], sizeof(word));
+      while (spsc_queue_count(&pipeline->usb_reply_queue) >= MIDI_PIPELINE_USB_REPLY_SIZE){
+        knot_hal_usb_out_wake();
+        knot_hal_yield();
+      }
+      // the source goes first, both queues are the same size so the packet always fits after it
+      spsc_queue_push(&pipeline->usb_reply_sources,
+                      route->source | (route->request_generation & MIDI_PIPELINE_USB_REPLY_GENERATION_MASK) << 8);
+      spsc_queue_push(&pipeline->usb_reply_queue, word);
+    }
+    bytes += chunk;
+    length -= chunk;
+  }
+  knot_hal_usb_out_wake();
+}
+
+static void midi_pipeline_trs_reply_send(void *ctx, const uint8_t *bytes, size_t length){
+
+  // request task only, the single producer of the reply lane; a long reply paces itself to the wire
+  midi_pipeline_t *pipeline = ctx;
+
+  while (length > 0){
+    struct uart_midi_event_packet msg = {
+      .length = length < 3 ? length : 3,
+      .byte1 = bytes[0],
+      .byte2 = length > 1 ? bytes[1] : 0,
+      .byte3 = length > 2 ? bytes[2] : 0,
+    };
+    while (midi_tx_scheduler_depth(&pipeline->tx, MIDI_TX_LANE_REPLY) >= MIDI_TX_LANE_SIZE){
+      knot_hal_trs_tx_wake();
+      knot_hal_yield();
+    }
+    midi_tx_scheduler_push_reply(&pipeline->tx, msg, knot_hal_time_us());
+    bytes += msg.length;
+    length -= msg.length;
+  }
+  knot_hal_trs_tx_wake();
+}
+
+void midi_pipeline_init(midi_pipeline_t *pipeline){
+
+  midi_merge_init(&pipeline->merge);
+  midi_parser_init(&pipeline->usb_reply_parser);
+  for (int i = 0; i < MIDI_PIPELINE_MAX_SOURCES; i++){
+    pipeline->usb_reply_routes[i].pipeline = pipeline;
+    pipeline->usb_reply_routes[i].source = i;
+    atomic_store(&pipeline->usb_reply_routes[i].generation, 0);
+    pipeline->usb_reply_routes[i].request_generation = 0;
+    knot_sysex_port_init(&pipeline->usb_ports[i], midi_pipeline_usb_reply_send, &pipeline->usb_reply_routes[i]);
+  }
+
+  midi_tx_scheduler_init(&pipeline->tx);
+  pipeline->trs_out_pulled = 0;
+
+  midi_parser_init(&pipeline->trs_parser);
+  knot_sysex_port_init(&pipeline->trs_port, midi_pipeline_trs_reply_send, pipeline);
+
+  spsc_queue_init(&pipeline->usb_out_queue, pipeline->usb_out_storage, MIDI_PIPELINE_USB_OUT_SIZE);
+  spsc_queue_init(&pipeline->usb_out_stamps, pipeline->usb_out_stamp_storage, MIDI_PIPELINE_USB_OUT_SIZE);
+  spsc_queue_init(&pipeline->usb_reply_queue, pipeline->usb_reply_storage, MIDI_PIPELINE_USB_REPLY_SIZE);
+  spsc_queue_init(&pipeline->usb_reply_sources, pipeline->usb_reply_source_storage, MIDI_PIPELINE_USB_REPLY_SIZE);
+  pipeline->usb_out_trs_in_sysex = false;
+  pipeline->usb_out_reply_active = false;
+
+  pipeline->usb_in_throttled = false;
+  atomic_store(&pipeline->usb_in_wake_armed, false);
+
+  memset((void *)&pipeline->stats, 0, sizeof(pipeline->stats));
+  for (int i = 0; i < MIDI_PIPELINE_PATH_COUNT; i++){
+    latency_hist_init(&pipeline->latency[i]);
+  }
+
+  const knot_config_snapshot_t *config = knot_hal_config_acquire();
+  pipeline->clock_base_period = midi_clock_period_from_ppm(config->config.bpm_default * MIDI_CLOCK_PPQN);
+  knot_hal_config_release(config);
+  pipeline->clock_period_pre_bend = pipeline->clock_base_period;
+  pipeline->clock_fine = 0;
+}
+
+// Packets belonging to a configuration request are never forwarded, the platform answers it from its request task
+static bool midi_pipeline_sysex_feed(knot_sysex_port_t *port, struct uart_midi_event_packet packet){
+
+  enum knot_sysex_feed_result result = knot_sysex_feed(&port->parser, packet);
+
+  if (result == KNOT_SYSEX_REQUEST){
+    knot_sysex_port_defer(port);
+    knot_hal_sysex_request(port);
+  }
+  return result != KNOT_SYSEX_PASS;
+}
+
+static uint32_t midi_pipeline_coarse_period(const struct knot_config *config, uint16_t step){
+
+  uint16_t bpm_min = config->bpm_min;
+  uint16_t bpm_max = config->bpm_max;
+  uint16_t steps = 128;
+  uint32_t pulses_per_minute = bpm_min * MIDI_CLOCK_PPQN + ((bpm_max - bpm_min) * step * MIDI_CLOCK_PPQN) / steps;
+  return midi_clock_period_from_ppm(pulses_per_minute);
+}
+
+static void midi_pipeline_clock_control(midi_pipeline_t *pipeline, const struct knot_config *config,
+                                        enum midi_route_clock clock, uint8_t value){
+
+  switch (clock){
+
+    case MIDI_ROUTE_CLOCK_COARSE:
+      pipeline->clock_base_period = midi_pipeline_coarse_period(config, value);
+      knot_hal_clock_set_period(midi_clock_apply_fine(pipeline->clock_base_period, pipeline->clock_fine));
+      break;
+
+    case MIDI_ROUTE_CLOCK_FINE:
+      pipeline->clock_fine = value - 0x3F;
+      knot_hal_clock_set_period(midi_clock_apply_fine(pipeline->clock_base_period, pipeline->clock_fine));
+      break;
+
+    case MIDI_ROUTE_CLOCK_BEND_UP:
+    case MIDI_ROUTE_CLOCK_BEND_DOWN:
+      // tempo bend; store pre-bend tempo on press, restore it on release
+      if (value == 0x7F){
+        uint32_t period = knot_hal_clock_get_period();
+        pipeline->clock_period_pre_bend = period;
+        knot_hal_clock_set_period(midi_clock_bend(period, config->bend_divisor, clock == MIDI_ROUTE_CLOCK_BEND_DOWN));
+      }
+      else if (value == 0x00){
+        knot_hal_clock_set_period(pipeline->clock_period_pre_bend);
+      }
+      break;
+
+    default:
+      break;
+  }
+}
+
+static void midi_pipeline_trs_out_push(midi_pipeline_t *pipeline, const struct uart_midi_event_packet *packets, size_t count,
+                                       uint32_t completed_us){
+
+  knot_hal_led(KNOT_HAL_LED_TX);
+
+  // a whole batch of messages is queued and wakes the TX consumer once
+  for (size_t i = 0; i < count; i++){
+    midi_tx_scheduler_push(&pipeline->tx, packets[i], completed_us);
+  }
+  knot_hal_trs_tx_wake();
+}
+
+void midi_pipeline_usb_in(midi_pipeline_t *pipeline, uint8_t source, const uint8_t *data, size_t length, uint16_t cable_mask,
+                          uint32_t completed_us){
+
+  struct uart_midi_event_packet packets[MIDI_PIPELINE_IN_MAX_PACKETS];
+  uint8_t cables[MIDI_PIPELINE_IN_MAX_PACKETS];
+  struct uart_midi_event_packet routed[MIDI_PIPELINE_IN_MAX_PACKETS * MIDI_ROUTER_MAX_OUT];
+  struct uart_midi_event_packet merged[MIDI_PIPELINE_IN_MAX_PACKETS * MIDI_ROUTER_MAX_OUT + MIDI_MERGE_HOLD_SIZE];
+
+  size_t count = usb_midi_decode_transfer_cables(data, length, cable_mask, packets, cables, MIDI_PIPELINE_IN_MAX_PACKETS);
+  pipeline->stats.usb_in_packets += count;
+
+  // A request made now is answered to this device only, the request task reads it once the port is busy
+  knot_sysex_port_t *port = &pipeline->usb_ports[source];
+  struct midi_pipeline_usb_reply_route *route = &pipeline->usb_reply_routes[source];
+  if (!atomic_load(&port->parser.busy)){
+    route->request_generation = atomic_load(&route->generation);
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++){
+    if (!midi_pipeline_sysex_feed(port, packets[i])){
+      packets[kept] = packets[i];
+      cables[kept] = cables[i];
+      kept++;
+    }
+  }
+  count = kept;
+
+  // The whole transfer is routed with one rule set, a live update applies from the next one
+  const knot_config_snapshot_t *config = knot_hal_config_acquire();
+  uint8_t ab = knot_hal_ab_switch();
+  size_t routed_count = 0;
+  for (size_t i = 0; i < count; i++){
+    TRACE_D(CLASS, TRACE_EV_USB_IN_MESSAGE, TRACE_PACK4(packets[i].length, packets[i].byte1, packets[i].byte2, packets[i].byte3));
+
+    enum midi_route_clock clock;
+    routed_count += midi_router_route(&config->router, source, cables[i], ab, packets[i], &routed[routed_count], &clock);
+    if (clock != MIDI_ROUTE_CLOCK_NONE){
+      midi_pipeline_clock_control(pipeline, &config->config, clock, packets[i].byte3);
+    }
+  }
+  knot_hal_config_release(config);
+
+  // Completions are fed in the order they happened, so the merged stream keeps that order
+  size_t merged_count = midi_merge_push(&pipeline->merge, source, routed, routed_count, merged, sizeof(merged) / sizeof(merged[0]),
+                                        completed_us);
+  if (merged_count){
+    midi_pipeline_trs_out_push(pipeline, merged, merged_count, completed_us);
+  }
+}
+
+void midi_pipeline_usb_in_remove(midi_pipeline_t *pipeline, uint8_t source){
+
+  knot_sysex_port_reset(&pipeline->usb_ports[source]);
+  // A reply still on its way belongs to the device that left, not to the next one in its slot
+  atomic_fetch_add(&pipeline->usb_reply_routes[source].generation, 1);
+
+  // Packets other devices held back behind this one's SysEx go out now
+  struct uart_midi_event_packet released[MIDI_MERGE_HOLD_SIZE];
+  uint32_t now = knot_hal_time_us();
+  size_t count = midi_merge_remove_source(&pipeline->merge, source, released, MIDI_MERGE_HOLD_SIZE, now);
+  if (count){
+    midi_pipeline_trs_out_push(pipeline, released, count, now);
+  }
+}
+
+bool midi_pipeline_usb_in_held(midi_pipeline_t *pipeline, uint8_t source){
+
+  // A device gone silent in the middle of its SysEx stops holding up the others
+  struct uart_midi_event_packet released[MIDI_MERGE_HOLD_SIZE];
+  uint32_t now = knot_hal_time_us();
+  size_t count = midi_merge_expire(&pipeline->merge, now, released, MIDI_MERGE_HOLD_SIZE);
+  if (count){
+    midi_pipeline_trs_out_push(pipeline, released, count, now);
+  }
+
+  return midi_merge_is_held(&pipeline->merge, source);
+}
+
+// Messages waiting for TRS out that came from USB, replies and the clock have their own lanes
+static uint32_t midi_pipeline_trs_out_backlog(midi_pipeline_t *pipeline){
+
+  return midi_tx_scheduler_depth(&pipeline->tx, MIDI_TX_LANE_NORMAL) + midi_tx_scheduler_depth(&pipeline->tx, MIDI_TX_LANE_REALTIME);
+}
+
+bool midi_pipeline_usb_in_throttle(midi_pipeline_t *pipeline){
+
+  if (!pipeline->usb_in_throttled){
+    if (midi_pipeline_trs_out_backlog(pipeline) < MIDI_PIPELINE_TRS_HIGH_WATER){
+      return false;
+    }
+    pipeline->usb_in_throttled = true;
+    pipeline->usb_in_throttled_since = knot_hal_time_us();
+    pipeline->stats.usb_in_throttled++;
+  }
+
+  // Arm the wake before looking at the lanes again, the TX consumer pulls in between and looks at it after
+  atomic_store(&pipeline->usb_in_wake_armed, true);
+  atomic_thread_fence(memory_order_seq_cst);
+  if (midi_pipeline_trs_out_backlog(pipeline) > MIDI_PIPELINE_TRS_LOW_WATER){
+    return true;
+  }
+
+  atomic_store(&pipeline->usb_in_wake_armed, false);
+  pipeline->usb_in_throttled = false;
+
+  uint32_t throttled = knot_hal_time_us() - pipeline->usb_in_throttled_since;
+  pipeline->stats.usb_in_throttled_total_us += throttled;
+  if (throttled > pipeline->stats.usb_in_throttled_max_us){
+    pipeline->stats.usb_in_throttled_max_us = throttled;
+  }
+  return false;
+}
+
+static void midi_pipeline_usb_out_push(midi_pipeline_t *pipeline, struct usb_midi_event_packet packet, uint32_t received_us){
+
+  uint32_t word;
+  memcpy(&word, &packet, sizeof(word));
+
+  // the stamp goes first, both queues are the same size so the packet always fits after it
+  if (spsc_queue_count(&pipeline->usb_out_queue) >= MIDI_PIPELINE_USB_OUT_SIZE){
+    pipeline->stats.usb_out_dropped_queue_full++;
+    return;
+  }
+  spsc_queue_push(&pipeline->usb_out_stamps, received_us);
+  spsc_queue_push(&pipeline->usb_out_queue, word);
+
+  pipeline->stats.usb_out_queued++;
+  uint32_t depth = spsc_queue_count(&pipeline->usb_out_queue);
+  if (depth > pipeline->stats.usb_out_queue_depth_max){
+    pipeline->stats.usb_out_queue_depth_max = depth;
+  }
+}
+
+static void midi_pipeline_trs_in_forward(midi_pipeline_t *pipeline, const struct usb_midi_event_packet *packets, size_t count,
+                                         uint32_t received_us){
+
+  for (size_t i = 0; i < count; i++){
+    TRACE_D(UART, TRACE_EV_UART_RX_MESSAGE, TRACE_PACK4(packets[i].byte0, packets[i].byte1, packets[i].byte2, packets[i].byte3));
+    if (!midi_pipeline_sysex_feed(&pipeline->trs_port, usb_midi_to_uart(packets[i]))){
+      midi_pipeline_usb_out_push(pipeline, packets[i], received_us);
+    }
+  }
+}
+
+void midi_pipeline_trs_in(midi_pipeline_t *pipeline, const uint8_t *data, size_t length, uint32_t received_us){
+
+  struct usb_midi_event_packet packets[TRS_IN_SLICE];
+
+  knot_hal_led(KNOT_HAL_LED_RX);
+
+  while (length > 0){
+    size_t slice = length < TRS_IN_SLICE ? length : TRS_IN_SLICE;
+    size_t count = midi_parse_span(&pipeline->trs_parser, data, slice, packets, TRS_IN_SLICE);
+    midi_pipeline_trs_in_forward(pipeline, packets, count, received_us);
+    data += slice;
+    length -= slice;
+  }
+
+  knot_hal_usb_out_wake();
+}
+
+void midi_pipeline_trs_in_packets(midi_pipeline_t *pipeline, const struct usb_midi_event_packet *packets, size_t count,
+                                  uint32_t received_us){
+
+  knot_hal_led(KNOT_HAL_LED_RX);
+  midi_pipeline_trs_in_forward(pipeline, packets, count, received_us);
+  knot_hal_usb_out_wake();
+}
+
+bool midi_pipeline_clock_pulse(midi_pipeline_t *pipeline, uint32_t due_us){
+
+  // clock ticks do not light the TX LED, it would never go dark
+  bool queued = midi_tx_scheduler_push_clock(&pipeline->tx, 0xF8, due_us);
+
+  knot_hal_trs_tx_wake();
+  return queued;
+}
+
+size_t midi_pipeline_trs_out_pull(midi_pipeline_t *pipeline, uint8_t *out, size_t max){
+
+  // the output profile may change with any configuration write
+  const knot_config_snapshot_t *config = knot_hal_config_acquire();
+  pipeline->tx.running_status = config->config.trs_out == KNOT_TRS_OUT_RUNNING_STATUS;
+  knot_hal_config_release(config);
+
+  size_t count = midi_tx_scheduler_pull(&pipeline->tx, knot_hal_time_us(), out, max);
+  pipeline->trs_out_pulled = count;
+
+  // Wake a throttled IN worker once the lanes are down to the low watermark
+  if (count > 0){
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pipeline->usb_in_wake_armed, memory_order_relaxed) &&
+        midi_pipeline_trs_out_backlog(pipeline) <= MIDI_PIPELINE_TRS_LOW_WATER &&
+        atomic_exchange(&pipeline->usb_in_wake_armed, false)){
+      knot_hal_usb_in_wake();
+    }
+  }
+  return count;
+}
+
+void midi_pipeline_trs_out_done(midi_pipeline_t *pipeline, uint32_t done_us){
+
+  for (uint8_t i = 0; i < pipeline->tx.sent_count; i++){
+    const struct midi_tx_sent *sent = &pipeline->tx.sent[i];
+    // the bytes after its last one were still to go
+    uint32_t done = done_us - (pipeline->trs_out_pulled - sent->end) * MIDI_PIPELINE_TRS_BYTE_US;
+    switch (sent->lane){
+      case MIDI_TX_LANE_CLOCK:
+        latency_hist_record(&pipeline->latency[MIDI_PIPELINE_PATH_CLOCK], done - sent->enqueued_at);
+        break;
+      case MIDI_TX_LANE_REALTIME:
+      case MIDI_TX_LANE_NORMAL:
+        latency_hist_record(&pipeline->latency[MIDI_PIPELINE_PATH_USB_TO_TRS], done - sent->enqueued_at);
+        break;
+      default:
+        // replies are not on a forwarding path
+        break;
+    }
+  }
+  pipeline->tx.sent_count = 0;
+}
+
+size_t midi_pipeline_usb_out_pop(midi_pipeline_t *pipeline, uint32_t *words, size_t max, uint32_t *received_us,
+                                 uint8_t *device){
+
+  size_t count = 0;
+  bool stamped = false;
+
+  *device = MIDI_PIPELINE_USB_OUT_ALL;
+
+  while (count < max){
+    if (!pipeline->usb_out_reply_active && !pipeline->usb_out_trs_in_sysex && spsc_queue_count(&pipeline->usb_reply_queue) > 0){
+      if (count > 0){
+        // a reply starts a batch of its own, it goes to one device only
+        break;
+      }
+      pipeline->usb_out_reply_active = true;
+    }
+    bool reply = pipeline->usb_out_reply_active;
+
+    uint32_t word;
+    if (!spsc_queue_pop(reply ? &pipeline->usb_reply_queue : &pipeline->usb_out_queue, &word)){
+      break;
+    }
+
+    bool keep = true;
+    if (reply){
+      uint32_t tag;
+      spsc_queue_pop(&pipeline->usb_reply_sources, &tag);
+      uint8_t source = tag & 0xFF;
+      uint32_t generation = atomic_load(&pipeline->usb_reply_routes[source].generation);
+      keep = tag >> 8 == (generation & MIDI_PIPELINE_USB_REPLY_GENERATION_MASK);
+      if (keep){
+        *device = source;
+      }
+      else {
+        pipeline->stats.usb_reply_dropped_gone++;
+      }
+    }
+    else {
+      uint32_t stamp;
+      spsc_queue_pop(&pipeline->usb_out_stamps, &stamp);
+      if (!stamped){
+        *received_us = stamp;
+        stamped = true;
+      }
+    }
+    if (keep){
+      words[count++] = word;
+    }
+
+    // CIN 4 starts or continues a SysEx, 5-7 end it, every other message but single bytes is outside of one
+    uint8_t cin = word & 0x0F;
+    bool sysex = cin == 0x4;
+    bool outside = (cin >= 0x5 && cin <= 0x7) || (cin >= 0x2 && cin <= 0x3) || (cin >= 0x8 && cin <= 0xE);
+    if (reply){
+      pipeline->usb_out_reply_active = !outside;
+      if (outside && count > 0){
+        // the TRS stream goes on in the next batch, to every device
+        break;
+      }
+    }
+    else if (sysex || outside){
+      pipeline->usb_out_trs_in_sysex = sysex;
+    }
+  }
+
+  if (!stamped){
+    *received_us = knot_hal_time_us();
+  }
+  return count;
+}
+
+void midi_pipeline_usb_out_done(midi_pipeline_t *pipeline, uint32_t received_us){
+
+  latency_hist_record(&pipeline->latency[MIDI_PIPELINE_PATH_TRS_TO_USB], knot_hal_time_us() - received_us);
+}
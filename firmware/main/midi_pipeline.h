@@ -0,0 +1,262 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "midi_translator.h"
+#include "midi_tx_scheduler.h"
+#include "midi_merge.h"
+#include "knot_sysex.h"
+#include "spsc_queue.h"
+#include "latency_hist.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+  USB <-> TRS data path
+
+  Everything between the USB endpoints and the TRS wire that does not
+  touch hardware: decoding, configuration requests, routing, tempo control,
+  merging and scheduling on the way out to TRS; parsing and batching with
+  interleaved replies on the way back to USB. The platform moves transfers
+  and bytes in and out and provides the services of knot_hal.h.
+
+  Every entry point belongs to one task, which keeps each queue inside
+  single producer, single consumer:
+
+    midi_pipeline_usb_in, _usb_in_remove,  USB IN worker
+    _usb_in_throttle, _usb_in_held
+    midi_pipeline_trs_in, _trs_in_packets  TRS RX task
+    midi_pipeline_clock_pulse              clock task
+    midi_pipeline_trs_out_pull, _done      TRS TX consumer, the UART interrupt
+    midi_pipeline_usb_out_pop, _done       USB client task
+    send of the configuration ports        request task of the platform, see knot_hal_sysex_request
+
+  Every message carries the time it arrived: IN transfer completion, UART
+  read or clock alarm. Once it is on the wire or acknowledged by the USB
+  device its end to end latency goes into the histogram of its path. The
+  bytes of one pull leave the wire back to back, so each message is done
+  MIDI_PIPELINE_TRS_BYTE_US per byte after it before the last stop bit.
+
+  USB delivers far more than the 31250 baud wire carries. Once the lanes
+  fed from USB hold MIDI_PIPELINE_TRS_HIGH_WATER messages the IN worker
+  stops resubmitting its transfers and the device buffers the burst. The
+  TX consumer wakes it when they have drained to MIDI_PIPELINE_TRS_LOW_WATER.
+
+  The same goes for a device the merge holds back behind another one's
+  SysEx: the IN worker keeps its completed transfers, undecoded, until
+  midi_pipeline_usb_in_held lets it go, see midi_merge.h.
+
+*/
+
+#define MIDI_PIPELINE_MAX_SOURCES       MIDI_MERGE_MAX_SOURCES  // USB devices served at the same time
+#define MIDI_PIPELINE_IN_MAX_PACKETS    16  // one full speed transfer, 64 bytes
+#define MIDI_PIPELINE_USB_OUT_SIZE      256 // event packets buffered between the TRS input and the USB client task
+#define MIDI_PIPELINE_USB_REPLY_SIZE    128 // event packets of configuration replies waiting for the OUT endpoints
+#define MIDI_PIPELINE_TRS_HIGH_WATER    96  // queued messages for TRS out that hold back the IN transfers, transfers
+                                            // still polling add up to MIDI_PIPELINE_IN_MAX_PACKETS each on top
+#define MIDI_PIPELINE_TRS_LOW_WATER     32  // about 30 ms of wire time left when they go again
+#define MIDI_PIPELINE_TRS_BYTE_US       320 // start bit, 8 data bits and stop bit at 31250 baud
+#define MIDI_PIPELINE_USB_OUT_ALL       0xFF // midi_pipeline_usb_out_pop batch of the TRS stream, for every device
+#define MIDI_PIPELINE_USB_REPLY_GENERATION_MASK 0xFFFFFF // generation bits a queued reply packet carries above its device
+
+enum midi_pipeline_path
+{
+  MIDI_PIPELINE_PATH_USB_TO_TRS,  // IN transfer completion to the last stop bit on TRS, TX consumer
+  MIDI_PIPELINE_PATH_TRS_TO_USB,  // UART read to the OUT transfer acknowledged, USB client task
+  MIDI_PIPELINE_PATH_CLOCK,       // clock alarm to the F8 stop bit, TX consumer
+  MIDI_PIPELINE_PATH_COUNT
+};
+
+/**
+ * Counters of the pipeline queues. Each group is written by one task only.
+ */
+struct midi_pipeline_stats
+{
+  uint32_t usb_in_packets;              // event packets decoded, IN worker
+  uint32_t usb_out_queued;              // accepted from the TRS input, RX task
+  uint32_t usb_out_dropped_queue_full;  // TRS input outran the USB device
+  uint32_t usb_out_queue_depth_max;     // deepest the queue has been
+  uint32_t usb_in_throttled;            // times the IN transfers were held back for TRS out, IN worker
+  uint32_t usb_in_throttled_max_us;     // longest they were held back
+  uint64_t usb_in_throttled_total_us;
+  uint32_t usb_reply_dropped_gone;      // reply packets for a device that went away meanwhile, client task
+};
+
+struct midi_pipeline;
+
+/**
+ * Context of the send of one USB configuration port, its replies go back to that device only.
+ * A device taking the slot after the one that asked is a new generation and never gets them.
+ */
+struct midi_pipeline_usb_reply_route
+{
+  struct midi_pipeline *pipeline;
+  uint8_t source;
+  _Atomic uint32_t generation;   // counts the devices that left the slot, IN worker
+  uint32_t request_generation;   // generation of the request being answered, set by the IN worker before it is queued
+};
+
+typedef struct midi_pipeline
+{
+  // USB IN -> TRS out, IN worker
+  midi_merge_t merge;
+  knot_sysex_port_t usb_ports[MIDI_PIPELINE_MAX_SOURCES];
+  struct midi_pipeline_usb_reply_route usb_reply_routes[MIDI_PIPELINE_MAX_SOURCES];
+  midi_parser_t usb_reply_parser;       // request task
+  uint32_t clock_base_period;
+  uint32_t clock_period_pre_bend;
+  int16_t clock_fine;
+  bool usb_in_throttled;                // IN transfers are held back until TRS out drains
+  uint32_t usb_in_throttled_since;
+  _Atomic bool usb_in_wake_armed;       // set by the IN worker, the TX consumer clears it when it wakes the worker
+
+  // TRS out: clock task, IN worker and request task produce, the TX consumer pulls
+  midi_tx_scheduler_t tx;
+  uint8_t trs_out_pulled;  // bytes of the latest pull, on the wire until midi_pipeline_trs_out_done
+
+  // TRS in -> USB OUT, RX task
+  midi_parser_t trs_parser;  // bytes of midi_pipeline_trs_in, framed input arrives parsed
+  knot_sysex_port_t trs_port;
+
+  // USB OUT: RX task and request task produce, client task consumes
+  spsc_queue_t usb_out_queue;
+  spsc_queue_t usb_out_stamps;  // arrival time of each packet of usb_out_queue, pushed and popped in step
+  spsc_queue_t usb_reply_queue;
+  spsc_queue_t usb_reply_sources;  // device each packet of usb_reply_queue goes to, pushed and popped in step
+  uint32_t usb_out_storage[MIDI_PIPELINE_USB_OUT_SIZE];
+  uint32_t usb_out_stamp_storage[MIDI_PIPELINE_USB_OUT_SIZE];
+  uint32_t usb_reply_storage[MIDI_PIPELINE_USB_REPLY_SIZE];
+  uint32_t usb_reply_source_storage[MIDI_PIPELINE_USB_REPLY_SIZE];
+  bool usb_out_trs_in_sysex;  // the TRS stream is in the middle of a SysEx, replies wait
+  bool usb_out_reply_active;  // a reply is in the middle of its SysEx, the TRS stream waits
+
+  volatile struct midi_pipeline_stats stats;
+  latency_hist_t latency[MIDI_PIPELINE_PATH_COUNT];
+} midi_pipeline_t;
+
+/**
+ * The one pipeline of the firmware or the simulator, defined by the platform.
+ */
+extern midi_pipeline_t midi_pipeline;
+
+/**
+ * @brief Reset every stage, the tempo starts out at the configured default
+ * @param[out] pipeline pipeline
+ */
+void midi_pipeline_init(midi_pipeline_t *pipeline);
+
+/**
+ * @brief Forward a completed IN transfer to TRS out, answering configuration requests on the way
+ * @param[in] pipeline pipeline
+ * @param[in] source device index, below MIDI_PIPELINE_MAX_SOURCES
+ * @param[in] data transfer buffer
+ * @param[in] length bytes received
+ * @param[in] cable_mask bit N forwards cable N of this endpoint
+ * @param[in] completed_us knot_hal_time_us of the transfer completion
+ */
+void midi_pipeline_usb_in(midi_pipeline_t *pipeline, uint8_t source, const uint8_t *data, size_t length, uint16_t cable_mask,
+                          uint32_t completed_us);
+
+/**
+ * @brief Whether the IN worker holds back its transfers, TRS out is above the high watermark
+ * @param[in] pipeline pipeline
+ *
+ * @return true from reaching MIDI_PIPELINE_TRS_HIGH_WATER until drained to MIDI_PIPELINE_TRS_LOW_WATER,
+ *         knot_hal_usb_in_wake is called once it is time to ask again
+ */
+bool midi_pipeline_usb_in_throttle(midi_pipeline_t *pipeline);
+
+/**
+ * @brief Whether a device has to wait for another one's SysEx before its next transfer is decoded,
+ *        ends the SysEx of an owner that went silent for MIDI_MERGE_OWNER_TIMEOUT_US
+ * @param[in] pipeline pipeline
+ * @param[in] source device index
+ *
+ * @return true while the merge holds packets of this device
+ */
+bool midi_pipeline_usb_in_held(midi_pipeline_t *pipeline, uint8_t source);
+
+/**
+ * @brief A device went away, drop its request in progress and release what the merge held for it
+ * @param[in] pipeline pipeline
+ * @param[in] source device index
+ */
+void midi_pipeline_usb_in_remove(midi_pipeline_t *pipeline, uint8_t source);
+
+/**
+ * @brief Forward bytes received on TRS in to USB OUT, answering configuration requests on the way
+ * @param[in] pipeline pipeline
+ * @param[in] data received bytes
+ * @param[in] length number of bytes
+ * @param[in] received_us knot_hal_time_us when the bytes were read from the UART
+ */
+void midi_pipeline_trs_in(midi_pipeline_t *pipeline, const uint8_t *data, size_t length, uint32_t received_us);
+
+/**
+ * @brief Forward messages the platform already framed on TRS in, instead of midi_pipeline_trs_in
+ * @param[in] pipeline pipeline
+ * @param[in] packets complete messages as event packets of cable 0, e.g. from midi_parse_span
+ * @param[in] count number of packets
+ * @param[in] received_us knot_hal_time_us when their last bytes were read from the UART
+ */
+void midi_pipeline_trs_in_packets(midi_pipeline_t *pipeline, const struct usb_midi_event_packet *packets, size_t count,
+                                  uint32_t received_us);
+
+/**
+ * @brief Queue one F8 pulse of the clock output
+ * @param[in] pipeline pipeline
+ * @param[in] due_us knot_hal_time_us the pulse was due at
+ *
+ * @return false if the clock lane was full
+ */
+bool midi_pipeline_clock_pulse(midi_pipeline_t *pipeline, uint32_t due_us);
+
+/**
+ * @brief Next bytes for the TRS wire, real-time first, never splitting a message but SysEx,
+ *        with running status unless the TRS out profile of the configuration says otherwise
+ * @param[in] pipeline pipeline
+ * @param[out] out byte buffer
+ * @param[in] max capacity of out, at least 3
+ *
+ * @return number of bytes written to out
+ */
+size_t midi_pipeline_trs_out_pull(midi_pipeline_t *pipeline, uint8_t *out, size_t max);
+
+/**
+ * @brief The bytes of the latest pull left the wire, count the latency of the messages they finished
+ * @param[in] pipeline pipeline
+ * @param[in] done_us knot_hal_time_us of the stop bit of the last byte
+ */
+void midi_pipeline_trs_out_done(midi_pipeline_t *pipeline, uint32_t done_us);
+
+/**
+ * @brief Next event packets for the USB OUT endpoints, replies only go in between two SysEx of the TRS stream
+ * @param[in] pipeline pipeline
+ * @param[out] words event packets, one per word
+ * @param[in] max capacity of words
+ * @param[out] received_us arrival of the oldest TRS packet taken, the time of the pop for replies
+ * @param[out] device MIDI_PIPELINE_USB_OUT_ALL for packets of the TRS stream, every device gets those,
+ *             otherwise the one device the packets of a reply go to; a reply is never batched with anything else,
+ *             one for a device that left since it asked is dropped
+ *
+ * @return number of event packets written to words
+ */
+size_t midi_pipeline_usb_out_pop(midi_pipeline_t *pipeline, uint32_t *words, size_t max, uint32_t *received_us,
+                                 uint8_t *device);
+
+/**
+ * @brief The device acknowledged an OUT transfer, count its latency
+ * @param[in] pipeline pipeline
+ * @param[in] received_us what midi_pipeline_usb_out_pop gave for the packets of the transfer
+ */
+void midi_pipeline_usb_out_done(midi_pipeline_t *pipeline, uint32_t received_us);
+
+
+#ifdef __cplusplus
+}
+#endif
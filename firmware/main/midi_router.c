@@ -0,0 +1,202 @@
+#include <stdint.h>
+#include <string.h>
+#include "midi_router.h"
+
+const struct midi_route_rule midi_router_default_rules[] = {
+  // Model:Samples track levels: CC 0x15-0x1A on channel 10 become CC 0x5F on channels 1-6
+  {
+    .status = 0xB0, .data1_min = 0x15, .data1_max = 0x1A,
+    .actions = MIDI_ROUTE_REMAP | MIDI_ROUTE_CHANNEL,
+    .data1 = 0x5F, .channel_shift = -9, .channel_step = 1,
+  },
+  // tempo knobs
+  { .status = 0xB0, .data1_min = 0x1B, .data1_max = 0x1B, .clock = MIDI_ROUTE_CLOCK_COARSE },
+  { .status = 0xB0, .data1_min = 0x1C, .data1_max = 0x1C, .clock = MIDI_ROUTE_CLOCK_FINE },
+  // tempo bend buttons on channel 16
+  { .status = 0xB0, .channel_mask = 1 << 15, .data1_min = 0x68, .data1_max = 0x68, .clock = MIDI_ROUTE_CLOCK_BEND_UP },
+  { .status = 0xB0, .channel_mask = 1 << 15, .data1_min = 0x69, .data1_max = 0x69, .clock = MIDI_ROUTE_CLOCK_BEND_DOWN },
+};
+
+const size_t midi_router_default_rule_count = sizeof(midi_router_default_rules) / sizeof(midi_router_default_rules[0]);
+
+static inline bool midi_router_is_channel_status(uint8_t status){
+
+  return status >= 0x80 && status < 0xF0;
+}
+
+static bool midi_router_rule_valid(const struct midi_route_rule *rule){
+
+  if (rule->data1_min > rule->data1_max || rule->data1_max > 0x7F){
+    return false;
+  }
+  if (rule->ab_mask & ~(MIDI_ROUTE_AB_A | MIDI_ROUTE_AB_B)){
+    return false;
+  }
+
+  if (midi_router_is_channel_status(rule->status)){
+    return (rule->status & 0x0F) == 0;
+  }
+
+  // SysEx is never routed
+  return rule->status > 0xF0 && rule->status != 0xF7;
+}
+
+static inline bool midi_router_is_restricted(const struct midi_route_rule *rule){
+
+  return rule->source_mask || rule->cable_mask || rule->ab_mask;
+}
+
+// Put the rule at the head of the chain of every cell it covers. Rules are placed last to first, so the
+// chain of a cell lists its rules in table order; an unrestricted rule always matches and ends the chain.
+static bool midi_router_place(midi_router_t *router, uint8_t index){
+
+  const struct midi_route_rule *rule = &router->rules[index];
+  bool restricted = midi_router_is_restricted(rule);
+
+  // link of this rule in front of each chain tail, cells sharing a tail share the link
+  uint8_t made[256];
+  memset(made, MIDI_ROUTER_NO_RULE, sizeof(made));
+
+  for (int channel = 0; channel < 16; channel++){
+
+    if (midi_router_is_channel_status(rule->status)){
+      if (rule->channel_mask && !(rule->channel_mask & (1u << channel))){
+        continue;
+      }
+    }
+    else if (channel > 0){
+      break;
+    }
+
+    uint8_t *row = router->dispatch[(rule->status | (midi_router_is_channel_status(rule->status) ? channel : 0)) - 0x80];
+    for (int data1 = rule->data1_min; data1 <= rule->data1_max; data1++){
+
+      uint8_t next = restricted ? row[data1] : MIDI_ROUTER_NO_RULE;
+      if (made[next] == MIDI_ROUTER_NO_RULE){
+        if (router->link_count == MIDI_ROUTER_MAX_LINKS){
+          return false;
+        }
+        router->links[router->link_count] = (midi_router_link_t){ .rule = index, .next = next };
+        made[next] = router->link_count++;
+      }
+      row[data1] = made[next];
+    }
+  }
+
+  return true;
+}
+
+static void midi_router_clear(midi_router_t *router){
+
+  router->count = 0;
+  router->link_count = 0;
+  memset(router->dispatch, MIDI_ROUTER_NO_RULE, sizeof(router->dispatch));
+}
+
+bool midi_router_compile(midi_router_t *router, const struct midi_route_rule *rules, size_t count){
+
+  midi_router_clear(router);
+
+  if (count > MIDI_ROUTER_MAX_RULES){
+    return false;
+  }
+
+  for (size_t i = 0; i < count; i++){
+    if (!midi_router_rule_valid(&rules[i])){
+      return false;
+    }
+  }
+
+  memcpy(router->rules, rules, count * sizeof(rules[0]));
+
+  for (size_t i = count; i-- > 0;){
+    if (!midi_router_place(router, (uint8_t)i)){
+      midi_router_clear(router);
+      return false;
+    }
+  }
+
+  router->count = (uint8_t)count;
+
+  return true;
+}
+
+// The cell already matched status, channel and data1, only the restrictions are left
+static bool midi_router_rule_matches(const struct midi_route_rule *rule, uint8_t source, uint8_t cable, uint8_t ab){
+
+  if (rule->source_mask && !(rule->source_mask & (1u << source))){
+    return false;
+  }
+  if (rule->cable_mask && !(rule->cable_mask & (1u << cable))){
+    return false;
+  }
+  if (rule->ab_mask && !(rule->ab_mask & ab)){
+    return false;
+  }
+
+  return true;
+}
+
+static struct uart_midi_event_packet midi_router_transform(const struct midi_route_rule *rule,
+                                                           struct uart_midi_event_packet packet){
+
+  uint8_t steps = packet.byte2 - rule->data1_min;
+
+  if (rule->actions & MIDI_ROUTE_CHANNEL && midi_router_is_channel_status(packet.byte1)){
+    int channel = (packet.byte1 & 0x0F) + rule->channel_shift + rule->channel_step * steps;
+    packet.byte1 = (packet.byte1 & 0xF0) | (channel & 0x0F);
+  }
+
+  if (rule->actions & MIDI_ROUTE_REMAP && packet.length >= 2){
+    packet.byte2 = (rule->data1 + rule->data1_step * steps) & 0x7F;
+  }
+
+  if (rule->actions & MIDI_ROUTE_SCALE && packet.length == 3){
+    packet.byte3 = rule->out_min + ((rule->out_max - rule->out_min) * packet.byte3) / 127;
+  }
+
+  return packet;
+}
+
+size_t midi_router_route(const midi_router_t *router, uint8_t source, uint8_t cable, uint8_t ab,
+                         struct uart_midi_event_packet packet, struct uart_midi_event_packet *out,
+                         enum midi_route_clock *clock){
+
+  *clock = MIDI_ROUTE_CLOCK_NONE;
+
+  uint8_t status = packet.byte1;
+  if (status < 0x80 || status == 0xF0 || status == 0xF7 || packet.length == 0){
+    out[0] = packet;
+    return 1;
+  }
+
+  uint8_t data1 = packet.length >= 2 ? packet.byte2 : 0;
+  uint8_t link = router->dispatch[status - 0x80][data1];
+
+  // The chain only holds rules covering this cell, the next one is looked at when a rule is limited to other sources, cables or switch positions
+  const struct midi_route_rule *rule = NULL;
+  for (; link != MIDI_ROUTER_NO_RULE; link = router->links[link].next){
+    if (midi_router_rule_matches(&router->rules[router->links[link].rule], source, cable, ab)){
+      rule = &router->rules[router->links[link].rule];
+      break;
+    }
+  }
+
+  if (rule == NULL){
+    out[0] = packet;
+    return 1;
+  }
+
+  *clock = (enum midi_route_clock)rule->clock;
+
+  size_t count = 0;
+  if (rule->actions & MIDI_ROUTE_DROP){
+    return 0;
+  }
+  if (rule->actions & MIDI_ROUTE_DUPLICATE){
+    out[count++] = packet;
+  }
+  out[count++] = midi_router_transform(rule, packet);
+
+  return count;
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "midi_translator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+  Routing and transform engine
+
+  A rule table matches messages on (source, cable, status, channel, data1
+  range, A/B switch position) and applies its actions. The table is
+  compiled once into a dispatch array indexed by the status byte and data1.
+  When several rules cover the same cell, the first one in table order
+  wins; rules restricted to some sources, cables or switch positions fall
+  through to the later rules of that cell when they do not match. Each cell
+  therefore points at a chain of candidate links that only holds the rules
+  covering that cell, up to the first unrestricted one. A message without
+  restricted rules in its cell is a single lookup; otherwise the walk is
+  bounded by the restricted rules overlapping that one cell, never by the
+  table length. Messages without a rule pass unchanged.
+
+  SysEx packets are never routed, their first byte is not a status byte in
+  the middle of a transfer.
+
+*/
+
+#define MIDI_ROUTER_MAX_RULES   64
+#define MIDI_ROUTER_NO_RULE     0xFF  // end of a candidate chain
+#define MIDI_ROUTER_MAX_LINKS   255   // distinct candidate links, cells with the same chain tail share them
+#define MIDI_ROUTER_MAX_OUT     2   // packets a single message can turn into
+
+// Actions, several can be combined in one rule and apply in this order
+#define MIDI_ROUTE_REMAP        0x01  // data1 = rule data1 + (data1 - data1_min) * data1_step
+#define MIDI_ROUTE_CHANNEL      0x02  // channel += channel_shift + (data1 - data1_min) * channel_step, wraps at 16
+#define MIDI_ROUTE_SCALE        0x04  // data2 0..127 is scaled onto out_min..out_max
+#define MIDI_ROUTE_DUPLICATE    0x08  // the untouched message is sent ahead of the transformed one
+#define MIDI_ROUTE_DROP         0x10  // nothing is sent, clock control still applies
+
+// Positions of the TRS A/B switch, rules can be limited to one of them
+#define MIDI_ROUTE_AB_A         0x01
+#define MIDI_ROUTE_AB_B         0x02
+
+enum midi_route_clock
+{
+  MIDI_ROUTE_CLOCK_NONE,
+  MIDI_ROUTE_CLOCK_COARSE,     // data2 picks the tempo across the whole range
+  MIDI_ROUTE_CLOCK_FINE,       // data2 around 0x3F nudges the tempo
+  MIDI_ROUTE_CLOCK_BEND_UP,    // data2 0x7F speeds up, 0x00 restores the tempo
+  MIDI_ROUTE_CLOCK_BEND_DOWN,  // data2 0x7F slows down, 0x00 restores the tempo
+};
+
+/**
+ * One rule, stored field by field in this order, see knot_config.h.
+ */
+struct midi_route_rule
+{
+  uint16_t cable_mask;    // bit N matches cable N, 0 matches every cable
+  uint16_t channel_mask;  // bit N matches channel N, 0 matches every channel
+  uint8_t source_mask;    // bit N matches USB device N, 0 matches every device
+  uint8_t status;         // 0x80-0xE0 for channel messages, F1-FF for system messages
+  uint8_t data1_min;      // data1 range, inclusive; messages without data1 are matched as data1 0
+  uint8_t data1_max;
+  uint8_t actions;        // MIDI_ROUTE_* flags
+  uint8_t clock;          // enum midi_route_clock
+  int8_t channel_shift;
+  int8_t channel_step;
+  uint8_t data1;
+  uint8_t data1_step;
+  uint8_t out_min;
+  uint8_t out_max;
+  uint8_t ab_mask;        // MIDI_ROUTE_AB_* positions of the A/B switch it matches, 0 matches both
+};
+
+typedef struct
+{
+  uint8_t rule;           // index in the rule table
+  uint8_t next;           // link of the next rule covering the cell, MIDI_ROUTER_NO_RULE ends the chain
+} midi_router_link_t;
+
+typedef struct
+{
+  struct midi_route_rule rules[MIDI_ROUTER_MAX_RULES];
+  uint8_t count;
+  uint8_t link_count;
+  midi_router_link_t links[MIDI_ROUTER_MAX_LINKS];
+  uint8_t dispatch[128][128]; // [status - 0x80][data1], link of the first rule covering the cell
+} midi_router_t;
+
+/**
+ * Rules the firmware runs without a stored table: the Model:Samples track level
+ * mapping and the tempo controls of the original hard-wired setup.
+ */
+extern const struct midi_route_rule midi_router_default_rules[];
+extern const size_t midi_router_default_rule_count;
+
+/**
+ * @brief Compile a rule table into a router
+ * @param[out] router compiled router
+ * @param[in] rules rule table, first match wins
+ * @param[in] count number of rules
+ *
+ * @return false if the table is too long, has a rule with an invalid status or range or its
+ *         overlapping restricted rules need more than MIDI_ROUTER_MAX_LINKS candidate links,
+ *         the router is left without rules then
+ */
+bool midi_router_compile(midi_router_t *router, const struct midi_route_rule *rules, size_t count);
+
+/**
+ * @brief Route one message
+ * @param[in] router compiled router
+ * @param[in] source USB device index
+ * @param[in] cable cable number the message arrived on
+ * @param[in] ab MIDI_ROUTE_AB_A or MIDI_ROUTE_AB_B, current position of the A/B switch
+ * @param[in] packet message
+ * @param[out] out receives up to MIDI_ROUTER_MAX_OUT packets
+ * @param[out] clock clock control the message triggers, MIDI_ROUTE_CLOCK_NONE if none
+ *
+ * @return number of packets written to out
+ */
+size_t midi_router_route(const midi_router_t *router, uint8_t source, uint8_t cable, uint8_t ab,
+                         struct uart_midi_event_packet packet, struct uart_midi_event_packet *out,
+                         enum midi_route_clock *clock);
+
+
+#ifdef __cplusplus
+}
+#endif
@@ -2,6 +2,49 @@
 #include "midi_translator.h"
 
 
+// Message length by USB-MIDI Code Index Number
+static const uint8_t usb_midi_cin_length[16] = {
+  0, // 0x0 Miscellaneous function codes. Reserved for future extensions.
+  0, // 0x1 Cable events. Reserved for future expansion.
+  2, // 0x2 Two-byte System Common messages like MTC, SongSelect, etc.
+  3, // 0x3 Three-byte System Common messages like SPP, etc.
+  3, // 0x4 SysEx starts or continues
+  1, // 0x5 Single-byte System Common Message or SysEx ends with following single byte.
+  2, // 0x6 SysEx ends with following two bytes.
+  3, // 0x7 SysEx ends with following three bytes.
+  3, // 0x8 Note-off
+  3, // 0x9 Note-on
+  3, // 0xA Poly-KeyPress
+  3, // 0xB Control Change
+  2, // 0xC Program Change
+  2, // 0xD Channel Pressure
+  3, // 0xE PitchBend Change
+  1, // 0xF Single Byte
+};
+
+// Code Index Number by the high nibble of the first byte, data bytes only occur inside sysex
+#define CIN_SYSEX         0x04
+#define CIN_SYSTEM        0x00 // resolved by usb_midi_system_cin
+static const uint8_t usb_midi_status_cin[16] = {
+  CIN_SYSEX, CIN_SYSEX, CIN_SYSEX, CIN_SYSEX, CIN_SYSEX, CIN_SYSEX, CIN_SYSEX, CIN_SYSEX,
+  0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E,
+  CIN_SYSTEM,
+};
+
+// Code Index Number of 0xF? status bytes by the low nibble
+#define CIN_BY_LENGTH     0x00 // System Common, resolved by usb_midi_system_common_cin
+static const uint8_t usb_midi_system_cin[16] = {
+  CIN_SYSEX,                                              // F0 sysex start
+  CIN_BY_LENGTH, CIN_BY_LENGTH, CIN_BY_LENGTH,            // F1 - F3
+  CIN_BY_LENGTH, CIN_BY_LENGTH, CIN_BY_LENGTH,            // F4 - F6
+  0x05,                                                   // F7 sysex end
+  0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F,         // real-time
+};
+
+// System Common Code Index Number by message length
+static const uint8_t usb_midi_system_common_cin[4] = {0x05, 0x05, 0x02, 0x03};
+
+
 struct uart_midi_event_packet usb_midi_to_uart(struct usb_midi_event_packet usb_packet){
 
   struct uart_midi_event_packet uart_packet = {
@@ -24,37 +67,80 @@ struct uart_midi_event_packet usb_midi_to_uart(struct usb_midi_event_packet usb_
   
   */
 
-  // MIDI Cable Number
-  uint8_t cn = ((usb_packet.byte0 & 0b11110000)>>4);
-
   // MIDI Code Index Number
-  uint8_t cin = (usb_packet.byte0 & 0b00001111);
-
-  switch(cin){
-    case 0x00: break; // Miscellaneous function codes. Reserved for future extensions.
-    case 0x01: break; // Cable events. Reserved for future expansion.
-    case 0x02: uart_packet.length = 2; break; // Two-byte System Common messages like MTC, SongSelect, etc.
-    case 0x03: uart_packet.length = 3; break; // Three-byte System Common messages like SPP, etc.
-    case 0x04: uart_packet.length = 3; break; // SysEx starts or continues
-    case 0x05: uart_packet.length = 1; break; // Single-byte System Common Message or SysEx ends with following single byte.
-    case 0x06: uart_packet.length = 2; break; // SysEx ends with following two bytes.
-    case 0x07: uart_packet.length = 3; break; // SysEx ends with following three bytes.
-    case 0x08: uart_packet.length = 3; break; // Note-off
-    case 0x09: uart_packet.length = 3; break; // Note-on
-    case 0x0A: uart_packet.length = 3; break; // Poly-KeyPress
-    case 0x0B: uart_packet.length = 3; break; // Control Change
-    case 0x0C: uart_packet.length = 2; break; // Program Change
-    case 0x0D: uart_packet.length = 2; break; // Channel Pressure
-    case 0x0E: uart_packet.length = 3; break; // PitchBend Change
-    case 0x0F: uart_packet.length = 1; break; // Single Byte
-    
-  }
+  uart_packet.length = usb_midi_cin_length[usb_packet.byte0 & 0x0F];
 
 
   return uart_packet;
 
 }
 
+size_t usb_midi_decode_transfer(const uint8_t *data, size_t length, struct uart_midi_event_packet *out, size_t capacity){
+
+  return usb_midi_decode_transfer_cables(data, length, USB_MIDI_ALL_CABLES, out, NULL, capacity);
+}
+
+size_t usb_midi_decode_transfer_cables(const uint8_t *data, size_t length, uint16_t cable_mask,
+                                       struct uart_midi_event_packet *out, uint8_t *cables, size_t capacity){
+
+  size_t count = 0;
+
+  // trailing bytes that do not form a whole event packet are ignored
+  for (size_t i = 0; i + 4 <= length && count < capacity; i += 4){
+
+    // cable number is the high nibble of byte 0
+    if (!(cable_mask & (1u << (data[i] >> 4)))){
+      continue;
+    }
+
+    struct usb_midi_event_packet usb_packet = {
+      .byte0 = data[i],
+      .byte1 = data[i + 1],
+      .byte2 = data[i + 2],
+      .byte3 = data[i + 3]
+    };
+
+    struct uart_midi_event_packet uart_packet = usb_midi_to_uart(usb_packet);
+
+    // CIN 0 is used as padding by some devices, skip it along with the reserved cable events
+    if (uart_packet.length){
+      out[count] = uart_packet;
+      if (cables){
+        cables[count] = data[i] >> 4;
+      }
+      count++;
+    }
+  }
+
+  return count;
+}
+
+size_t uart_midi_pack_packets(const struct uart_midi_event_packet *packets, size_t count, uint8_t *out, size_t capacity){
+
+  size_t written = 0;
+
+  for (size_t i = 0; i < count; i++){
+
+    uint8_t length = packets[i].length;
+
+    if (written + length > capacity){
+      break;
+    }
+
+    out[written] = packets[i].byte1;
+    if (length > 1){
+      out[written + 1] = packets[i].byte2;
+    }
+    if (length > 2){
+      out[written + 2] = packets[i].byte3;
+    }
+
+    written += length;
+  }
+
+  return written;
+}
+
 uint8_t uart_midi_is_byte_rtm(uint8_t byte){
 
   if (byte >= 0xF8){
@@ -66,212 +152,212 @@ uint8_t uart_midi_is_byte_rtm(uint8_t byte){
 }
 
 
-uint8_t uart_midi_processor_buffer[3] = {0};
-uint8_t uart_midi_processor_buffer_index = 0;
-uint8_t uart_midi_processor_buffer_limit = 0;
-uint8_t uart_midi_processor_state_is_sysex = 0;
-
-
 struct usb_midi_event_packet midi_uart_to_usb(struct uart_midi_event_packet uart_packet){
 
   // initialize return packet
   struct usb_midi_event_packet ev =
   {
     .byte0 = 0,
-    .byte1 = 0,
-    .byte2 = 0,
-    .byte3 = 0
+    .byte1 = uart_packet.byte1,
+    .byte2 = uart_packet.byte2,
+    .byte3 = uart_packet.byte3
   };
 
   if (uart_packet.length == 0){
-    return ev;
+    return (struct usb_midi_event_packet){.byte0 = 0, .byte1 = 0, .byte2 = 0, .byte3 = 0};
   }
 
-  if (uart_packet.byte1 == 0xF0 || uart_packet.byte1 < 128){
-    //Sysex start or continue
-    if (uart_packet.byte2 == 0xF7){
-      ev.byte0 = 0x06;
-      ev.byte1 = uart_packet.byte1;
-      ev.byte2 = uart_packet.byte2;
-      ev.byte3 = uart_packet.byte3;
-    }
-    else if (uart_packet.byte3 == 0xF7){
-      ev.byte0 = 0x07;
-      ev.byte1 = uart_packet.byte1;
-      ev.byte2 = uart_packet.byte2;
-      ev.byte3 = uart_packet.byte3;
-    }
-    else{
-      ev.byte0 = 0x04;
-      ev.byte1 = uart_packet.byte1;
-      ev.byte2 = uart_packet.byte2;
-      ev.byte3 = uart_packet.byte3; 
-    }
+  uint8_t cin = usb_midi_status_cin[uart_packet.byte1 >> 4];
 
+  if (cin == CIN_SYSTEM){
+    cin = usb_midi_system_cin[uart_packet.byte1 & 0x0F];
+    if (cin == CIN_BY_LENGTH){
+      //System Common: F1 and F3 are two bytes, F2 is three bytes, F6 is single byte
+      cin = usb_midi_system_common_cin[uart_packet.length & 0x03];
+    }
   }
-  else if (uart_packet.byte1 == 0xF7){
-    //Sysex stop
-    ev.byte0 = 0x05;
-    ev.byte1 = uart_packet.byte1;
-    ev.byte2 = uart_packet.byte2;
-    ev.byte3 = uart_packet.byte3; 
 
-  }
-  else{
-    //Channel Voice Message or real time
-    ev.byte0 = (uart_packet.byte1 >> 4);
-    ev.byte1 = uart_packet.byte1;
-    ev.byte2 = uart_packet.byte2;
-    ev.byte3 = uart_packet.byte3;
+  if (cin == CIN_SYSEX){
+    //Sysex start or continue: an F7 in the second byte ends with two bytes, in the third with three
+    uint8_t end_at_2 = (uart_packet.byte2 == 0xF7);
+    uint8_t end_at_3 = (uart_packet.byte3 == 0xF7) & !end_at_2;
+    cin = CIN_SYSEX + 2 * end_at_2 + 3 * end_at_3;
   }
 
+  ev.byte0 = cin;
 
   return ev;
 }
 
-struct uart_midi_event_packet uart_midi_process_byte(uint8_t byte){
+// Number of bytes (status included) of a message started by the given status byte, 0 if it has no data bytes to wait for
+static uint8_t midi_parser_message_length(uint8_t status){
 
-  // initialize return packet
-  struct uart_midi_event_packet ev =
-  {
-    .length = 0,
-    .byte1 = 0,
-    .byte2 = 0,
-    .byte3 = 0
-  };
+  switch (status & 0xF0){
+    case 0xC0: return 2; // Program Change
+    case 0xD0: return 2; // Channel Pressure
+    case 0xF0: break;
+    default: return 3;   // Note off/on, Poly-KeyPress, Control Change, PitchBend
+  }
 
-  if (uart_midi_processor_state_is_sysex){
+  switch (status){
+    case 0xF1: return 2; // MTC Quarter Frame
+    case 0xF2: return 3; // Song Position Pointer
+    case 0xF3: return 2; // Song Select
+    case 0xF6: return 1; // Tune Request
+    default: return 0;   // undefined F4, F5 or stray F7
+  }
+}
 
-    // store sysex data
-    uart_midi_processor_buffer[uart_midi_processor_buffer_index] = byte;
-    uart_midi_processor_buffer_index++;
+// Copy the buffered bytes into msg zero padded, clear the buffer and return the message length
+static inline uint8_t midi_parser_emit(midi_parser_t *parser, uint8_t *msg){
 
-    if (byte == 0xF7){
-      // sysex end command: switch to normal mode
-      uart_midi_processor_state_is_sysex = 0;
+  uint8_t length = parser->index;
 
-      // assemble return packet
-      ev = (struct uart_midi_event_packet){
-        .length = uart_midi_processor_buffer_index, 
-        .byte1 = uart_midi_processor_buffer[0], 
-        .byte2 = uart_midi_processor_buffer[1], 
-        .byte3 = uart_midi_processor_buffer[2]
-      };
+  msg[0] = parser->buffer[0];
+  msg[1] = length > 1 ? parser->buffer[1] : 0;
+  msg[2] = length > 2 ? parser->buffer[2] : 0;
 
-      // Clear buffer
-      uart_midi_processor_buffer[0] = 0;
-      uart_midi_processor_buffer[1] = 0;
-      uart_midi_processor_buffer[2] = 0;
-      uart_midi_processor_buffer_index = 0;
-      uart_midi_processor_buffer_limit = 0;
+  parser->index = 0;
 
-    }
-    else if (uart_midi_processor_buffer_index == 3){
-      // no more space, send packet and continue in sysex mode
-      
-      // assemble return packet
-      ev = (struct uart_midi_event_packet){
-        .length = uart_midi_processor_buffer_index, 
-        .byte1 = uart_midi_processor_buffer[0], 
-        .byte2 = uart_midi_processor_buffer[1], 
-        .byte3 = uart_midi_processor_buffer[2]
-      };
-
-      // Clear buffer
-      uart_midi_processor_buffer[0] = 0;
-      uart_midi_processor_buffer[1] = 0;
-      uart_midi_processor_buffer[2] = 0;
-      uart_midi_processor_buffer_index = 0;
-      uart_midi_processor_buffer_limit = 0;
+  return length;
+}
 
-    }
+void midi_parser_init(midi_parser_t *parser){
+
+  parser->buffer[0] = 0;
+  parser->buffer[1] = 0;
+  parser->buffer[2] = 0;
+  parser->index = 0;
+  parser->limit = 0;
+  parser->running_status = 0;
+  parser->is_sysex = 0;
+}
+
+// Feed one byte, returns the length of the completed message written to msg or 0
+static inline uint8_t midi_parser_feed(midi_parser_t *parser, uint8_t byte, uint8_t *msg){
 
+  if (byte >= 0xF8){
 
+    // real-time messages may appear anywhere, even inside sysex, and do not touch the parser state
+    msg[0] = byte;
+    msg[1] = 0;
+    msg[2] = 0;
+    return 1;
   }
-  else{
 
-    if (byte == 0xF0){
-      // switch to sysex mode
-      uart_midi_processor_state_is_sysex = 1;
-      // Clear buffer and store sysex start command
-      uart_midi_processor_buffer[0] = byte;
-      uart_midi_processor_buffer[1] = 0;
-      uart_midi_processor_buffer[2] = 0;
-      uart_midi_processor_buffer_index = 1;
-      uart_midi_processor_buffer_limit = 3;
+  if (parser->is_sysex){
 
-    }
-    else{
+    if (byte < 128 || byte == 0xF7){
 
-      if (byte > 127){
+      // store sysex data
+      parser->buffer[parser->index] = byte;
+      parser->index++;
 
-        if (uart_midi_is_byte_rtm(byte)){
+      if (byte == 0xF7){
+        // sysex end command: switch to normal mode
+        parser->is_sysex = 0;
+        return midi_parser_emit(parser, msg);
+      }
 
-          // assemble return packet but do not clear the buffer
-          ev = (struct uart_midi_event_packet){
-            .length = 1, 
-            .byte1 = byte, 
-            .byte2 = 0, 
-            .byte3 = 0
-          };
-        }
-        else{
+      if (parser->index == 3){
+        // no more space, send packet and continue in sysex mode
+        return midi_parser_emit(parser, msg);
+      }
 
-          // Clear buffer and store the command
-          uart_midi_processor_buffer[0] = byte;
-          uart_midi_processor_buffer[1] = 0;
-          uart_midi_processor_buffer[2] = 0;
-          uart_midi_processor_buffer_index = 1;
+      return 0;
+    }
 
-          if ((byte&0b11110000) == 0xC0 || (byte&0b11110000) == 0xD0 ){
-            // set buffer limit to 2 for program change and channel preassure/aftertouch command types
-            uart_midi_processor_buffer_limit = 2;
-          }
-          else{
-            // set buffer limit to 3 for all other channel voice messages
-            uart_midi_processor_buffer_limit = 3;
-          }
-        }
+    // any other status byte terminates the sysex, the unterminated tail is dropped
+    parser->is_sysex = 0;
+    parser->index = 0;
+  }
 
+  if (byte == 0xF0){
 
+    // switch to sysex mode and store sysex start command
+    parser->is_sysex = 1;
+    parser->running_status = 0;
+    parser->buffer[0] = byte;
+    parser->index = 1;
+    parser->limit = 3;
+  }
+  else if (byte > 127){
 
-      }
-      else{
-        // store incoming byte
-        uart_midi_processor_buffer[uart_midi_processor_buffer_index] = byte;
-        uart_midi_processor_buffer_index++;
-
-        if (uart_midi_processor_buffer_index == uart_midi_processor_buffer_limit){
-          // assemble return packet
-          ev = (struct uart_midi_event_packet){
-            .length = uart_midi_processor_buffer_index, 
-            .byte1 = uart_midi_processor_buffer[0], 
-            .byte2 = uart_midi_processor_buffer[1], 
-            .byte3 = uart_midi_processor_buffer[2]
-          };
-
-          // Clear buffer
-
-          uart_midi_processor_buffer[0] = 0;
-          uart_midi_processor_buffer[1] = 0;
-          uart_midi_processor_buffer[2] = 0;
-          uart_midi_processor_buffer_index = 0;
-          uart_midi_processor_buffer_limit = 0;
-        }
+    // store the command, only channel messages establish running status
+    parser->running_status = byte < 0xF0 ? byte : 0;
+    parser->buffer[0] = byte;
+    parser->index = 1;
+    parser->limit = midi_parser_message_length(byte);
+
+    if (parser->limit == 1){
+      // single byte system common message, complete already
+      return midi_parser_emit(parser, msg);
+    }
+    if (parser->limit == 0){
+      parser->index = 0;
+    }
+  }
+  else{
+
+    if (parser->index == 0){
 
+      if (parser->running_status == 0){
+        // data byte without any status to belong to
+        return 0;
       }
 
+      // running status: the data byte starts a new message with the previous status
+      parser->buffer[0] = parser->running_status;
+      parser->index = 1;
+      parser->limit = midi_parser_message_length(parser->running_status);
     }
 
+    // store incoming byte
+    parser->buffer[parser->index] = byte;
+    parser->index++;
+
+    if (parser->index == parser->limit){
+      return midi_parser_emit(parser, msg);
+    }
   }
 
+  return 0;
+}
 
+struct uart_midi_event_packet midi_parser_process_byte(midi_parser_t *parser, uint8_t byte){
 
+  uint8_t msg[3];
+  uint8_t length = midi_parser_feed(parser, byte, msg);
 
+  if (length == 0){
+    return (struct uart_midi_event_packet){.length = 0, .byte1 = 0, .byte2 = 0, .byte3 = 0};
+  }
 
+  return (struct uart_midi_event_packet){.length = length, .byte1 = msg[0], .byte2 = msg[1], .byte3 = msg[2]};
+}
 
+size_t midi_parse_span(midi_parser_t *parser, const uint8_t *data, size_t length, struct usb_midi_event_packet *out, size_t capacity){
 
+  size_t count = 0;
+  uint8_t msg[3];
 
-  return ev;
+  for (size_t i = 0; i < length; i++){
 
-}
\ No newline at end of file
+    uint8_t msg_length = midi_parser_feed(parser, data[i], msg);
+
+    if (msg_length && count < capacity){
+      out[count] = midi_uart_to_usb((struct uart_midi_event_packet){.length = msg_length, .byte1 = msg[0], .byte2 = msg[1], .byte3 = msg[2]});
+      count++;
+    }
+  }
+
+  return count;
+}
+
+
+static midi_parser_t uart_midi_default_parser;
+
+struct uart_midi_event_packet uart_midi_process_byte(uint8_t byte){
+
+  return midi_parser_process_byte(&uart_midi_default_parser, byte);
+}
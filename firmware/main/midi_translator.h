@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #ifdef __cplusplus
@@ -40,6 +41,44 @@ struct uart_midi_event_packet usb_midi_to_uart(struct usb_midi_event_packet usb_
  */
 struct usb_midi_event_packet midi_uart_to_usb(struct uart_midi_event_packet uart_packet);
 
+/**
+ * @brief Convert every USB midi event packet of an IN transfer to uart midi packets.
+ * @param[in] data transfer data buffer, walked in 4 byte strides
+ * @param[in] length actual number of bytes in the transfer
+ * @param[out] out array receiving the translated packets
+ * @param[in] capacity number of packets out can hold
+ *
+ * @return number of packets written to out, CIN 0 padding and reserved packets are skipped
+ */
+size_t usb_midi_decode_transfer(const uint8_t *data, size_t length, struct uart_midi_event_packet *out, size_t capacity);
+
+#define USB_MIDI_ALL_CABLES 0xFFFF
+
+/**
+ * @brief Like usb_midi_decode_transfer, but only decodes the packets of the selected cables.
+ * @param[in] data transfer data buffer, walked in 4 byte strides
+ * @param[in] length actual number of bytes in the transfer
+ * @param[in] cable_mask bit N set decodes the packets of cable number N
+ * @param[out] out array receiving the translated packets
+ * @param[out] cables array receiving the cable number of each packet, may be NULL
+ * @param[in] capacity number of packets out (and cables) can hold
+ *
+ * @return number of packets written to out
+ */
+size_t usb_midi_decode_transfer_cables(const uint8_t *data, size_t length, uint16_t cable_mask,
+                                       struct uart_midi_event_packet *out, uint8_t *cables, size_t capacity);
+
+/**
+ * @brief Pack uart midi packets into one contiguous byte stream for a single uart write.
+ * @param[in] packets uart midi packets
+ * @param[in] count number of packets
+ * @param[out] out destination byte buffer
+ * @param[in] capacity size of out in bytes
+ *
+ * @return number of bytes written to out, packets that do not fit entirely are dropped
+ */
+size_t uart_midi_pack_packets(const struct uart_midi_event_packet *packets, size_t count, uint8_t *out, size_t capacity);
+
 /**
  * @brief Determine wether a given byte represents a MIDI Real-Time Message or not
  * @param[in] byte MIDI byte
@@ -52,7 +91,48 @@ uint8_t uart_midi_is_byte_rtm(uint8_t byte);
 
 
 /**
- * @brief Store next byte and return event packet once completed
+ * State of one UART MIDI byte stream parser. Every input owns its own instance.
+ */
+typedef struct
+{
+  uint8_t buffer[3];
+  uint8_t index;          // number of bytes buffered
+  uint8_t limit;          // length of the message being assembled
+  uint8_t running_status; // last channel status byte, 0 if none
+  uint8_t is_sysex;
+} midi_parser_t;
+
+/**
+ * @brief Reset a parser to its power-on state
+ * @param[out] parser parser instance
+ */
+void midi_parser_init(midi_parser_t *parser);
+
+/**
+ * @brief Store next byte and return event packet once completed.
+ * Handles running status, interleaved real-time messages and 1-3 byte System Common messages.
+ * @param[in] parser parser instance
+ * @param[in] byte incoming 8-bit data chunk
+ *
+ * @return event packet if available, all zeros if not complete yet
+ */
+struct uart_midi_event_packet midi_parser_process_byte(midi_parser_t *parser, uint8_t byte);
+
+/**
+ * @brief Parse a whole buffer of UART bytes into USB midi event packets in one call
+ * @param[in] parser parser instance, state carries over between calls
+ * @param[in] data received bytes
+ * @param[in] length number of received bytes
+ * @param[out] out array receiving the packed usb event packets (cable 0)
+ * @param[in] capacity number of packets out can hold; a byte completes at most one
+ *            message, so capacity >= length never drops anything
+ *
+ * @return number of packets written to out, packets beyond capacity are dropped
+ */
+size_t midi_parse_span(midi_parser_t *parser, const uint8_t *data, size_t length, struct usb_midi_event_packet *out, size_t capacity);
+
+/**
+ * @brief Store next byte and return event packet once completed, using the default parser instance
  * @param[in] byte incoming 8-bit data chunk
  *
  * @return event packet if available, all zeros if not complete yet
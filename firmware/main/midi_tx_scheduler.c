@@ -0,0 +1,339 @@
+#include <stdint.h>
+#include <string.h>
+#include "midi_tx_scheduler.h"
+
+#define MIDI_TX_LANE_MASK (MIDI_TX_LANE_SIZE - 1)
+
+static void midi_tx_lane_init(midi_tx_lane_t *lane){
+
+  atomic_store_explicit(&lane->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&lane->tail, 0, memory_order_release);
+  atomic_store(&lane->claimed, UINT32_MAX);
+  lane->depth_max = 0;
+  lane->wait_max_us = 0;
+  lane->messages = 0;
+  lane->dropped = 0;
+  lane->coalesced = 0;
+}
+
+static bool midi_tx_lane_push(midi_tx_lane_t *lane, struct uart_midi_event_packet msg, uint32_t now_us){
+
+  uint32_t head = atomic_load_explicit(&lane->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&lane->tail, memory_order_acquire);
+
+  if (head - tail >= MIDI_TX_LANE_SIZE){
+    lane->dropped++;
+    return false;
+  }
+
+  lane->entries[head & MIDI_TX_LANE_MASK].msg = msg;
+  lane->entries[head & MIDI_TX_LANE_MASK].enqueued_at = now_us;
+  atomic_store_explicit(&lane->head, head + 1, memory_order_release);
+
+  if (head + 1 - tail > lane->depth_max){
+    lane->depth_max = head + 1 - tail;
+  }
+
+  return true;
+}
+
+// Oldest entry of a lane or NULL if empty, consumer side
+static struct midi_tx_entry *midi_tx_lane_peek(midi_tx_lane_t *lane){
+
+  uint32_t tail = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&lane->head, memory_order_acquire);
+
+  if (head == tail){
+    return NULL;
+  }
+
+  return &lane->entries[tail & MIDI_TX_LANE_MASK];
+}
+
+// The consumer starts on the oldest entry, a producer overwriting it from now on has to queue its value as well
+static void midi_tx_lane_claim(midi_tx_lane_t *lane){
+
+  atomic_store(&lane->claimed, atomic_load_explicit(&lane->tail, memory_order_relaxed));
+}
+
+static struct uart_midi_event_packet midi_tx_entry_load(struct midi_tx_entry *entry){
+
+  struct uart_midi_event_packet msg;
+  uint32_t word = atomic_load(&entry->word);
+  memcpy(&msg, &word, sizeof(msg));
+  return msg;
+}
+
+// Overwrite the value waiting at position, producer side; false if it is gone, or the consumer may have read it already
+static bool midi_tx_lane_replace(midi_tx_lane_t *lane, uint32_t position, uint32_t barrier, struct uart_midi_event_packet msg){
+
+  uint32_t head = atomic_load_explicit(&lane->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&lane->tail, memory_order_acquire);
+
+  if (position - tail >= head - tail || (int32_t)(position - barrier) < 0 || (int32_t)(position - atomic_load(&lane->claimed)) <= 0){
+    return false;
+  }
+
+  // the slot table may point at a position from an earlier pass over the ring
+  struct midi_tx_entry *entry = &lane->entries[position & MIDI_TX_LANE_MASK];
+  struct uart_midi_event_packet queued = midi_tx_entry_load(entry);
+  if (queued.byte1 != msg.byte1 || ((msg.byte1 & 0xF0) == 0xB0 && queued.byte2 != msg.byte2)){
+    return false;
+  }
+
+  uint32_t word;
+  memcpy(&word, &msg, sizeof(word));
+  atomic_store(&entry->word, word);
+
+  // the consumer claims before it loads, so either it sees the new value or we see its claim
+  if ((int32_t)(position - atomic_load(&lane->claimed)) <= 0){
+    return false;
+  }
+
+  lane->coalesced++;
+  return true;
+}
+
+static void midi_tx_lane_pop(midi_tx_scheduler_t *scheduler, enum midi_tx_lane index, size_t end){
+
+  midi_tx_lane_t *lane = &scheduler->lanes[index];
+  uint32_t tail = atomic_load_explicit(&lane->tail, memory_order_relaxed);
+
+  if (scheduler->sent_count < MIDI_TX_SENT_MAX){
+    scheduler->sent[scheduler->sent_count].enqueued_at = lane->entries[tail & MIDI_TX_LANE_MASK].enqueued_at;
+    scheduler->sent[scheduler->sent_count].lane = index;
+    scheduler->sent[scheduler->sent_count].end = end;
+    scheduler->sent_count++;
+  }
+
+  atomic_store_explicit(&lane->tail, tail + 1, memory_order_release);
+  lane->messages++;
+}
+
+static void midi_tx_lane_account_wait(midi_tx_lane_t *lane, const struct midi_tx_entry *entry, uint32_t now_us){
+
+  uint32_t wait = now_us - entry->enqueued_at;
+  if (wait > lane->wait_max_us){
+    lane->wait_max_us = wait;
+  }
+}
+
+static inline uint8_t midi_tx_msg_byte(const struct uart_midi_event_packet *msg, uint8_t index){
+
+  return index == 0 ? msg->byte1 : index == 1 ? msg->byte2 : msg->byte3;
+}
+
+// Where the newest value of the message's controller sits, NULL if the message may not be overwritten
+static uint16_t *midi_tx_coalesce_slot(midi_tx_coalesce_t *coalesce, struct uart_midi_event_packet msg){
+
+  uint8_t channel = msg.byte1 & 0x0F;
+
+  switch (msg.byte1 & 0xF0){
+    case 0xB0:
+      // bank select, data entry, (N)RPN and channel mode messages only mean something in their order
+      if (msg.length != 3 || msg.byte2 == 0 || msg.byte2 == 6 || msg.byte2 == 32 || msg.byte2 == 38 ||
+          (msg.byte2 >= 96 && msg.byte2 <= 101) || msg.byte2 >= 120){
+        return NULL;
+      }
+      return &coalesce->cc[channel][msg.byte2];
+    case 0xD0:
+      return msg.length == 2 ? &coalesce->pressure[channel] : NULL;
+    case 0xE0:
+      return msg.length == 3 ? &coalesce->pitch_bend[channel] : NULL;
+    default:
+      return NULL;
+  }
+}
+
+static bool midi_tx_scheduler_push_normal(midi_tx_scheduler_t *scheduler, struct uart_midi_event_packet msg, uint32_t now_us){
+
+  midi_tx_lane_t *lane = &scheduler->lanes[MIDI_TX_LANE_NORMAL];
+  midi_tx_coalesce_t *coalesce = &scheduler->coalesce;
+  uint32_t head = atomic_load_explicit(&lane->head, memory_order_relaxed);
+  uint16_t *slot = midi_tx_coalesce_slot(coalesce, msg);
+
+  if (slot == NULL){
+    // nothing queued before this message may overtake it
+    if (!midi_tx_lane_push(lane, msg, now_us)){
+      return false;
+    }
+    coalesce->barrier = head + 1;
+    return true;
+  }
+
+  uint32_t position = head - (uint16_t)((uint16_t)head - *slot);
+  if (midi_tx_scheduler_depth(scheduler, MIDI_TX_LANE_NORMAL) >= MIDI_TX_COALESCE_DEPTH &&
+      midi_tx_lane_replace(lane, position, coalesce->barrier, msg)){
+    return true;
+  }
+
+  if (!midi_tx_lane_push(lane, msg, now_us)){
+    return false;
+  }
+  *slot = (uint16_t)head;
+  return true;
+}
+
+void midi_tx_scheduler_init(midi_tx_scheduler_t *scheduler){
+
+  for (int i = 0; i < MIDI_TX_LANE_COUNT; i++){
+    midi_tx_lane_init(&scheduler->lanes[i]);
+  }
+  scheduler->offset = 0;
+  scheduler->in_sysex = 0;
+  scheduler->active = MIDI_TX_LANE_NORMAL;
+  scheduler->sent_count = 0;
+  scheduler->running_status = false;
+  scheduler->running_status_byte = 0;
+  memset(&scheduler->coalesce, 0, sizeof(scheduler->coalesce));
+}
+
+bool midi_tx_scheduler_push(midi_tx_scheduler_t *scheduler, struct uart_midi_event_packet msg, uint32_t now_us){
+
+  if (msg.length == 0){
+    return true;
+  }
+
+  if (msg.length == 1 && uart_midi_is_byte_rtm(msg.byte1)){
+    return midi_tx_lane_push(&scheduler->lanes[MIDI_TX_LANE_REALTIME], msg, now_us);
+  }
+
+  return midi_tx_scheduler_push_normal(scheduler, msg, now_us);
+}
+
+bool midi_tx_scheduler_push_clock(midi_tx_scheduler_t *scheduler, uint8_t byte, uint32_t now_us){
+
+  struct uart_midi_event_packet msg = { .length = 1, .byte1 = byte };
+
+  return midi_tx_lane_push(&scheduler->lanes[MIDI_TX_LANE_CLOCK], msg, now_us);
+}
+
+bool midi_tx_scheduler_push_reply(midi_tx_scheduler_t *scheduler, struct uart_midi_event_packet msg, uint32_t now_us){
+
+  if (msg.length == 0){
+    return true;
+  }
+
+  return midi_tx_lane_push(&scheduler->lanes[MIDI_TX_LANE_REPLY], msg, now_us);
+}
+
+size_t midi_tx_scheduler_pull(midi_tx_scheduler_t *scheduler, uint32_t now_us, uint8_t *out, size_t max){
+
+  size_t count = 0;
+
+  scheduler->sent_count = 0;
+
+  while (count < max){
+
+    // real-time bytes go first whenever the wire is at a point where they may be inserted
+    enum midi_tx_lane realtime = MIDI_TX_LANE_CLOCK;
+    struct midi_tx_entry *entry = midi_tx_lane_peek(&scheduler->lanes[realtime]);
+    if (entry == NULL){
+      realtime = MIDI_TX_LANE_REALTIME;
+      entry = midi_tx_lane_peek(&scheduler->lanes[realtime]);
+    }
+
+    if (entry != NULL){
+      midi_tx_lane_account_wait(&scheduler->lanes[realtime], entry, now_us);
+      out[count++] = entry->msg.byte1;
+      midi_tx_lane_pop(scheduler, realtime, count);
+      continue;
+    }
+
+    // between messages the normal lane goes ahead of replies, inside one the wire stays on its lane
+    if (scheduler->offset == 0 && !scheduler->in_sysex){
+      scheduler->active = midi_tx_lane_peek(&scheduler->lanes[MIDI_TX_LANE_NORMAL]) ? MIDI_TX_LANE_NORMAL : MIDI_TX_LANE_REPLY;
+    }
+    midi_tx_lane_t *lane = &scheduler->lanes[scheduler->active];
+
+    entry = midi_tx_lane_peek(lane);
+    if (entry == NULL){
+      break;
+    }
+
+    if (scheduler->offset == 0){
+      midi_tx_lane_account_wait(lane, entry, now_us);
+      midi_tx_lane_claim(lane);
+    }
+
+    // read once after the claim, a newer value cannot land in the middle of it
+    struct uart_midi_event_packet msg = midi_tx_entry_load(entry);
+    uint8_t first = msg.byte1;
+
+    if (scheduler->in_sysex || first == 0xF0){
+
+      // SysEx bytes go one at a time so real-time bytes can slip in between any two of them
+      uint8_t byte = midi_tx_msg_byte(&msg, scheduler->offset);
+      out[count++] = byte;
+      scheduler->offset++;
+
+      scheduler->running_status_byte = 0;
+      if (byte == 0xF0){
+        scheduler->in_sysex = 1;
+      }
+      else if (byte > 0x7F){
+        // F7 or any other status byte ends the SysEx
+        scheduler->in_sysex = 0;
+      }
+
+      if (scheduler->offset >= msg.length){
+        scheduler->offset = 0;
+        midi_tx_lane_pop(scheduler, scheduler->active, count);
+      }
+      continue;
+    }
+
+    // the status byte is left out if the receiver still holds it, system common messages cancel it
+    bool channel = first >= 0x80 && first < 0xF0;
+    uint8_t skip = channel && scheduler->running_status && first == scheduler->running_status_byte &&
+                   now_us - scheduler->running_status_sent_at < MIDI_TX_RUNNING_STATUS_REFRESH_US;
+
+    // other messages are atomic: send them whole or wait for the next pull
+    if ((size_t)(msg.length - skip) > max - count){
+      break;
+    }
+
+    for (uint8_t i = skip; i < msg.length; i++){
+      out[count++] = midi_tx_msg_byte(&msg, i);
+    }
+    if (channel && !skip){
+      scheduler->running_status_byte = first;
+      scheduler->running_status_sent_at = now_us;
+    }
+    else if (!channel){
+      scheduler->running_status_byte = 0;
+    }
+    midi_tx_lane_pop(scheduler, scheduler->active, count);
+  }
+
+  return count;
+}
+
+void midi_tx_scheduler_cancel_running_status(midi_tx_scheduler_t *scheduler){
+
+  scheduler->running_status_byte = 0;
+}
+
+bool midi_tx_scheduler_at_boundary(const midi_tx_scheduler_t *scheduler){
+
+  return scheduler->offset == 0 && !scheduler->in_sysex;
+}
+
+uint32_t midi_tx_scheduler_depth(midi_tx_scheduler_t *scheduler, enum midi_tx_lane lane){
+
+  midi_tx_lane_t *l = &scheduler->lanes[lane];
+
+  return atomic_load_explicit(&l->head, memory_order_acquire) - atomic_load_explicit(&l->tail, memory_order_acquire);
+}
+
+void midi_tx_scheduler_get_stats(midi_tx_scheduler_t *scheduler, enum midi_tx_lane lane, struct midi_tx_lane_stats *stats){
+
+  midi_tx_lane_t *l = &scheduler->lanes[lane];
+
+  stats->depth = midi_tx_scheduler_depth(scheduler, lane);
+  stats->depth_max = l->depth_max;
+  stats->wait_max_us = l->wait_max_us;
+  stats->messages = l->messages;
+  stats->dropped = l->dropped;
+  stats->coalesced = l->coalesced;
+}
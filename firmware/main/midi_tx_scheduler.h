@@ -0,0 +1,209 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "midi_translator.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+  TRS output scheduler
+
+  Messages waiting for the 31250 baud wire are queued in lanes. The
+  real-time lane (F8 clock, FA start, FB continue, FC stop and the other
+  single byte real-time messages) always goes first. Channel voice and
+  system common messages are never split, so real-time bytes jump ahead at
+  message boundaries; inside a SysEx they may be interleaved between any
+  two bytes, as the MIDI spec allows. Replies to configuration requests
+  have a lane below the normal one; the wire switches between the two only
+  at message boundaries outside a SysEx, so neither cuts the other's SysEx
+  short.
+
+  Under backlog, control changes, pitch bend and channel pressure do not
+  queue up behind their own older values: a newer value overwrites the one
+  still waiting in the normal lane, so a sweep of several encoders takes
+  one slot per controller instead of growing the queue. Only values queued
+  after the last message of any other kind are overwritten, so a new value
+  never moves ahead of a note, a SysEx or a program change.
+
+  With running status on, a channel message leaves out its status byte
+  when it is the same as the one before, a third of the wire time of a
+  dense note or controller stream. Real-time bytes do not interrupt it,
+  a SysEx or system common message cancels it, and the status byte is
+  sent again once it is MIDI_TX_RUNNING_STATUS_REFRESH_US old, so a
+  receiver plugged in or idle meanwhile picks the stream up again.
+
+  Each lane is a single producer, single consumer ring, so producers on
+  another core hand messages over without taking a lock. The clock engine
+  has a lane of its own, everything else is pushed from the USB IN worker,
+  replies from the TRS input task, and one task pulls.
+
+*/
+
+#define MIDI_TX_LANE_SIZE 256 // entries per lane, must be a power of two
+#define MIDI_TX_SENT_MAX  8   // messages finished by one pull that are reported, see midi_tx_scheduler_t sent
+#define MIDI_TX_COALESCE_DEPTH 8  // normal lane entries from which newer controller values overwrite queued ones
+#define MIDI_TX_RUNNING_STATUS_REFRESH_US 100000  // a status byte is repeated at least this often
+
+enum midi_tx_lane
+{
+  MIDI_TX_LANE_CLOCK = 0,
+  MIDI_TX_LANE_REALTIME,
+  MIDI_TX_LANE_NORMAL,
+  MIDI_TX_LANE_REPLY,
+  MIDI_TX_LANE_COUNT
+};
+
+struct midi_tx_entry
+{
+  union
+  {
+    struct uart_midi_event_packet msg;
+    _Atomic uint32_t word;  // the message as one store, for overwriting it while queued
+  };
+  uint32_t enqueued_at;     // an overwritten value keeps the arrival of the one it replaced
+};
+
+// A message whose last byte went out with the latest pull
+struct midi_tx_sent
+{
+  uint32_t enqueued_at;
+  uint8_t lane;
+  uint8_t end;  // bytes of the pull up to and including the message's last one
+};
+
+struct midi_tx_lane_stats
+{
+  uint32_t depth;        // entries waiting right now
+  uint32_t depth_max;    // deepest the lane has been
+  uint32_t wait_max_us;  // longest time an entry waited before its first byte was pulled
+  uint32_t messages;     // entries sent
+  uint32_t dropped;      // entries rejected because the lane was full
+  uint32_t coalesced;    // entries overwritten in place by a newer value instead of queued
+};
+
+typedef struct
+{
+  struct midi_tx_entry entries[MIDI_TX_LANE_SIZE];
+  _Atomic uint32_t head;
+  _Atomic uint32_t tail;
+  _Atomic uint32_t claimed;  // entry the consumer has started on, a producer no longer overwrites it
+  uint32_t depth_max;
+  uint32_t wait_max_us;
+  uint32_t messages;
+  uint32_t dropped;
+  uint32_t coalesced;
+} midi_tx_lane_t;
+
+// Producer side of the normal lane: position of the newest value of every controller that can be overwritten
+typedef struct
+{
+  uint16_t cc[16][128];
+  uint16_t pressure[16];
+  uint16_t pitch_bend[16];
+  uint32_t barrier;  // lane position right after the newest message that nothing may move ahead of
+} midi_tx_coalesce_t;
+
+typedef struct
+{
+  midi_tx_lane_t lanes[MIDI_TX_LANE_COUNT];
+  uint8_t offset;     // bytes of the message lane head entry already pulled
+  uint8_t in_sysex;   // the wire is inside a SysEx message
+  uint8_t active;     // message lane (normal or reply) the wire is in the middle of
+  bool running_status;              // leave out repeated status bytes, set by the consumer
+  uint8_t running_status_byte;      // channel status the receiver holds, 0 for none
+  uint32_t running_status_sent_at;  // when it was last on the wire
+  midi_tx_coalesce_t coalesce;
+
+  // Consumer side: what the latest pull finished, for the latency once those bytes are on the wire
+  struct midi_tx_sent sent[MIDI_TX_SENT_MAX];
+  uint8_t sent_count;
+} midi_tx_scheduler_t;
+
+/**
+ * @brief Reset every lane
+ * @param[out] scheduler scheduler
+ */
+void midi_tx_scheduler_init(midi_tx_scheduler_t *scheduler);
+
+/**
+ * @brief Queue a message, real-time messages go to the real-time lane
+ * @param[in] scheduler scheduler
+ * @param[in] msg 1-3 byte message or SysEx chunk
+ * @param[in] now_us when the message arrived, its wait and latency count from here
+ *
+ * @return false if the lane was full and the message was dropped, true if queued or merged into a queued value
+ */
+bool midi_tx_scheduler_push(midi_tx_scheduler_t *scheduler, struct uart_midi_event_packet msg, uint32_t now_us);
+
+/**
+ * @brief Queue a real-time byte from the clock engine on its own lane
+ * @param[in] scheduler scheduler
+ * @param[in] byte real-time status byte, F8 for a clock pulse
+ * @param[in] now_us when the message arrived, its wait and latency count from here
+ *
+ * @return false if the lane was full and the byte was dropped
+ */
+bool midi_tx_scheduler_push_clock(midi_tx_scheduler_t *scheduler, uint8_t byte, uint32_t now_us);
+
+/**
+ * @brief Queue a piece of a configuration reply, called from the reply producer only
+ * @param[in] scheduler scheduler
+ * @param[in] msg 1-3 byte message or SysEx chunk
+ * @param[in] now_us when the message arrived, its wait and latency count from here
+ *
+ * @return false if the lane was full and the message was dropped
+ */
+bool midi_tx_scheduler_push_reply(midi_tx_scheduler_t *scheduler, struct uart_midi_event_packet msg, uint32_t now_us);
+
+/**
+ * @brief Pull the next bytes for the wire in priority order
+ * @param[in] scheduler scheduler
+ * @param[in] now_us timestamp used for the wait statistics
+ * @param[out] out byte buffer
+ * @param[in] max capacity of out, at least 3 so every message fits
+ *
+ * @return number of bytes written to out
+ *
+ * The messages this pull finished are listed in sent, up to MIDI_TX_SENT_MAX of them.
+ */
+size_t midi_tx_scheduler_pull(midi_tx_scheduler_t *scheduler, uint32_t now_us, uint8_t *out, size_t max);
+
+/**
+ * @brief The receiver may have lost the running status, e.g. it was rewired; the next message carries its status byte
+ * @param[in] scheduler scheduler
+ */
+void midi_tx_scheduler_cancel_running_status(midi_tx_scheduler_t *scheduler);
+
+/**
+ * @brief Whether everything pulled so far ends on a message boundary, consumer side
+ * @param[in] scheduler scheduler
+ *
+ * @return false while a message, SysEx included, is only partly pulled
+ */
+bool midi_tx_scheduler_at_boundary(const midi_tx_scheduler_t *scheduler);
+
+/**
+ * @brief Number of entries waiting in a lane
+ * @param[in] scheduler scheduler
+ * @param[in] lane enum midi_tx_lane
+ */
+uint32_t midi_tx_scheduler_depth(midi_tx_scheduler_t *scheduler, enum midi_tx_lane lane);
+
+/**
+ * @brief Snapshot of a lane's counters
+ * @param[in] scheduler scheduler
+ * @param[in] lane enum midi_tx_lane
+ * @param[out] stats counters
+ */
+void midi_tx_scheduler_get_stats(midi_tx_scheduler_t *scheduler, enum midi_tx_lane lane, struct midi_tx_lane_stats *stats);
+
+
+#ifdef __cplusplus
+}
+#endif
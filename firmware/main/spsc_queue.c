@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include "spsc_queue.h"
+
+void spsc_queue_init(spsc_queue_t *queue, uint32_t *storage, uint32_t size){
+
+  queue->buffer = storage;
+  queue->mask = size - 1;
+  atomic_store_explicit(&queue->head, 0, memory_order_relaxed);
+  atomic_store_explicit(&queue->tail, 0, memory_order_release);
+}
+
+bool spsc_queue_push(spsc_queue_t *queue, uint32_t value){
+
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+  if (head - tail > queue->mask){
+    // full
+    return false;
+  }
+
+  queue->buffer[head & queue->mask] = value;
+  atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+  return true;
+}
+
+bool spsc_queue_pop(spsc_queue_t *queue, uint32_t *value){
+
+  return spsc_queue_pop_many(queue, value, 1) == 1;
+}
+
+size_t spsc_queue_pop_many(spsc_queue_t *queue, uint32_t *values, size_t max){
+
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+
+  size_t count = head - tail;
+  if (count > max){
+    count = max;
+  }
+
+  for (size_t i = 0; i < count; i++){
+    values[i] = queue->buffer[(tail + i) & queue->mask];
+  }
+
+  atomic_store_explicit(&queue->tail, tail + count, memory_order_release);
+
+  return count;
+}
+
+uint32_t spsc_queue_count(spsc_queue_t *queue){
+
+  uint32_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+  uint32_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+
+  return head - tail;
+}
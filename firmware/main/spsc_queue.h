@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Lock-free single producer, single consumer queue of 32-bit words.
+ *
+ * A USB MIDI event packet is exactly one word, so the queue carries packets
+ * between two tasks (even on different cores) without a critical section.
+ * Exactly one task may push and exactly one task may pop.
+ */
+typedef struct
+{
+  uint32_t *buffer;
+  uint32_t mask;
+  _Atomic uint32_t head;  // written by the producer only
+  _Atomic uint32_t tail;  // written by the consumer only
+} spsc_queue_t;
+
+/**
+ * Static initializer, size must be a power of two and match the storage array
+ */
+#define SPSC_QUEUE_INIT(storage, size) { .buffer = (storage), .mask = (size) - 1 }
+
+/**
+ * @brief Initialize a queue over caller provided storage
+ * @param[in] queue queue
+ * @param[in] storage word array backing the queue
+ * @param[in] size number of words in storage, must be a power of two
+ */
+void spsc_queue_init(spsc_queue_t *queue, uint32_t *storage, uint32_t size);
+
+/**
+ * @brief Append a word, producer side
+ * @param[in] queue queue
+ * @param[in] value word to append
+ *
+ * @return false if the queue is full and the word was not stored
+ */
+bool spsc_queue_push(spsc_queue_t *queue, uint32_t value);
+
+/**
+ * @brief Take the oldest word, consumer side
+ * @param[in] queue queue
+ * @param[out] value oldest word
+ *
+ * @return false if the queue is empty
+ */
+bool spsc_queue_pop(spsc_queue_t *queue, uint32_t *value);
+
+/**
+ * @brief Take up to max words in one go, consumer side
+ * @param[in] queue queue
+ * @param[out] values destination array
+ * @param[in] max capacity of values
+ *
+ * @return number of words taken
+ */
+size_t spsc_queue_pop_many(spsc_queue_t *queue, uint32_t *values, size_t max);
+
+/**
+ * @brief Number of words currently queued, exact only from the producer or consumer
+ * @param[in] queue queue
+ */
+uint32_t spsc_queue_count(spsc_queue_t *queue);
+
+
+#ifdef __cplusplus
+}
+#endif
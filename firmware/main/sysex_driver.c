@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "esp_log.h"
+
+#include "sysex_driver.h"
+#include "config_driver.h"
+#include "class_driver.h"
+#include "clock_driver.h"
+#include "midi_clock.h"
+#include "midi_tx_scheduler.h"
+#include "ab_switch_driver.h"
+#include "midi_pipeline.h"
+
+#define SYSEX_REQUEST_QUEUE_SIZE    (MIDI_PIPELINE_MAX_SOURCES + 1) //A port is busy until answered, so one entry per port
+
+static const char *TAG = "SYSEX";
+
+static QueueHandle_t sysex_request_queue;
+
+extern void uart_get_tx_stats(enum midi_tx_lane lane, struct midi_tx_lane_stats *stats);
+extern void uart_trs_ab_refresh(void);
+
+static size_t sysex_encode_config(uint8_t *blob)
+{
+    const knot_config_snapshot_t *config = config_driver_acquire();
+    size_t size = knot_config_encode(&config->config, blob, KNOT_CONFIG_MAX_SIZE);
+    config_driver_release(config);
+    return size;
+}
+
+static void sysex_reply_counters(knot_sysex_writer_t *writer)
+{
+    struct usb_midi_out_stats out;
+    usb_midi_out_get_stats(&out);
+    knot_sysex_reply_write_u32(writer, out.packets_queued);
+    knot_sysex_reply_write_u32(writer, out.packets_dropped_queue_full);
+    knot_sysex_reply_write_u32(writer, out.packets_dropped_no_device);
+    knot_sysex_reply_write_u32(writer, out.packets_dropped_device_busy);
+    knot_sysex_reply_write_u32(writer, out.packets_sent);
+    knot_sysex_reply_write_u32(writer, out.transfers_failed);
+
+    struct usb_midi_in_stats in;
+    usb_midi_in_get_stats(&in);
+    knot_sysex_reply_write_u32(writer, in.transfers_completed);
+    knot_sysex_reply_write_u32(writer, in.submit_failed);
+    knot_sysex_reply_write_u32(writer, in.idle_max_us);
+
+    for (int lane = 0; lane < MIDI_TX_LANE_COUNT; lane++) {
+        struct midi_tx_lane_stats tx;
+        uart_get_tx_stats(lane, &tx);
+        knot_sysex_reply_write_u32(writer, tx.messages);
+        knot_sysex_reply_write_u32(writer, tx.dropped);
+        knot_sysex_reply_write_u32(writer, tx.wait_max_us);
+    }
+
+    struct clock_driver_stats clock;
+    clock_driver_get_stats(&clock);
+    knot_sysex_reply_write_u32(writer, clock.pulses);
+    knot_sysex_reply_write_u32(writer, clock.wake_latency_max_us);
+}
+
+static void sysex_reply_latency(knot_sysex_writer_t *writer)
+{
+    for (int path = 0; path < MIDI_PIPELINE_PATH_COUNT; path++) {
+        struct latency_hist_summary summary;
+        latency_hist_summarize(&midi_pipeline.latency[path], &summary);
+        knot_sysex_reply_write_u32(writer, summary.count);
+        knot_sysex_reply_write_u32(writer, summary.p50_us);
+        knot_sysex_reply_write_u32(writer, summary.p99_us);
+        knot_sysex_reply_write_u32(writer, summary.max_us);
+    }
+}
+
+static void sysex_reply_state(knot_sysex_writer_t *writer)
+{
+    struct clock_driver_stats clock;
+    clock_driver_get_stats(&clock);
+    knot_sysex_reply_write_u32(writer, clock_driver_get_period() >> MIDI_CLOCK_FRAC_BITS);
+    knot_sysex_reply_write_u32(writer, clock.pulses);
+
+    const knot_config_snapshot_t *config = config_driver_acquire();
+    uint8_t state[] = { KNOT_CONFIG_VERSION, config->config.rule_count, config->config.trs_ab, ab_switch_get() };
+    config_driver_release(config);
+    knot_sysex_reply_write(writer, state, sizeof(state));
+}
+
+static void sysex_run(knot_sysex_port_t *port)
+{
+    knot_sysex_parser_t *parser = &port->parser;
+    knot_sysex_writer_t writer;
+    uint8_t status = parser->valid ? KNOT_SYSEX_OK : KNOT_SYSEX_INVALID;
+
+    switch (parser->command) {
+    case KNOT_SYSEX_CONFIG_WRITE:
+    case KNOT_SYSEX_CONFIG_RESET:
+        if (parser->command == KNOT_SYSEX_CONFIG_RESET) {
+            knot_config_defaults(&port->staging);
+        }
+        if (status == KNOT_SYSEX_OK) {
+            esp_err_t err = config_driver_update(&port->staging);
+            status = err == ESP_OK ? KNOT_SYSEX_OK : err == ESP_ERR_INVALID_ARG ? KNOT_SYSEX_INVALID : KNOT_SYSEX_STORAGE_ERROR;
+            //The TRS A/B mode may have changed, nothing polls it
+            uart_trs_ab_refresh();
+        }
+        knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+        break;
+    case KNOT_SYSEX_CONFIG_READ: {
+        //Encoded before the reply starts, so running out of memory can still be reported
+        uint8_t *blob = status == KNOT_SYSEX_OK ? malloc(KNOT_CONFIG_MAX_SIZE) : NULL;
+        if (status == KNOT_SYSEX_OK && blob == NULL) {
+            status = KNOT_SYSEX_STORAGE_ERROR;
+        }
+        size_t size = blob ? sysex_encode_config(blob) : 0;
+        knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+        knot_sysex_reply_write(&writer, blob, size);
+        free(blob);
+        break;
+    }
+    case KNOT_SYSEX_COUNTERS_READ:
+        knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+        if (status == KNOT_SYSEX_OK) {
+            sysex_reply_counters(&writer);
+        }
+        break;
+    case KNOT_SYSEX_STATE_READ:
+        knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+        if (status == KNOT_SYSEX_OK) {
+            sysex_reply_state(&writer);
+        }
+        break;
+    case KNOT_SYSEX_LATENCY_READ:
+        knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+        if (status == KNOT_SYSEX_OK) {
+            sysex_reply_latency(&writer);
+        }
+        break;
+    default:
+        status = KNOT_SYSEX_UNKNOWN_COMMAND;
+        knot_sysex_reply_begin(&writer, port->send, port->ctx, parser->command, status);
+        break;
+    }
+
+    knot_sysex_reply_end(&writer);
+    ESP_LOGI(TAG, "Request %02x, status %02x", parser->command, status);
+}
+
+void sysex_driver_init(void)
+{
+    sysex_request_queue = xQueueCreate(SYSEX_REQUEST_QUEUE_SIZE, sizeof(knot_sysex_port_t *));
+    assert(sysex_request_queue);
+}
+
+void sysex_driver_request(knot_sysex_port_t *port)
+{
+    //Called by the IN worker and the RX task, the NVS write and the reply wait in the request task
+    if (xQueueSend(sysex_request_queue, &port, 0) != pdTRUE) {
+        knot_sysex_port_done(port);
+    }
+}
+
+void sysex_driver_task(void *arg)
+{
+    knot_sysex_port_t *port;
+
+    for (;;) {
+        xQueueReceive(sysex_request_queue, &port, portMAX_DELAY);
+        sysex_run(port);
+        knot_sysex_port_done(port);
+    }
+}
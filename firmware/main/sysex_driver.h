@@ -0,0 +1,31 @@
+#pragma once
+
+#include "knot_sysex.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Set up the request queue, before any task feeds the pipeline
+ */
+void sysex_driver_init(void);
+
+/**
+ * @brief Queue the request a port just completed, never blocks
+ * @param[in] port deferred port, its parser holds the command and whether the request was valid
+ */
+void sysex_driver_request(knot_sysex_port_t *port);
+
+/**
+ * @brief Answer queued requests one after the other, applying and storing config writes
+ * @param[in] arg unused
+ *
+ * Replies go out through the port's send, which waits for room, the port is done after its reply.
+ */
+void sysex_driver_task(void *arg);
+
+
+#ifdef __cplusplus
+}
+#endif
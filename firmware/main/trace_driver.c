@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "trace_ring.h"
+
+#ifdef CONFIG_KNOT_TRACE_RING
+
+#define TRACE_DRAIN_PERIOD_MS 100
+
+static const char *TAG = "TRACE";
+
+trace_ring_t trace_ring;
+
+static const char *trace_event_names[TRACE_EV_COUNT] = {
+    [TRACE_EV_USB_IN_MESSAGE] = "usb in message",
+    [TRACE_EV_USB_IN_ERROR] = "usb in error",
+    [TRACE_EV_USB_OUT_ERROR] = "usb out error",
+    [TRACE_EV_TEMPO_PERIOD] = "tempo period",
+    [TRACE_EV_UART_RX_MESSAGE] = "uart rx message",
+    [TRACE_EV_UART_RX_ERROR] = "uart rx error",
+};
+
+uint32_t trace_timestamp(void)
+{
+    return (uint32_t)esp_timer_get_time();
+}
+
+void trace_init(void)
+{
+    trace_ring_init(&trace_ring);
+}
+
+void trace_task(void *arg)
+{
+    struct trace_entry entry;
+
+    ESP_LOGI(TAG, "Trace drain task started");
+
+    for (;;) {
+
+        vTaskDelay(pdMS_TO_TICKS(TRACE_DRAIN_PERIOD_MS));
+
+        while (trace_ring_pop(&trace_ring, &entry)) {
+            const char *name = entry.event < TRACE_EV_COUNT ? trace_event_names[entry.event] : "unknown";
+            ESP_LOGI(TAG, "%10lu us %-16s 0x%08lX", (unsigned long)entry.timestamp, name, (unsigned long)entry.arg);
+        }
+
+        uint32_t dropped = trace_ring_take_dropped(&trace_ring);
+        if (dropped) {
+            ESP_LOGW(TAG, "%lu trace entries dropped", (unsigned long)dropped);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include "trace_ring.h"
+
+/*
+
+  Bounded MPSC queue after D. Vyukov: every cell carries a sequence number.
+  A producer owns a cell once it wins the CAS on head while the cell sequence
+  equals its position, and publishes it by bumping the sequence to position+1.
+  The consumer frees a cell by moving the sequence a full lap ahead.
+
+*/
+
+#define TRACE_RING_MASK (TRACE_RING_SIZE - 1)
+
+void trace_ring_init(trace_ring_t *ring){
+
+  for (uint32_t i = 0; i < TRACE_RING_SIZE; i++){
+    atomic_store_explicit(&ring->cells[i].sequence, i, memory_order_relaxed);
+  }
+
+  atomic_store_explicit(&ring->head, 0, memory_order_relaxed);
+  ring->tail = 0;
+  atomic_store_explicit(&ring->dropped, 0, memory_order_release);
+}
+
+bool trace_ring_push(trace_ring_t *ring, uint32_t timestamp, uint16_t event, uint32_t arg){
+
+  uint32_t pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+  struct trace_cell *cell;
+
+  for (;;){
+
+    cell = &ring->cells[pos & TRACE_RING_MASK];
+    uint32_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    int32_t diff = (int32_t)(sequence - pos);
+
+    if (diff == 0){
+      if (atomic_compare_exchange_weak_explicit(&ring->head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)){
+        break;
+      }
+    }
+    else if (diff < 0){
+      // full: never block the hot path
+      atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+      return false;
+    }
+    else{
+      pos = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    }
+  }
+
+  cell->entry.timestamp = timestamp;
+  cell->entry.arg = arg;
+  cell->entry.event = event;
+
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+
+  return true;
+}
+
+bool trace_ring_pop(trace_ring_t *ring, struct trace_entry *entry){
+
+  uint32_t pos = ring->tail;
+  struct trace_cell *cell = &ring->cells[pos & TRACE_RING_MASK];
+  uint32_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+
+  if ((int32_t)(sequence - (pos + 1)) < 0){
+    // empty
+    return false;
+  }
+
+  *entry = cell->entry;
+
+  atomic_store_explicit(&cell->sequence, pos + TRACE_RING_SIZE, memory_order_release);
+  ring->tail = pos + 1;
+
+  return true;
+}
+
+uint32_t trace_ring_take_dropped(trace_ring_t *ring){
+
+  return atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+}
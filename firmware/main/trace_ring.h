@@ -0,0 +1,155 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+
+  Hot path trace facility
+
+  Forwarding code must not call printf-family functions: a console write at
+  115200 baud takes longer than a MIDI message on the 31250 baud wire. Instead
+  the hot path records small binary events which a low priority task formats
+  and prints later.
+
+  Every subsystem has a compile-time trace level (menuconfig -> Knot trace).
+  Events above the configured level, or all events when the trace ring is
+  disabled, compile to nothing.
+
+*/
+
+#define TRACE_LEVEL_NONE  0
+#define TRACE_LEVEL_ERROR 1
+#define TRACE_LEVEL_INFO  2
+#define TRACE_LEVEL_DEBUG 3
+
+#ifndef CONFIG_KNOT_TRACE_LEVEL_CLASS
+#define CONFIG_KNOT_TRACE_LEVEL_CLASS TRACE_LEVEL_NONE
+#endif
+
+#ifndef CONFIG_KNOT_TRACE_LEVEL_UART
+#define CONFIG_KNOT_TRACE_LEVEL_UART TRACE_LEVEL_NONE
+#endif
+
+#ifndef CONFIG_KNOT_TRACE_LEVEL_CLOCK
+#define CONFIG_KNOT_TRACE_LEVEL_CLOCK TRACE_LEVEL_NONE
+#endif
+
+#define TRACE_LEVEL_CLASS CONFIG_KNOT_TRACE_LEVEL_CLASS
+#define TRACE_LEVEL_UART  CONFIG_KNOT_TRACE_LEVEL_UART
+#define TRACE_LEVEL_CLOCK CONFIG_KNOT_TRACE_LEVEL_CLOCK
+
+// Number of entries in the trace ring, must be a power of two
+#define TRACE_RING_SIZE 256
+
+enum trace_event
+{
+  TRACE_EV_USB_IN_MESSAGE = 0,  // arg: packed uart midi packet
+  TRACE_EV_USB_IN_ERROR,        // arg: usb transfer status
+  TRACE_EV_USB_OUT_ERROR,       // arg: usb transfer status
+  TRACE_EV_TEMPO_PERIOD,        // arg: new clock period in usec
+  TRACE_EV_UART_RX_MESSAGE,     // arg: packed usb midi event packet
+  TRACE_EV_UART_RX_ERROR,       // arg: uart event type
+  TRACE_EV_COUNT
+};
+
+struct trace_entry
+{
+  uint32_t timestamp;
+  uint32_t arg;
+  uint16_t event;
+};
+
+struct trace_cell
+{
+  _Atomic uint32_t sequence;
+  struct trace_entry entry;
+};
+
+/**
+ * Bounded lock-free multi producer, single consumer ring of trace entries.
+ * Producers never block: when the ring is full the entry is dropped and counted.
+ */
+typedef struct
+{
+  struct trace_cell cells[TRACE_RING_SIZE];
+  _Atomic uint32_t head;
+  uint32_t tail;
+  _Atomic uint32_t dropped;
+} trace_ring_t;
+
+// Pack four bytes into a trace argument
+#define TRACE_PACK4(b0, b1, b2, b3) \
+  (((uint32_t)(b0) << 24) | ((uint32_t)(b1) << 16) | ((uint32_t)(b2) << 8) | (uint32_t)(b3))
+
+/**
+ * @brief Reset a trace ring to empty
+ * @param[in] ring trace ring
+ */
+void trace_ring_init(trace_ring_t *ring);
+
+/**
+ * @brief Record an entry, safe to call from any task, core or ISR
+ * @param[in] ring trace ring
+ * @param[in] timestamp time of the event
+ * @param[in] event one of enum trace_event
+ * @param[in] arg event specific argument
+ *
+ * @return true if recorded, false if the ring was full and the entry was dropped
+ */
+bool trace_ring_push(trace_ring_t *ring, uint32_t timestamp, uint16_t event, uint32_t arg);
+
+/**
+ * @brief Take the oldest entry, must only be called from the single draining task
+ * @param[in] ring trace ring
+ * @param[out] entry oldest entry
+ *
+ * @return true if an entry was available
+ */
+bool trace_ring_pop(trace_ring_t *ring, struct trace_entry *entry);
+
+/**
+ * @brief Return and clear the number of dropped entries
+ * @param[in] ring trace ring
+ */
+uint32_t trace_ring_take_dropped(trace_ring_t *ring);
+
+
+#ifdef CONFIG_KNOT_TRACE_RING
+
+extern trace_ring_t trace_ring;
+
+/**
+ * @brief Timestamp source of the TRACE macros, provided by the platform
+ */
+uint32_t trace_timestamp(void);
+
+#define TRACE(subsys, level, event, arg) do {                                   \
+    if (TRACE_LEVEL_##level <= TRACE_LEVEL_##subsys) {                          \
+      trace_ring_push(&trace_ring, trace_timestamp(), (event), (uint32_t)(arg)); \
+    }                                                                           \
+  } while (0)
+
+#else
+
+#define TRACE(subsys, level, event, arg) do { } while (0)
+
+#endif
+
+#define TRACE_E(subsys, event, arg) TRACE(subsys, ERROR, event, arg)
+#define TRACE_I(subsys, event, arg) TRACE(subsys, INFO, event, arg)
+#define TRACE_D(subsys, event, arg) TRACE(subsys, DEBUG, event, arg)
+
+
+#ifdef __cplusplus
+}
+#endif
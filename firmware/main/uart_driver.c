@@ -6,26 +6,53 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
-#include "freertos/ringbuf.h"
+#include "freertos/task.h"
 #include "esp_log.h"
 #include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_intr_alloc.h"
 
 #include "driver/gpio.h"
 
 
-#include "freertos/queue.h"
 #include "driver/uart.h"
+#include "hal/uart_ll.h"
+#include "soc/uart_periph.h"
 #include "midi_translator.h"
+#include "midi_pipeline.h"
+#include "config_driver.h"
+#include "ab_switch_driver.h"
+#include "spsc_queue.h"
+#include "trace_ring.h"
 
 
 #define EX_UART_NUM UART_NUM_1
-#define PATTERN_CHR_NUM    (3)         /*!< Set the number of consecutive and identical characters received by receiver which defines a UART pattern*/
-
-#define BUF_SIZE (1024)
-#define RD_BUF_SIZE (BUF_SIZE)
-static QueueHandle_t uart0_queue;
+#define EX_UART_HW  UART_LL_GET_HW(EX_UART_NUM)
+
+#define RD_BUF_SIZE (128)
+
+// Bytes pulled per refill of the TX FIFO. The scheduler can only reorder what
+// has not reached the FIFO yet, so this bounds how long a clock tick waits
+// behind other traffic: 3 bytes, one whole message, are about 1 ms on the wire.
+#define TX_CHUNK_SIZE 3
+
+// The RX FIFO is read out once it holds this many bytes or the line went
+// quiet for this many symbols
+#ifdef CONFIG_KNOT_UART_RX_LOW_LATENCY
+#define RX_FULL_THRESHOLD   1       // every byte, a clock tick goes on as soon as its stop bit is in
+#define RX_TIMEOUT_SYMBOLS  1
+#else
+#define RX_FULL_THRESHOLD   120     // the IDF driver defaults
+#define RX_TIMEOUT_SYMBOLS  10
+#endif
+#define RX_QUEUE_SIZE       256     // messages between the interrupt and uart_rx_task, a power of two
+#define RX_SLICE            16      // bytes framed at a time, keeps the interrupt stack small
+
+#define RX_INTR_MASK (UART_INTR_RXFIFO_FULL | UART_INTR_RXFIFO_TOUT | UART_INTR_RXFIFO_OVF | \
+                      UART_INTR_FRAM_ERR | UART_INTR_PARITY_ERR | UART_INTR_BRK_DET)
 
 static const char *TAG = "UART";
 
@@ -33,18 +60,163 @@ static const char *TAG = "UART";
 
 #define TRS_TX_AB_SELECT 15
 #define TRS_RX_AB_SELECT 16
-#define SW_AB_PIN 35
+#define TRS_AB_SELECT_TYPE_A 0   // TRS_TX_AB_SELECT level for type A wiring
+
+
+
+// UART1 belongs to this file: its interrupt is the consumer of midi_pipeline.tx
+// and feeds the TX FIFO straight from the scheduler, no driver ring buffer or
+// mutex in between. It is allocated on the core uart_init runs on.
+static intr_handle_t uart_intr_hdl;
+static portMUX_TYPE uart_intr_lock = portMUX_INITIALIZER_UNLOCKED;  //int_ena is changed from the producers' cores too
+static atomic_bool uart_tx_ready;      //The interrupt is allocated, producers may kick it
+static bool uart_tx_busy;              //Interrupt only: bytes of the latest pull are on the wire, TX_DONE follows
+static atomic_bool trs_ab_pending;     //The wiring has to be looked at again, applied between two messages
+
+// RX: the interrupt frames the bytes of the FIFO into these, uart_rx_task feeds midi_pipeline_trs_in_packets
+static TaskHandle_t uart_rx_task_hdl;
+static midi_parser_t rx_parser;        //Interrupt only
+static spsc_queue_t rx_queue;          //Complete messages as event packets
+static spsc_queue_t rx_stamps;         //Time each message was read from the FIFO, pushed and popped in step with rx_queue
+static uint32_t rx_storage[RX_QUEUE_SIZE];
+static uint32_t rx_stamp_storage[RX_QUEUE_SIZE];
+
+void uart_tx_wake(void);
+void uart_trs_ab_refresh(void);
+
+//Wiring of the TRS output: the hardware switch unless the config forces one
+static int trs_tx_ab_level(void)
+{
+    const knot_config_snapshot_t *config = config_driver_acquire();
+    uint8_t mode = config->config.trs_ab;
+    config_driver_release(config);
+
+    if (mode == KNOT_TRS_AB_FORCE_A) {
+        return TRS_AB_SELECT_TYPE_A;
+    }
+    if (mode == KNOT_TRS_AB_FORCE_B) {
+        return !TRS_AB_SELECT_TYPE_A;
+    }
+    return ab_switch_get() == MIDI_ROUTE_AB_A ? TRS_AB_SELECT_TYPE_A : !TRS_AB_SELECT_TYPE_A;
+}
+
+
+//Interrupt only: switch the wiring once the wire is idle between two messages, never in the middle of one
+static void uart_trs_ab_apply(void)
+{
+    if (!atomic_load(&trs_ab_pending) || !midi_tx_scheduler_at_boundary(&midi_pipeline.tx)) {
+        return;
+    }
+    //Cleared first, a change while the level is looked up sets it again
+    atomic_store(&trs_ab_pending, false);
+    gpio_set_level(TRS_TX_AB_SELECT, trs_tx_ab_level());
+    //What is on the other end now has not seen the last status byte
+    midi_tx_scheduler_cancel_running_status(&midi_pipeline.tx);
+}
+
+
+//Interrupt only: put the next bytes into the empty TX FIFO, TX_DONE fires once their last stop bit is out
+static void uart_tx_refill(uart_dev_t *hw)
+{
+    uint8_t chunk[TX_CHUNK_SIZE];
+
+    uart_trs_ab_apply();
 
+    size_t length = midi_pipeline_trs_out_pull(&midi_pipeline, chunk, sizeof(chunk));
+    uart_tx_busy = length > 0;
+    if (!uart_tx_busy) {
+        return;
+    }
 
+    portENTER_CRITICAL_ISR(&uart_intr_lock);
+    uart_ll_clr_intsts_mask(hw, UART_INTR_TX_DONE);
+    uart_ll_ena_intr_mask(hw, UART_INTR_TX_DONE);
+    portEXIT_CRITICAL_ISR(&uart_intr_lock);
+
+    uart_ll_write_txfifo(hw, chunk, length);
+}
 
-RingbufHandle_t uart_rx_buffer_cvm;
-RingbufHandle_t uart_rx_buffer_rtm;
 
-uint8_t current_is_sysex = 0;
+//Interrupt only: frame what the RX FIFO holds, uart_rx_task is only woken for complete messages
+static void uart_rx_drain(uart_dev_t *hw, BaseType_t *task_woken)
+{
+    uint8_t bytes[RX_SLICE];
+    struct usb_midi_event_packet packets[RX_SLICE];
+    bool complete = false;
+
+    uint32_t received_at = (uint32_t)esp_timer_get_time();
+    uint32_t length;
+    while ((length = uart_ll_get_rxfifo_len(hw)) > 0) {
+        if (length > RX_SLICE) {
+            length = RX_SLICE;
+        }
+        uart_ll_read_rxfifo(hw, bytes, length);
+
+        size_t count = midi_parse_span(&rx_parser, bytes, length, packets, RX_SLICE);
+        for (size_t i = 0; i < count; i++) {
+            if (spsc_queue_count(&rx_queue) >= RX_QUEUE_SIZE) {
+                TRACE_E(UART, TRACE_EV_UART_RX_ERROR, UART_BUFFER_FULL);
+                break;
+            }
+            uint32_t word;
+            memcpy(&word, &packets[i], sizeof(word));
+            spsc_queue_push(&rx_stamps, received_at);
+            spsc_queue_push(&rx_queue, word);
+            complete = true;
+        }
+    }
+
+    if (complete && uart_rx_task_hdl != NULL) {
+        vTaskNotifyGiveFromISR(uart_rx_task_hdl, task_woken);
+    }
+}
+
+
+static void uart_isr(void *arg)
+{
+    uart_dev_t *hw = EX_UART_HW;
+    BaseType_t task_woken = pdFALSE;
+
+    uint32_t status = uart_ll_get_intsts_mask(hw);
+    uart_ll_clr_intsts_mask(hw, status);
+
+    if (status & (UART_INTR_RXFIFO_FULL | UART_INTR_RXFIFO_TOUT)) {
+        uart_rx_drain(hw, &task_woken);
+    }
+    if (status & UART_INTR_RXFIFO_OVF) {
+        //What the FIFO held is lost anyway, start over with the next byte
+        uart_ll_rxfifo_rst(hw);
+        TRACE_E(UART, TRACE_EV_UART_RX_ERROR, UART_FIFO_OVF);
+    }
+    if (status & UART_INTR_BRK_DET) {
+        TRACE_E(UART, TRACE_EV_UART_RX_ERROR, UART_BREAK);
+    }
+    if (status & UART_INTR_PARITY_ERR) {
+        TRACE_E(UART, TRACE_EV_UART_RX_ERROR, UART_PARITY_ERR);
+    }
+    if (status & UART_INTR_FRAM_ERR) {
+        TRACE_E(UART, TRACE_EV_UART_RX_ERROR, UART_FRAME_ERR);
+    }
+
+    if (status & (UART_INTR_TX_DONE | UART_INTR_TXFIFO_EMPTY)) {
+        //Both are one-shot: TX_DONE ends the latest pull, TXFIFO_EMPTY is a kick of uart_tx_wake.
+        //Disabled before the pull, so a producer that queued after it kicks again.
+        portENTER_CRITICAL_ISR(&uart_intr_lock);
+        uart_ll_disable_intr_mask(hw, status & (UART_INTR_TX_DONE | UART_INTR_TXFIFO_EMPTY));
+        portEXIT_CRITICAL_ISR(&uart_intr_lock);
+
+        if (status & UART_INTR_TX_DONE) {
+            uart_tx_busy = false;
+            midi_pipeline_trs_out_done(&midi_pipeline, (uint32_t)esp_timer_get_time());
+        }
+        if (!uart_tx_busy) {
+            uart_tx_refill(hw);
+        }
+    }
+
+    portYIELD_FROM_ISR(task_woken);
+}
 
-extern void led_tx_effect_start(void);
-extern void led_rx_effect_start(void);
-extern void led_err_effect_start(void);
 
 void uart_init(){
 
@@ -63,8 +235,7 @@ void uart_init(){
         .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
         .source_clk = UART_SCLK_DEFAULT,
     };
-    //Install UART driver, and get the queue.
-    uart_driver_install(EX_UART_NUM, BUF_SIZE * 2, BUF_SIZE * 2, 20, &uart0_queue, 0);
+    //No IDF driver, the interrupt below owns the FIFOs
     uart_param_config(EX_UART_NUM, &uart_config);
 
     //Set UART log level
@@ -75,70 +246,66 @@ void uart_init(){
 
     uart_set_line_inverse(EX_UART_NUM, UART_SIGNAL_TXD_INV);
 
-    //Set uart pattern detect function.
-    uart_enable_pattern_det_baud_intr(EX_UART_NUM, '+', PATTERN_CHR_NUM, 9, 0, 0);
-    //Reset the pattern queue length to record at most 20 pattern positions.
-    uart_pattern_queue_reset(EX_UART_NUM, 20);
-
-
-    gpio_set_direction(SW_AB_PIN, GPIO_MODE_INPUT);
+    //Nothing is on the wire yet, the first wiring is set right away
+    ab_switch_driver_init(uart_trs_ab_refresh);
 
     gpio_set_direction(TRS_TX_AB_SELECT, GPIO_MODE_OUTPUT);
     // gpio_set_direction(TRS_RX_AB_SELECT, GPIO_MODE_OUTPUT);
 
-    
-    //gpio_set_level(TRS_TX_AB_SELECT, gpio_get_level(SW_AB_PIN));
-    gpio_set_level(TRS_TX_AB_SELECT, !gpio_get_level(SW_AB_PIN));
-
-
+    gpio_set_level(TRS_TX_AB_SELECT, trs_tx_ab_level());
+
+    midi_parser_init(&rx_parser);
+    spsc_queue_init(&rx_queue, rx_storage, RX_QUEUE_SIZE);
+    spsc_queue_init(&rx_stamps, rx_stamp_storage, RX_QUEUE_SIZE);
+
+    uart_dev_t *hw = EX_UART_HW;
+    uart_ll_disable_intr_mask(hw, UART_LL_INTR_MASK);
+    uart_ll_clr_intsts_mask(hw, UART_LL_INTR_MASK);
+    uart_ll_rxfifo_rst(hw);
+    uart_ll_txfifo_rst(hw);
+    uart_ll_set_rxfifo_full_thr(hw, RX_FULL_THRESHOLD);
+    uart_set_rx_timeout(EX_UART_NUM, RX_TIMEOUT_SYMBOLS);
+    //TXFIFO_EMPTY only fires with nothing left in the FIFO
+    uart_ll_set_txfifo_empty_thr(hw, 1);
+
+    //Not in IRAM, TRS out pauses while the flash is written, e.g. a configuration update
+    ESP_ERROR_CHECK(esp_intr_alloc(uart_periph_signal[EX_UART_NUM].irq, ESP_INTR_FLAG_LEVEL1, uart_isr, NULL, &uart_intr_hdl));
+    uart_ll_ena_intr_mask(hw, RX_INTR_MASK);
+
+    //Producers may have queued before, pick that up right away
+    atomic_store(&uart_tx_ready, true);
+    uart_tx_wake();
+}
 
-    // Channel Voice Message Buffer
-    #define UART_RX_BUFFER_CVM_SIZE 1600
-    uart_rx_buffer_cvm = xRingbufferCreate(UART_RX_BUFFER_CVM_SIZE, RINGBUF_TYPE_NOSPLIT);
-    if (uart_rx_buffer_cvm == NULL) {
-        printf("Failed to create ring buffer\n");
-    }
 
-    // Real-Time Message Buffer
-    #define UART_RX_BUFFER_RTM_SIZE 20
-    uart_rx_buffer_rtm = xRingbufferCreate(UART_RX_BUFFER_RTM_SIZE, RINGBUF_TYPE_NOSPLIT);
-    if (uart_rx_buffer_rtm == NULL) {
-        printf("Failed to create ring buffer\n");
+//Kick the TX interrupt, called by every producer of midi_pipeline.tx after a push
+void uart_tx_wake(void)
+{
+    //The clock task may tick before uart_init allocated the interrupt
+    if (!atomic_load(&uart_tx_ready)) {
+        return;
     }
 
+    //The FIFO is empty whenever the wire is idle, so TXFIFO_EMPTY fires right away then, and
+    //otherwise once the bytes in flight went out: the interrupt ignores it while TX_DONE is pending
+    uart_dev_t *hw = EX_UART_HW;
+    portENTER_CRITICAL_SAFE(&uart_intr_lock);
+    uart_ll_clr_intsts_mask(hw, UART_INTR_TXFIFO_EMPTY);
+    uart_ll_ena_intr_mask(hw, UART_INTR_TXFIFO_EMPTY);
+    portEXIT_CRITICAL_SAFE(&uart_intr_lock);
 }
 
 
-int uart_send_data(struct uart_midi_event_packet ev)
+void uart_trs_ab_refresh(void)
 {
-
-    led_tx_effect_start();
-
-    const int txBytes = uart_write_bytes(EX_UART_NUM, &ev.byte1, ev.length);
-    //printf("MIDI: %d : %d %d %d\n", ev.length, ev.byte1, ev.byte2, ev.byte3);
-    //ESP_LOGI(logName, "Wrote %d bytes %d %d %d", txBytes, data[0], data[1], data[2]);
-    return txBytes;
+    atomic_store(&trs_ab_pending, true);
+    uart_tx_wake();
 }
 
 
-void uart_housekeeping_task(void *arg){
-
-
-
-    SemaphoreHandle_t signaling_sem = (SemaphoreHandle_t)arg;
-    //xSemaphoreTake(signaling_sem, portMAX_DELAY);
-
-    ESP_LOGI(TAG, "UART TX init done");
-
-    for(;;) {
-    
-
-        vTaskDelay(pdMS_TO_TICKS(10));
-
-        //gpio_set_level(TRS_TX_AB_SELECT, gpio_get_level(SW_AB_PIN));
-        gpio_set_level(TRS_TX_AB_SELECT, !gpio_get_level(SW_AB_PIN));
-
-    }
+void uart_get_tx_stats(enum midi_tx_lane lane, struct midi_tx_lane_stats *stats)
+{
+    midi_tx_scheduler_get_stats(&midi_pipeline.tx, lane, stats);
 }
 
 
@@ -150,105 +317,41 @@ void uart_rx_task(void *arg)
     SemaphoreHandle_t signaling_sem = (SemaphoreHandle_t)arg;
     //xSemaphoreTake(signaling_sem, portMAX_DELAY);
 
-    uart_event_t event;
-    size_t buffered_size;
-    uint8_t* dtmp = (uint8_t*) malloc(RD_BUF_SIZE);
+    uint32_t words[RD_BUF_SIZE];
+    struct usb_midi_event_packet packets[RD_BUF_SIZE];
+
+    uart_rx_task_hdl = xTaskGetCurrentTaskHandle();
 
+    //The UART interrupt is allocated on the core that runs uart_init, keep it next to this task
+    uart_init();
 
     ESP_LOGI(TAG, "UART RX init done");
 
     for(;;) {
 
-
-
-        //Waiting for UART event.
-        if(xQueueReceive(uart0_queue, (void * )&event, (TickType_t)portMAX_DELAY)) {
-            bzero(dtmp, RD_BUF_SIZE);
-            //ESP_LOGI(TAG, "uart[%d] event:", EX_UART_NUM);
-            switch(event.type) {
-                //Event of UART receving data
-                /*We'd better handler data event fast, there would be much more data events than
-                other types of events. If we take too much time on data event, the queue might
-                be full.*/
-                case UART_DATA:
-                    
-                    led_rx_effect_start();
-                    
-                    //ESP_LOGI(TAG, "[UART DATA]: %d", event.size);
-                    uart_read_bytes(EX_UART_NUM, dtmp, event.size, portMAX_DELAY);
-                    
-                    for(uint8_t i = 0; i<event.size; i++){
-
-                        struct uart_midi_event_packet uart_ev = uart_midi_process_byte(dtmp[i]);
-
-                        if (uart_ev.length){
-                            struct usb_midi_event_packet usb_ev = midi_uart_to_usb(uart_ev);
-                            printf("USB: %d %d %d %d\n", usb_ev.byte0, usb_ev.byte1, usb_ev.byte2, usb_ev.byte3);
-                        }
-
-                    }
-                    
-                    //ESP_LOGI(TAG, "[DATA EVT]: %d %d %d %d", dtmp[0], dtmp[1], dtmp[2], dtmp[3]);
-                    break;
-                //Event of HW FIFO overflow detected
-                case UART_FIFO_OVF:
-                    ESP_LOGI(TAG, "hw fifo overflow");
-                    // If fifo overflow happened, you should consider adding flow control for your application.
-                    // The ISR has already reset the rx FIFO,
-                    // As an example, we directly flush the rx buffer here in order to read more data.
-                    uart_flush_input(EX_UART_NUM);
-                    xQueueReset(uart0_queue);
-                    break;
-                //Event of UART ring buffer full
-                case UART_BUFFER_FULL:
-                    ESP_LOGI(TAG, "ring buffer full");
-                    // If buffer full happened, you should consider encreasing your buffer size
-                    // As an example, we directly flush the rx buffer here in order to read more data.
-                    uart_flush_input(EX_UART_NUM);
-                    xQueueReset(uart0_queue);
-                    break;
-                //Event of UART RX break detected
-                case UART_BREAK:
-                    ESP_LOGI(TAG, "uart rx break");
-                    break;
-                //Event of UART parity check error
-                case UART_PARITY_ERR:
-                    ESP_LOGI(TAG, "uart parity error");
-                    break;
-                //Event of UART frame error
-                case UART_FRAME_ERR:
-                    ESP_LOGI(TAG, "uart frame error");
-                    break;
-                //UART_PATTERN_DET
-                case UART_PATTERN_DET:
-                    uart_get_buffered_data_len(EX_UART_NUM, &buffered_size);
-                    int pos = uart_pattern_pop_pos(EX_UART_NUM);
-                    ESP_LOGI(TAG, "[UART PATTERN DETECTED] pos: %d, buffered size: %d", pos, buffered_size);
-                    if (pos == -1) {
-                        // There used to be a UART_PATTERN_DET event, but the pattern position queue is full so that it can not
-                        // record the position. We should set a larger queue size.
-                        // As an example, we directly flush the rx buffer here.
-                        uart_flush_input(EX_UART_NUM);
-                    } else {
-                        uart_read_bytes(EX_UART_NUM, dtmp, pos, 100 / portTICK_PERIOD_MS);
-                        uint8_t pat[PATTERN_CHR_NUM + 1];
-                        memset(pat, 0, sizeof(pat));
-                        uart_read_bytes(EX_UART_NUM, pat, PATTERN_CHR_NUM, 100 / portTICK_PERIOD_MS);
-                        ESP_LOGI(TAG, "read data: %s", dtmp);
-                        ESP_LOGI(TAG, "read pat : %s", pat);
-                    }
-                    break;
-                //Others
-                default:
-                    ESP_LOGI(TAG, "uart event type: %d", event.type);
-                    break;
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        size_t count;
+        while ((count = spsc_queue_pop_many(&rx_queue, words, RD_BUF_SIZE)) > 0) {
+
+            //Messages read out by one interrupt share their time, hand them over together
+            size_t start = 0;
+            uint32_t received_at = 0;
+            for (size_t i = 0; i < count; i++) {
+                uint32_t stamp;
+                spsc_queue_pop(&rx_stamps, &stamp);
+                if (i > start && stamp != received_at) {
+                    midi_pipeline_trs_in_packets(&midi_pipeline, packets + start, i - start, received_at);
+                    start = i;
+                }
+                received_at = stamp;
+                memcpy(&packets[i], &words[i], sizeof(words[i]));
             }
+            midi_pipeline_trs_in_packets(&midi_pipeline, packets + start, count - start, received_at);
         }
 
         //ESP_LOGI(TAG, "UART RX loop");
     }
-    free(dtmp);
-    dtmp = NULL;
     vTaskDelete(NULL);
 
 }
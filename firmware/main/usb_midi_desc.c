@@ -0,0 +1,99 @@
+#include <string.h>
+#include "usb_midi_desc.h"
+
+#define DESC_TYPE_INTERFACE       0x04
+#define DESC_TYPE_ENDPOINT        0x05
+#define DESC_TYPE_CS_INTERFACE    0x24
+#define DESC_TYPE_CS_ENDPOINT     0x25
+
+#define USB_CLASS_AUDIO           0x01
+#define USB_SUBCLASS_MIDISTREAMING 0x03
+
+#define MS_GENERAL                0x01
+
+#define EP_TRANSFER_TYPE_MASK     0x03
+#define EP_TRANSFER_TYPE_BULK     0x02
+#define EP_TRANSFER_TYPE_INTR     0x03
+
+size_t usb_midi_parse_config(const uint8_t *desc, size_t length, struct usb_midi_stream_info *info){
+
+  memset(info, 0, sizeof(*info));
+
+  bool in_midi_streaming = false;
+  uint8_t interface = 0;
+  struct usb_midi_endpoint_info *endpoint = NULL; // last endpoint, its MS descriptor follows it
+
+  for (size_t offset = 0; offset + 2 <= length; ){
+
+    const uint8_t *d = &desc[offset];
+    uint8_t d_length = d[0];
+
+    if (d_length < 2 || offset + d_length > length){
+      // malformed, keep what was parsed so far
+      break;
+    }
+    offset += d_length;
+
+    switch (d[1]){
+
+      case DESC_TYPE_INTERFACE:
+        endpoint = NULL;
+        interface = d[2];
+        in_midi_streaming = d_length >= 9 && d[5] == USB_CLASS_AUDIO && d[6] == USB_SUBCLASS_MIDISTREAMING && d[3] == 0;
+        if (in_midi_streaming && info->num_interfaces < USB_MIDI_MAX_INTERFACES){
+          info->interfaces[info->num_interfaces++] = interface;
+        }
+        break;
+
+      case DESC_TYPE_ENDPOINT: {
+        endpoint = NULL;
+        if (!in_midi_streaming || d_length < 7){
+          break;
+        }
+        uint8_t transfer_type = d[3] & EP_TRANSFER_TYPE_MASK;
+        if (transfer_type != EP_TRANSFER_TYPE_BULK && transfer_type != EP_TRANSFER_TYPE_INTR){
+          break;
+        }
+        if (info->num_endpoints >= USB_MIDI_MAX_ENDPOINTS){
+          break;
+        }
+        endpoint = &info->endpoints[info->num_endpoints++];
+        endpoint->address = d[2];
+        endpoint->mps = (d[4] | (d[5] << 8)) & 0x7FF;
+        endpoint->interface = interface;
+        endpoint->num_cables = 1;
+        break;
+      }
+
+      case DESC_TYPE_CS_ENDPOINT:
+        if (endpoint != NULL && d_length >= 4 && d[2] == MS_GENERAL){
+          uint8_t cables = d[3];
+          if (cables > USB_MIDI_MAX_CABLES){
+            cables = USB_MIDI_MAX_CABLES;
+          }
+          if (cables > d_length - 4){
+            cables = d_length - 4;
+          }
+          memcpy(endpoint->jack_ids, &d[4], cables);
+          // an endpoint without any jack listed still carries cable 0
+          endpoint->num_cables = cables > 0 ? cables : 1;
+        }
+        break;
+
+      case DESC_TYPE_CS_INTERFACE:
+        if (in_midi_streaming && d_length >= 5 && (d[2] == USB_MIDI_JACK_IN || d[2] == USB_MIDI_JACK_OUT)
+            && info->num_jacks < USB_MIDI_MAX_JACKS){
+          struct usb_midi_jack_info *jack = &info->jacks[info->num_jacks++];
+          jack->direction = d[2];
+          jack->type = d[3];
+          jack->id = d[4];
+        }
+        break;
+
+      default:
+        break;
+    }
+  }
+
+  return info->num_interfaces;
+}
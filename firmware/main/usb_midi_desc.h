@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Parser for the MIDIStreaming parts of a USB configuration descriptor.
+ *
+ * Walks the raw descriptor once at enumeration and collects every
+ * MIDIStreaming interface, its bulk/interrupt endpoints, the class-specific
+ * MS endpoint descriptors (how many cables each endpoint carries and which
+ * embedded jack each cable is) and the MIDI IN/OUT jacks. The result is what
+ * the per-cable routing table is built from, nothing on the transfer path
+ * needs to look at descriptors again.
+ */
+
+#define USB_MIDI_MAX_INTERFACES 4
+#define USB_MIDI_MAX_ENDPOINTS  4
+#define USB_MIDI_MAX_CABLES     16
+#define USB_MIDI_MAX_JACKS      32
+
+#define USB_MIDI_JACK_EMBEDDED  0x01
+#define USB_MIDI_JACK_EXTERNAL  0x02
+
+#define USB_MIDI_JACK_IN        0x02 // MIDI_IN_JACK descriptor subtype
+#define USB_MIDI_JACK_OUT       0x03 // MIDI_OUT_JACK descriptor subtype
+
+struct usb_midi_endpoint_info
+{
+  uint8_t address;                      // bEndpointAddress, bit 7 set for IN
+  uint16_t mps;
+  uint8_t interface;                    // bInterfaceNumber it belongs to
+  uint8_t num_cables;                   // bNumEmbMIDIJack, 1 if the device omitted the MS endpoint descriptor
+  uint8_t jack_ids[USB_MIDI_MAX_CABLES];// embedded jack of each cable number
+};
+
+struct usb_midi_jack_info
+{
+  uint8_t id;
+  uint8_t direction;  // USB_MIDI_JACK_IN or USB_MIDI_JACK_OUT
+  uint8_t type;       // USB_MIDI_JACK_EMBEDDED or USB_MIDI_JACK_EXTERNAL
+};
+
+struct usb_midi_stream_info
+{
+  uint8_t num_interfaces;
+  uint8_t interfaces[USB_MIDI_MAX_INTERFACES];
+  uint8_t num_endpoints;
+  struct usb_midi_endpoint_info endpoints[USB_MIDI_MAX_ENDPOINTS];
+  uint8_t num_jacks;
+  struct usb_midi_jack_info jacks[USB_MIDI_MAX_JACKS];
+};
+
+/**
+ * @brief Collect every MIDIStreaming interface, endpoint, cable and jack of a configuration
+ * @param[in] desc raw configuration descriptor
+ * @param[in] length wTotalLength of the configuration
+ * @param[out] info parsed streams, entries beyond the limits above are left out
+ *
+ * @return number of MIDIStreaming interfaces found
+ */
+size_t usb_midi_parse_config(const uint8_t *desc, size_t length, struct usb_midi_stream_info *info);
+
+/**
+ * @brief Whether an endpoint carries data from the device to the host
+ */
+static inline bool usb_midi_endpoint_is_in(const struct usb_midi_endpoint_info *endpoint)
+{
+  return (endpoint->address & 0x80) != 0;
+}
+
+
+#ifdef __cplusplus
+}
+#endif